@@ -0,0 +1,41 @@
+#ifndef BENCH_H
+#define BENCH_H
+
+#include <stdbool.h>
+#include <stddef.h>
+
+/**
+ * Microbenchmark harness
+ *
+ * Each benchmark is a function running its operation a given number of
+ * times. The harness calibrates the count to BENCH_ROUND_NS, keeps the
+ * best of BENCH_ROUNDS rounds and counts the calls to the global allocator
+ * made meanwhile. Results are written as JSON.
+ */
+
+#define BENCH_ROUNDS 5
+#define BENCH_ROUND_NS 100000000LL	// 100 ms
+#define BENCH_MAX_RESULTS 64
+
+typedef void (*bench_fn)(void *state, size_t iterations);
+
+typedef struct bench_result_t {
+    char name[64];
+    size_t iterations;
+    double ns_per_op;
+    double allocs_per_op;
+    double bytes_per_second;	// 0 when the operation has no size
+} bench_result_t;
+
+void bench_run(const char *name, bench_fn fn, void *state, size_t bytes_per_op);
+void bench_check(const char *name, bool passed);
+unsigned long long bench_allocations(void);
+
+void bench_parser(void);
+void bench_cimap(void);
+void bench_headers(void);
+void bench_mime(void);
+void bench_response_head(void);
+void bench_conf(void);
+
+#endif
@@ -0,0 +1,183 @@
+#define _GNU_SOURCE
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+#include "bench.h"
+#include "cimap.h"
+
+static bench_result_t bench_results[BENCH_MAX_RESULTS];
+static size_t bench_result_count = 0;
+
+static struct {
+	const char *name;
+	bool passed;
+} bench_checks[BENCH_MAX_RESULTS];
+static size_t bench_check_count = 0;
+
+/**
+ * Every allocation of the process goes through these, so that a benchmark
+ * sees the calls made by libc on its behalf too.
+ */
+static unsigned long long bench_allocation_count = 0;
+
+extern void *__libc_malloc(size_t size);
+extern void *__libc_calloc(size_t count, size_t size);
+extern void *__libc_realloc(void *pointer, size_t size);
+
+void *malloc(size_t size)
+{
+	bench_allocation_count++;
+	return __libc_malloc(size);
+}
+
+void *calloc(size_t count, size_t size)
+{
+	bench_allocation_count++;
+	return __libc_calloc(count, size);
+}
+
+void *realloc(void *pointer, size_t size)
+{
+	bench_allocation_count++;
+	return __libc_realloc(pointer, size);
+}
+
+unsigned long long bench_allocations(void)
+{
+	return bench_allocation_count;
+}
+
+static long long bench_now(void)
+{
+	struct timespec now;
+	clock_gettime(CLOCK_MONOTONIC, &now);
+	return (long long)now.tv_sec * 1000000000LL + now.tv_nsec;
+}
+
+void bench_run(const char *name, bench_fn fn, void *state, size_t bytes_per_op)
+{
+	if (bench_result_count == BENCH_MAX_RESULTS)
+		return;
+
+	// Warm up, then grow the count until a round is long enough to time
+	fn(state, 1);
+	size_t iterations = 1;
+	long long elapsed = 0;
+	while (iterations < ((size_t)1 << 40)) {
+		long long start = bench_now();
+		fn(state, iterations);
+		elapsed = bench_now() - start;
+		if (elapsed >= BENCH_ROUND_NS / 10)
+			break;
+		iterations *= 2;
+	}
+	if (elapsed > 0 && elapsed < BENCH_ROUND_NS)
+		iterations = iterations * (BENCH_ROUND_NS / (double)elapsed);
+
+	double best = 0;
+	unsigned long long allocations = 0;
+	for (int round = 0; round < BENCH_ROUNDS; round++) {
+		unsigned long long before = bench_allocations();
+		long long start = bench_now();
+		fn(state, iterations);
+		double ns = (double)(bench_now() - start) / iterations;
+		allocations = bench_allocations() - before;
+		if (0 == round || ns < best)
+			best = ns;
+	}
+
+	bench_result_t *result = &bench_results[bench_result_count++];
+	snprintf(result->name, sizeof(result->name), "%s", name);
+	result->iterations = iterations;
+	result->ns_per_op = best;
+	result->allocs_per_op = (double)allocations / iterations;
+	result->bytes_per_second =
+	    bytes_per_op > 0 && best > 0 ? bytes_per_op * 1e9 / best : 0;
+
+	fprintf(stderr, "%-40s %12.1f ns/op %8.2f allocs/op", name, best,
+		result->allocs_per_op);
+	if (result->bytes_per_second > 0)
+		fprintf(stderr, " %10.1f MB/s", result->bytes_per_second / 1e6);
+	fprintf(stderr, "\n");
+}
+
+void bench_check(const char *name, bool passed)
+{
+	if (bench_check_count == BENCH_MAX_RESULTS)
+		return;
+	bench_checks[bench_check_count].name = name;
+	bench_checks[bench_check_count++].passed = passed;
+	if (!passed)
+		fprintf(stderr, "Error: Check '%s' failed\n", name);
+}
+
+static const char *bench_kernel_name(cimap_kernel kernel)
+{
+	switch (kernel) {
+	case CIMAP_KERNEL_SSE2:
+		return "sse2";
+	case CIMAP_KERNEL_AVX2:
+		return "avx2";
+	default:
+		return "scalar";
+	}
+}
+
+static void bench_write(FILE *output)
+{
+	fprintf(output, "{\n  \"cimap_kernel\": \"%s\",\n",
+		bench_kernel_name(cimap_kernel_get()));
+
+	fprintf(output, "  \"checks\": {");
+	for (size_t i = 0; i < bench_check_count; i++)
+		fprintf(output, "%s\n    \"%s\": %s", i ? "," : "",
+			bench_checks[i].name,
+			bench_checks[i].passed ? "true" : "false");
+	fprintf(output, "\n  },\n");
+
+	fprintf(output, "  \"benchmarks\": [");
+	for (size_t i = 0; i < bench_result_count; i++) {
+		const bench_result_t *result = &bench_results[i];
+		fprintf(output,
+			"%s\n    {\"name\": \"%s\", \"iterations\": %zu, "
+			"\"ns_per_op\": %.2f, \"allocs_per_op\": %.3f, "
+			"\"bytes_per_second\": %.0f}", i ? "," : "",
+			result->name, result->iterations, result->ns_per_op,
+			result->allocs_per_op, result->bytes_per_second);
+	}
+	fprintf(output, "\n  ]\n}\n");
+}
+
+int main(int argc, char *argv[])
+{
+	cimap_init();
+	bench_parser();
+	bench_cimap();
+	bench_headers();
+	bench_mime();
+	bench_response_head();
+	bench_conf();
+
+	FILE *output = stdout;
+	if (argc > 1) {
+		output = fopen(argv[1], "w");
+		if (NULL == output) {
+			fprintf(stderr, "Error: Cannot write '%s'\n", argv[1]);
+			return 1;
+		}
+	}
+	bench_write(output);
+	if (stdout != output) {
+		fclose(output);
+		fprintf(stderr, "Info: Results written to '%s'\n", argv[1]);
+	}
+
+	for (size_t i = 0; i < bench_check_count; i++) {
+		if (!bench_checks[i].passed)
+			return 1;
+	}
+	return 0;
+}
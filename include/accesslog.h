@@ -0,0 +1,96 @@
+#ifndef ACCESSLOG_H
+#define ACCESSLOG_H
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+#include <sys/types.h>
+
+/**
+ * Asynchronous access log
+ *
+ * Request handlers never format or write log lines: they copy a fixed-size
+ * record into a ring in shared memory, one ring per worker, and go on. A
+ * dedicated logger process, forked by the master, drains the rings, formats
+ * the records and writes them in large batches, so a slow log file delays
+ * the log and not the responses. When a ring is full the record is dropped
+ * and counted, the logger reports the drops.
+ *
+ * A ring slot is claimed with a compare-and-swap on the ring head and
+ * published with its sequence number (a bounded MPSC queue), because the
+ * processes forked per connection all share the first ring. A process
+ * killed between the two would leave a slot that is never published and
+ * stall its ring: the logger skips a slot still unpublished after
+ * ACCESSLOG_STALL, and a late producer then drops its record.
+ *
+ * Records are written in the Common or Combined Log Format, or as they are
+ * (binary) after a file header, for simple-http-logdecode to turn into
+ * text later. Successful requests can be sampled, errors are always logged.
+ * SIGHUP to the master makes the logger reopen the file after a rotation.
+ */
+
+#define ACCESSLOG_RING_SIZE 1024	// records per worker, a power of two
+#define ACCESSLOG_URI_SIZE 224
+#define ACCESSLOG_FIELD_SIZE 128
+#define ACCESSLOG_BATCH_SIZE 65536
+#define ACCESSLOG_INTERVAL 10	// milliseconds between idle polls
+#define ACCESSLOG_STALL 1000	// milliseconds before an unpublished slot is skipped
+#define ACCESSLOG_MAGIC "SHLOG\0\0\1"
+#define ACCESSLOG_LINE_SIZE 1024
+
+typedef enum accesslog_format {
+    ACCESSLOG_COMMON = 0,
+    ACCESSLOG_COMBINED = 1,
+    ACCESSLOG_BINARY = 2,
+} accesslog_format;
+
+typedef struct accesslog_record_t {
+    uint64_t time;	// microseconds since the epoch
+    uint32_t address;	// IPv4, network byte order
+    uint16_t port;
+    uint8_t method;
+    uint8_t version;	// major * 10 + minor
+    uint16_t status_code;
+    uint16_t reserved;
+    uint32_t duration;	// microseconds
+    uint64_t sent;	// body bytes, or of its ranges
+    char uri[ACCESSLOG_URI_SIZE];
+    char referer[ACCESSLOG_FIELD_SIZE];
+    char user_agent[ACCESSLOG_FIELD_SIZE];
+} accesslog_record_t;
+
+typedef struct accesslog_slot_t {
+    uint64_t sequence;
+    accesslog_record_t record;
+} accesslog_slot_t;
+
+typedef struct accesslog_ring_t {
+    uint64_t head;	// next slot to claim, by the workers
+    uint64_t tail;	// next slot to read, by the logger
+    uint64_t dropped;
+    uint64_t stalled_since;	// by the logger, when the slot at tail stalled
+    accesslog_slot_t slots[ACCESSLOG_RING_SIZE];
+} accesslog_ring_t;
+
+typedef struct accesslog_t {
+    int ring_count;
+    accesslog_format format;
+    unsigned int sample;
+    pid_t master;
+    pid_t logger;
+    size_t mapping_size;
+} accesslog_t;
+
+struct http_request_t;
+struct http_response_t;
+struct client_t;
+
+int accesslog_parse_format(const char *value, accesslog_format *format);
+int accesslog_init(const char *path, accesslog_format format, unsigned int sample, int workers);
+void accesslog_worker(int index);
+pid_t accesslog_logger(void);
+void accesslog_request(const struct client_t *client, const struct http_request_t *request, const struct http_response_t *response, uint64_t started);
+int accesslog_format_record(const accesslog_record_t *record, accesslog_format format, char *buffer, size_t size);
+int accesslog_free(void);
+
+#endif
@@ -0,0 +1,53 @@
+#ifndef ADMISSION_H
+#define ADMISSION_H
+
+#include <stdbool.h>
+#include <stdint.h>
+#include <stddef.h>
+
+#include "network.h"
+
+/**
+ * Admission control
+ *
+ * The listen() backlog only bounds the connections the kernel holds for
+ * the server, not the ones it serves. A counter in shared memory, mapped by
+ * the master before forking, holds the connections being served by every
+ * process; past the limit, accepted connections are shed: they get a
+ * constant 503 Service Unavailable with Retry-After and are closed right
+ * away, before anything is read, forked or allocated for them.
+ *
+ * Connections can also be shed on the time they waited in the accept
+ * queue, which TCP_INFO tells as the time since the request (or the
+ * handshake) arrived. As with CoDel, a burst is let through: only once the
+ * shortest wait of a whole ADMISSION_INTERVAL stayed above the target is
+ * the queue taken as standing, and connections that waited longer than the
+ * target are shed until it drains.
+ *
+ * A process killed while serving connections cannot give their slots back
+ * itself, the master does it when it reaps the process: a child forked for
+ * a connection holds its slot until it is reaped, and each pool worker
+ * counts the slots it holds, which are released before it is respawned.
+ */
+
+#define ADMISSION_INTERVAL 100	// milliseconds
+#define ADMISSION_RETRY_AFTER "1"	// seconds
+
+typedef struct admission_t {
+    int64_t active;
+    int max_active;	// 0 for no limit
+    int queue_delay;	// milliseconds, 0 for no target
+    int workers;
+    size_t mapping_size;
+    int64_t held[];	// slots held by each pool worker
+} admission_t;
+
+int admission_init(int max_active, int queue_delay, int workers);
+void admission_worker(int index);
+bool admission_enter(socket_t socket);
+void admission_leave(void);
+void admission_reclaim(int index);
+void admission_shed(socket_t socket);
+int admission_free(void);
+
+#endif
@@ -0,0 +1,43 @@
+#ifndef ARENA_H
+#define ARENA_H
+
+#include <stddef.h>
+
+/**
+ * Per-connection bump allocator
+ *
+ * Everything a request needs while it is served (header maps, their keys
+ * and values, the request body, ...) is carved out of blocks owned by the
+ * connection and released all at once by arena_reset() when the response
+ * is done. Blocks are kept across requests, so a connection that reached
+ * its working size serves requests without calling malloc() at all.
+ *
+ * Allocations larger than half a block get their own buffer, which is
+ * returned to the system on reset instead of being kept.
+ */
+
+#define ARENA_BLOCK_SIZE 4096
+#define ARENA_ALIGNMENT 16
+
+typedef struct arena_block_t {
+    struct arena_block_t *next;
+    size_t size;
+    size_t used;
+    // Data follows, aligned on ARENA_ALIGNMENT
+} arena_block_t;
+
+typedef struct arena_t {
+    arena_block_t *first;
+    arena_block_t *current;
+    arena_block_t *large;
+    size_t block_size;
+} arena_t;
+
+void arena_init(arena_t *arena, size_t block_size);
+void *arena_alloc(arena_t *arena, size_t size);
+void *arena_calloc(arena_t *arena, size_t count, size_t size);
+char *arena_strdup(arena_t *arena, const char *str);
+void arena_reset(arena_t *arena);
+void arena_free(arena_t *arena);
+
+#endif
@@ -0,0 +1,111 @@
+#ifndef CACHE_H
+#define CACHE_H
+
+#include <pthread.h>
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+#include <sys/types.h>
+#include <time.h>
+
+/**
+ * Shared static content cache
+ *
+ * A single shared memory region, mapped by the master before forking, holds
+ * small and medium files together with their prebuilt response head (status
+ * line, Server, Content-Type, Content-Length and the validators, without the
+ * Date and Connection headers and the blank line, which depend on the
+ * request). Every worker reads from and fills the same region.
+ *
+ * Data blocks come from a buddy allocator under a fixed byte budget and are
+ * evicted with the CLOCK algorithm. Entries are validated against the file
+ * inode, size and mtime at most once per CACHE_VALIDATE_INTERVAL, so a hot
+ * entry is served without any filesystem system call.
+ *
+ * Entries are keyed by path and content coding: style.css.gz served as the
+ * gzip variant of style.css does not share its head with a request for
+ * style.css.gz itself.
+ *
+ * A worker sending an entry pins it, so that it is not evicted meanwhile.
+ * Pins record the process that holds them and come from a fixed pool:
+ * when a process dies, the master hands its pins back with cache_reclaim(),
+ * and once the pool is used up, lookups miss instead of pinning.
+ */
+
+#define CACHE_PATH_SIZE 256
+#define CACHE_BLOCK_SIZE 1024
+#define CACHE_ENTRY_AVERAGE 16384
+#define CACHE_MIN_ENTRIES 64
+#define CACHE_VALIDATE_INTERVAL 1	// seconds
+#define CACHE_PINS_PER_ENTRY 4
+
+struct http_response_t;
+struct stat;
+
+typedef struct cache_entry_t {
+    char path[CACHE_PATH_SIZE];
+    uint64_t hash;
+    uint8_t coding;
+    bool vary;	// the head has Vary: Accept-Encoding
+    int32_t next;
+    bool used;
+    bool loading;
+    bool dead;
+    bool referenced;
+    uint32_t refcount;
+    int32_t pins;	// first pin of the entry
+    dev_t device;
+    ino_t inode;
+    struct timespec mtime;
+    off_t size;
+    time_t validated_at;
+    int32_t block;
+    uint8_t order;
+    size_t head_length;
+    size_t body_length;
+} cache_entry_t;
+
+typedef struct cache_pin_t {
+    pid_t owner;
+    int32_t entry;
+    int32_t next;	// next pin of the entry, or next free pin
+} cache_pin_t;
+
+typedef struct cache_block_t {
+    int32_t next;
+    int32_t prev;
+    uint8_t order;
+    bool free;
+} cache_block_t;
+
+typedef struct cache_t {
+    pthread_mutex_t lock;
+    size_t max_file;
+    uint8_t max_order;
+    int32_t entry_count;
+    int32_t bucket_count;
+    int32_t block_count;
+    int32_t clock_hand;
+    int32_t pin_count;
+    int32_t free_pins;
+    int32_t free_lists[32];
+    int32_t *buckets;
+    cache_entry_t *entries;
+    cache_pin_t *pins;
+    cache_block_t *blocks;
+    char *data;
+    size_t mapping_size;
+} cache_t;
+
+int cache_init(size_t budget, size_t max_file);
+bool cache_enabled(void);
+int cache_acquire(const char *path, int coding, cache_entry_t **entry);
+int cache_fill(const char *path, int coding, struct http_response_t *response, cache_entry_t **entry);
+int cache_store(const char *path, int coding, const struct stat *file_stat, struct http_response_t *response, const char *body, size_t body_length, cache_entry_t **entry);
+void cache_release(cache_entry_t *entry);
+void cache_reclaim(pid_t pid);
+const char *cache_head(const cache_entry_t *entry);
+const char *cache_body(const cache_entry_t *entry);
+int cache_free(void);
+
+#endif
@@ -3,14 +3,34 @@
 
 #include <stdbool.h>
 #include <stddef.h>
+#include <stdint.h>
+
+#include "arena.h"
+
+/**
+ * Keys are hashed and compared with ASCII case folding (never locale-aware
+ * tolower()), 16 or 32 bytes at a time with SSE2 or AVX2 when the CPU has
+ * them. cimap_init() picks the kernel once at startup; the scalar one folds
+ * 8 bytes per word and is used until then, or when the CPU has neither.
+ * All kernels produce the same hashes, so maps survive the switch.
+ */
+
+typedef enum cimap_kernel {
+    CIMAP_KERNEL_SCALAR = 0,
+    CIMAP_KERNEL_SSE2 = 1,
+    CIMAP_KERNEL_AVX2 = 2,
+} cimap_kernel;
 
 typedef struct cimap_entry_t {
     char* key;
     char* value;
+    size_t length;
+    uint64_t hash;
     struct cimap_entry_t* next;
 } cimap_entry_t;
 
 typedef struct cimap_t {
+    arena_t* arena;	// NULL when entries are allocated with malloc()
     cimap_entry_t** buckets;
     size_t bucket_count;
     size_t count;
@@ -18,6 +38,7 @@ typedef struct cimap_t {
 } cimap_t;
 
 cimap_t* cimap_create(size_t initial_size, bool case_sensitive);
+cimap_t* cimap_create_arena(arena_t* arena, size_t initial_size, bool case_sensitive);
 int cimap_free(cimap_t* map);
 int cimap_set(cimap_t* map, const char* key, const char* value);
 const char* cimap_get(const cimap_t* map, const char* key);
@@ -34,7 +55,14 @@ typedef struct cimap_iterator_t {
 } cimap_iterator_t;
 
 cimap_iterator_t *cimap_iterator(const cimap_t* map);
+void cimap_iterator_init(const cimap_t* map, cimap_iterator_t* iterator);
 int cimap_next(cimap_iterator_t* iterator, const char** key, const char** value);
 void cimap_iterator_free(cimap_iterator_t* iterator);
 
+uint64_t cimap_hash(const char* key, size_t length, bool case_sensitive);
+bool cimap_equal(const char* a, const char* b, size_t length, bool case_sensitive);
+void cimap_init(void);
+cimap_kernel cimap_kernel_get(void);
+int cimap_kernel_set(cimap_kernel kernel);
+
 #endif
\ No newline at end of file
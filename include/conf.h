@@ -1,13 +1,53 @@
 #ifndef CONF_H
 #define CONF_H
 
+#include <stddef.h>
+
+#include "accesslog.h"
+
+typedef enum io_model
+{
+    IO_MODEL_BLOCKING = 0,
+    IO_MODEL_EPOLL = 1,
+    IO_MODEL_URING = 2
+} io_model;
+
+typedef enum reuseport_mode
+{
+    REUSEPORT_OFF = 0,
+    REUSEPORT_ON = 1,
+    REUSEPORT_CPU = 2
+} reuseport_mode;
+
 typedef struct config
 {
     int host;
     int port;
     char *vroot;
     int max_connections;
+    int max_active;
+    int queue_delay;
     int request_timeout;
+    int body_timeout;
+    int send_timeout;
+    int keep_alive_timeout;
+    int keep_alive_requests;
+    int workers;
+    io_model io_model;
+    reuseport_mode reuseport;
+    size_t cache_size;
+    size_t cache_max_file;
+    char *mime_types;
+    int max_headers;
+    int max_header_size;
+    char *status_uri;
+    int slow_request;
+    int flight_recorder;
+    char *access_log;
+    accesslog_format access_log_format;
+    int access_log_sample;
+    int compress_level;
+    size_t compress_min_size;
 } config;
 
 typedef enum conf_error
@@ -18,6 +58,9 @@ typedef enum conf_error
     CONF_MEMORY_ERROR = -3
 } conf_error;
 
+conf_error conf_parse_io_model(const char *value, io_model *model);
+conf_error conf_parse_reuseport(const char *value, reuseport_mode *mode);
+conf_error conf_parse_size(const char *value, size_t *size);
 conf_error conf_load(const char *conf_path, config *config);
 
 #endif
\ No newline at end of file
@@ -0,0 +1,24 @@
+#ifndef DATE_H
+#define DATE_H
+
+#include <stdbool.h>
+#include <time.h>
+
+/**
+ * HTTP dates
+ *
+ * Dates are written in the IMF-fixdate format ("Sun, 06 Nov 1994 08:49:37
+ * GMT") without strftime(), and the current date is formatted once per
+ * second. IMF-fixdate is parsed by hand as well, the obsolete RFC 850 and
+ * asctime() formats go through strptime(). The last parsed date is kept:
+ * clients send back the Last-Modified they got, so the same few strings
+ * come in over and over.
+ */
+
+#define DATE_SIZE 30	// IMF-fixdate and its terminating null byte
+
+void date_format(time_t time, char *buffer);
+const char *date_now(void);
+bool date_parse(const char *value, time_t *time);
+
+#endif
@@ -0,0 +1,70 @@
+#ifndef ENCODING_H
+#define ENCODING_H
+
+#include <stdbool.h>
+#include <stdint.h>
+#include <sys/types.h>
+#include <time.h>
+
+/**
+ * Content codings
+ *
+ * A file may have precompressed siblings next to it (style.css.gz,
+ * style.css.br, style.css.zst). When the Accept-Encoding header of the
+ * request allows some of them, the smallest one is served instead, with
+ * Content-Encoding set. Variants older than the file itself are ignored,
+ * they are left over from a previous version.
+ *
+ * Which variants a file has is kept in a small table, keyed by path and
+ * checked again at most once per ENCODING_VALIDATE_INTERVAL, so negotiating
+ * does not stat() the siblings on every request. The table is mapped before
+ * forking, like the content cache, so that processes forked per connection
+ * use it too. Each slot is written under a sequence lock: a reader copies
+ * it, and scans the file itself when a writer was busy with it.
+ *
+ * Files of a compressible type without a gzip variant can be compressed on
+ * the fly instead, once: the result goes to the content cache, keyed by the
+ * path of the file and ENCODING_GZIP. The table remembers the files that
+ * did not compress well, so they are not tried again until they change.
+ * The level drops while the CPUs are saturated, a cache miss then costs
+ * less, at the price of a larger entry.
+ */
+
+#define ENCODING_SLOTS 512
+#define ENCODING_PATH_SIZE 256
+#define ENCODING_VALIDATE_INTERVAL 1	// seconds
+#define ENCODING_CHUNK_SIZE 65536
+#define ENCODING_LOAD_INTERVAL 1	// seconds between load samples
+
+typedef enum encoding_coding {
+    ENCODING_IDENTITY = 0,
+    ENCODING_GZIP = 1,
+    ENCODING_BROTLI = 2,
+    ENCODING_ZSTD = 3,
+    ENCODING_CODINGS = 4,
+} encoding_coding;
+
+typedef struct encoding_variants_t {
+    uint64_t sequence;	// odd while the slot is written
+    char path[ENCODING_PATH_SIZE];
+    uint64_t hash;
+    time_t validated_at;
+    time_t mtime;
+    off_t sizes[ENCODING_CODINGS];	// -1 when the file or variant is missing
+    bool incompressible;
+} encoding_variants_t;
+
+int encoding_init(void);
+unsigned int encoding_accepted(const char *accept_encoding);
+encoding_coding encoding_select(const char *path, unsigned int accepted, bool *negotiated);
+const char *encoding_name(encoding_coding coding);
+const char *encoding_suffix(encoding_coding coding);
+bool encoding_compressible_type(const char *content_type);
+bool encoding_compressible(const char *path, size_t min_size);
+void encoding_incompressible(const char *path);
+int encoding_level(int level);
+int encoding_gzip(int file, size_t file_size, int level, char *output, size_t *length);
+size_t encoding_gzip_bound(size_t file_size);
+void encoding_free(void);
+
+#endif
@@ -0,0 +1,63 @@
+#ifndef EVENT_H
+#define EVENT_H
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+
+#include "arena.h"
+#include "http.h"
+#include "rfc1945.h"
+#include "server.h"
+#include "trace.h"
+#include "wheel.h"
+
+/**
+ * Event-driven connection handling
+ *
+ * One epoll loop per process serves every connection with non-blocking
+ * sockets. Each connection walks through the states below; the loop only
+ * resumes it when its socket is ready, so idle or slow clients cost a
+ * connection_t and nothing else. Each state has its deadline on a timing
+ * wheel, which the loop advances whenever epoll_wait() returns.
+ */
+
+#define EVENT_MAX_EVENTS 256
+#define EVENT_ACCEPT_BATCH 64
+
+typedef enum connection_state {
+    CONNECTION_READING_HEAD = 0,
+    CONNECTION_READING_BODY = 1,
+    CONNECTION_WRITING_HEAD = 2,
+    CONNECTION_WRITING_FILE = 3,
+} connection_state;
+
+typedef struct connection_t {
+    client_t client;
+    connection_state state;
+    unsigned int watching;
+    http_buffer_t input;
+    size_t body_received;
+    arena_t arena;	// request and response memory, reset between requests
+    http_request_t request;
+    http_response_t response;
+    http_output_t output;
+    int file;
+    size_t file_size;
+    size_t file_sent;
+    size_t chunk_length;
+    size_t chunk_sent;
+    char chunk[SERVER_BUFFER_SIZE];
+    bool zero_copy;
+    unsigned int requests;
+    bool keep_alive;
+    uint64_t started;	// request head complete, for the duration metric
+    trace_t trace;
+    bool idle;	// waiting for the next request, under the keep-alive timeout
+    wheel_timer_t timer;
+    uint64_t progress;	// last time the socket took more of the response
+} connection_t;
+
+int event_loop_run(const server_t server);
+
+#endif
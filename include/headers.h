@@ -0,0 +1,93 @@
+#ifndef HEADERS_H
+#define HEADERS_H
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+
+#include "arena.h"
+
+/**
+ * Header tables
+ *
+ * Well-known header names map to a header_id through a perfect hash on
+ * their length, first and last bytes, so looking them up never hashes or
+ * compares whole strings. Other names are still accepted and matched by a
+ * 7-bit tag from their case-insensitive hash.
+ *
+ * A table keeps one tag byte per header next to the entries, inline for the
+ * first HEADERS_INLINE headers, and a lookup compares 16 tags at a time
+ * (SSE2 where available). Headers keep their insertion order.
+ */
+
+#define HEADERS_INLINE 16
+#define HEADER_SLOTS 64
+#define HEADER_TAG_OTHER 0x80	// tag of names without an id
+
+typedef enum header_id {
+    HEADER_UNKNOWN = 0,
+    HEADER_ACCEPT = 1,
+    HEADER_ACCEPT_ENCODING = 2,
+    HEADER_ACCEPT_RANGES = 3,
+    HEADER_AUTHORIZATION = 4,
+    HEADER_CACHE_CONTROL = 5,
+    HEADER_CONNECTION = 6,
+    HEADER_CONTENT_ENCODING = 7,
+    HEADER_CONTENT_LENGTH = 8,
+    HEADER_CONTENT_RANGE = 9,
+    HEADER_CONTENT_TYPE = 10,
+    HEADER_COOKIE = 11,
+    HEADER_DATE = 12,
+    HEADER_ETAG = 13,
+    HEADER_EXPECT = 14,
+    HEADER_HOST = 15,
+    HEADER_IF_MODIFIED_SINCE = 16,
+    HEADER_IF_NONE_MATCH = 17,
+    HEADER_IF_RANGE = 18,
+    HEADER_KEEP_ALIVE = 19,
+    HEADER_LAST_MODIFIED = 20,
+    HEADER_LOCATION = 21,
+    HEADER_ORIGIN = 22,
+    HEADER_RANGE = 23,
+    HEADER_REFERER = 24,
+    HEADER_RETRY_AFTER = 25,
+    HEADER_SERVER = 26,
+    HEADER_TRANSFER_ENCODING = 27,
+    HEADER_UPGRADE = 28,
+    HEADER_USER_AGENT = 29,
+    HEADER_VARY = 30,
+    HEADER_COUNT = 31,
+} header_id;
+
+typedef struct headers_entry_t {
+    const char *name;
+    size_t name_length;
+    char *value;
+    size_t value_length;
+} headers_entry_t;
+
+typedef struct headers_t {
+    arena_t *arena;	// NULL when values are allocated with malloc()
+    uint8_t *tags;	// header_id, or HEADER_TAG_OTHER | hash bits
+    headers_entry_t *entries;
+    size_t count;
+    size_t capacity;	// multiple of 16, unused tags are 0
+    uint8_t inline_tags[HEADERS_INLINE];
+    headers_entry_t inline_entries[HEADERS_INLINE];
+} headers_t;
+
+header_id header_lookup(const char *name, size_t length);
+const char *header_name(header_id id);
+
+void headers_init(headers_t *headers, arena_t *arena);
+int headers_set(headers_t *headers, const char *name, const char *value);
+int headers_set_id(headers_t *headers, header_id id, const char *value);
+const char *headers_get(const headers_t *headers, const char *name);
+const char *headers_get_id(const headers_t *headers, header_id id);
+int headers_remove(headers_t *headers, const char *name);
+int headers_remove_id(headers_t *headers, header_id id);
+size_t headers_size(const headers_t *headers);
+int headers_next(const headers_t *headers, size_t *position, const char **name, const char **value);
+void headers_free(headers_t *headers);
+
+#endif
@@ -1,56 +1,187 @@
 #ifndef HTTP_H
 #define HTTP_H
 
+#include <stdbool.h>
 #include <stddef.h>
 #include <stdio.h>
+#include <sys/socket.h>
+#include <sys/types.h>
+#include <sys/uio.h>
 
-#include "cimap.h"
+#include "arena.h"
+#include "headers.h"
+#include "parser.h"
 #include "rfc1945.h"
 #include "server.h"
 
+// In-memory bodies from this size on are sent with MSG_ZEROCOPY
+#define HTTP_ZEROCOPY_THRESHOLD 65536
+#define HTTP_HEAD_END_SIZE 96	// Date, Connection and the blank line
+#define HTTP_ETAG_SIZE 80
+#define HTTP_RANGES_MAX 8	// requests for more ranges get the whole file
+#define HTTP_PART_SIZE 512	// delimiter and header of a multipart/byteranges part
+#define HTTP_BOUNDARY "simple-http-3d6b6a416f9b5"
+
 typedef enum http_method_t {
     HTTP_METHOD_GET = 1,
     HTTP_METHOD_HEAD = 2,
     HTTP_METHOD_POST = 3,
 } http_method_t;
 
+/**
+ * Receive buffer owned by a connection. A read may return the end of one
+ * request and the start of the next ones (pipelining): the bytes past the
+ * current request are kept and become the start of the next request.
+ */
+typedef struct http_buffer_t {
+    char data[SERVER_BUFFER_SIZE + 1];
+    size_t length;
+    size_t consumed;	// bytes that belong to the current request
+} http_buffer_t;
+
+/**
+ * The URI and headers point into the receive buffer of the connection, the
+ * body comes from the arena of the connection (or the heap without one).
+ */
 typedef struct http_request_t {
+    arena_t *arena;
     http_method_t method;
-    char uri[SERVER_BUFFER_SIZE];
+    const char *uri;
+    size_t uri_length;
     int major;
     int minor;
-    cimap_t *headers;
+    http_header_t headers[PARSER_HEADERS_MAX];
+    size_t header_count;
     char *body;
     size_t body_length;
+    parser_t parser;
 } http_request_t;
 
+struct cache_entry_t;
+struct timespec;
+struct trace_t;
+
+// Fixed response kept as constant bytes (head without Connection, body)
+typedef struct http_prebuilt_t {
+    int status_code;
+    const char *head;
+    size_t head_length;
+    const char *body;
+    size_t body_length;
+} http_prebuilt_t;
+
+typedef struct http_range_t {
+    off_t offset;
+    size_t length;
+} http_range_t;
+
+/**
+ * Byte ranges of the representation to send, from the Range header. A single
+ * range is sent as it is, more are sent as multipart/byteranges parts.
+ */
+typedef struct http_ranges_t {
+    http_range_t parts[HTTP_RANGES_MAX];
+    size_t count;	// 0 for the whole representation
+    size_t size;	// complete length of the representation
+    char *type;	// Content-Type of the parts, when multipart
+} http_ranges_t;
+
+// Headers and body live in the arena, when there is one
 typedef struct http_response_t {
+    arena_t *arena;
     int status_code;
     int major;
     int minor;
-    cimap_t *headers;
+    headers_t headers;
     char *body;
     size_t body_length;
+    struct cache_entry_t *cached;
+    const http_prebuilt_t *prebuilt;
+    http_ranges_t ranges;
+    bool keep_alive;
+    bool more;	// pipelined responses follow, let the kernel coalesce them
+    size_t sent;	// bytes handed to the kernel, once the response is out
+    size_t body_sent;	// of them, the body (or its ranges and delimiters)
+    struct trace_t *trace;	// timeline of the request, if traced
 } http_response_t;
 
+/**
+ * Response bytes waiting to be sent: head, end of head, part header and body,
+ * written together with sendmsg() and advanced across short writes, then the
+ * slice of the file that follows them, if any. A multipart response is laid
+ * out again for each of its parts.
+ */
+typedef struct http_output_t {
+    char head[SERVER_BUFFER_SIZE];
+    char end[HTTP_HEAD_END_SIZE];
+    char part[HTTP_PART_SIZE];
+    struct iovec iov[4];
+    struct iovec *current;
+    int count;
+    size_t length;	// of the buffers and earlier file slices, before any of it was sent
+    size_t head_length;	// of the head and its end
+    struct msghdr message;
+    const char *body;	// in-memory body the parts are cut from, NULL for a file
+    size_t next_part;
+    off_t file_offset;
+    size_t file_length;
+} http_output_t;
+
 typedef enum http_error {
     HTTP_OK = 0,
     HTTP_REQUEST_MALFORMED = -10,
     HTTP_ENTITY_NOT_FOUND = -20,
     HTTP_ENTITY_TOO_LARGE = -21,
+    HTTP_CONNECTION_CLOSED = -30,
 } http_error;
 
-int http_request_create(const client_t client, http_request_t *request);
+const char *http_method_name(http_method_t method);
+
+void http_buffer_init(http_buffer_t *buffer);
+int http_buffer_request(http_buffer_t *buffer, http_request_t *request, size_t *body_received);
+void http_buffer_shift(http_buffer_t *buffer);
+bool http_buffer_pending(const http_buffer_t *buffer);
+
+int http_request_init(http_request_t *request, arena_t *arena);
+int http_request_parse(http_request_t *request, char *buffer);
+const char *http_request_header(const http_request_t *request, const char *name);
+const char *http_request_header_id(const http_request_t *request, header_id id);
+size_t http_request_content_length(const http_request_t *request);
+bool http_request_chunked(const http_request_t *request);
+bool http_request_keep_alive(const http_request_t *request);
+int http_request_create(const client_t client, http_buffer_t *buffer, http_request_t *request, arena_t *arena, size_t *body_received);
+int http_request_receive_body(const client_t client, http_request_t *request, size_t body_received);
 void http_request_destroy(http_request_t *request);
 
-int http_response_create(http_response_t *response);
+int http_response_create(http_response_t *response, arena_t *arena);
 int http_response_status(http_response_t *response, int status_code);
 int http_response_body(http_response_t *response, const char *body);
+const char *http_response_message(int status_code);
+int http_response_head(const http_response_t *response, char *buffer, size_t size);
+int http_response_head_end(const http_response_t *response, char *buffer, size_t size);
+int http_response_prebuilt(http_response_t *response, int status_code);
+int http_output_prepare(http_output_t *output, const http_request_t *request, const http_response_t *response, bool has_file);
+bool http_output_next(http_output_t *output, const http_response_t *response);
+void http_output_advance(http_output_t *output, size_t sent);
+bool http_output_done(const http_output_t *output);
+struct msghdr *http_output_message(http_output_t *output);
+ssize_t http_output_send(http_output_t *output, socket_t socket, int flags);
+int http_output_send_all(http_output_t *output, socket_t socket, int flags);
+int http_response_file_error(http_response_t *response, int error);
+int http_response_file_size(http_response_t *response, size_t file_size);
+int http_response_validators(http_response_t *response, ino_t inode, off_t size, const struct timespec *mtime);
+bool http_request_conditional(const http_request_t *request);
+bool http_response_conditional(const http_request_t *request, http_response_t *response, ino_t inode, off_t size, const struct timespec *mtime);
+bool http_request_ranged(const http_request_t *request);
+bool http_response_range(const http_request_t *request, http_response_t *response, size_t size);
+int http_response_restore(http_response_t *response);
+int http_response_file(const http_request_t *request, http_response_t *response, const char *file_name, int *file, size_t *file_size);
 int http_response_send(const client_t client, const http_request_t *request, http_response_t *response);
 int http_response_send_file(const client_t client, const http_request_t *request, http_response_t *response, const char *file_name);
+ssize_t http_sendfile(socket_t socket, int file, off_t *offset, size_t count);
 void http_response_destroy(http_response_t *response);
 
-int http_content_init(void);
+int http_content_init(const char *mime_types);
 int http_content_get(const char *file_name, char **content_type);
 int http_content_free(void);
 
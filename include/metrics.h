@@ -0,0 +1,66 @@
+#ifndef METRICS_H
+#define METRICS_H
+
+#include <stddef.h>
+#include <stdint.h>
+#include <sys/types.h>
+
+#include "network.h"
+
+/**
+ * Shared metrics registry
+ *
+ * Counters and the request duration histogram live in a shared memory
+ * region mapped by the master before forking, split in one shard per
+ * worker. A worker only writes to its own shard, with relaxed atomic adds
+ * (processes forked per connection share the first one), so the request
+ * path never takes a lock. The status page sums the shards when it is
+ * rendered.
+ *
+ * The request duration runs from the complete request head to the last
+ * response byte handed to the kernel.
+ */
+
+#define METRICS_METHODS 4	// other, GET, HEAD, POST
+#define METRICS_STATUS_CLASSES 5	// 1xx to 5xx
+#define METRICS_BUCKETS 16	// plus +Inf
+#define METRICS_RENDER_SIZE 16384	// plus METRICS_RENDER_WORKER per worker
+#define METRICS_RENDER_WORKER 160
+
+typedef enum metrics_format {
+    METRICS_FORMAT_TEXT = 0,
+    METRICS_FORMAT_PROMETHEUS = 1,
+} metrics_format;
+
+typedef struct metrics_shard_t {
+    pid_t pid;
+    uint64_t requests[METRICS_METHODS][METRICS_STATUS_CLASSES];
+    uint64_t bytes_sent;
+    int64_t connections_active;
+    uint64_t connections_total;
+    uint64_t connections_shed;
+    uint64_t accept_errors;
+    uint64_t duration_buckets[METRICS_BUCKETS + 1];
+    uint64_t duration_sum;	// microseconds
+} metrics_shard_t;
+
+typedef struct metrics_t {
+    int shard_count;
+    size_t shard_size;
+    time_t started_at;
+    size_t mapping_size;
+} metrics_t;
+
+int metrics_init(int workers);
+void metrics_worker(int index);
+uint64_t metrics_now(void);
+void metrics_connection_open(void);
+void metrics_connection_close(void);
+void metrics_connection_shed(void);
+void metrics_accept_error(void);
+void metrics_request(int method, int status_code, size_t bytes, uint64_t started);
+size_t metrics_render_size(void);
+int metrics_render(char *buffer, size_t size, metrics_format format, socket_t listener);
+int metrics_free(void);
+
+#endif
@@ -0,0 +1,53 @@
+#ifndef MIME_H
+#define MIME_H
+
+#include <stddef.h>
+#include <sys/types.h>
+#include <time.h>
+
+/**
+ * MIME type resolution
+ *
+ * Content types come from an extension table compiled at startup from a
+ * mime.types file (built-in defaults are used for anything it lacks). The
+ * table is sorted once and searched with bsearch(), so the common case never
+ * touches the file itself.
+ *
+ * Only files with an unknown extension are sniffed with libmagic. The magic
+ * database is loaded on first use, and results are kept per path, keyed by
+ * inode and mtime, so a given file is sniffed once until it changes.
+ */
+
+#define MIME_TYPES_DEFAULT "/etc/mime.types"
+#define MIME_EXTENSION_SIZE 16
+#define MIME_TYPE_SIZE 128
+#define MIME_SNIFF_SLOTS 256
+#define MIME_SNIFF_PATH_SIZE 256
+
+typedef struct mime_entry_t {
+    char extension[MIME_EXTENSION_SIZE];
+    const char *type;
+    size_t order;
+} mime_entry_t;
+
+typedef struct mime_sniff_t {
+    char path[MIME_SNIFF_PATH_SIZE];
+    dev_t device;
+    ino_t inode;
+    struct timespec mtime;
+    char type[MIME_TYPE_SIZE];
+} mime_sniff_t;
+
+typedef enum mime_error {
+    MIME_OK = 0,
+    MIME_MEMORY_ERROR = -1,
+    MIME_MAGIC_ERROR = -2,
+    MIME_NOT_FOUND = -3,
+} mime_error;
+
+int mime_init(const char *path);
+const char *mime_lookup(const char *file_name);
+int mime_sniff(const char *file_name, char *type, size_t size);
+void mime_free(void);
+
+#endif
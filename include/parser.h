@@ -0,0 +1,65 @@
+#ifndef PARSER_H
+#define PARSER_H
+
+#include <stddef.h>
+#include <stdint.h>
+
+#include "headers.h"
+
+/**
+ * Incremental HTTP request parser
+ *
+ * A byte-at-a-time state machine in the spirit of picohttpparser. It keeps
+ * its position between calls, so the bytes of a slowly arriving head are
+ * looked at once, and it reports "need more data" instead of waiting for
+ * them. The request line and headers are not copied: the URI, header names
+ * and values are slices of the receive buffer, NUL-terminated in place.
+ */
+
+#define PARSER_HEADERS_MAX 64	// upper bound of the MAX_HEADERS setting
+#define PARSER_DEFAULT_HEADERS 32
+#define PARSER_METHOD_SIZE 8
+
+typedef enum parser_state {
+    PARSER_METHOD = 0,
+    PARSER_URI_START = 1,
+    PARSER_URI = 2,
+    PARSER_VERSION = 3,
+    PARSER_LINE_LF = 4,
+    PARSER_HEADER_START = 5,
+    PARSER_HEADER_NAME = 6,
+    PARSER_VALUE_START = 7,
+    PARSER_VALUE = 8,
+    PARSER_HEAD_END_LF = 9,
+    PARSER_DONE = 10,
+} parser_state;
+
+typedef struct http_header_t {
+    header_id id;
+    const char *name;
+    size_t name_length;
+    const char *value;
+    size_t value_length;
+} http_header_t;
+
+typedef struct parser_t {
+    parser_state state;
+    size_t offset;		// next byte to look at
+    size_t mark;		// start of the current token
+    uint64_t method;		// method bytes packed as they arrive
+    size_t method_length;
+} parser_t;
+
+typedef enum parser_error {
+    PARSER_OK = 0,
+    PARSER_MALFORMED = -10,
+    PARSER_TOO_LARGE = -11,
+} parser_error;
+
+struct http_request_t;
+
+void parser_limits(size_t max_headers, size_t max_head_size);
+void parser_init(parser_t *parser);
+int parser_execute(parser_t *parser, struct http_request_t *request, char *data, size_t length);
+
+#endif
@@ -0,0 +1,40 @@
+#ifndef POOL_H
+#define POOL_H
+
+#include <sys/types.h>
+#include <time.h>
+
+#include "server.h"
+
+/**
+ * Pre-forked worker pool
+ *
+ * The master process forks a fixed number of long-lived workers that all
+ * accept on the shared listening socket. Each worker waits on its own epoll
+ * instance with EPOLLEXCLUSIVE so that a single connection only wakes up one
+ * worker. The master does not serve requests: it respawns dead workers and
+ * tears the pool down on SIGINT/SIGTERM.
+ *
+ * With REUSEPORT enabled, the shared socket is replaced by one SO_REUSEPORT
+ * listener per worker and each worker is pinned to its own CPU, so the
+ * kernel spreads connections without any shared accept queue. In "cpu"
+ * mode a classic BPF program steers each connection to the listener of the
+ * CPU that received it (this assumes contiguous CPU ids).
+ */
+
+typedef struct pool_worker_t {
+    pid_t pid;
+    time_t started_at;
+} pool_worker_t;
+
+typedef struct pool_t {
+    pool_worker_t *workers;
+    int size;
+    socket_t *listeners;
+    int *cpus;
+    int cpu_count;
+} pool_t;
+
+int pool_run(server_t *server);
+
+#endif
@@ -6,6 +6,7 @@
 /* ---------- HTTP Version ---------- */
 #define HTTP_VERSION_0_9 "HTTP/0.9"
 #define HTTP_VERSION_1_0 "HTTP/1.0"
+#define HTTP_VERSION_1_1 "HTTP/1.1"	// RFC 9112, for persistent connections
 /* ---------------------------------- */
 
 /* ---------- Special Characters ---------- */
@@ -27,6 +28,7 @@
 #define STATUS_TEXT_201 "Created"
 #define STATUS_TEXT_202 "Accepted"
 #define STATUS_TEXT_204 "No Content"
+#define STATUS_TEXT_206 "Partial Content"	// RFC 9110, for byte ranges
 
 // 3xx: Redirection
 #define STATUS_TEXT_300 "Multiple Choices"
@@ -39,6 +41,7 @@
 #define STATUS_TEXT_401 "Unauthorized"
 #define STATUS_TEXT_403 "Forbidden"
 #define STATUS_TEXT_404 "Not Found"
+#define STATUS_TEXT_416 "Range Not Satisfiable"	// RFC 9110
 #define STATUS_TEXT_418 "I'm a teapot"
 
 // 5xx: Server Error
@@ -78,6 +81,9 @@
 #define CONTENT_CODING_X_GZIP "x-gzip"
 #define CONTENT_CODING_COMPRESS "compress"
 #define CONTENT_CODING_X_COMPRESS "x-compress"
+#define CONTENT_CODING_IDENTITY "identity"
+#define CONTENT_CODING_BROTLI "br"
+#define CONTENT_CODING_ZSTD "zstd"
 /* ----------------------------------------- */
 
 /* ---------- Miscellaneous ---------- */
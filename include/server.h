@@ -3,6 +3,7 @@
 
 #include <arpa/inet.h>
 #include <stdbool.h>
+#include <stddef.h>
 
 #include "conf.h"
 #include "network.h"
@@ -18,6 +19,30 @@ typedef struct client_t {
     socket_t socket;
 } client_t;
 
+typedef enum server_route {
+    SERVER_ROUTE_NONE = 0,
+    SERVER_ROUTE_TEXT = 1,
+    SERVER_ROUTE_FILE = 2,
+    SERVER_ROUTE_CACHE = 3,
+} server_route;
+
+#define SERVER_YIELD_IDLE 50	// milliseconds
+#define SERVER_LINGER_TIME 1000	// milliseconds
+#define SERVER_LINGER_SIZE 65536	// bytes discarded at most
+
+struct http_request_t;
+struct http_response_t;
+
+int server_listen(const server_t server, socket_t *listener);
+int server_accept_connection(const server_t server, client_t *client);
+int server_spare_init(void);
+int server_refuse_connection(const server_t server);
+server_route server_route_request(const server_t server, const struct http_request_t *request, struct http_response_t *response, char *file_name, size_t size);
+bool server_keep_alive(const server_t server, const struct http_request_t *request, unsigned int requests);
+int server_handle_connection(const server_t server, const client_t client);
+void server_linger(const client_t client, int timeout);
+int server_close_connection(const client_t client);
+
 int server_start(server_t *server);
 int server_stop(const server_t server);
 
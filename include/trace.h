@@ -0,0 +1,84 @@
+#ifndef TRACE_H
+#define TRACE_H
+
+#include <stddef.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <sys/types.h>
+
+/**
+ * Request tracing
+ *
+ * Every request carries a timeline: one timestamp per phase boundary, read
+ * from CLOCK_MONOTONIC_COARSE, which costs a few nanoseconds but only ticks
+ * once per jiffy (1 to 4 ms). It is meant to tell which phase a slow
+ * request spent its time in, not to profile fast ones; perf or bpftrace on
+ * the USDT probes below do that.
+ *
+ * Finished timelines go to a flight recorder: a ring of the last requests
+ * in shared memory, written by every process without a lock (each slot is
+ * guarded by a sequence number) and dumped to stderr on SIGUSR1. Requests
+ * slower than the slow request threshold are also logged as they finish.
+ *
+ * The time a connection spends in the accept queue is not visible from
+ * user space, a timeline starts when the server begins to wait for the
+ * request (accept() returned, or the previous response was sent).
+ */
+
+#define TRACE_URI_SIZE 64
+#define TRACE_DEFAULT_ENTRIES 256
+
+// Compiled in with make USDT=1, needs <sys/sdt.h> (systemtap-sdt-dev)
+#ifdef TRACE_USDT
+#include <sys/sdt.h>
+#define TRACE_PROBE2(name, a, b) DTRACE_PROBE2(simple_http, name, a, b)
+#define TRACE_PROBE4(name, a, b, c, d) \
+	DTRACE_PROBE4(simple_http, name, a, b, c, d)
+#else
+#define TRACE_PROBE2(name, a, b) do { } while (0)
+#define TRACE_PROBE4(name, a, b, c, d) do { } while (0)
+#endif
+
+typedef enum trace_phase {
+    TRACE_WAITING = 0,	// accepted, or the previous response was sent
+    TRACE_RECEIVING = 1,	// first bytes of the request are there
+    TRACE_PARSED = 2,	// request head (and body) received and parsed
+    TRACE_ROUTED = 3,	// cache lookup, MIME type or sniffing done
+    TRACE_OPENED = 4,	// file opened and stat'ed
+    TRACE_HEAD_SENT = 5,	// head handed to the kernel, body follows
+    TRACE_DONE = 6,	// last byte handed to the kernel
+    TRACE_PHASES = 7,
+} trace_phase;
+
+typedef struct trace_t {
+    uint64_t at[TRACE_PHASES];	// nanoseconds, 0 when the phase was skipped
+    pid_t pid;
+    int method;
+    int status_code;
+    size_t sent;
+    char uri[TRACE_URI_SIZE];
+} trace_t;
+
+typedef struct trace_slot_t {
+    uint64_t sequence;	// odd while the slot is being written
+    trace_t trace;
+} trace_slot_t;
+
+typedef struct trace_ring_t {
+    uint64_t next;
+    size_t size;
+    size_t mapping_size;
+    trace_slot_t slots[];
+} trace_ring_t;
+
+int trace_init(size_t entries, int slow_threshold);
+uint64_t trace_now(void);
+void trace_begin(trace_t *trace);
+void trace_mark(trace_t *trace, trace_phase phase);
+void trace_request(trace_t *trace, int method, const char *uri);
+void trace_end(trace_t *trace, int status_code, size_t sent);
+void trace_poll(void);
+void trace_dump(FILE *output);
+int trace_free(void);
+
+#endif
@@ -0,0 +1,109 @@
+#ifndef URING_H
+#define URING_H
+
+#include <linux/io_uring.h>
+#include <linux/stat.h>
+#include <linux/time_types.h>
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+
+#include "arena.h"
+#include "http.h"
+#include "rfc1945.h"
+#include "server.h"
+#include "trace.h"
+#include "wheel.h"
+
+/**
+ * io_uring connection handling
+ *
+ * Same request flow as the epoll loop, but every step (accept, recv,
+ * openat, statx, splice, send) is queued as a submission entry and the
+ * whole batch is handed to the kernel with a single io_uring_enter() per
+ * loop iteration. The ring is driven through the raw system calls, so
+ * there is no dependency on liburing.
+ *
+ * File bodies are spliced into a pipe of the connection and from there to
+ * the socket, so they stay in the page cache like with sendfile(). Files
+ * that cannot be spliced are read into the chunk buffer and sent instead.
+ *
+ * Deadlines live on a timing wheel, ticked by a timeout operation. As a
+ * connection always has one operation in flight, an expired deadline shuts
+ * its socket down, and the failed operation closes it as any other error.
+ */
+
+#define URING_ENTRIES 256
+#define URING_PIPE_SIZE 65536	// default capacity of a pipe
+
+typedef struct uring_t {
+    int fd;
+    unsigned int entries;
+    unsigned int *sq_head;
+    unsigned int *sq_tail;
+    unsigned int *sq_mask;
+    unsigned int *sq_array;
+    unsigned int sq_local_tail;
+    unsigned int sq_submitted;
+    unsigned int *cq_head;
+    unsigned int *cq_tail;
+    unsigned int *cq_mask;
+    struct io_uring_sqe *sqes;
+    struct io_uring_cqe *cqes;
+    void *sq_ring;
+    size_t sq_ring_size;
+    void *cq_ring;
+    size_t cq_ring_size;
+    size_t sqes_size;
+} uring_t;
+
+typedef enum uring_state {
+    URING_READING_HEAD = 0,
+    URING_READING_BODY = 1,
+    URING_OPENING_FILE = 2,
+    URING_STATING_FILE = 3,
+    URING_WRITING_HEAD = 4,
+    URING_READING_FILE = 5,
+    URING_WRITING_FILE = 6,
+    URING_FILLING_PIPE = 7,
+    URING_DRAINING_PIPE = 8,
+} uring_state;
+
+typedef struct uring_connection_t {
+    client_t client;
+    uring_state state;
+    http_buffer_t input;
+    size_t body_received;
+    arena_t arena;	// request and response memory, reset between requests
+    http_request_t request;
+    http_response_t response;
+    char file_name[SERVER_BUFFER_SIZE];
+    struct statx file_stat;
+    http_output_t output;
+    int file;
+    size_t file_size;
+    size_t file_sent;
+    char chunk[SERVER_BUFFER_SIZE];
+    size_t chunk_length;
+    size_t chunk_sent;
+    bool zero_copy;	// the file goes through the pipe, not the chunk
+    int pipe[2];	// opened for the first file body, -1 until then
+    size_t piped;	// file bytes in the pipe, not sent yet
+    unsigned int requests;
+    bool keep_alive;
+    uint64_t started;	// request head complete, for the duration metric
+    trace_t trace;
+    bool idle;	// waiting for the next request, under the keep-alive timeout
+    wheel_timer_t timer;
+    uint64_t progress;	// last time the socket took more of the response
+} uring_connection_t;
+
+int uring_init(uring_t *ring, unsigned int entries);
+struct io_uring_sqe *uring_sqe(uring_t *ring);
+int uring_submit(uring_t *ring, unsigned int wait);
+void uring_free(uring_t *ring);
+
+int uring_probe(void);
+int uring_loop_run(const server_t server);
+
+#endif
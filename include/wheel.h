@@ -0,0 +1,50 @@
+#ifndef WHEEL_H
+#define WHEEL_H
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+
+/**
+ * Hierarchical timing wheel
+ *
+ * Connection deadlines are rounded up to a tick and hashed into
+ * WHEEL_LEVELS wheels of WHEEL_SLOTS slots, each level WHEEL_SLOTS times
+ * coarser than the one below. Adding or removing a timer is O(1) whatever
+ * the number of connections; advancing the wheel by a tick expires one
+ * slot of the first level, and once every WHEEL_SLOTS ticks the next slot
+ * of the level above cascades down. Timers are embedded in the connections
+ * they time, so the wheel never allocates.
+ *
+ * With 10 ms ticks, the first level spans 640 ms and the last one about
+ * 46 hours; longer deadlines are cut to that.
+ */
+
+#define WHEEL_TICK 10	// milliseconds
+#define WHEEL_BITS 6
+#define WHEEL_SLOTS (1 << WHEEL_BITS)
+#define WHEEL_LEVELS 4
+
+typedef struct wheel_timer_t {
+    uint64_t expires;	// tick
+    void *data;
+    struct wheel_timer_t *next;
+    struct wheel_timer_t **pprev;	// NULL when not scheduled
+} wheel_timer_t;
+
+typedef struct wheel_t {
+    uint64_t now;	// last tick expired
+    size_t count;
+    wheel_timer_t *slots[WHEEL_LEVELS][WHEEL_SLOTS];
+} wheel_t;
+
+uint64_t wheel_now(void);
+void wheel_init(wheel_t *wheel, uint64_t now);
+void wheel_timer_init(wheel_timer_t *timer, void *data);
+bool wheel_pending(const wheel_timer_t *timer);
+void wheel_add(wheel_t *wheel, wheel_timer_t *timer, uint64_t deadline);
+void wheel_remove(wheel_t *wheel, wheel_timer_t *timer);
+wheel_timer_t *wheel_advance(wheel_t *wheel, uint64_t now);
+int wheel_timeout(const wheel_t *wheel, uint64_t now);
+
+#endif
@@ -0,0 +1,35 @@
+#ifndef HISTOGRAM_H
+#define HISTOGRAM_H
+
+#include <stddef.h>
+#include <stdint.h>
+
+/**
+ * High dynamic range latency histogram
+ *
+ * Values are nanoseconds. The first HISTOGRAM_SUB_BUCKETS values have a
+ * bucket each; above that, each power of two is split into
+ * HISTOGRAM_SUB_BUCKETS / 2 linear buckets, so every recorded value is
+ * kept within 0.1% whatever its magnitude, in a fixed amount of memory.
+ */
+
+#define HISTOGRAM_SUB_BITS 11
+#define HISTOGRAM_SUB_BUCKETS (1 << HISTOGRAM_SUB_BITS)
+#define HISTOGRAM_MAX_BITS 40	// about 18 minutes
+#define HISTOGRAM_BUCKETS \
+	((HISTOGRAM_MAX_BITS - HISTOGRAM_SUB_BITS + 2) * (HISTOGRAM_SUB_BUCKETS / 2))
+
+typedef struct histogram_t {
+    uint64_t counts[HISTOGRAM_BUCKETS];
+    uint64_t total;
+    uint64_t min;
+    uint64_t max;
+    double sum;
+} histogram_t;
+
+void histogram_init(histogram_t *histogram);
+void histogram_record(histogram_t *histogram, uint64_t value);
+uint64_t histogram_percentile(const histogram_t *histogram, double percentile);
+double histogram_mean(const histogram_t *histogram);
+
+#endif
@@ -0,0 +1,109 @@
+#ifndef LOADGEN_H
+#define LOADGEN_H
+
+#include <netinet/in.h>
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+
+#include "histogram.h"
+#include "workload.h"
+
+/**
+ * HTTP load generator
+ *
+ * A single epoll loop drives every connection with non-blocking sockets.
+ * In closed-loop mode each connection sends its next request as soon as it
+ * got a response. In open-loop mode requests are due at a fixed rate
+ * whatever the responses do; a request that finds no free connection waits,
+ * and its latency is measured from the time it was due, so a stalled server
+ * is not hidden by fewer requests being sent (coordinated omission).
+ *
+ * Some connections can be made slow readers (reading slow_bytes every
+ * slow_interval) or slow senders (sending their request the same way).
+ */
+
+#define LOADGEN_MAX_EVENTS 256
+#define LOADGEN_REQUEST_SIZE 2048
+#define LOADGEN_HEAD_SIZE 8192
+#define LOADGEN_READ_SIZE 65536
+#define LOADGEN_RETRY_DELAY 100	// ms before reconnecting after an error
+
+typedef struct loadgen_options_t {
+    struct sockaddr_in address;
+    char host[64];
+    unsigned int connections;
+    double duration;	// seconds
+    double rate;	// requests per second, 0 for a closed loop
+    const workload_t *workload;
+    bool keep_alive;
+    unsigned int slow_readers;	// percentage of the connections
+    unsigned int slow_senders;	// percentage of the connections
+    size_t slow_bytes;
+    unsigned int slow_interval;	// ms
+    unsigned int timeout;	// ms
+} loadgen_options_t;
+
+typedef enum loadgen_state {
+    LOADGEN_CLOSED = 0,
+    LOADGEN_CONNECTING = 1,
+    LOADGEN_IDLE = 2,
+    LOADGEN_SENDING = 3,
+    LOADGEN_RECEIVING = 4,
+} loadgen_state;
+
+typedef struct loadgen_connection_t {
+    int socket;
+    loadgen_state state;
+    unsigned int watching;
+    bool slow_reader;
+    bool slow_sender;
+    char request[LOADGEN_REQUEST_SIZE];
+    size_t request_length;
+    size_t request_sent;
+    char head[LOADGEN_HEAD_SIZE + 1];
+    size_t head_length;
+    bool head_done;
+    int status;
+    bool close_after;
+    bool until_close;	// no Content-Length, the body ends with the connection
+    size_t body_length;
+    size_t body_received;
+    long long started;	// when the request was due, ns
+    long long step_at;	// next slow step or reconnection, 0 when none
+} loadgen_connection_t;
+
+typedef struct loadgen_stats_t {
+    uint64_t requests;
+    uint64_t errors;
+    uint64_t timeouts;
+    uint64_t connects;
+    uint64_t bytes;
+    uint64_t status[6];	// by class, status[2] counts 2xx
+    uint64_t backlog;	// open loop requests still waiting at the end
+    double elapsed;	// seconds
+    histogram_t latency;
+} loadgen_stats_t;
+
+typedef struct loadgen_t {
+    const loadgen_options_t *options;
+    loadgen_stats_t *stats;
+    int epoll;
+    loadgen_connection_t *connections;
+    uint64_t seed;
+    long long start;
+    long long now;
+    bool running;
+    uint64_t issued;	// open loop requests sent so far
+    long long interval;	// ns between open loop requests
+} loadgen_t;
+
+typedef enum loadgen_error {
+    LOADGEN_OK = 0,
+    LOADGEN_MEMORY_ERROR = -1,
+    LOADGEN_EPOLL_ERROR = -2,
+} loadgen_error;
+
+int loadgen_run(const loadgen_options_t *options, loadgen_stats_t *stats);
+
+#endif
@@ -0,0 +1,43 @@
+#ifndef WORKLOAD_H
+#define WORKLOAD_H
+
+#include <stddef.h>
+#include <stdint.h>
+
+/**
+ * URL mix replayed by the load generator
+ *
+ * A workload file has one request per line, either "<path>",
+ * "<weight> <path>" or an access log line in the common or combined format,
+ * from which the quoted request line is used. Paths are picked at random in
+ * proportion to their weights.
+ */
+
+#define WORKLOAD_PATH_SIZE 1024
+
+typedef struct workload_entry_t {
+    char *path;
+    uint64_t weight;	// cumulative
+} workload_entry_t;
+
+typedef struct workload_t {
+    workload_entry_t *entries;
+    size_t count;
+    size_t capacity;
+    uint64_t total;
+} workload_t;
+
+typedef enum workload_error {
+    WORKLOAD_OK = 0,
+    WORKLOAD_FOPEN_ERROR = -1,
+    WORKLOAD_MEMORY_ERROR = -2,
+    WORKLOAD_EMPTY_ERROR = -3,
+} workload_error;
+
+void workload_init(workload_t *workload);
+int workload_add(workload_t *workload, const char *path, uint64_t weight);
+int workload_load(workload_t *workload, const char *file_name);
+const char *workload_pick(const workload_t *workload, uint64_t *seed);
+void workload_free(workload_t *workload);
+
+#endif
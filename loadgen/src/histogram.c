@@ -0,0 +1,73 @@
+#include <string.h>
+
+#include "histogram.h"
+
+#define HISTOGRAM_HALF (HISTOGRAM_SUB_BUCKETS / 2)
+
+void histogram_init(histogram_t *histogram)
+{
+	memset(histogram, 0, sizeof(histogram_t));
+}
+
+static size_t histogram_index(uint64_t value)
+{
+	if (value < HISTOGRAM_SUB_BUCKETS)
+		return value;
+
+	// Keep the HISTOGRAM_SUB_BITS most significant bits
+	int shift = 63 - __builtin_clzll(value) - (HISTOGRAM_SUB_BITS - 1);
+	size_t index = (size_t)(shift + 1) * HISTOGRAM_HALF
+	    + ((value >> shift) - HISTOGRAM_HALF);
+	return index < HISTOGRAM_BUCKETS ? index : HISTOGRAM_BUCKETS - 1;
+}
+
+// Highest value that falls in a bucket
+static uint64_t histogram_value(size_t index)
+{
+	if (index < HISTOGRAM_SUB_BUCKETS)
+		return index;
+
+	int shift = index / HISTOGRAM_HALF - 1;
+	uint64_t sub = index % HISTOGRAM_HALF + HISTOGRAM_HALF;
+	return ((sub + 1) << shift) - 1;
+}
+
+void histogram_record(histogram_t *histogram, uint64_t value)
+{
+	histogram->counts[histogram_index(value)]++;
+	if (0 == histogram->total || value < histogram->min)
+		histogram->min = value;
+	if (value > histogram->max)
+		histogram->max = value;
+	histogram->total++;
+	histogram->sum += value;
+}
+
+/**
+ * Smallest recorded value that the given percentage (0 to 100) of values
+ * do not exceed.
+ */
+uint64_t histogram_percentile(const histogram_t *histogram, double percentile)
+{
+	if (0 == histogram->total)
+		return 0;
+
+	uint64_t rank = (uint64_t)(percentile / 100.0 * histogram->total + 0.5);
+	if (rank < 1)
+		rank = 1;
+
+	uint64_t seen = 0;
+	for (size_t i = 0; i < HISTOGRAM_BUCKETS; i++) {
+		seen += histogram->counts[i];
+		if (seen >= rank) {
+			uint64_t value = histogram_value(i);
+			return value < histogram->max ? value : histogram->max;
+		}
+	}
+	return histogram->max;
+}
+
+double histogram_mean(const histogram_t *histogram)
+{
+	return histogram->total ? histogram->sum / histogram->total : 0;
+}
@@ -0,0 +1,482 @@
+#define _GNU_SOURCE
+
+#include <errno.h>
+#include <netinet/tcp.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <strings.h>
+#include <sys/epoll.h>
+#include <sys/socket.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "histogram.h"
+#include "loadgen.h"
+#include "workload.h"
+
+#define LOADGEN_MS 1000000LL
+#define LOADGEN_SLOW_RCVBUF 4096
+
+static long long loadgen_now(void)
+{
+	struct timespec now;
+	clock_gettime(CLOCK_MONOTONIC, &now);
+	return (long long)now.tv_sec * 1000000000LL + now.tv_nsec;
+}
+
+static void loadgen_watch(loadgen_t *loop, loadgen_connection_t *connection,
+			  unsigned int events)
+{
+	if (connection->watching == events)
+		return;
+
+	struct epoll_event event = {.events = events,.data.ptr = connection };
+	epoll_ctl(loop->epoll, EPOLL_CTL_MOD, connection->socket, &event);
+	connection->watching = events;
+}
+
+static void loadgen_close(loadgen_connection_t *connection)
+{
+	if (connection->socket >= 0)
+		close(connection->socket);
+	connection->socket = -1;
+	connection->state = LOADGEN_CLOSED;
+	connection->watching = 0;
+	connection->step_at = 0;
+}
+
+// Closes the connection, a new one is opened a bit later
+static void loadgen_fail(loadgen_t *loop, loadgen_connection_t *connection)
+{
+	loop->stats->errors++;
+	loadgen_close(connection);
+	connection->step_at = loop->now + LOADGEN_RETRY_DELAY * LOADGEN_MS;
+}
+
+static void loadgen_issue(loadgen_t *loop, loadgen_connection_t *connection,
+			  long long due);
+
+static void loadgen_connected(loadgen_t *loop,
+			      loadgen_connection_t *connection)
+{
+	connection->state = LOADGEN_IDLE;
+	loadgen_watch(loop, connection, EPOLLIN);	// Notice a close
+
+	if (loop->running && 0 == loop->options->rate)
+		loadgen_issue(loop, connection, loop->now);
+}
+
+static void loadgen_connect(loadgen_t *loop, loadgen_connection_t *connection)
+{
+	connection->step_at = 0;
+	connection->socket = socket(AF_INET,
+				    SOCK_STREAM | SOCK_NONBLOCK | SOCK_CLOEXEC,
+				    0);
+	if (connection->socket < 0) {
+		loadgen_fail(loop, connection);
+		return;
+	}
+
+	int one = 1;
+	setsockopt(connection->socket, IPPROTO_TCP, TCP_NODELAY, &one,
+		   sizeof(one));
+	if (connection->slow_reader) {
+		// Otherwise the kernel would read the response for the client
+		int size = LOADGEN_SLOW_RCVBUF;
+		setsockopt(connection->socket, SOL_SOCKET, SO_RCVBUF, &size,
+			   sizeof(size));
+	}
+
+	struct epoll_event event = {.events = EPOLLOUT,.data.ptr = connection };
+	if (epoll_ctl(loop->epoll, EPOLL_CTL_ADD, connection->socket, &event)
+	    < 0) {
+		loadgen_fail(loop, connection);
+		return;
+	}
+	connection->watching = EPOLLOUT;
+	loop->stats->connects++;
+
+	int err = connect(connection->socket,
+			  (const struct sockaddr *)&loop->options->address,
+			  sizeof(loop->options->address));
+	if (err == 0) {
+		loadgen_connected(loop, connection);
+	} else if (EINPROGRESS == errno) {
+		connection->state = LOADGEN_CONNECTING;
+	} else {
+		loadgen_fail(loop, connection);
+	}
+}
+
+static void loadgen_send(loadgen_t *loop, loadgen_connection_t *connection)
+{
+	const loadgen_options_t *options = loop->options;
+
+	size_t left = connection->request_length - connection->request_sent;
+	if (connection->slow_sender && left > options->slow_bytes)
+		left = options->slow_bytes;
+
+	ssize_t sent = send(connection->socket,
+			    connection->request + connection->request_sent,
+			    left, MSG_NOSIGNAL);
+	if (sent < 0) {
+		if (EAGAIN == errno || EWOULDBLOCK == errno)
+			loadgen_watch(loop, connection, EPOLLOUT);
+		else
+			loadgen_fail(loop, connection);
+		return;
+	}
+	connection->request_sent += sent;
+
+	if (connection->request_sent == connection->request_length) {
+		connection->state = LOADGEN_RECEIVING;
+		connection->step_at = 0;
+		loadgen_watch(loop, connection, EPOLLIN);
+	} else if (connection->slow_sender) {
+		connection->step_at =
+		    loop->now + options->slow_interval * LOADGEN_MS;
+		loadgen_watch(loop, connection, 0);
+	} else {
+		loadgen_watch(loop, connection, EPOLLOUT);
+	}
+}
+
+static void loadgen_issue(loadgen_t *loop, loadgen_connection_t *connection,
+			  long long due)
+{
+	const loadgen_options_t *options = loop->options;
+	const char *path = workload_pick(options->workload, &loop->seed);
+
+	int length = snprintf(connection->request, LOADGEN_REQUEST_SIZE,
+			      "GET %s HTTP/1.1\r\n"
+			      "Host: %s\r\n"
+			      "User-Agent: simple-http-bench\r\n"
+			      "%s\r\n", path, options->host,
+			      options->keep_alive ? "" :
+			      "Connection: close\r\n");
+	if (length < 0 || length >= LOADGEN_REQUEST_SIZE) {
+		loadgen_fail(loop, connection);
+		return;
+	}
+
+	connection->request_length = length;
+	connection->request_sent = 0;
+	connection->head_length = 0;
+	connection->head_done = false;
+	connection->status = 0;
+	connection->close_after = !options->keep_alive;
+	connection->until_close = false;
+	connection->body_length = 0;
+	connection->body_received = 0;
+	connection->started = due;
+	connection->state = LOADGEN_SENDING;
+	loadgen_send(loop, connection);
+}
+
+static void loadgen_parse_head(loadgen_connection_t *connection)
+{
+	const char *line = connection->head;
+	if (strncmp(line, "HTTP/", 5) == 0) {
+		const char *space = strchr(line, ' ');
+		if (NULL != space)
+			connection->status = atoi(space + 1);
+	}
+
+	bool has_length = false;
+	while (NULL != (line = strstr(line, "\r\n")) && line[2] != '\r') {
+		line += 2;
+		if (strncasecmp(line, "Content-Length:", 15) == 0) {
+			connection->body_length = strtoull(line + 15, NULL, 10);
+			has_length = true;
+		} else if (strncasecmp(line, "Connection:", 11) == 0) {
+			const char *end = strstr(line, "\r\n");
+			char value[64];
+			size_t length = end - line - 11;
+			if (length >= sizeof(value))
+				length = sizeof(value) - 1;
+			memcpy(value, line + 11, length);
+			value[length] = '\0';
+			if (NULL != strcasestr(value, "close"))
+				connection->close_after = true;
+		}
+	}
+
+	int status = connection->status;
+	if (!has_length && status >= 200 && 204 != status && 304 != status)
+		connection->until_close = true;
+}
+
+static void loadgen_complete(loadgen_t *loop,
+			     loadgen_connection_t *connection)
+{
+	loadgen_stats_t *stats = loop->stats;
+	long long latency = loop->now - connection->started;
+	histogram_record(&stats->latency, latency > 0 ? latency : 0);
+	stats->requests++;
+	stats->bytes += connection->head_length + connection->body_received;
+	int class = connection->status / 100;
+	if (class >= 1 && class <= 5)
+		stats->status[class]++;
+
+	if (connection->close_after || connection->until_close) {
+		loadgen_close(connection);
+		if (loop->running)
+			loadgen_connect(loop, connection);
+		return;
+	}
+
+	connection->state = LOADGEN_IDLE;
+	loadgen_watch(loop, connection, EPOLLIN);
+	if (loop->running && 0 == loop->options->rate)
+		loadgen_issue(loop, connection, loop->now);
+}
+
+static void loadgen_receive(loadgen_t *loop, loadgen_connection_t *connection)
+{
+	const loadgen_options_t *options = loop->options;
+	static char scratch[LOADGEN_READ_SIZE];
+
+	for (;;) {
+		char *buffer = scratch;
+		size_t size = sizeof(scratch);
+		if (!connection->head_done) {
+			buffer = connection->head + connection->head_length;
+			size = LOADGEN_HEAD_SIZE - connection->head_length;
+		}
+		if (connection->slow_reader && size > options->slow_bytes)
+			size = options->slow_bytes;
+		if (0 == size) {
+			loadgen_fail(loop, connection);	// Head too large
+			return;
+		}
+
+		ssize_t received = recv(connection->socket, buffer, size, 0);
+		if (received < 0) {
+			if (EAGAIN == errno || EWOULDBLOCK == errno)
+				loadgen_watch(loop, connection, EPOLLIN);
+			else
+				loadgen_fail(loop, connection);
+			return;
+		}
+		if (0 == received) {
+			if (connection->head_done && connection->until_close)
+				loadgen_complete(loop, connection);
+			else
+				loadgen_fail(loop, connection);
+			return;
+		}
+
+		if (!connection->head_done) {
+			connection->head_length += received;
+			connection->head[connection->head_length] = '\0';
+			char *end = strstr(connection->head, "\r\n\r\n");
+			if (NULL != end) {
+				size_t length = end + 4 - connection->head;
+				connection->body_received =
+				    connection->head_length - length;
+				connection->head_length = length;
+				connection->head_done = true;
+				loadgen_parse_head(connection);
+			}
+		} else {
+			connection->body_received += received;
+		}
+
+		if (connection->head_done && !connection->until_close
+		    && connection->body_received >= connection->body_length) {
+			loadgen_complete(loop, connection);
+			return;
+		}
+
+		if (connection->slow_reader) {
+			connection->step_at =
+			    loop->now + options->slow_interval * LOADGEN_MS;
+			loadgen_watch(loop, connection, 0);
+			return;
+		}
+	}
+}
+
+static void loadgen_connecting(loadgen_t *loop,
+			       loadgen_connection_t *connection,
+			       unsigned int events)
+{
+	int error = 0;
+	socklen_t length = sizeof(error);
+	getsockopt(connection->socket, SOL_SOCKET, SO_ERROR, &error, &length);
+	if (0 != error || (events & (EPOLLERR | EPOLLHUP)))
+		loadgen_fail(loop, connection);
+	else
+		loadgen_connected(loop, connection);
+}
+
+// An idle connection is readable when the server closed it
+static void loadgen_idle(loadgen_t *loop, loadgen_connection_t *connection)
+{
+	char byte;
+	if (recv(connection->socket, &byte, 1, MSG_PEEK) > 0)
+		return;
+
+	loadgen_close(connection);
+	if (loop->running)
+		loadgen_connect(loop, connection);
+}
+
+static void loadgen_event(loadgen_t *loop, loadgen_connection_t *connection,
+			  unsigned int events)
+{
+	switch (connection->state) {
+	case LOADGEN_CONNECTING:
+		loadgen_connecting(loop, connection, events);
+		break;
+	case LOADGEN_IDLE:
+		loadgen_idle(loop, connection);
+		break;
+	case LOADGEN_SENDING:
+		if (events & (EPOLLERR | EPOLLHUP))
+			loadgen_fail(loop, connection);
+		else
+			loadgen_send(loop, connection);
+		break;
+	case LOADGEN_RECEIVING:
+		loadgen_receive(loop, connection);
+		break;
+	case LOADGEN_CLOSED:
+		break;
+	}
+}
+
+/**
+ * Runs the due slow steps, reconnections and timeouts, and sends the due
+ * open loop requests. Returns the next time something is due.
+ */
+static long long loadgen_tick(loadgen_t *loop, long long end)
+{
+	const loadgen_options_t *options = loop->options;
+	long long wake = end;
+
+	uint64_t due = 0;
+	if (options->rate > 0 && loop->running)
+		due = (loop->now - loop->start) / loop->interval + 1;
+
+	for (unsigned int i = 0; i < options->connections; i++) {
+		loadgen_connection_t *connection = &loop->connections[i];
+
+		if (0 != connection->step_at && connection->step_at <= loop->now) {
+			connection->step_at = 0;
+			if (LOADGEN_CLOSED == connection->state) {
+				if (loop->running)
+					loadgen_connect(loop, connection);
+			} else if (LOADGEN_SENDING == connection->state) {
+				loadgen_send(loop, connection);
+			} else if (LOADGEN_RECEIVING == connection->state) {
+				loadgen_receive(loop, connection);
+			}
+		}
+
+		if ((LOADGEN_SENDING == connection->state
+		     || LOADGEN_RECEIVING == connection->state)
+		    && options->timeout > 0
+		    && loop->now - connection->started >
+		    options->timeout * LOADGEN_MS) {
+			loop->stats->timeouts++;
+			loadgen_fail(loop, connection);
+		}
+
+		if (LOADGEN_IDLE == connection->state && loop->issued < due) {
+			loadgen_issue(loop, connection, loop->start
+				      + (long long)loop->issued * loop->interval);
+			loop->issued++;
+		}
+
+		if (0 != connection->step_at && connection->step_at < wake)
+			wake = connection->step_at;
+	}
+
+	if (options->rate > 0 && loop->running) {
+		long long next = loop->start
+		    + (long long)loop->issued * loop->interval;
+		// Requests waiting for a connection are sent when one is free
+		if (next > loop->now && next < wake)
+			wake = next;
+	}
+	return wake;
+}
+
+int loadgen_run(const loadgen_options_t *options, loadgen_stats_t *stats)
+{
+	memset(stats, 0, sizeof(loadgen_stats_t));
+	histogram_init(&stats->latency);
+
+	loadgen_t loop = {.options = options,.stats = stats,.seed =
+		    0x9e3779b97f4a7c15ULL,.running = true,.issued = 0 };
+	loop.interval = options->rate > 0 ? (long long)(1e9 / options->rate) : 0;
+	if (options->rate > 0 && loop.interval < 1)
+		loop.interval = 1;
+
+	loop.epoll = epoll_create1(EPOLL_CLOEXEC);
+	if (loop.epoll < 0)
+		return LOADGEN_EPOLL_ERROR;
+
+	loop.connections = calloc(options->connections,
+				  sizeof(loadgen_connection_t));
+	if (NULL == loop.connections) {
+		close(loop.epoll);
+		return LOADGEN_MEMORY_ERROR;
+	}
+
+	loop.start = loop.now = loadgen_now();
+	long long end = loop.start + (long long)(options->duration * 1e9);
+
+	for (unsigned int i = 0; i < options->connections; i++) {
+		loadgen_connection_t *connection = &loop.connections[i];
+		connection->socket = -1;
+		// Spread the slow connections evenly
+		connection->slow_reader =
+		    (i * 100 / options->connections) < options->slow_readers;
+		connection->slow_sender =
+		    ((options->connections - 1 - i) * 100 /
+		     options->connections) < options->slow_senders;
+		loadgen_connect(&loop, connection);
+	}
+
+	struct epoll_event events[LOADGEN_MAX_EVENTS];
+	while (loop.now < end) {
+		long long wake = loadgen_tick(&loop, end);
+
+		// Open-loop send times need better than epoll_wait() milliseconds
+		loop.now = loadgen_now();
+		long long wait = wake > loop.now ? wake - loop.now : 0;
+		if (wait > 100 * LOADGEN_MS)
+			wait = 100 * LOADGEN_MS;
+		struct timespec timeout = {
+			.tv_sec = wait / 1000000000LL,.tv_nsec =
+			    wait % 1000000000LL
+		};
+
+		int count = epoll_pwait2(loop.epoll, events,
+					 LOADGEN_MAX_EVENTS, &timeout, NULL);
+		if (count < 0 && EINTR != errno)
+			break;
+
+		loop.now = loadgen_now();
+		for (int i = 0; i < count; i++)
+			loadgen_event(&loop, events[i].data.ptr,
+				      events[i].events);
+	}
+	loop.running = false;
+
+	stats->elapsed = (loop.now - loop.start) / 1e9;
+	if (options->rate > 0) {
+		uint64_t due = (end - loop.start + loop.interval - 1) /
+		    loop.interval;
+		stats->backlog = due > loop.issued ? due - loop.issued : 0;
+	}
+
+	for (unsigned int i = 0; i < options->connections; i++)
+		loadgen_close(&loop.connections[i]);
+	free(loop.connections);
+	close(loop.epoll);
+	return LOADGEN_OK;
+}
@@ -0,0 +1,269 @@
+#define _GNU_SOURCE
+
+#include <arpa/inet.h>
+#include <getopt.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "histogram.h"
+#include "loadgen.h"
+#include "workload.h"
+
+static struct option loadgen_longopts[15] = {
+	{"host", required_argument, 0, 'h'},
+	{"port", required_argument, 0, 'p'},
+	{"connections", required_argument, 0, 'c'},
+	{"duration", required_argument, 0, 'd'},
+	{"rate", required_argument, 0, 'r'},
+	{"url", required_argument, 0, 'u'},
+	{"workload", required_argument, 0, 'w'},
+	{"close", no_argument, 0, 'C'},
+	{"slow-readers", required_argument, 0, 'R'},
+	{"slow-senders", required_argument, 0, 'S'},
+	{"slow-bytes", required_argument, 0, 'b'},
+	{"slow-interval", required_argument, 0, 'i'},
+	{"timeout", required_argument, 0, 't'},
+	{"output", required_argument, 0, 'o'},
+	{0, 0, 0, 0},
+};
+
+static char *loadgen_shortopts = "h:p:c:d:r:u:w:CR:S:b:i:t:o:";
+
+static void loadgen_usage(void)
+{
+	fprintf(stderr,
+		"Usage: simple-http-bench [-h <host>] [-p <port>] "
+		"[-c <connections>] [-d <seconds>] [-r <requests/s>]\n"
+		"       [-u <url> | -w <workload file>] [-C] "
+		"[-R <slow readers %%>] [-S <slow senders %%>]\n"
+		"       [-b <slow bytes>] [-i <slow interval ms>] "
+		"[-t <timeout ms>] [-o <json file>]\n");
+}
+
+static int loadgen_number(const char *name, const char *value, double min,
+			  double max, double *number)
+{
+	char *end = NULL;
+	*number = strtod(value, &end);
+	if ('\0' == value[0] || '\0' != *end || *number < min
+	    || *number > max) {
+		fprintf(stderr, "Error: Invalid %s '%s'\n", name, value);
+		return -1;
+	}
+	return 0;
+}
+
+static void loadgen_report(FILE *output, const loadgen_stats_t *stats)
+{
+	const histogram_t *latency = &stats->latency;
+	double rate = stats->elapsed > 0 ? stats->requests / stats->elapsed : 0;
+	double throughput = stats->elapsed > 0 ?
+	    stats->bytes / stats->elapsed / 1e6 : 0;
+
+	fprintf(output, "Requests     %llu in %.2fs, %.1f req/s, %.2f MB/s\n",
+		(unsigned long long)stats->requests, stats->elapsed, rate,
+		throughput);
+	fprintf(output, "Status       2xx %llu, 3xx %llu, 4xx %llu, 5xx %llu\n",
+		(unsigned long long)stats->status[2],
+		(unsigned long long)stats->status[3],
+		(unsigned long long)stats->status[4],
+		(unsigned long long)stats->status[5]);
+	fprintf(output, "Errors       %llu (%llu timeouts), %llu connections\n",
+		(unsigned long long)stats->errors,
+		(unsigned long long)stats->timeouts,
+		(unsigned long long)stats->connects);
+	if (stats->backlog > 0)
+		fprintf(output, "Backlog      %llu requests never sent\n",
+			(unsigned long long)stats->backlog);
+	fprintf(output,
+		"Latency      mean %.1fus, p50 %.1fus, p90 %.1fus, p99 %.1fus, "
+		"p99.9 %.1fus, max %.1fus\n", histogram_mean(latency) / 1e3,
+		histogram_percentile(latency, 50) / 1e3,
+		histogram_percentile(latency, 90) / 1e3,
+		histogram_percentile(latency, 99) / 1e3,
+		histogram_percentile(latency, 99.9) / 1e3,
+		latency->max / 1e3);
+}
+
+static int loadgen_report_json(const char *file_name,
+			       const loadgen_options_t *options,
+			       const loadgen_stats_t *stats)
+{
+	FILE *output = fopen(file_name, "w");
+	if (NULL == output) {
+		fprintf(stderr, "Error: Cannot write '%s'\n", file_name);
+		return -1;
+	}
+
+	const histogram_t *latency = &stats->latency;
+	fprintf(output,
+		"{\n  \"mode\": \"%s\",\n  \"connections\": %u,\n"
+		"  \"rate\": %.1f,\n  \"duration\": %.3f,\n"
+		"  \"requests\": %llu,\n  \"requests_per_second\": %.1f,\n"
+		"  \"bytes\": %llu,\n  \"errors\": %llu,\n  \"timeouts\": %llu,\n"
+		"  \"connects\": %llu,\n  \"backlog\": %llu,\n"
+		"  \"status\": {\"2xx\": %llu, \"3xx\": %llu, \"4xx\": %llu, "
+		"\"5xx\": %llu},\n",
+		options->rate > 0 ? "open" : "closed", options->connections,
+		options->rate, stats->elapsed,
+		(unsigned long long)stats->requests,
+		stats->elapsed > 0 ? stats->requests / stats->elapsed : 0,
+		(unsigned long long)stats->bytes,
+		(unsigned long long)stats->errors,
+		(unsigned long long)stats->timeouts,
+		(unsigned long long)stats->connects,
+		(unsigned long long)stats->backlog,
+		(unsigned long long)stats->status[2],
+		(unsigned long long)stats->status[3],
+		(unsigned long long)stats->status[4],
+		(unsigned long long)stats->status[5]);
+	fprintf(output,
+		"  \"latency_ns\": {\"mean\": %.0f, \"p50\": %llu, \"p90\": %llu, "
+		"\"p99\": %llu, \"p99.9\": %llu, \"max\": %llu}\n}\n",
+		histogram_mean(latency),
+		(unsigned long long)histogram_percentile(latency, 50),
+		(unsigned long long)histogram_percentile(latency, 90),
+		(unsigned long long)histogram_percentile(latency, 99),
+		(unsigned long long)histogram_percentile(latency, 99.9),
+		(unsigned long long)latency->max);
+	fclose(output);
+	return 0;
+}
+
+int main(int argc, char *argv[])
+{
+	loadgen_options_t options = {
+		.connections = 16,.duration = 10,.rate = 0,.keep_alive =
+		    true,.slow_readers = 0,.slow_senders = 0,.slow_bytes =
+		    16,.slow_interval = 10,.timeout = 10000
+	};
+	options.address.sin_family = AF_INET;
+	options.address.sin_port = htons(8080);
+	options.address.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+	snprintf(options.host, sizeof(options.host), "127.0.0.1");
+
+	const char *url = "/index.html";
+	const char *workload_file = NULL;
+	const char *output = NULL;
+
+	int c;
+	double number;
+	while ((c = getopt_long(argc, argv, loadgen_shortopts,
+				loadgen_longopts, NULL)) != -1) {
+		switch (c) {
+		case 'h':
+			if (inet_pton(AF_INET, optarg,
+				      &options.address.sin_addr) != 1) {
+				fprintf(stderr,
+					"Error: Invalid host address '%s'\n",
+					optarg);
+				return 1;
+			}
+			snprintf(options.host, sizeof(options.host), "%s",
+				 optarg);
+			break;
+		case 'p':
+			if (loadgen_number("port", optarg, 1, 65535, &number) < 0)
+				return 1;
+			options.address.sin_port = htons((int)number);
+			break;
+		case 'c':
+			if (loadgen_number("connections", optarg, 1, 100000,
+					   &number) < 0)
+				return 1;
+			options.connections = number;
+			break;
+		case 'd':
+			if (loadgen_number("duration", optarg, 0.001, 86400,
+					   &options.duration) < 0)
+				return 1;
+			break;
+		case 'r':
+			if (loadgen_number("rate", optarg, 0, 1e9,
+					   &options.rate) < 0)
+				return 1;
+			break;
+		case 'u':
+			url = optarg;
+			break;
+		case 'w':
+			workload_file = optarg;
+			break;
+		case 'C':
+			options.keep_alive = false;
+			break;
+		case 'R':
+			if (loadgen_number("slow readers", optarg, 0, 100,
+					   &number) < 0)
+				return 1;
+			options.slow_readers = number;
+			break;
+		case 'S':
+			if (loadgen_number("slow senders", optarg, 0, 100,
+					   &number) < 0)
+				return 1;
+			options.slow_senders = number;
+			break;
+		case 'b':
+			if (loadgen_number("slow bytes", optarg, 1, 1 << 20,
+					   &number) < 0)
+				return 1;
+			options.slow_bytes = number;
+			break;
+		case 'i':
+			if (loadgen_number("slow interval", optarg, 1, 60000,
+					   &number) < 0)
+				return 1;
+			options.slow_interval = number;
+			break;
+		case 't':
+			if (loadgen_number("timeout", optarg, 0, 3600000,
+					   &number) < 0)
+				return 1;
+			options.timeout = number;
+			break;
+		case 'o':
+			output = optarg;
+			break;
+		default:
+			loadgen_usage();
+			return 1;
+		}
+	}
+
+	workload_t workload;
+	workload_init(&workload);
+	int err = NULL != workload_file ? workload_load(&workload,
+							workload_file) :
+	    workload_add(&workload, url, 1);
+	if (err < 0) {
+		fprintf(stderr, "Error: Cannot load workload '%s'\n",
+			NULL != workload_file ? workload_file : url);
+		workload_free(&workload);
+		return 1;
+	}
+	options.workload = &workload;
+
+	fprintf(stderr, "Info: %s loop, %u connections, %.1fs against %s:%d\n",
+		options.rate > 0 ? "Open" : "Closed", options.connections,
+		options.duration, options.host,
+		ntohs(options.address.sin_port));
+
+	loadgen_stats_t *stats = malloc(sizeof(loadgen_stats_t));
+	if (NULL == stats || loadgen_run(&options, stats) < 0) {
+		fprintf(stderr, "Error: Load generator failed\n");
+		free(stats);
+		workload_free(&workload);
+		return 1;
+	}
+
+	loadgen_report(stdout, stats);
+	if (NULL != output)
+		loadgen_report_json(output, &options, stats);
+
+	int failed = 0 == stats->requests;
+	free(stats);
+	workload_free(&workload);
+	return failed;
+}
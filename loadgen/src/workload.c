@@ -0,0 +1,137 @@
+#define _GNU_SOURCE
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "workload.h"
+
+void workload_init(workload_t *workload)
+{
+	workload->entries = NULL;
+	workload->count = 0;
+	workload->capacity = 0;
+	workload->total = 0;
+}
+
+int workload_add(workload_t *workload, const char *path, uint64_t weight)
+{
+	if (0 == weight)
+		return WORKLOAD_OK;
+
+	if (workload->count == workload->capacity) {
+		size_t capacity = workload->capacity ? workload->capacity * 2 : 16;
+		workload_entry_t *entries = realloc(workload->entries,
+						    capacity *
+						    sizeof(workload_entry_t));
+		if (NULL == entries)
+			return WORKLOAD_MEMORY_ERROR;
+		workload->entries = entries;
+		workload->capacity = capacity;
+	}
+
+	char *copy = strdup(path);
+	if (NULL == copy)
+		return WORKLOAD_MEMORY_ERROR;
+
+	workload->total += weight;
+	workload->entries[workload->count].path = copy;
+	workload->entries[workload->count].weight = workload->total;
+	workload->count++;
+	return WORKLOAD_OK;
+}
+
+/**
+ * Finds the path of a line: "<path>", "<weight> <path>", or the request
+ * line quoted in an access log entry. Returns 0 when there is none.
+ */
+static int workload_parse_line(char *line, char **path, uint64_t *weight)
+{
+	*weight = 1;
+
+	char *quote = strchr(line, '"');
+	if (NULL != quote) {
+		// ... "GET /path HTTP/1.1" ...
+		char *save = NULL;
+		char *method = strtok_r(quote + 1, " \"", &save);
+		*path = strtok_r(NULL, " \"", &save);
+		return NULL != method && NULL != *path && '/' == (*path)[0];
+	}
+
+	char *save = NULL;
+	char *first = strtok_r(line, " \t\r\n", &save);
+	if (NULL == first || '#' == first[0])
+		return 0;
+
+	char *second = strtok_r(NULL, " \t\r\n", &save);
+	if (NULL == second) {
+		*path = first;
+	} else {
+		char *end = NULL;
+		*weight = strtoull(first, &end, 10);
+		if ('\0' != *end)
+			return 0;
+		*path = second;
+	}
+	return '/' == (*path)[0];
+}
+
+int workload_load(workload_t *workload, const char *file_name)
+{
+	FILE *file = fopen(file_name, "r");
+	if (NULL == file)
+		return WORKLOAD_FOPEN_ERROR;
+
+	char line[WORKLOAD_PATH_SIZE * 2];
+	while (NULL != fgets(line, sizeof(line), file)) {
+		char *path;
+		uint64_t weight;
+		if (!workload_parse_line(line, &path, &weight))
+			continue;
+		if (strlen(path) >= WORKLOAD_PATH_SIZE)
+			continue;
+
+		int err = workload_add(workload, path, weight);
+		if (err < 0) {
+			fclose(file);
+			return err;
+		}
+	}
+	fclose(file);
+
+	return 0 == workload->count ? WORKLOAD_EMPTY_ERROR : WORKLOAD_OK;
+}
+
+// xorshift64*, cheap and good enough to spread requests
+static uint64_t workload_random(uint64_t *seed)
+{
+	*seed ^= *seed >> 12;
+	*seed ^= *seed << 25;
+	*seed ^= *seed >> 27;
+	return *seed * 0x2545f4914f6cdd1dULL;
+}
+
+const char *workload_pick(const workload_t *workload, uint64_t *seed)
+{
+	if (1 == workload->count)
+		return workload->entries[0].path;
+
+	uint64_t target = workload_random(seed) % workload->total;
+	size_t low = 0, high = workload->count - 1;
+	while (low < high) {
+		size_t middle = low + (high - low) / 2;
+		if (workload->entries[middle].weight > target)
+			high = middle;
+		else
+			low = middle + 1;
+	}
+	return workload->entries[low].path;
+}
+
+void workload_free(workload_t *workload)
+{
+	for (size_t i = 0; i < workload->count; i++)
+		free(workload->entries[i].path);
+	free(workload->entries);
+	workload_init(workload);
+}
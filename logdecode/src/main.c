@@ -0,0 +1,86 @@
+#include <getopt.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "accesslog.h"
+
+/**
+ * Turns a binary access log back into Common or Combined Log Format lines.
+ * Reads the files given, or stdin, and writes to stdout.
+ */
+
+static void logdecode_usage(void)
+{
+	fprintf(stderr,
+		"Usage: simple-http-logdecode [-f common|combined] [file...]\n");
+}
+
+static int logdecode_file(FILE *file, const char *name,
+			  accesslog_format format)
+{
+	char magic[8];
+	if (fread(magic, 1, sizeof(magic), file) != sizeof(magic)
+	    || memcmp(magic, ACCESSLOG_MAGIC, sizeof(magic)) != 0) {
+		fprintf(stderr, "Error: '%s' is not a binary access log\n",
+			name);
+		return -1;
+	}
+
+	accesslog_record_t record;
+	char line[ACCESSLOG_LINE_SIZE];
+	while (fread(&record, sizeof(record), 1, file) == 1) {
+		int length = accesslog_format_record(&record, format, line,
+						     sizeof(line));
+		if (length > 0)
+			fwrite(line, 1, length, stdout);
+	}
+
+	if (ferror(file)) {
+		fprintf(stderr, "Error: Cannot read '%s'\n", name);
+		return -1;
+	}
+	return 0;
+}
+
+int main(int argc, char **argv)
+{
+	accesslog_format format = ACCESSLOG_COMMON;
+
+	int c;
+	while ((c = getopt(argc, argv, "f:")) != -1) {
+		switch (c) {
+		case 'f':
+			if (accesslog_parse_format(optarg, &format) < 0
+			    || ACCESSLOG_BINARY == format) {
+				fprintf(stderr,
+					"Error: Invalid format '%s'\n", optarg);
+				return EXIT_FAILURE;
+			}
+			break;
+
+		default:
+			logdecode_usage();
+			return EXIT_FAILURE;
+		}
+	}
+
+	if (optind == argc)
+		return logdecode_file(stdin, "stdin", format) < 0 ?
+		    EXIT_FAILURE : EXIT_SUCCESS;
+
+	int err = 0;
+	for (int i = optind; i < argc; i++) {
+		FILE *file = fopen(argv[i], "rb");
+		if (NULL == file) {
+			fprintf(stderr, "Error: Cannot open '%s'\n", argv[i]);
+			err = -1;
+			continue;
+		}
+		if (logdecode_file(file, argv[i], format) < 0)
+			err = -1;
+		fclose(file);
+	}
+
+	return err < 0 ? EXIT_FAILURE : EXIT_SUCCESS;
+}
@@ -0,0 +1,534 @@
+#define _GNU_SOURCE
+
+#include <arpa/inet.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <signal.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <sys/prctl.h>
+#include <sys/stat.h>
+#include <sys/types.h>
+#include <sys/wait.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "accesslog.h"
+#include "http.h"
+#include "metrics.h"
+#include "server.h"
+
+static accesslog_t *accesslog = NULL;
+static accesslog_ring_t *accesslog_current = NULL;
+static unsigned int accesslog_counter = 0;
+
+static volatile sig_atomic_t accesslog_reopen_requested = 0;
+static volatile sig_atomic_t accesslog_stopping = 0;
+
+static const char *accesslog_methods[] = { "-", "GET", "HEAD", "POST" };
+
+int accesslog_parse_format(const char *value, accesslog_format *format)
+{
+	if (strcmp(value, "common") == 0)
+		*format = ACCESSLOG_COMMON;
+	else if (strcmp(value, "combined") == 0)
+		*format = ACCESSLOG_COMBINED;
+	else if (strcmp(value, "binary") == 0)
+		*format = ACCESSLOG_BINARY;
+	else
+		return -1;
+	return 0;
+}
+
+static accesslog_ring_t *accesslog_ring(int index)
+{
+	return (accesslog_ring_t *) ((char *)accesslog +
+				     sizeof(accesslog_t)) + index;
+}
+
+/* ---------- Workers ---------- */
+
+void accesslog_worker(int index)
+{
+	if (NULL != accesslog && index >= 0 && index < accesslog->ring_count)
+		accesslog_current = accesslog_ring(index);
+}
+
+static void accesslog_copy(char *destination, size_t size, const char *value)
+{
+	if (NULL == value) {
+		destination[0] = '\0';
+		return;
+	}
+
+	size_t length = strlen(value);
+	if (length >= size)
+		length = size - 1;
+	memcpy(destination, value, length);
+	destination[length] = '\0';
+}
+
+static accesslog_slot_t *accesslog_claim(accesslog_ring_t *ring,
+					 uint64_t *position)
+{
+	uint64_t head = __atomic_load_n(&ring->head, __ATOMIC_RELAXED);
+	while (1) {
+		accesslog_slot_t *slot =
+		    &ring->slots[head & (ACCESSLOG_RING_SIZE - 1)];
+		uint64_t sequence = __atomic_load_n(&slot->sequence,
+						    __ATOMIC_ACQUIRE);
+		if (sequence < head)
+			return NULL;	// Full, the logger is behind
+		if (sequence == head
+		    && __atomic_compare_exchange_n(&ring->head, &head,
+						   head + 1, false,
+						   __ATOMIC_RELAXED,
+						   __ATOMIC_RELAXED)) {
+			*position = head;
+			return slot;
+		}
+		if (sequence > head)
+			head = __atomic_load_n(&ring->head, __ATOMIC_RELAXED);
+	}
+}
+
+/**
+ * Queues the record of a finished request for the logger. Every request
+ * that fails is logged, successful ones are sampled.
+ */
+void accesslog_request(const client_t *client, const http_request_t *request,
+		       const http_response_t *response, uint64_t started)
+{
+	if (NULL == accesslog_current)
+		return;
+
+	if (accesslog->sample > 1 && response->status_code < 400
+	    && accesslog_counter++ % accesslog->sample != 0)
+		return;
+
+	uint64_t position;
+	accesslog_slot_t *slot = accesslog_claim(accesslog_current, &position);
+	if (NULL == slot) {
+		__atomic_fetch_add(&accesslog_current->dropped, 1,
+				   __ATOMIC_RELAXED);
+		return;
+	}
+
+	struct timespec now;
+	clock_gettime(CLOCK_REALTIME_COARSE, &now);
+
+	accesslog_record_t *record = &slot->record;
+	record->time = (uint64_t)now.tv_sec * 1000000 + now.tv_nsec / 1000;
+	record->address = client->client_addr.sin_addr.s_addr;
+	record->port = ntohs(client->client_addr.sin_port);
+	record->method = request->method;
+	record->version = request->major * 10 + request->minor;
+	record->status_code = response->status_code;
+	record->reserved = 0;
+	record->duration = (metrics_now() - started) / 1000;
+	record->sent = response->body_sent;
+	accesslog_copy(record->uri, sizeof(record->uri), request->uri);
+	accesslog_copy(record->referer, sizeof(record->referer),
+		       http_request_header_id(request, HEADER_REFERER));
+	accesslog_copy(record->user_agent, sizeof(record->user_agent),
+		       http_request_header_id(request, HEADER_USER_AGENT));
+
+	// The logger may have skipped the slot meanwhile, it is not ours then
+	uint64_t claimed = position;
+	if (!__atomic_compare_exchange_n(&slot->sequence, &claimed,
+					 position + 1, false,
+					 __ATOMIC_RELEASE, __ATOMIC_RELAXED))
+		__atomic_fetch_add(&accesslog_current->dropped, 1,
+				   __ATOMIC_RELAXED);
+}
+
+/* ---------- Formatting ---------- */
+
+// Quotes and control characters are escaped, so a field cannot forge a line
+static size_t accesslog_escape(char *buffer, size_t size, const char *value)
+{
+	static const char hex[] = "0123456789abcdef";
+	size_t length = 0;
+	if ('\0' == value[0])
+		value = "-";
+
+	for (; '\0' != *value && length + 4 < size; value++) {
+		unsigned char c = *value;
+		if ('"' == c || '\\' == c || c < 0x20 || c >= 0x7f) {
+			buffer[length++] = '\\';
+			buffer[length++] = 'x';
+			buffer[length++] = hex[c >> 4];
+			buffer[length++] = hex[c & 0xf];
+		} else
+			buffer[length++] = c;
+	}
+	buffer[length] = '\0';
+	return length;
+}
+
+/**
+ * Formats a record as a text line (with its newline). Returns the length,
+ * or a negative value when the buffer is too small.
+ */
+int accesslog_format_record(const accesslog_record_t *record,
+			    accesslog_format format, char *buffer, size_t size)
+{
+	// Formatting the date is the expensive part, records come in bursts
+	static time_t cached_second = -1;
+	static char cached_date[32];
+
+	time_t second = record->time / 1000000;
+	if (second != cached_second) {
+		struct tm tm;
+		localtime_r(&second, &tm);
+		strftime(cached_date, sizeof(cached_date),
+			 "%d/%b/%Y:%H:%M:%S %z", &tm);
+		cached_second = second;
+	}
+
+	char address[INET_ADDRSTRLEN];
+	inet_ntop(AF_INET, &record->address, address, sizeof(address));
+
+	char uri[ACCESSLOG_URI_SIZE * 4];
+	accesslog_escape(uri, sizeof(uri), record->uri);
+
+	// Body bytes only, "-" when there is no body
+	char sent[24] = "-";
+	if (record->sent > 0)
+		snprintf(sent, sizeof(sent), "%llu",
+			 (unsigned long long)record->sent);
+
+	const char *method = record->method < 4 ?
+	    accesslog_methods[record->method] : accesslog_methods[0];
+	int length = snprintf(buffer, size,
+			      "%s - - [%s] \"%s %s HTTP/%d.%d\" %d %s",
+			      address, cached_date, method, uri,
+			      record->version / 10, record->version % 10,
+			      record->status_code, sent);
+	if (length < 0 || (size_t)length >= size)
+		return -1;
+
+	if (ACCESSLOG_COMBINED == format) {
+		char referer[ACCESSLOG_FIELD_SIZE * 4];
+		char user_agent[ACCESSLOG_FIELD_SIZE * 4];
+		accesslog_escape(referer, sizeof(referer), record->referer);
+		accesslog_escape(user_agent, sizeof(user_agent),
+				 record->user_agent);
+		int write_size = snprintf(buffer + length, size - length,
+					  " \"%s\" \"%s\"", referer,
+					  user_agent);
+		if (write_size < 0 || (size_t)write_size >= size - length)
+			return -1;
+		length += write_size;
+	}
+
+	if ((size_t)length + 1 >= size)
+		return -1;
+	buffer[length++] = '\n';
+	buffer[length] = '\0';
+	return length;
+}
+
+/* ---------- Logger process ---------- */
+
+typedef struct accesslog_writer_t {
+	const char *path;
+	int file;
+	char buffer[ACCESSLOG_BATCH_SIZE];
+	size_t length;
+} accesslog_writer_t;
+
+static void accesslog_signal_handler(int signum)
+{
+	if (SIGHUP == signum)
+		accesslog_reopen_requested = 1;
+	else
+		accesslog_stopping = 1;
+}
+
+static void accesslog_flush(accesslog_writer_t *writer)
+{
+	size_t written = 0;
+	while (written < writer->length) {
+		ssize_t size = write(writer->file, writer->buffer + written,
+				     writer->length - written);
+		if (size < 0 && EINTR == errno)
+			continue;
+		if (size <= 0)
+			break;	// Nowhere to log to, do not hold the records
+		written += size;
+	}
+	writer->length = 0;
+}
+
+static int accesslog_open(accesslog_writer_t *writer)
+{
+	if (NULL == writer->path) {
+		writer->file = STDERR_FILENO;
+		return 0;
+	}
+
+	writer->file = open(writer->path,
+			    O_WRONLY | O_APPEND | O_CREAT | O_CLOEXEC, 0644);
+	if (writer->file < 0) {
+		fprintf(stderr, "Error: Cannot open access log '%s'\n",
+			writer->path);
+		return -1;
+	}
+
+	// A new binary log starts with its header
+	struct stat file_stat;
+	if (ACCESSLOG_BINARY == accesslog->format
+	    && fstat(writer->file, &file_stat) == 0 && file_stat.st_size == 0) {
+		memcpy(writer->buffer + writer->length, ACCESSLOG_MAGIC, 8);
+		writer->length += 8;
+	}
+	return 0;
+}
+
+static void accesslog_reopen(accesslog_writer_t *writer)
+{
+	accesslog_flush(writer);
+	if (STDERR_FILENO != writer->file)
+		close(writer->file);
+	if (accesslog_open(writer) < 0)
+		writer->file = STDERR_FILENO;
+}
+
+static void accesslog_write(accesslog_writer_t *writer,
+			    const accesslog_record_t *record)
+{
+	if (ACCESSLOG_BINARY == accesslog->format) {
+		if (writer->length + sizeof(*record) > sizeof(writer->buffer))
+			accesslog_flush(writer);
+		memcpy(writer->buffer + writer->length, record,
+		       sizeof(*record));
+		writer->length += sizeof(*record);
+		return;
+	}
+
+	if (writer->length + ACCESSLOG_LINE_SIZE > sizeof(writer->buffer))
+		accesslog_flush(writer);
+	int length = accesslog_format_record(record, accesslog->format,
+					     writer->buffer + writer->length,
+					     ACCESSLOG_LINE_SIZE);
+	if (length > 0)
+		writer->length += length;
+}
+
+/**
+ * Tells whether the slot at the tail, claimed but not published, waited
+ * long enough to be skipped: its producer was likely killed in between.
+ * Publishing it would fail then, as the sequence number is no longer the
+ * one it claimed.
+ */
+static bool accesslog_skip(accesslog_ring_t *ring, accesslog_slot_t *slot,
+			   uint64_t tail)
+{
+	if (__atomic_load_n(&ring->head, __ATOMIC_RELAXED) == tail) {
+		ring->stalled_since = 0;
+		return false;	// Empty
+	}
+
+	uint64_t now = metrics_now() / 1000000;
+	if (0 == ring->stalled_since) {
+		ring->stalled_since = now;
+		return false;
+	}
+	if (now - ring->stalled_since < ACCESSLOG_STALL)
+		return false;
+
+	uint64_t claimed = tail;
+	if (!__atomic_compare_exchange_n(&slot->sequence, &claimed,
+					 tail + ACCESSLOG_RING_SIZE, false,
+					 __ATOMIC_ACQ_REL, __ATOMIC_ACQUIRE))
+		return false;	// Published just now, read it next time
+
+	ring->tail = tail + 1;
+	ring->stalled_since = 0;
+	__atomic_fetch_add(&ring->dropped, 1, __ATOMIC_RELAXED);
+	return true;
+}
+
+// Returns the number of records taken from the ring
+static size_t accesslog_drain(accesslog_writer_t *writer,
+			      accesslog_ring_t *ring)
+{
+	size_t count = 0;
+	while (1) {
+		uint64_t tail = ring->tail;
+		accesslog_slot_t *slot =
+		    &ring->slots[tail & (ACCESSLOG_RING_SIZE - 1)];
+		if (__atomic_load_n(&slot->sequence, __ATOMIC_ACQUIRE) !=
+		    tail + 1) {
+			if (accesslog_skip(ring, slot, tail))
+				continue;
+			break;
+		}
+
+		ring->stalled_since = 0;
+		accesslog_write(writer, &slot->record);
+		ring->tail = tail + 1;
+		__atomic_store_n(&slot->sequence, tail + ACCESSLOG_RING_SIZE,
+				 __ATOMIC_RELEASE);
+		count++;
+	}
+	return count;
+}
+
+static void accesslog_report_drops(uint64_t *reported)
+{
+	uint64_t dropped = 0;
+	for (int i = 0; i < accesslog->ring_count; i++)
+		dropped += __atomic_load_n(&accesslog_ring(i)->dropped,
+					   __ATOMIC_RELAXED);
+	if (dropped > *reported) {
+		fprintf(stderr, "Warning: %llu access log records dropped\n",
+			(unsigned long long)(dropped - *reported));
+		*reported = dropped;
+	}
+}
+
+static void accesslog_run(const char *path)
+{
+	signal(SIGINT, SIG_IGN);
+	signal(SIGUSR1, SIG_IGN);
+	signal(SIGCHLD, SIG_DFL);
+
+	struct sigaction action;
+	memset(&action, 0, sizeof(action));
+	action.sa_handler = accesslog_signal_handler;
+	sigemptyset(&action.sa_mask);
+	sigaction(SIGHUP, &action, NULL);
+	sigaction(SIGTERM, &action, NULL);
+
+	// Leave with the master, whichever way it goes
+	prctl(PR_SET_PDEATHSIG, SIGTERM);
+	if (getppid() == 1)
+		accesslog_stopping = 1;
+
+	static accesslog_writer_t writer;
+	writer.path = path;
+	writer.length = 0;
+	if (accesslog_open(&writer) < 0)
+		writer.file = STDERR_FILENO;
+
+	uint64_t reported = 0;
+	while (1) {
+		bool stopping = accesslog_stopping;
+		if (accesslog_reopen_requested) {
+			accesslog_reopen_requested = 0;
+			accesslog_reopen(&writer);
+		}
+
+		size_t count = 0;
+		for (int i = 0; i < accesslog->ring_count; i++)
+			count += accesslog_drain(&writer, accesslog_ring(i));
+		accesslog_flush(&writer);
+		accesslog_report_drops(&reported);
+
+		if (stopping)
+			break;
+		if (0 == count) {
+			struct timespec interval = {
+				.tv_sec = 0,.tv_nsec =
+				    ACCESSLOG_INTERVAL * 1000000L
+			};
+			nanosleep(&interval, NULL);
+		}
+	}
+
+	if (STDERR_FILENO != writer.file)
+		close(writer.file);
+	exit(EXIT_SUCCESS);
+}
+
+static void accesslog_forward_handler(int signum)
+{
+	if (NULL != accesslog && accesslog->logger > 0)
+		kill(accesslog->logger, signum);
+}
+
+/**
+ * Maps the rings and forks the logger. The path is NULL for stderr. The
+ * master forwards SIGHUP to the logger, workers ignore it.
+ */
+int accesslog_init(const char *path, accesslog_format format,
+		   unsigned int sample, int workers)
+{
+	int ring_count = workers > 0 ? workers : 1;
+	size_t mapping_size = sizeof(accesslog_t) +
+	    (size_t)ring_count * sizeof(accesslog_ring_t);
+
+	void *mapping = mmap(NULL, mapping_size, PROT_READ | PROT_WRITE,
+			     MAP_SHARED | MAP_ANONYMOUS, -1, 0);
+	if (MAP_FAILED == mapping)
+		return -1;
+
+	accesslog = mapping;
+	accesslog->ring_count = ring_count;
+	accesslog->format = format;
+	accesslog->sample = sample > 0 ? sample : 1;
+	accesslog->master = getpid();
+	accesslog->mapping_size = mapping_size;
+	for (int i = 0; i < ring_count; i++) {
+		accesslog_ring_t *ring = accesslog_ring(i);
+		ring->stalled_since = 0;
+		for (uint64_t j = 0; j < ACCESSLOG_RING_SIZE; j++)
+			ring->slots[j].sequence = j;
+	}
+
+	if (ACCESSLOG_BINARY == format && NULL == path) {
+		fprintf(stderr, "Error: The binary access log needs a file\n");
+		accesslog_free();
+		return -1;
+	}
+
+	pid_t pid = fork();
+	if (pid < 0) {
+		accesslog_free();
+		return -1;
+	}
+	if (pid == 0)
+		accesslog_run(path);
+
+	accesslog->logger = pid;
+	accesslog_current = accesslog_ring(0);
+
+	struct sigaction action;
+	memset(&action, 0, sizeof(action));
+	action.sa_handler = accesslog_forward_handler;
+	action.sa_flags = SA_RESTART;
+	sigemptyset(&action.sa_mask);
+	return sigaction(SIGHUP, &action, NULL);
+}
+
+/**
+ * Returns the pid of the logger, 0 without an access log.
+ */
+pid_t accesslog_logger(void)
+{
+	return NULL != accesslog ? accesslog->logger : 0;
+}
+
+/**
+ * Stops the logger once it wrote what is left in the rings. Only the
+ * master does, other processes just drop their mapping.
+ */
+int accesslog_free(void)
+{
+	if (NULL == accesslog)
+		return 0;
+
+	if (accesslog->logger > 0 && getpid() == accesslog->master) {
+		kill(accesslog->logger, SIGTERM);
+		waitpid(accesslog->logger, NULL, 0);
+	}
+
+	int err = munmap(accesslog, accesslog->mapping_size);
+	accesslog = NULL;
+	accesslog_current = NULL;
+	return err;
+}
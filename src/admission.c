@@ -0,0 +1,176 @@
+#define _GNU_SOURCE
+
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <sys/mman.h>
+#include <sys/socket.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "admission.h"
+#include "metrics.h"
+#include "rfc1945.h"
+
+static admission_t *admission = NULL;
+static int64_t *admission_held = NULL;	// slots held by this worker
+
+// Per process, each one judges the waits of the connections it accepts
+static uint64_t admission_interval_end = 0;
+static uint32_t admission_interval_min = UINT32_MAX;
+static bool admission_standing = false;
+
+static const char admission_response[] =
+    HTTP_VERSION_1_1 SP "503" SP STATUS_TEXT_503 EOL
+    "Server:" SP SERVER_NAME EOL
+    "Retry-After:" SP ADMISSION_RETRY_AFTER EOL
+    "Content-Length:" SP "0" EOL "Connection:" SP "close" EOL EOL;
+
+int admission_init(int max_active, int queue_delay, int workers)
+{
+	// Nothing to enforce, admitting a connection costs nothing then
+	if (max_active <= 0 && queue_delay <= 0)
+		return 0;
+
+	if (workers < 0)
+		workers = 0;
+	size_t mapping_size = sizeof(admission_t) + workers * sizeof(int64_t);
+	void *mapping = mmap(NULL, mapping_size, PROT_READ | PROT_WRITE,
+			     MAP_SHARED | MAP_ANONYMOUS, -1, 0);
+	if (MAP_FAILED == mapping)
+		return -1;
+
+	admission = mapping;
+	admission->active = 0;
+	admission->max_active = max_active > 0 ? max_active : 0;
+	admission->queue_delay = queue_delay > 0 ? queue_delay : 0;
+	admission->workers = workers;
+	admission->mapping_size = mapping_size;
+	for (int i = 0; i < workers; i++)
+		admission->held[i] = 0;
+	return 0;
+}
+
+/**
+ * Called in a pool worker, which then counts the slots it holds.
+ */
+void admission_worker(int index)
+{
+	if (NULL != admission && index >= 0 && index < admission->workers)
+		admission_held = &admission->held[index];
+}
+
+static uint64_t admission_now(void)
+{
+	struct timespec now;
+	clock_gettime(CLOCK_MONOTONIC_COARSE, &now);
+	return (uint64_t)now.tv_sec * 1000 + now.tv_nsec / 1000000;
+}
+
+// Whether the connection waited longer than the target in a standing queue
+static bool admission_late(socket_t socket)
+{
+	struct tcp_info info;
+	socklen_t length = sizeof(info);
+	if (getsockopt(socket, IPPROTO_TCP, TCP_INFO, &info, &length) < 0)
+		return false;
+	uint32_t delay = info.tcpi_last_data_recv;
+	uint32_t target = admission->queue_delay;
+
+	uint64_t now = admission_now();
+	if (now >= admission_interval_end) {
+		// Standing when no connection of the interval that just ended
+		// (and no idle gap after it) got in under the target
+		admission_standing = admission_interval_min > target
+		    && now < admission_interval_end + ADMISSION_INTERVAL;
+		admission_interval_min = UINT32_MAX;
+		admission_interval_end = now + ADMISSION_INTERVAL;
+	}
+	if (delay < admission_interval_min)
+		admission_interval_min = delay;
+
+	return admission_standing && delay > target;
+}
+
+/**
+ * Counts an accepted connection in, unless the server is over its limit or
+ * behind its queueing delay target. Returns false when the connection is to
+ * be shed.
+ */
+bool admission_enter(socket_t socket)
+{
+	if (NULL == admission)
+		return true;
+
+	if (admission->queue_delay > 0 && admission_late(socket))
+		return false;
+
+	if (admission->max_active <= 0)
+		return true;
+
+	if (__atomic_add_fetch(&admission->active, 1, __ATOMIC_RELAXED)
+	    > admission->max_active) {
+		__atomic_sub_fetch(&admission->active, 1, __ATOMIC_RELAXED);
+		return false;
+	}
+	if (NULL != admission_held)
+		__atomic_add_fetch(admission_held, 1, __ATOMIC_RELAXED);
+	return true;
+}
+
+/**
+ * Gives a slot back. Also called by the master, from its SIGCHLD handler,
+ * for a child that served a connection, so it only touches atomics.
+ */
+void admission_leave(void)
+{
+	if (NULL == admission || admission->max_active <= 0)
+		return;
+
+	if (NULL != admission_held)
+		__atomic_sub_fetch(admission_held, 1, __ATOMIC_RELAXED);
+	__atomic_sub_fetch(&admission->active, 1, __ATOMIC_RELAXED);
+}
+
+/**
+ * Called by the master once a pool worker exited, before respawning it:
+ * the slots the worker still held go back.
+ */
+void admission_reclaim(int index)
+{
+	if (NULL == admission || index < 0 || index >= admission->workers)
+		return;
+
+	int64_t held = __atomic_exchange_n(&admission->held[index], 0,
+					   __ATOMIC_RELAXED);
+	if (held > 0)
+		__atomic_sub_fetch(&admission->active, held, __ATOMIC_RELAXED);
+}
+
+/**
+ * Answers 503 and closes the connection. The request head the client may
+ * have sent already is read first: closing with unread data resets the
+ * connection, and the client could lose the response with it.
+ */
+void admission_shed(socket_t socket)
+{
+	metrics_connection_shed();
+
+	send(socket, admission_response, sizeof(admission_response) - 1,
+	     MSG_DONTWAIT | MSG_NOSIGNAL);
+	shutdown(socket, SHUT_WR);
+
+	char drain[SERVER_BUFFER_SIZE];
+	recv(socket, drain, sizeof(drain), MSG_DONTWAIT);
+	close(socket);
+}
+
+int admission_free(void)
+{
+	if (NULL == admission)
+		return 0;
+
+	int err = munmap(admission, admission->mapping_size);
+	admission = NULL;
+	admission_held = NULL;
+	return err;
+}
@@ -0,0 +1,126 @@
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "arena.h"
+
+#define ARENA_ALIGN(size) \
+	(((size) + ARENA_ALIGNMENT - 1) & ~(size_t)(ARENA_ALIGNMENT - 1))
+#define ARENA_HEADER ARENA_ALIGN(sizeof(arena_block_t))
+
+static arena_block_t *arena_block_create(size_t size)
+{
+	arena_block_t *block = malloc(ARENA_HEADER + size);
+	if (NULL == block)
+		return NULL;
+	block->next = NULL;
+	block->size = size;
+	block->used = 0;
+	return block;
+}
+
+static void *arena_block_data(arena_block_t *block)
+{
+	return (char *)block + ARENA_HEADER;
+}
+
+void arena_init(arena_t *arena, size_t block_size)
+{
+	arena->first = NULL;
+	arena->current = NULL;
+	arena->large = NULL;
+	arena->block_size = ARENA_ALIGN(block_size);
+}
+
+static void *arena_alloc_large(arena_t *arena, size_t size)
+{
+	arena_block_t *block = arena_block_create(size);
+	if (NULL == block)
+		return NULL;
+	block->used = size;
+	block->next = arena->large;
+	arena->large = block;
+	return arena_block_data(block);
+}
+
+void *arena_alloc(arena_t *arena, size_t size)
+{
+	size = ARENA_ALIGN(size ? size : 1);
+	if (size > arena->block_size / 2)
+		return arena_alloc_large(arena, size);
+
+	arena_block_t *block = arena->current;
+	while (NULL != block && block->size - block->used < size) {
+		// Blocks past the current one were emptied by the last reset
+		block = block->next;
+		if (NULL != block)
+			block->used = 0;
+	}
+
+	if (NULL == block) {
+		block = arena_block_create(arena->block_size);
+		if (NULL == block)
+			return NULL;
+		if (NULL == arena->current)
+			arena->first = block;
+		else {
+			// Append after the last block of the chain
+			arena_block_t *last = arena->current;
+			while (NULL != last->next)
+				last = last->next;
+			last->next = block;
+		}
+	}
+
+	arena->current = block;
+	void *pointer = (char *)arena_block_data(block) + block->used;
+	block->used += size;
+	return pointer;
+}
+
+void *arena_calloc(arena_t *arena, size_t count, size_t size)
+{
+	if (0 != size && count > SIZE_MAX / size)
+		return NULL;
+	void *pointer = arena_alloc(arena, count * size);
+	if (NULL != pointer)
+		memset(pointer, 0, count * size);
+	return pointer;
+}
+
+char *arena_strdup(arena_t *arena, const char *str)
+{
+	size_t size = strlen(str) + 1;
+	char *copy = arena_alloc(arena, size);
+	if (NULL != copy)
+		memcpy(copy, str, size);
+	return copy;
+}
+
+/**
+ * Forgets every allocation. The blocks are kept for the next request, only
+ * the buffers of large allocations are freed.
+ */
+void arena_reset(arena_t *arena)
+{
+	while (NULL != arena->large) {
+		arena_block_t *next = arena->large->next;
+		free(arena->large);
+		arena->large = next;
+	}
+
+	arena->current = arena->first;
+	if (NULL != arena->first)
+		arena->first->used = 0;
+}
+
+void arena_free(arena_t *arena)
+{
+	arena_reset(arena);
+	while (NULL != arena->first) {
+		arena_block_t *next = arena->first->next;
+		free(arena->first);
+		arena->first = next;
+	}
+	arena->current = NULL;
+}
@@ -0,0 +1,632 @@
+#define _GNU_SOURCE
+
+#include <errno.h>
+#include <fcntl.h>
+#include <pthread.h>
+#include <signal.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#include "cache.h"
+#include "http.h"
+#include "rfc1945.h"
+
+static cache_t *cache = NULL;
+static pid_t cache_owner = 0;	// this process, as pins record it
+
+static void cache_forked(void)
+{
+	cache_owner = getpid();
+}
+
+static uint64_t cache_hash(const char *str)
+{
+	uint64_t hash = 5381;
+	int c;
+	while ((c = *str++))
+		hash = ((hash << 5) + hash) + c;
+	return hash;
+}
+
+static size_t cache_align(size_t size)
+{
+	return (size + 63) & ~(size_t)63;
+}
+
+static void cache_lock(void)
+{
+	// A worker died while holding the lock: the tables are still usable
+	if (pthread_mutex_lock(&cache->lock) == EOWNERDEAD)
+		pthread_mutex_consistent(&cache->lock);
+}
+
+static void cache_unlock(void)
+{
+	pthread_mutex_unlock(&cache->lock);
+}
+
+/* ---------- Buddy allocator ---------- */
+
+static void cache_block_push(int32_t index, uint8_t order)
+{
+	cache_block_t *block = &cache->blocks[index];
+	block->order = order;
+	block->free = true;
+	block->prev = -1;
+	block->next = cache->free_lists[order];
+	if (block->next >= 0)
+		cache->blocks[block->next].prev = index;
+	cache->free_lists[order] = index;
+}
+
+static void cache_block_unlink(int32_t index)
+{
+	cache_block_t *block = &cache->blocks[index];
+	if (block->prev >= 0)
+		cache->blocks[block->prev].next = block->next;
+	else
+		cache->free_lists[block->order] = block->next;
+	if (block->next >= 0)
+		cache->blocks[block->next].prev = block->prev;
+	block->free = false;
+}
+
+static int32_t cache_block_alloc(uint8_t order)
+{
+	uint8_t current = order;
+	while (current <= cache->max_order && cache->free_lists[current] < 0)
+		current++;
+	if (current > cache->max_order)
+		return -1;
+
+	int32_t index = cache->free_lists[current];
+	cache_block_unlink(index);
+
+	// Split down, handing the upper halves back to the free lists
+	while (current > order) {
+		current--;
+		cache_block_push(index + (1 << current), current);
+	}
+
+	cache->blocks[index].order = order;
+	return index;
+}
+
+static void cache_block_free(int32_t index)
+{
+	uint8_t order = cache->blocks[index].order;
+
+	while (order < cache->max_order) {
+		int32_t buddy = index ^ (1 << order);
+		if (buddy >= cache->block_count || !cache->blocks[buddy].free
+		    || cache->blocks[buddy].order != order)
+			break;
+		cache_block_unlink(buddy);
+		if (buddy < index)
+			index = buddy;
+		order++;
+	}
+
+	cache_block_push(index, order);
+}
+
+static uint8_t cache_order(size_t size)
+{
+	uint8_t order = 0;
+	while (((size_t)CACHE_BLOCK_SIZE << order) < size)
+		order++;
+	return order;
+}
+
+/* ---------- Pins ---------- */
+
+// Takes a reference to the entry for this process
+static int cache_pin(cache_entry_t *entry)
+{
+	int32_t index = cache->free_pins;
+	if (index < 0)
+		return -1;
+
+	cache_pin_t *pin = &cache->pins[index];
+	cache->free_pins = pin->next;
+	pin->owner = cache_owner;
+	pin->entry = entry - cache->entries;
+	pin->next = entry->pins;
+	entry->pins = index;
+	entry->refcount++;
+	return 0;
+}
+
+// Gives back a reference of the process to the entry, the pin is found first
+static void cache_unpin(cache_entry_t *entry, pid_t owner)
+{
+	int32_t *link = &entry->pins;
+	while (*link >= 0 && cache->pins[*link].owner != owner)
+		link = &cache->pins[*link].next;
+	if (*link < 0)
+		return;
+
+	int32_t index = *link;
+	*link = cache->pins[index].next;
+	cache->pins[index].next = cache->free_pins;
+	cache->free_pins = index;
+	if (entry->refcount > 0)
+		entry->refcount--;
+}
+
+/* ---------- Entries ---------- */
+
+static void cache_unlink(cache_entry_t *entry)
+{
+	int32_t index = entry - cache->entries;
+	int32_t *link = &cache->buckets[entry->hash % cache->bucket_count];
+	while (*link >= 0) {
+		if (*link == index) {
+			*link = entry->next;
+			break;
+		}
+		link = &cache->entries[*link].next;
+	}
+	entry->next = -1;
+}
+
+static void cache_drop(cache_entry_t *entry)
+{
+	if (entry->block >= 0)
+		cache_block_free(entry->block);
+	entry->block = -1;
+	entry->used = false;
+	entry->dead = false;
+	entry->loading = false;
+	entry->pins = -1;
+}
+
+/**
+ * Removes an entry from the index. Its memory is reclaimed right away, or
+ * when the last worker still sending it releases it.
+ */
+static void cache_remove(cache_entry_t *entry)
+{
+	if (!entry->dead && !entry->loading)
+		cache_unlink(entry);
+	entry->dead = true;
+
+	if (entry->refcount == 0)
+		cache_drop(entry);
+}
+
+static cache_entry_t *cache_find(const char *path, int coding, uint64_t hash)
+{
+	int32_t index = cache->buckets[hash % cache->bucket_count];
+	while (index >= 0) {
+		cache_entry_t *entry = &cache->entries[index];
+		if (entry->hash == hash && entry->coding == coding
+		    && strcmp(entry->path, path) == 0)
+			return entry;
+		index = entry->next;
+	}
+
+	return NULL;
+}
+
+/**
+ * CLOCK sweep: entries referenced since the last pass get a second chance,
+ * pinned entries are skipped. Returns false once nothing can be evicted.
+ */
+static bool cache_evict_one(void)
+{
+	for (int32_t i = 0; i < 2 * cache->entry_count; i++) {
+		cache_entry_t *entry = &cache->entries[cache->clock_hand];
+		cache->clock_hand = (cache->clock_hand + 1) % cache->entry_count;
+
+		if (!entry->used || entry->dead || entry->loading
+		    || entry->refcount > 0)
+			continue;
+		if (entry->referenced) {
+			entry->referenced = false;
+			continue;
+		}
+
+		cache_remove(entry);
+		return true;
+	}
+
+	return false;
+}
+
+static cache_entry_t *cache_entry_alloc(size_t size)
+{
+	uint8_t order = cache_order(size);
+	if (order > cache->max_order)
+		return NULL;
+
+	int32_t block;
+	while ((block = cache_block_alloc(order)) < 0) {
+		if (!cache_evict_one())
+			return NULL;
+	}
+
+	cache_entry_t *entry = NULL;
+	for (int32_t i = 0; i < cache->entry_count && NULL == entry; i++) {
+		if (!cache->entries[i].used)
+			entry = &cache->entries[i];
+	}
+	while (NULL == entry) {
+		if (!cache_evict_one()) {
+			cache_block_free(block);
+			return NULL;
+		}
+		for (int32_t i = 0; i < cache->entry_count && NULL == entry;
+		     i++) {
+			if (!cache->entries[i].used)
+				entry = &cache->entries[i];
+		}
+	}
+
+	entry->used = true;
+	entry->block = block;
+	entry->order = order;
+	entry->next = -1;
+	return entry;
+}
+
+/* ---------- Public API ---------- */
+
+int cache_init(size_t budget, size_t max_file)
+{
+	if (budget < CACHE_BLOCK_SIZE)
+		return 0;	// Disabled
+
+	// The largest block fits the biggest file and its head
+	uint8_t max_order = cache_order(max_file + SERVER_BUFFER_SIZE);
+	while (max_order > 0 && ((size_t)CACHE_BLOCK_SIZE << max_order) > budget)
+		max_order--;
+	size_t chunk_size = (size_t)CACHE_BLOCK_SIZE << max_order;
+	size_t data_size = budget / chunk_size * chunk_size;
+
+	int32_t block_count = data_size / CACHE_BLOCK_SIZE;
+	int32_t entry_count = budget / CACHE_ENTRY_AVERAGE;
+	if (entry_count < CACHE_MIN_ENTRIES)
+		entry_count = CACHE_MIN_ENTRIES;
+	int32_t bucket_count = entry_count;
+	int32_t pin_count = entry_count * CACHE_PINS_PER_ENTRY;
+
+	size_t header_size = cache_align(sizeof(cache_t));
+	size_t buckets_size = cache_align(bucket_count * sizeof(int32_t));
+	size_t entries_size =
+	    cache_align(entry_count * sizeof(cache_entry_t));
+	size_t blocks_size = cache_align(block_count * sizeof(cache_block_t));
+	size_t pins_size = cache_align(pin_count * sizeof(cache_pin_t));
+	size_t mapping_size = header_size + buckets_size + entries_size +
+	    blocks_size + pins_size + data_size;
+
+	char *mapping = mmap(NULL, mapping_size, PROT_READ | PROT_WRITE,
+			     MAP_SHARED | MAP_ANONYMOUS, -1, 0);
+	if (MAP_FAILED == mapping)
+		return -1;
+
+	cache = (cache_t *) mapping;
+	cache->mapping_size = mapping_size;
+	cache->max_file = max_file;
+	cache->max_order = max_order;
+	cache->entry_count = entry_count;
+	cache->bucket_count = bucket_count;
+	cache->block_count = block_count;
+	cache->clock_hand = 0;
+	cache->pin_count = pin_count;
+	cache->buckets = (int32_t *) (mapping + header_size);
+	cache->entries = (cache_entry_t *) (mapping + header_size +
+					    buckets_size);
+	cache->blocks = (cache_block_t *) (mapping + header_size +
+					   buckets_size + entries_size);
+	cache->pins = (cache_pin_t *) (mapping + header_size + buckets_size +
+				       entries_size + blocks_size);
+	cache->data = mapping + header_size + buckets_size + entries_size +
+	    blocks_size + pins_size;
+
+	pthread_mutexattr_t attributes;
+	pthread_mutexattr_init(&attributes);
+	pthread_mutexattr_setpshared(&attributes, PTHREAD_PROCESS_SHARED);
+	pthread_mutexattr_setrobust(&attributes, PTHREAD_MUTEX_ROBUST);
+	int err = pthread_mutex_init(&cache->lock, &attributes);
+	pthread_mutexattr_destroy(&attributes);
+	if (err != 0) {
+		munmap(mapping, mapping_size);
+		cache = NULL;
+		return -1;
+	}
+
+	for (int32_t i = 0; i < bucket_count; i++)
+		cache->buckets[i] = -1;
+	for (int32_t i = 0; i < entry_count; i++) {
+		cache->entries[i].used = false;
+		cache->entries[i].block = -1;
+		cache->entries[i].next = -1;
+		cache->entries[i].pins = -1;
+	}
+	for (int32_t i = 0; i < pin_count; i++)
+		cache->pins[i].next = i + 1 < pin_count ? i + 1 : -1;
+	cache->free_pins = 0;
+	for (int i = 0; i < 32; i++)
+		cache->free_lists[i] = -1;
+	for (int32_t i = 0; i < block_count; i += 1 << max_order)
+		cache_block_push(i, max_order);
+
+	// Pins record their process, which forked workers must not inherit
+	cache_owner = getpid();
+	pthread_atfork(NULL, NULL, cache_forked);
+
+	fprintf(stderr, "Info: Content cache of %zu bytes (%d entries)\n",
+		data_size, entry_count);
+	return 0;
+}
+
+bool cache_enabled(void)
+{
+	return NULL != cache;
+}
+
+const char *cache_head(const cache_entry_t *entry)
+{
+	return cache->data + (size_t)entry->block * CACHE_BLOCK_SIZE;
+}
+
+const char *cache_body(const cache_entry_t *entry)
+{
+	return cache_head(entry) + entry->head_length;
+}
+
+int cache_acquire(const char *path, int coding, cache_entry_t **entry)
+{
+	*entry = NULL;
+	if (NULL == cache || strlen(path) >= CACHE_PATH_SIZE)
+		return -1;
+
+	uint64_t hash = cache_hash(path);
+
+	cache_lock();
+	cache_entry_t *found = cache_find(path, coding, hash);
+	if (NULL == found || cache_pin(found) < 0) {
+		cache_unlock();
+		return -1;
+	}
+	found->referenced = true;
+	time_t validated_at =
+	    __atomic_load_n(&found->validated_at, __ATOMIC_RELAXED);
+	cache_unlock();
+
+	time_t now = time(NULL);
+	if (now - validated_at < CACHE_VALIDATE_INTERVAL) {
+		*entry = found;
+		return 0;
+	}
+
+	struct stat file_stat;
+	bool valid = stat(path, &file_stat) == 0
+	    && file_stat.st_ino == found->inode
+	    && file_stat.st_dev == found->device
+	    && file_stat.st_size == found->size
+	    && file_stat.st_mtim.tv_sec == found->mtime.tv_sec
+	    && file_stat.st_mtim.tv_nsec == found->mtime.tv_nsec;
+
+	if (!valid) {
+		cache_lock();
+		cache_remove(found);
+		cache_unlock();
+		cache_release(found);
+		return -1;
+	}
+
+	// Stored outside the lock, other lookups load it atomically
+	__atomic_store_n(&found->validated_at, now, __ATOMIC_RELAXED);
+	*entry = found;
+	return 0;
+}
+
+/**
+ * Allocates an entry for a body of the given length and writes its head.
+ * The entry stays invisible to lookups until cache_publish().
+ */
+static cache_entry_t *cache_reserve(const char *path, int coding,
+				    const struct stat *file_stat,
+				    struct http_response_t *response,
+				    size_t body_length)
+{
+	http_response_file_size(response, body_length);
+	http_response_validators(response, file_stat->st_ino,
+				 file_stat->st_size, &file_stat->st_mtim);
+
+	char head[SERVER_BUFFER_SIZE];
+	// The Connection header and the blank line are added when sending
+	int head_length = http_response_head(response, head, sizeof(head));
+	if (head_length < 0)
+		return NULL;
+
+	cache_lock();
+	cache_entry_t *created = cache_entry_alloc(head_length + body_length);
+	if (NULL == created) {
+		cache_unlock();
+		return NULL;
+	}
+	created->loading = true;
+	created->dead = false;
+	created->refcount = 0;
+	created->pins = -1;
+	if (cache_pin(created) < 0) {
+		cache_drop(created);
+		cache_unlock();
+		return NULL;
+	}
+	cache_unlock();
+
+	strcpy(created->path, path);
+	created->hash = cache_hash(path);
+	created->coding = coding;
+	created->vary = NULL != headers_get_id(&response->headers, HEADER_VARY);
+	created->device = file_stat->st_dev;
+	created->inode = file_stat->st_ino;
+	created->mtime = file_stat->st_mtim;
+	created->size = file_stat->st_size;
+	created->validated_at = time(NULL);
+	created->referenced = true;
+	created->head_length = head_length;
+	created->body_length = body_length;
+
+	memcpy((char *)cache_head(created), head, head_length);
+	return created;
+}
+
+static int cache_publish(cache_entry_t *created, bool loaded)
+{
+	cache_lock();
+	if (!loaded) {
+		cache_unpin(created, cache_owner);
+		cache_drop(created);
+		cache_unlock();
+		return -1;
+	}
+
+	// Another worker may have loaded the same file in the meantime
+	cache_entry_t *previous =
+	    cache_find(created->path, created->coding, created->hash);
+	if (NULL != previous)
+		cache_remove(previous);
+
+	int32_t bucket = created->hash % cache->bucket_count;
+	created->next = cache->buckets[bucket];
+	cache->buckets[bucket] = created - cache->entries;
+	created->loading = false;
+	cache_unlock();
+	return 0;
+}
+
+int cache_fill(const char *path, int coding, struct http_response_t *response,
+	       cache_entry_t **entry)
+{
+	*entry = NULL;
+	if (NULL == cache || strlen(path) >= CACHE_PATH_SIZE)
+		return -1;
+
+	int file = open(path, O_RDONLY | O_CLOEXEC);
+	if (file < 0)
+		return -1;
+
+	struct stat file_stat;
+	if (fstat(file, &file_stat) < 0 || !S_ISREG(file_stat.st_mode)
+	    || (size_t)file_stat.st_size > cache->max_file) {
+		close(file);
+		return -1;
+	}
+
+	cache_entry_t *created = cache_reserve(path, coding, &file_stat,
+					       response, file_stat.st_size);
+	if (NULL == created) {
+		close(file);
+		return -1;
+	}
+
+	char *data = (char *)cache_body(created);
+	size_t loaded = 0;
+	while (loaded < created->body_length) {
+		ssize_t read_size = pread(file, data + loaded,
+					  created->body_length - loaded,
+					  loaded);
+		if (read_size <= 0) {
+			if (read_size < 0 && EINTR == errno)
+				continue;
+			break;
+		}
+		loaded += read_size;
+	}
+	close(file);
+
+	if (cache_publish(created, loaded == created->body_length) < 0)
+		return -1;
+
+	*entry = created;
+	return 0;
+}
+
+/**
+ * Caches a body derived from a file, e.g. compressed. The entry is
+ * validated against the file like the ones of cache_fill().
+ */
+int cache_store(const char *path, int coding, const struct stat *file_stat,
+		struct http_response_t *response, const char *body,
+		size_t body_length, cache_entry_t **entry)
+{
+	*entry = NULL;
+	if (NULL == cache || strlen(path) >= CACHE_PATH_SIZE
+	    || body_length > cache->max_file)
+		return -1;
+
+	cache_entry_t *created = cache_reserve(path, coding, file_stat,
+					       response, body_length);
+	if (NULL == created)
+		return -1;
+
+	memcpy((char *)cache_body(created), body, body_length);
+	if (cache_publish(created, true) < 0)
+		return -1;
+
+	*entry = created;
+	return 0;
+}
+
+
+void cache_release(cache_entry_t *entry)
+{
+	if (NULL == cache || NULL == entry)
+		return;
+
+	cache_lock();
+	cache_unpin(entry, cache_owner);
+	if (entry->dead && entry->refcount == 0)
+		cache_drop(entry);
+	cache_unlock();
+}
+
+/**
+ * Called by the master once a process exited, to give back the pins it
+ * still held. With 0, gives back those of every process that is gone.
+ * Entries it was loading are dropped.
+ */
+void cache_reclaim(pid_t pid)
+{
+	if (NULL == cache)
+		return;
+
+	cache_lock();
+	for (int32_t i = 0; i < cache->entry_count; i++) {
+		cache_entry_t *entry = &cache->entries[i];
+		int32_t index = entry->used ? entry->pins : -1;
+		while (index >= 0) {
+			pid_t owner = cache->pins[index].owner;
+			index = cache->pins[index].next;
+			if (owner == pid || (0 == pid && kill(owner, 0) < 0
+					     && ESRCH == errno))
+				cache_unpin(entry, owner);
+		}
+		if (!entry->used || entry->refcount > 0)
+			continue;
+		if (entry->loading)
+			cache_remove(entry);
+		else if (entry->dead)
+			cache_drop(entry);
+	}
+	cache_unlock();
+}
+
+int cache_free(void)
+{
+	if (NULL == cache)
+		return 0;
+
+	int err = munmap(cache, cache->mapping_size);
+	cache = NULL;
+	return err;
+}
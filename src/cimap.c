@@ -1,37 +1,311 @@
-#include <ctype.h>
 #include <stdbool.h>
+#include <stdint.h>
 #include <stdlib.h>
+#include <string.h>
 
+#if defined(__GNUC__) && (defined(__x86_64__) || defined(__i386__))
+#define CIMAP_X86 1
+#include <immintrin.h>
+#endif
+
+#include "arena.h"
 #include "cimap.h"
 #include "utils.h"
 
 #define CIMAP_LOAD_FACTOR 0.75
+#define CIMAP_MULTIPLIER 0x9e3779b97f4a7c15ULL
+
+#define CIMAP_ONES 0x0101010101010101ULL
+#define CIMAP_HIGH 0x8080808080808080ULL
+
+static uint64_t cimap_mix(uint64_t hash, uint64_t word)
+{
+	hash = (hash ^ word) * CIMAP_MULTIPLIER;
+	return hash ^ (hash >> 32);
+}
+
+static uint64_t cimap_finish(uint64_t hash, size_t length)
+{
+	hash = (hash ^ length) * CIMAP_MULTIPLIER;
+	return hash ^ (hash >> 29);
+}
+
+// Load of up to 8 bytes in host order, as the vector kernels store them
+static uint64_t cimap_load(const char *str, size_t length)
+{
+	uint64_t word = 0;
+	memcpy(&word, str, length < 8 ? length : 8);
+	return word;
+}
+
+// Lowercases the ASCII letters of 8 bytes at once
+static uint64_t cimap_fold_word(uint64_t word)
+{
+	uint64_t heptets = word & ~CIMAP_HIGH;
+	uint64_t above_z = heptets + (0x7f - 'Z') * CIMAP_ONES;
+	uint64_t from_a = heptets + (0x80 - 'A') * CIMAP_ONES;
+	uint64_t upper = ~word & (from_a ^ above_z) & CIMAP_HIGH;
+	return word | upper >> 2;
+}
 
-static size_t hash(const char *str, size_t bucket_count, bool case_sensitivity)
+static uint64_t cimap_hash_scalar(const char *str, size_t length, bool fold)
 {
-	size_t hash = 5381;
-	int c;
-	while ((c = *str++)) {
-		hash =
-		    ((hash << 5) + hash) + (case_sensitivity ? c : tolower(c));
+	uint64_t hash = 0;
+	for (size_t i = 0; i < length; i += 8) {
+		uint64_t word = cimap_load(str + i, length - i);
+		hash = cimap_mix(hash, fold ? cimap_fold_word(word) : word);
 	}
-	return hash % bucket_count;
+	return cimap_finish(hash, length);
+}
+
+static bool cimap_equal_scalar(const char *a, const char *b, size_t length)
+{
+	for (size_t i = 0; i < length; i += 8) {
+		uint64_t x = cimap_load(a + i, length - i);
+		uint64_t y = cimap_load(b + i, length - i);
+		if (x != y && cimap_fold_word(x) != cimap_fold_word(y))
+			return false;
+	}
+	return true;
+}
+
+#ifdef CIMAP_X86
+/**
+ * 'A'..'Z' are moved to the bottom of the signed byte range, so a single
+ * signed comparison selects them and their 0x20 bit is set.
+ */
+static __m128i cimap_fold_sse2(__m128i bytes)
+{
+	__m128i shifted = _mm_add_epi8(bytes, _mm_set1_epi8(0x80 - 'A'));
+	__m128i upper = _mm_cmplt_epi8(shifted, _mm_set1_epi8(-128 + 26));
+	return _mm_or_si128(bytes, _mm_and_si128(upper, _mm_set1_epi8(0x20)));
+}
+
+static uint64_t cimap_hash_sse2(const char *str, size_t length, bool fold)
+{
+	uint64_t hash = 0;
+	size_t i = 0;
+	for (; i + 16 <= length; i += 16) {
+		__m128i bytes = _mm_loadu_si128((const __m128i *)(str + i));
+		if (fold)
+			bytes = cimap_fold_sse2(bytes);
+		uint64_t words[2];
+		_mm_storeu_si128((__m128i *) words, bytes);
+		hash = cimap_mix(hash, words[0]);
+		hash = cimap_mix(hash, words[1]);
+	}
+	for (; i < length; i += 8) {
+		uint64_t word = cimap_load(str + i, length - i);
+		hash = cimap_mix(hash, fold ? cimap_fold_word(word) : word);
+	}
+	return cimap_finish(hash, length);
+}
+
+static bool cimap_equal_sse2(const char *a, const char *b, size_t length)
+{
+	size_t i = 0;
+	for (; i + 16 <= length; i += 16) {
+		__m128i x = _mm_loadu_si128((const __m128i *)(a + i));
+		__m128i y = _mm_loadu_si128((const __m128i *)(b + i));
+		__m128i same = _mm_cmpeq_epi8(cimap_fold_sse2(x),
+					      cimap_fold_sse2(y));
+		if (_mm_movemask_epi8(same) != 0xffff)
+			return false;
+	}
+	return cimap_equal_scalar(a + i, b + i, length - i);
+}
+
+__attribute__((target("avx2")))
+static __m256i cimap_fold_avx2(__m256i bytes)
+{
+	__m256i shifted = _mm256_add_epi8(bytes, _mm256_set1_epi8(0x80 - 'A'));
+	__m256i upper = _mm256_cmpgt_epi8(_mm256_set1_epi8(-128 + 26), shifted);
+	return _mm256_or_si256(bytes,
+			       _mm256_and_si256(upper, _mm256_set1_epi8(0x20)));
+}
+
+__attribute__((target("avx2")))
+static uint64_t cimap_hash_avx2(const char *str, size_t length, bool fold)
+{
+	uint64_t hash = 0;
+	size_t i = 0;
+	for (; i + 32 <= length; i += 32) {
+		__m256i bytes = _mm256_loadu_si256((const __m256i *)(str + i));
+		if (fold)
+			bytes = cimap_fold_avx2(bytes);
+		uint64_t words[4];
+		_mm256_storeu_si256((__m256i *) words, bytes);
+		for (int j = 0; j < 4; j++)
+			hash = cimap_mix(hash, words[j]);
+	}
+	_mm256_zeroupper();	// See cimap_equal_avx2()
+	if (i + 16 <= length) {
+		__m128i bytes = _mm_loadu_si128((const __m128i *)(str + i));
+		if (fold)
+			bytes = cimap_fold_sse2(bytes);
+		uint64_t words[2];
+		_mm_storeu_si128((__m128i *) words, bytes);
+		hash = cimap_mix(hash, words[0]);
+		hash = cimap_mix(hash, words[1]);
+		i += 16;
+	}
+	for (; i < length; i += 8) {
+		uint64_t word = cimap_load(str + i, length - i);
+		hash = cimap_mix(hash, fold ? cimap_fold_word(word) : word);
+	}
+	return cimap_finish(hash, length);
+}
+
+__attribute__((target("avx2")))
+static bool cimap_equal_avx2(const char *a, const char *b, size_t length)
+{
+	size_t i = 0;
+	for (; i + 32 <= length; i += 32) {
+		__m256i x = _mm256_loadu_si256((const __m256i *)(a + i));
+		__m256i y = _mm256_loadu_si256((const __m256i *)(b + i));
+		__m256i same = _mm256_cmpeq_epi8(cimap_fold_avx2(x),
+						 cimap_fold_avx2(y));
+		if ((uint32_t)_mm256_movemask_epi8(same) != 0xffffffffU) {
+			_mm256_zeroupper();
+			return false;
+		}
+	}
+	/**
+	 * Dirty upper halves make every later legacy SSE instruction pay for a
+	 * merge, and the compiler does not clear them on every path.
+	 */
+	_mm256_zeroupper();
+	if (i + 16 <= length) {
+		__m128i x = _mm_loadu_si128((const __m128i *)(a + i));
+		__m128i y = _mm_loadu_si128((const __m128i *)(b + i));
+		__m128i same = _mm_cmpeq_epi8(cimap_fold_sse2(x),
+					      cimap_fold_sse2(y));
+		if (_mm_movemask_epi8(same) != 0xffff)
+			return false;
+		i += 16;
+	}
+	return cimap_equal_scalar(a + i, b + i, length - i);
+}
+#endif
+
+// Scalar until cimap_init() picks a kernel, the hashes are the same
+static uint64_t (*cimap_hash_kernel)(const char *, size_t, bool) =
+    cimap_hash_scalar;
+static bool (*cimap_equal_kernel)(const char *, const char *, size_t) =
+    cimap_equal_scalar;
+static cimap_kernel cimap_kernel_active = CIMAP_KERNEL_SCALAR;
+
+int cimap_kernel_set(cimap_kernel kernel)
+{
+	switch (kernel) {
+	case CIMAP_KERNEL_SCALAR:
+		cimap_hash_kernel = cimap_hash_scalar;
+		cimap_equal_kernel = cimap_equal_scalar;
+		break;
+#ifdef CIMAP_X86
+	case CIMAP_KERNEL_SSE2:
+		if (!__builtin_cpu_supports("sse2"))
+			return -1;
+		cimap_hash_kernel = cimap_hash_sse2;
+		cimap_equal_kernel = cimap_equal_sse2;
+		break;
+	case CIMAP_KERNEL_AVX2:
+		if (!__builtin_cpu_supports("avx2"))
+			return -1;
+		cimap_hash_kernel = cimap_hash_avx2;
+		cimap_equal_kernel = cimap_equal_avx2;
+		break;
+#endif
+	default:
+		return -1;
+	}
+	cimap_kernel_active = kernel;
+	return 0;
+}
+
+void cimap_init(void)
+{
+	if (cimap_kernel_set(CIMAP_KERNEL_AVX2) < 0
+	    && cimap_kernel_set(CIMAP_KERNEL_SSE2) < 0)
+		cimap_kernel_set(CIMAP_KERNEL_SCALAR);
+}
+
+cimap_kernel cimap_kernel_get(void)
+{
+	return cimap_kernel_active;
+}
+
+uint64_t cimap_hash(const char *key, size_t length, bool case_sensitive)
+{
+	return cimap_hash_kernel(key, length, !case_sensitive);
+}
+
+bool cimap_equal(const char *a, const char *b, size_t length,
+		 bool case_sensitive)
+{
+	if (case_sensitive)
+		return memcmp(a, b, length) == 0;
+	return cimap_equal_kernel(a, b, length);
+}
+
+static cimap_entry_t *cimap_find(const cimap_t *map, const char *key,
+				 size_t length, uint64_t hash,
+				 cimap_entry_t ***link)
+{
+	cimap_entry_t **slot = &map->buckets[hash % map->bucket_count];
+	for (; NULL != *slot; slot = &(*slot)->next) {
+		cimap_entry_t *entry = *slot;
+		if (entry->hash == hash && entry->length == length
+		    && cimap_equal(entry->key, key, length,
+				   map->case_sensitivity)) {
+			if (NULL != link)
+				*link = slot;
+			return entry;
+		}
+	}
+	return NULL;
+}
+
+// Maps created in an arena leave their memory to arena_reset()
+static void *cimap_alloc(const cimap_t *map, size_t size)
+{
+	return map->arena ? arena_alloc(map->arena, size) : malloc(size);
+}
+
+static char *cimap_strdup(const cimap_t *map, const char *str)
+{
+	return map->arena ? arena_strdup(map->arena, str) : strdup(str);
+}
+
+static void cimap_release(const cimap_t *map, void *pointer)
+{
+	if (!map->arena)
+		free(pointer);
 }
 
 cimap_t *cimap_create(size_t initial_size, bool case_sensitivity)
 {
-	cimap_t *map = malloc(sizeof(cimap_t));
+	return cimap_create_arena(NULL, initial_size, case_sensitivity);
+}
+
+cimap_t *cimap_create_arena(arena_t *arena, size_t initial_size,
+			    bool case_sensitivity)
+{
+	cimap_t *map = arena ? arena_alloc(arena, sizeof(cimap_t)) :
+	    malloc(sizeof(cimap_t));
 	if (!map)
 		return NULL;
 
+	map->arena = arena;
 	map->bucket_count = initial_size;
 	map->count = 0;
 	map->case_sensitivity = case_sensitivity;
-	map->buckets = calloc(initial_size, sizeof(cimap_entry_t *));
+	map->buckets = cimap_alloc(map, initial_size * sizeof(cimap_entry_t *));
 	if (!map->buckets) {
-		free(map);
+		cimap_release(map, map);
 		return NULL;
 	}
+	memset(map->buckets, 0, initial_size * sizeof(cimap_entry_t *));
 	return map;
 }
 
@@ -39,17 +313,10 @@ int cimap_free(cimap_t *map)
 {
 	if (!map)
 		return -1;
+	if (map->arena)
+		return 0;
 
-	for (size_t i = 0; i < map->bucket_count; i++) {
-		cimap_entry_t *entry = map->buckets[i];
-		while (entry) {
-			cimap_entry_t *next = entry->next;
-			free(entry->key);
-			free(entry->value);
-			free(entry);
-			entry = next;
-		}
-	}
+	cimap_clear(map);
 	free(map->buckets);
 	free(map);
 	return 0;
@@ -60,34 +327,34 @@ int cimap_set(cimap_t *map, const char *key, const char *value)
 	if (!map || !key || !value)
 		return -1;
 
-	size_t index = hash(key, map->bucket_count, map->case_sensitivity);
-	cimap_entry_t *entry = map->buckets[index];
-
-	while (entry) {
-		if (str_compare(entry->key, key, map->case_sensitivity) == 0) {
-			char *new_value = strdup(value);
-			if (!new_value)
-				return -1;
-			free(entry->value);
-			entry->value = new_value;
-			return 0;
-		}
-		entry = entry->next;
+	size_t length = strlen(key);
+	uint64_t hash = cimap_hash(key, length, map->case_sensitivity);
+	cimap_entry_t *entry = cimap_find(map, key, length, hash, NULL);
+	if (entry) {
+		char *new_value = cimap_strdup(map, value);
+		if (!new_value)
+			return -1;
+		cimap_release(map, entry->value);
+		entry->value = new_value;
+		return 0;
 	}
 
-	cimap_entry_t *new_entry = malloc(sizeof(cimap_entry_t));
+	cimap_entry_t *new_entry = cimap_alloc(map, sizeof(cimap_entry_t));
 	if (!new_entry)
 		return -1;
 
-	new_entry->key = strdup(key);
-	new_entry->value = strdup(value);
+	new_entry->key = cimap_strdup(map, key);
+	new_entry->value = cimap_strdup(map, value);
 	if (!new_entry->key || !new_entry->value) {
-		free(new_entry->key);
-		free(new_entry->value);
-		free(new_entry);
+		cimap_release(map, new_entry->key);
+		cimap_release(map, new_entry->value);
+		cimap_release(map, new_entry);
 		return -1;
 	}
+	new_entry->length = length;
+	new_entry->hash = hash;
 
+	size_t index = hash % map->bucket_count;
 	new_entry->next = map->buckets[index];
 	map->buckets[index] = new_entry;
 	map->count++;
@@ -104,17 +371,12 @@ const char *cimap_get(const cimap_t *map, const char *key)
 	if (!map || !key)
 		return NULL;
 
-	size_t index = hash(key, map->bucket_count, map->case_sensitivity);
-	cimap_entry_t *entry = map->buckets[index];
-
-	while (entry) {
-		if (str_compare(entry->key, key, map->case_sensitivity) == 0) {
-			return entry->value;
-		}
-		entry = entry->next;
-	}
-
-	return NULL;
+	size_t length = strlen(key);
+	cimap_entry_t *entry = cimap_find(map, key, length,
+					  cimap_hash(key, length,
+						     map->case_sensitivity),
+					  NULL);
+	return entry ? entry->value : NULL;
 }
 
 int cimap_remove(cimap_t *map, const char *key)
@@ -122,28 +384,21 @@ int cimap_remove(cimap_t *map, const char *key)
 	if (!map || !key)
 		return -1;
 
-	size_t index = hash(key, map->bucket_count, map->case_sensitivity);
-	cimap_entry_t *entry = map->buckets[index];
-	cimap_entry_t *prev = NULL;
-
-	while (entry) {
-		if (str_compare(entry->key, key, map->case_sensitivity) == 0) {
-			if (prev) {
-				prev->next = entry->next;
-			} else {
-				map->buckets[index] = entry->next;
-			}
-			free(entry->key);
-			free(entry->value);
-			free(entry);
-			map->count--;
-			return 0;
-		}
-		prev = entry;
-		entry = entry->next;
-	}
-
-	return 1;		// Key not found
+	size_t length = strlen(key);
+	cimap_entry_t **link = NULL;
+	cimap_entry_t *entry = cimap_find(map, key, length,
+					  cimap_hash(key, length,
+						     map->case_sensitivity),
+					  &link);
+	if (!entry)
+		return 1;	// Key not found
+
+	*link = entry->next;
+	cimap_release(map, entry->key);
+	cimap_release(map, entry->value);
+	cimap_release(map, entry);
+	map->count--;
+	return 0;
 }
 
 int cimap_contains(const cimap_t *map, const char *key)
@@ -165,9 +420,9 @@ int cimap_clear(cimap_t *map)
 		cimap_entry_t *entry = map->buckets[i];
 		while (entry) {
 			cimap_entry_t *next = entry->next;
-			free(entry->key);
-			free(entry->value);
-			free(entry);
+			cimap_release(map, entry->key);
+			cimap_release(map, entry->value);
+			cimap_release(map, entry);
 			entry = next;
 		}
 		map->buckets[i] = NULL;
@@ -181,23 +436,24 @@ int cimap_resize(cimap_t *map, size_t new_size)
 	if (!map || new_size < map->count)
 		return -1;
 
-	cimap_entry_t **new_buckets = calloc(new_size, sizeof(cimap_entry_t *));
+	cimap_entry_t **new_buckets =
+	    cimap_alloc(map, new_size * sizeof(cimap_entry_t *));
 	if (!new_buckets)
 		return -1;
+	memset(new_buckets, 0, new_size * sizeof(cimap_entry_t *));
 
 	for (size_t i = 0; i < map->bucket_count; i++) {
 		cimap_entry_t *entry = map->buckets[i];
 		while (entry) {
 			cimap_entry_t *next = entry->next;
-			size_t new_index =
-			    hash(entry->key, new_size, map->case_sensitivity);
+			size_t new_index = entry->hash % new_size;
 			entry->next = new_buckets[new_index];
 			new_buckets[new_index] = entry;
 			entry = next;
 		}
 	}
 
-	free(map->buckets);
+	cimap_release(map, map->buckets);
 	map->buckets = new_buckets;
 	map->bucket_count = new_size;
 	return 0;
@@ -212,11 +468,16 @@ cimap_iterator_t *cimap_iterator(const cimap_t *map)
 	if (!iterator)
 		return NULL;
 
+	cimap_iterator_init(map, iterator);
+	return iterator;
+}
+
+// Same as cimap_iterator(), for an iterator that lives on the stack
+void cimap_iterator_init(const cimap_t *map, cimap_iterator_t *iterator)
+{
 	iterator->map = map;
 	iterator->bucket_index = 0;
-	iterator->current = NULL;
-
-	return iterator;
+	iterator->current = map->bucket_count > 0 ? map->buckets[0] : NULL;
 }
 
 int cimap_next(cimap_iterator_t *iterator, const char **key, const char **value)
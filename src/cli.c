@@ -6,18 +6,43 @@
 #include "cli.h"
 #include "conf.h"
 #include "multiset.h"
+#include "parser.h"
+#include "rfc1945.h"
+#include "trace.h"
 
-static struct option cli_longopts[7] = {
+static struct option cli_longopts[29] = {
 	{"config", optional_argument, 0, 'c'},
 	{"directory", optional_argument, 0, 'd'},
 	{"host", optional_argument, 0, 'h'},
 	{"port", optional_argument, 0, 'p'},
 	{"max-connections", optional_argument, 0, 'm'},
+	{"max-active", optional_argument, 0, 'a'},
+	{"queue-delay", optional_argument, 0, 'q'},
 	{"timeout", optional_argument, 0, 't'},
+	{"body-timeout", optional_argument, 0, 'b'},
+	{"send-timeout", optional_argument, 0, 'o'},
+	{"keep-alive", optional_argument, 0, 'k'},
+	{"keep-alive-requests", optional_argument, 0, 'n'},
+	{"workers", optional_argument, 0, 'w'},
+	{"io", optional_argument, 0, 'i'},
+	{"reuseport", optional_argument, 0, 'r'},
+	{"cache-size", optional_argument, 0, 's'},
+	{"cache-max-file", optional_argument, 0, 'f'},
+	{"mime-types", optional_argument, 0, 'M'},
+	{"max-headers", optional_argument, 0, 'H'},
+	{"max-header-size", optional_argument, 0, 'B'},
+	{"status-uri", optional_argument, 0, 'S'},
+	{"slow-request", optional_argument, 0, 'T'},
+	{"flight-recorder", optional_argument, 0, 'F'},
+	{"access-log", optional_argument, 0, 'l'},
+	{"access-log-format", optional_argument, 0, 'L'},
+	{"access-log-sample", optional_argument, 0, 'e'},
+	{"compress-level", optional_argument, 0, 'z'},
+	{"compress-min-size", optional_argument, 0, 'Z'},
 	{0, 0, 0, 0},
 };
 
-static char *cli_shortopts = "c:d:h:p:m:t:";
+static char *cli_shortopts = "c:d:h:p:m:a:q:t:b:o:k:n:w:i:r:s:f:M:H:B:S:T:F:l:L:e:z:Z:";
 
 cli_error cli_config_reset(config *config)
 {
@@ -25,7 +50,29 @@ cli_error cli_config_reset(config *config)
 	config->port = 8080;
 	config->vroot = "./www";
 	config->max_connections = SOMAXCONN;
+	config->max_active = 0;	// no limit
+	config->queue_delay = 0;	// no target
 	config->request_timeout = 0;	// no timeout
+	config->body_timeout = 0;
+	config->send_timeout = 0;
+	config->keep_alive_timeout = 5000;
+	config->keep_alive_requests = 100;
+	config->workers = 0;	// fork per connection
+	config->io_model = IO_MODEL_BLOCKING;
+	config->reuseport = REUSEPORT_OFF;
+	config->cache_size = 0;	// no cache
+	config->cache_max_file = 1024 * 1024;
+	config->mime_types = NULL;	// /etc/mime.types
+	config->max_headers = PARSER_DEFAULT_HEADERS;
+	config->max_header_size = SERVER_BUFFER_SIZE;
+	config->status_uri = NULL;	// no status page
+	config->slow_request = 0;	// not logged
+	config->flight_recorder = TRACE_DEFAULT_ENTRIES;
+	config->access_log = "-";	// stderr
+	config->access_log_format = ACCESSLOG_COMMON;
+	config->access_log_sample = 1;	// every request
+	config->compress_level = 0;	// no compression on the fly
+	config->compress_min_size = 1024;
 	return cli_ok;
 }
 
@@ -51,11 +98,87 @@ cli_error cli_config_check(config *config)
 		return cli_config_error;
 	}
 
+	if (config->max_active < 0) {
+		fprintf(stderr, "Error: Invalid max active connections\n");
+		return cli_config_error;
+	}
+
+	if (config->queue_delay < 0) {
+		fprintf(stderr, "Error: Invalid queue delay target\n");
+		return cli_config_error;
+	}
+
 	if (config->request_timeout < 0) {
 		fprintf(stderr, "Error: Invalid request timeout\n");
 		return cli_config_error;
 	}
 
+	if (config->body_timeout < 0) {
+		fprintf(stderr, "Error: Invalid body timeout\n");
+		return cli_config_error;
+	}
+
+	if (config->send_timeout < 0) {
+		fprintf(stderr, "Error: Invalid send timeout\n");
+		return cli_config_error;
+	}
+
+	if (config->keep_alive_timeout < 0) {
+		fprintf(stderr, "Error: Invalid keep-alive timeout\n");
+		return cli_config_error;
+	}
+
+	if (config->keep_alive_requests < 0) {
+		fprintf(stderr, "Error: Invalid keep-alive requests\n");
+		return cli_config_error;
+	}
+
+	if (config->max_headers < 1 || config->max_headers > PARSER_HEADERS_MAX) {
+		fprintf(stderr, "Error: Invalid max headers\n");
+		return cli_config_error;
+	}
+
+	if (config->max_header_size < 64
+	    || config->max_header_size > SERVER_BUFFER_SIZE) {
+		fprintf(stderr, "Error: Invalid max header size\n");
+		return cli_config_error;
+	}
+
+	if (config->status_uri != NULL && config->status_uri[0] != '/') {
+		fprintf(stderr, "Error: Invalid status URI\n");
+		return cli_config_error;
+	}
+
+	if (config->slow_request < 0) {
+		fprintf(stderr, "Error: Invalid slow request threshold\n");
+		return cli_config_error;
+	}
+
+	if (config->flight_recorder < 0) {
+		fprintf(stderr, "Error: Invalid flight recorder size\n");
+		return cli_config_error;
+	}
+
+	if (config->access_log == NULL || config->access_log[0] == '\0') {
+		fprintf(stderr, "Error: Invalid access log\n");
+		return cli_config_error;
+	}
+
+	if (config->access_log_sample < 1) {
+		fprintf(stderr, "Error: Invalid access log sample\n");
+		return cli_config_error;
+	}
+
+	if (config->compress_level < 0 || config->compress_level > 9) {
+		fprintf(stderr, "Error: Invalid compression level\n");
+		return cli_config_error;
+	}
+
+	if (config->workers < 0) {
+		fprintf(stderr, "Error: Invalid number of workers\n");
+		return cli_config_error;
+	}
+
 	return cli_ok;
 }
 
@@ -158,6 +281,32 @@ cli_error cli_load_from_args(int argc, char **argv, config *config)
 			}
 			break;
 
+		case 'a':
+			;
+			endptr = NULL;
+			config->max_active = strtoul(optarg, &endptr, 10);
+
+			if (*endptr != '\0') {
+				fprintf(stderr,
+					"Error: Invalid max active connections '%s'\n",
+					optarg);
+				return cli_conversion_error;
+			}
+			break;
+
+		case 'q':
+			;
+			endptr = NULL;
+			config->queue_delay = strtoul(optarg, &endptr, 10);
+
+			if (*endptr != '\0') {
+				fprintf(stderr,
+					"Error: Invalid queue delay target '%s'\n",
+					optarg);
+				return cli_conversion_error;
+			}
+			break;
+
 		case 't':
 			;
 			endptr = NULL;
@@ -171,6 +320,222 @@ cli_error cli_load_from_args(int argc, char **argv, config *config)
 			}
 			break;
 
+		case 'b':
+			;
+			endptr = NULL;
+			config->body_timeout = strtoul(optarg, &endptr, 10);
+
+			if (*endptr != '\0') {
+				fprintf(stderr,
+					"Error: Invalid body timeout '%s'\n",
+					optarg);
+				return cli_conversion_error;
+			}
+			break;
+
+		case 'o':
+			;
+			endptr = NULL;
+			config->send_timeout = strtoul(optarg, &endptr, 10);
+
+			if (*endptr != '\0') {
+				fprintf(stderr,
+					"Error: Invalid send timeout '%s'\n",
+					optarg);
+				return cli_conversion_error;
+			}
+			break;
+
+		case 'k':
+			;
+			endptr = NULL;
+			config->keep_alive_timeout = strtoul(optarg, &endptr, 10);
+
+			if (*endptr != '\0') {
+				fprintf(stderr,
+					"Error: Invalid keep-alive timeout '%s'\n",
+					optarg);
+				return cli_conversion_error;
+			}
+			break;
+
+		case 'n':
+			;
+			endptr = NULL;
+			config->keep_alive_requests = strtoul(optarg, &endptr, 10);
+
+			if (*endptr != '\0') {
+				fprintf(stderr,
+					"Error: Invalid keep-alive requests '%s'\n",
+					optarg);
+				return cli_conversion_error;
+			}
+			break;
+
+		case 'w':
+			;
+			endptr = NULL;
+			config->workers = strtoul(optarg, &endptr, 10);
+
+			if (*endptr != '\0') {
+				fprintf(stderr,
+					"Error: Invalid number of workers '%s'\n",
+					optarg);
+				return cli_conversion_error;
+			}
+			break;
+
+		case 'i':
+			if (conf_parse_io_model(optarg, &(config->io_model)) !=
+			    CONF_OK) {
+				fprintf(stderr,
+					"Error: Invalid I/O model '%s'\n",
+					optarg);
+				return cli_conversion_error;
+			}
+			break;
+
+		case 'r':
+			if (conf_parse_reuseport(optarg, &(config->reuseport)) !=
+			    CONF_OK) {
+				fprintf(stderr,
+					"Error: Invalid reuseport mode '%s'\n",
+					optarg);
+				return cli_conversion_error;
+			}
+			break;
+
+		case 's':
+			if (conf_parse_size(optarg, &(config->cache_size)) !=
+			    CONF_OK) {
+				fprintf(stderr,
+					"Error: Invalid cache size '%s'\n",
+					optarg);
+				return cli_conversion_error;
+			}
+			break;
+
+		case 'f':
+			if (conf_parse_size(optarg, &(config->cache_max_file))
+			    != CONF_OK) {
+				fprintf(stderr,
+					"Error: Invalid cache file size '%s'\n",
+					optarg);
+				return cli_conversion_error;
+			}
+			break;
+
+		case 'M':
+			config->mime_types = optarg;
+			break;
+
+		case 'H':
+			;
+			endptr = NULL;
+			config->max_headers = strtoul(optarg, &endptr, 10);
+
+			if (*endptr != '\0') {
+				fprintf(stderr,
+					"Error: Invalid max headers '%s'\n",
+					optarg);
+				return cli_conversion_error;
+			}
+			break;
+
+		case 'B':
+			;
+			endptr = NULL;
+			config->max_header_size = strtoul(optarg, &endptr, 10);
+
+			if (*endptr != '\0') {
+				fprintf(stderr,
+					"Error: Invalid max header size '%s'\n",
+					optarg);
+				return cli_conversion_error;
+			}
+			break;
+
+		case 'S':
+			config->status_uri = optarg;
+			break;
+
+		case 'T':
+			;
+			endptr = NULL;
+			config->slow_request = strtoul(optarg, &endptr, 10);
+
+			if (*endptr != '\0') {
+				fprintf(stderr,
+					"Error: Invalid slow request threshold '%s'\n",
+					optarg);
+				return cli_conversion_error;
+			}
+			break;
+
+		case 'F':
+			;
+			endptr = NULL;
+			config->flight_recorder = strtoul(optarg, &endptr, 10);
+
+			if (*endptr != '\0') {
+				fprintf(stderr,
+					"Error: Invalid flight recorder size '%s'\n",
+					optarg);
+				return cli_conversion_error;
+			}
+			break;
+
+		case 'l':
+			config->access_log = optarg;
+			break;
+
+		case 'L':
+			if (accesslog_parse_format(optarg,
+						   &(config->access_log_format))
+			    < 0) {
+				fprintf(stderr,
+					"Error: Invalid access log format '%s'\n",
+					optarg);
+				return cli_conversion_error;
+			}
+			break;
+
+		case 'e':
+			;
+			endptr = NULL;
+			config->access_log_sample = strtoul(optarg, &endptr, 10);
+
+			if (*endptr != '\0') {
+				fprintf(stderr,
+					"Error: Invalid access log sample '%s'\n",
+					optarg);
+				return cli_conversion_error;
+			}
+			break;
+
+		case 'z':
+			;
+			endptr = NULL;
+			config->compress_level = strtoul(optarg, &endptr, 10);
+
+			if (*endptr != '\0') {
+				fprintf(stderr,
+					"Error: Invalid compression level '%s'\n",
+					optarg);
+				return cli_conversion_error;
+			}
+			break;
+
+		case 'Z':
+			if (conf_parse_size(optarg, &(config->compress_min_size))
+			    != CONF_OK) {
+				fprintf(stderr,
+					"Error: Invalid compression min size '%s'\n",
+					optarg);
+				return cli_conversion_error;
+			}
+			break;
+
 		default:
 			fprintf(stderr, "Warning: Unknown option\n");
 			break;
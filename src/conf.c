@@ -60,6 +60,66 @@ int conf_test_regex(const char *line, const char *pattern)
 	return 1;
 }
 
+conf_error conf_parse_io_model(const char *value, io_model *model)
+{
+	if (strcmp(value, "blocking") == 0)
+		*model = IO_MODEL_BLOCKING;
+	else if (strcmp(value, "epoll") == 0)
+		*model = IO_MODEL_EPOLL;
+	else if (strcmp(value, "uring") == 0)
+		*model = IO_MODEL_URING;
+	else
+		return CONF_MALFORMED_ERROR;
+
+	return CONF_OK;
+}
+
+conf_error conf_parse_reuseport(const char *value, reuseport_mode *mode)
+{
+	if (strcmp(value, "off") == 0)
+		*mode = REUSEPORT_OFF;
+	else if (strcmp(value, "on") == 0)
+		*mode = REUSEPORT_ON;
+	else if (strcmp(value, "cpu") == 0)
+		*mode = REUSEPORT_CPU;
+	else
+		return CONF_MALFORMED_ERROR;
+
+	return CONF_OK;
+}
+
+/**
+ * Parses a byte count with an optional K, M or G suffix (powers of 1024).
+ */
+conf_error conf_parse_size(const char *value, size_t *size)
+{
+	char *endptr = NULL;
+	unsigned long long parsed = strtoull(value, &endptr, 10);
+	if (endptr == value)
+		return CONF_MALFORMED_ERROR;
+
+	switch (*endptr) {
+	case 'G':
+		parsed *= 1024;
+		/* fall through */
+	case 'M':
+		parsed *= 1024;
+		/* fall through */
+	case 'K':
+		parsed *= 1024;
+		endptr++;
+		break;
+	default:
+		break;
+	}
+
+	if (*endptr != '\0')
+		return CONF_MALFORMED_ERROR;
+
+	*size = parsed;
+	return CONF_OK;
+}
+
 conf_error conf_load(const char *conf_path, config *config)
 {
 	conf_error err;
@@ -158,6 +218,301 @@ conf_error conf_load(const char *conf_path, config *config)
 					"Error: Invalid max connections '%s'\n",
 					value);
 
+				free(arg);
+				free(value);
+				free(line);
+				fclose(file);
+				return CONF_MALFORMED_ERROR;
+			}
+		} else if (strcmp(arg, "MAX_ACTIVE") == 0) {
+			endptr = NULL;
+			config->max_active = strtoul(value, &endptr, 10);
+
+			if (*endptr != '\0') {
+				fprintf(stderr,
+					"Error: Invalid max active connections '%s'\n",
+					value);
+
+				free(arg);
+				free(value);
+				free(line);
+				fclose(file);
+				return CONF_MALFORMED_ERROR;
+			}
+		} else if (strcmp(arg, "QUEUE_DELAY") == 0) {
+			endptr = NULL;
+			config->queue_delay = strtoul(value, &endptr, 10);
+
+			if (*endptr != '\0') {
+				fprintf(stderr,
+					"Error: Invalid queue delay target '%s'\n",
+					value);
+
+				free(arg);
+				free(value);
+				free(line);
+				fclose(file);
+				return CONF_MALFORMED_ERROR;
+			}
+		} else if (strcmp(arg, "REQUEST_TIMEOUT") == 0) {
+			endptr = NULL;
+			config->request_timeout = strtoul(value, &endptr, 10);
+
+			if (*endptr != '\0') {
+				fprintf(stderr,
+					"Error: Invalid request timeout '%s'\n",
+					value);
+
+				free(arg);
+				free(value);
+				free(line);
+				fclose(file);
+				return CONF_MALFORMED_ERROR;
+			}
+		} else if (strcmp(arg, "BODY_TIMEOUT") == 0) {
+			endptr = NULL;
+			config->body_timeout = strtoul(value, &endptr, 10);
+
+			if (*endptr != '\0') {
+				fprintf(stderr,
+					"Error: Invalid body timeout '%s'\n",
+					value);
+
+				free(arg);
+				free(value);
+				free(line);
+				fclose(file);
+				return CONF_MALFORMED_ERROR;
+			}
+		} else if (strcmp(arg, "SEND_TIMEOUT") == 0) {
+			endptr = NULL;
+			config->send_timeout = strtoul(value, &endptr, 10);
+
+			if (*endptr != '\0') {
+				fprintf(stderr,
+					"Error: Invalid send timeout '%s'\n",
+					value);
+
+				free(arg);
+				free(value);
+				free(line);
+				fclose(file);
+				return CONF_MALFORMED_ERROR;
+			}
+		} else if (strcmp(arg, "KEEP_ALIVE_TIMEOUT") == 0) {
+			endptr = NULL;
+			config->keep_alive_timeout = strtoul(value, &endptr, 10);
+
+			if (*endptr != '\0') {
+				fprintf(stderr,
+					"Error: Invalid keep-alive timeout '%s'\n",
+					value);
+
+				free(arg);
+				free(value);
+				free(line);
+				fclose(file);
+				return CONF_MALFORMED_ERROR;
+			}
+		} else if (strcmp(arg, "KEEP_ALIVE_REQUESTS") == 0) {
+			endptr = NULL;
+			config->keep_alive_requests = strtoul(value, &endptr, 10);
+
+			if (*endptr != '\0') {
+				fprintf(stderr,
+					"Error: Invalid keep-alive requests '%s'\n",
+					value);
+
+				free(arg);
+				free(value);
+				free(line);
+				fclose(file);
+				return CONF_MALFORMED_ERROR;
+			}
+		} else if (strcmp(arg, "WORKERS") == 0) {
+			endptr = NULL;
+			config->workers = strtoul(value, &endptr, 10);
+
+			if (*endptr != '\0') {
+				fprintf(stderr,
+					"Error: Invalid number of workers '%s'\n",
+					value);
+
+				free(arg);
+				free(value);
+				free(line);
+				fclose(file);
+				return CONF_MALFORMED_ERROR;
+			}
+		} else if (strcmp(arg, "IO_MODEL") == 0) {
+			if (conf_parse_io_model(value, &(config->io_model)) !=
+			    CONF_OK) {
+				fprintf(stderr,
+					"Error: Invalid I/O model '%s'\n",
+					value);
+
+				free(arg);
+				free(value);
+				free(line);
+				fclose(file);
+				return CONF_MALFORMED_ERROR;
+			}
+		} else if (strcmp(arg, "REUSEPORT") == 0) {
+			if (conf_parse_reuseport(value, &(config->reuseport)) !=
+			    CONF_OK) {
+				fprintf(stderr,
+					"Error: Invalid reuseport mode '%s'\n",
+					value);
+
+				free(arg);
+				free(value);
+				free(line);
+				fclose(file);
+				return CONF_MALFORMED_ERROR;
+			}
+		} else if (strcmp(arg, "CACHE_SIZE") == 0) {
+			if (conf_parse_size(value, &(config->cache_size)) !=
+			    CONF_OK) {
+				fprintf(stderr,
+					"Error: Invalid cache size '%s'\n",
+					value);
+
+				free(arg);
+				free(value);
+				free(line);
+				fclose(file);
+				return CONF_MALFORMED_ERROR;
+			}
+		} else if (strcmp(arg, "CACHE_MAX_FILE") == 0) {
+			if (conf_parse_size(value, &(config->cache_max_file)) !=
+			    CONF_OK) {
+				fprintf(stderr,
+					"Error: Invalid cache file size '%s'\n",
+					value);
+
+				free(arg);
+				free(value);
+				free(line);
+				fclose(file);
+				return CONF_MALFORMED_ERROR;
+			}
+		} else if (strcmp(arg, "MAX_HEADERS") == 0) {
+			endptr = NULL;
+			config->max_headers = strtoul(value, &endptr, 10);
+
+			if (*endptr != '\0') {
+				fprintf(stderr,
+					"Error: Invalid max headers '%s'\n",
+					value);
+
+				free(arg);
+				free(value);
+				free(line);
+				fclose(file);
+				return CONF_MALFORMED_ERROR;
+			}
+		} else if (strcmp(arg, "MAX_HEADER_SIZE") == 0) {
+			endptr = NULL;
+			config->max_header_size = strtoul(value, &endptr, 10);
+
+			if (*endptr != '\0') {
+				fprintf(stderr,
+					"Error: Invalid max header size '%s'\n",
+					value);
+
+				free(arg);
+				free(value);
+				free(line);
+				fclose(file);
+				return CONF_MALFORMED_ERROR;
+			}
+		} else if (strcmp(arg, "MIME_TYPES") == 0) {
+			config->mime_types = strdup(value);
+		} else if (strcmp(arg, "STATUS_URI") == 0) {
+			config->status_uri = strdup(value);
+		} else if (strcmp(arg, "SLOW_REQUEST") == 0) {
+			endptr = NULL;
+			config->slow_request = strtoul(value, &endptr, 10);
+
+			if (*endptr != '\0') {
+				fprintf(stderr,
+					"Error: Invalid slow request threshold '%s'\n",
+					value);
+
+				free(arg);
+				free(value);
+				free(line);
+				fclose(file);
+				return CONF_MALFORMED_ERROR;
+			}
+		} else if (strcmp(arg, "FLIGHT_RECORDER") == 0) {
+			endptr = NULL;
+			config->flight_recorder = strtoul(value, &endptr, 10);
+
+			if (*endptr != '\0') {
+				fprintf(stderr,
+					"Error: Invalid flight recorder size '%s'\n",
+					value);
+
+				free(arg);
+				free(value);
+				free(line);
+				fclose(file);
+				return CONF_MALFORMED_ERROR;
+			}
+		} else if (strcmp(arg, "ACCESS_LOG") == 0) {
+			config->access_log = strdup(value);
+		} else if (strcmp(arg, "ACCESS_LOG_FORMAT") == 0) {
+			if (accesslog_parse_format(value,
+						   &(config->access_log_format))
+			    < 0) {
+				fprintf(stderr,
+					"Error: Invalid access log format '%s'\n",
+					value);
+
+				free(arg);
+				free(value);
+				free(line);
+				fclose(file);
+				return CONF_MALFORMED_ERROR;
+			}
+		} else if (strcmp(arg, "ACCESS_LOG_SAMPLE") == 0) {
+			endptr = NULL;
+			config->access_log_sample = strtoul(value, &endptr, 10);
+
+			if (*endptr != '\0') {
+				fprintf(stderr,
+					"Error: Invalid access log sample '%s'\n",
+					value);
+
+				free(arg);
+				free(value);
+				free(line);
+				fclose(file);
+				return CONF_MALFORMED_ERROR;
+			}
+		} else if (strcmp(arg, "COMPRESS_LEVEL") == 0) {
+			endptr = NULL;
+			config->compress_level = strtoul(value, &endptr, 10);
+
+			if (*endptr != '\0') {
+				fprintf(stderr,
+					"Error: Invalid compression level '%s'\n",
+					value);
+
+				free(arg);
+				free(value);
+				free(line);
+				fclose(file);
+				return CONF_MALFORMED_ERROR;
+			}
+		} else if (strcmp(arg, "COMPRESS_MIN_SIZE") == 0) {
+			if (conf_parse_size(value, &(config->compress_min_size))
+			    != CONF_OK) {
+				fprintf(stderr,
+					"Error: Invalid compression min size '%s'\n",
+					value);
+
 				free(arg);
 				free(value);
 				free(line);
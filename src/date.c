@@ -0,0 +1,142 @@
+#define _GNU_SOURCE
+
+#include <string.h>
+#include <time.h>
+
+#include "date.h"
+
+static const char date_days[7][4] = {
+	"Sun", "Mon", "Tue", "Wed", "Thu", "Fri", "Sat"
+};
+
+static const char date_months[12][4] = {
+	"Jan", "Feb", "Mar", "Apr", "May", "Jun",
+	"Jul", "Aug", "Sep", "Oct", "Nov", "Dec"
+};
+
+static void date_digits(char *buffer, int value)
+{
+	buffer[0] = '0' + value / 10;
+	buffer[1] = '0' + value % 10;
+}
+
+void date_format(time_t time, char *buffer)
+{
+	struct tm tm;
+	gmtime_r(&time, &tm);
+
+	// "Sun, 06 Nov 1994 08:49:37 GMT"
+	memcpy(buffer, date_days[tm.tm_wday], 3);
+	memcpy(buffer + 3, ", ", 2);
+	date_digits(buffer + 5, tm.tm_mday);
+	buffer[7] = ' ';
+	memcpy(buffer + 8, date_months[tm.tm_mon], 3);
+	buffer[11] = ' ';
+	int year = tm.tm_year + 1900;
+	date_digits(buffer + 12, year / 100 % 100);
+	date_digits(buffer + 14, year % 100);
+	buffer[16] = ' ';
+	date_digits(buffer + 17, tm.tm_hour);
+	buffer[19] = ':';
+	date_digits(buffer + 20, tm.tm_min);
+	buffer[22] = ':';
+	date_digits(buffer + 23, tm.tm_sec);
+	memcpy(buffer + 25, " GMT", 5);
+}
+
+const char *date_now(void)
+{
+	static time_t formatted_at = -1;
+	static char now[DATE_SIZE];
+
+	time_t second = time(NULL);
+	if (second != formatted_at) {
+		date_format(second, now);
+		formatted_at = second;
+	}
+	return now;
+}
+
+static int date_number(const char *digits, int count)
+{
+	int value = 0;
+	for (int i = 0; i < count; i++) {
+		if (digits[i] < '0' || digits[i] > '9')
+			return -1;
+		value = value * 10 + digits[i] - '0';
+	}
+	return value;
+}
+
+// Days from 1970-01-01 to a date of the proleptic Gregorian calendar
+static long date_days_from_civil(int year, int month, int day)
+{
+	year -= month <= 2;
+	long era = (year >= 0 ? year : year - 399) / 400;
+	long year_of_era = year - era * 400;
+	long day_of_year = (153 * (month + (month > 2 ? -3 : 9)) + 2) / 5 +
+	    day - 1;
+	long day_of_era = year_of_era * 365 + year_of_era / 4 -
+	    year_of_era / 100 + day_of_year;
+	return era * 146097 + day_of_era - 719468;
+}
+
+static bool date_parse_fixdate(const char *value, time_t *time)
+{
+	if (strlen(value) != DATE_SIZE - 1 || ',' != value[3]
+	    || ' ' != value[4] || ' ' != value[7] || ' ' != value[11]
+	    || ' ' != value[16] || ':' != value[19] || ':' != value[22]
+	    || memcmp(value + 25, " GMT", 4) != 0)
+		return false;
+
+	int month = -1;
+	for (int i = 0; i < 12; i++) {
+		if (memcmp(value + 8, date_months[i], 3) == 0)
+			month = i + 1;
+	}
+	int day = date_number(value + 5, 2);
+	int year = date_number(value + 12, 4);
+	int hour = date_number(value + 17, 2);
+	int minute = date_number(value + 20, 2);
+	int second = date_number(value + 23, 2);
+	if (month < 0 || day < 1 || day > 31 || year < 0 || hour < 0
+	    || hour > 23 || minute < 0 || minute > 59 || second < 0
+	    || second > 60)
+		return false;
+
+	*time = (time_t)date_days_from_civil(year, month, day) * 86400 +
+	    hour * 3600 + minute * 60 + second;
+	return true;
+}
+
+bool date_parse(const char *value, time_t *time)
+{
+	static char parsed[DATE_SIZE] = "";
+	static time_t parsed_time = 0;
+
+	if ('\0' != parsed[0] && strcmp(value, parsed) == 0) {
+		*time = parsed_time;
+		return true;
+	}
+
+	if (!date_parse_fixdate(value, time)) {
+		// RFC 850 and asctime() dates, still to be accepted
+		struct tm tm;
+		memset(&tm, 0, sizeof(tm));
+		const char *end = strptime(value, "%A, %d-%b-%y %H:%M:%S GMT",
+					   &tm);
+		if (NULL == end || '\0' != *end) {
+			memset(&tm, 0, sizeof(tm));
+			end = strptime(value, "%a %b %e %H:%M:%S %Y", &tm);
+		}
+		if (NULL == end || '\0' != *end)
+			return false;
+		*time = timegm(&tm);
+	}
+
+	if (strlen(value) < DATE_SIZE) {
+		strcpy(parsed, value);
+		parsed_time = *time;
+	}
+	return true;
+}
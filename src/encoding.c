@@ -0,0 +1,380 @@
+#define _GNU_SOURCE
+
+#include <errno.h>
+#include <stdlib.h>
+#include <string.h>
+#include <strings.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#include <zlib.h>
+
+#include "encoding.h"
+#include "rfc1945.h"
+
+static const char *encoding_names[ENCODING_CODINGS] = {
+	[ENCODING_IDENTITY] = CONTENT_CODING_IDENTITY,
+	[ENCODING_GZIP] = CONTENT_CODING_GZIP,
+	[ENCODING_BROTLI] = CONTENT_CODING_BROTLI,
+	[ENCODING_ZSTD] = CONTENT_CODING_ZSTD,
+};
+
+static const char *encoding_suffixes[ENCODING_CODINGS] = {
+	[ENCODING_IDENTITY] = "",
+	[ENCODING_GZIP] = ".gz",
+	[ENCODING_BROTLI] = ".br",
+	[ENCODING_ZSTD] = ".zst",
+};
+
+static encoding_variants_t *encoding_table = NULL;
+
+int encoding_init(void)
+{
+	void *mapping = mmap(NULL, ENCODING_SLOTS * sizeof(encoding_variants_t),
+			     PROT_READ | PROT_WRITE,
+			     MAP_SHARED | MAP_ANONYMOUS, -1, 0);
+	if (MAP_FAILED == mapping)
+		return -1;
+
+	encoding_table = mapping;
+	return 0;
+}
+
+const char *encoding_name(encoding_coding coding)
+{
+	return encoding_names[coding];
+}
+
+const char *encoding_suffix(encoding_coding coding)
+{
+	return encoding_suffixes[coding];
+}
+
+static int encoding_lookup(const char *name, size_t length)
+{
+	if (length == 6 && strncasecmp(name, CONTENT_CODING_X_GZIP, 6) == 0)
+		return ENCODING_GZIP;
+	for (int coding = ENCODING_GZIP; coding < ENCODING_CODINGS; coding++) {
+		if (strlen(encoding_names[coding]) == length
+		    && strncasecmp(name, encoding_names[coding], length) == 0)
+			return coding;
+	}
+	return -1;
+}
+
+// A q parameter of 0 refuses the coding, anything else accepts it
+static bool encoding_refused(const char *params, const char *end)
+{
+	while (params < end) {
+		while (params < end && (' ' == *params || ';' == *params
+					|| '\t' == *params))
+			params++;
+		if (end - params > 2 && ('q' == params[0] || 'Q' == params[0])
+		    && '=' == params[1])
+			return strtod(params + 2, NULL) <= 0.0;
+		while (params < end && ';' != *params)
+			params++;
+	}
+	return false;
+}
+
+/**
+ * Returns the codings of the Accept-Encoding header as a mask of
+ * (1 << encoding_coding). Quality values only tell accepted codings from
+ * refused ones, the choice between them is made on size.
+ */
+unsigned int encoding_accepted(const char *accept_encoding)
+{
+	if (NULL == accept_encoding)
+		return 0;
+
+	unsigned int accepted = 0;
+	unsigned int listed = 0;
+	bool wildcard = false;
+
+	const char *item = accept_encoding;
+	while ('\0' != *item) {
+		while (' ' == *item || '\t' == *item || ',' == *item)
+			item++;
+		const char *end = item;
+		while ('\0' != *end && ',' != *end)
+			end++;
+
+		size_t length = strcspn(item, " \t;,");
+		bool refused = encoding_refused(item + length, end);
+		if (length == 1 && '*' == item[0]) {
+			wildcard = !refused;
+		} else {
+			int coding = encoding_lookup(item, length);
+			if (coding > 0) {
+				listed |= 1u << coding;
+				if (!refused)
+					accepted |= 1u << coding;
+			}
+		}
+		item = end;
+	}
+
+	if (wildcard)
+		accepted |= ~listed & ((1u << ENCODING_CODINGS) - 2);
+	return accepted;
+}
+
+static uint64_t encoding_hash(const char *str)
+{
+	uint64_t hash = 5381;
+	int c;
+	while ((c = *str++))
+		hash = ((hash << 5) + hash) + c;
+	return hash;
+}
+
+static void encoding_scan(encoding_variants_t *variants, const char *path)
+{
+	off_t size = variants->sizes[ENCODING_IDENTITY];
+	time_t mtime = variants->mtime;
+
+	struct stat file_stat;
+	for (int coding = 0; coding < ENCODING_CODINGS; coding++)
+		variants->sizes[coding] = -1;
+	if (stat(path, &file_stat) < 0 || !S_ISREG(file_stat.st_mode))
+		return;
+	variants->sizes[ENCODING_IDENTITY] = file_stat.st_size;
+	variants->mtime = file_stat.st_mtime;
+
+	// A file that changed may compress well now
+	if (size != file_stat.st_size || mtime != file_stat.st_mtime)
+		variants->incompressible = false;
+
+	size_t length = strlen(path);
+	char variant[ENCODING_PATH_SIZE + 8];
+	memcpy(variant, path, length);
+	for (int coding = ENCODING_GZIP; coding < ENCODING_CODINGS; coding++) {
+		strcpy(variant + length, encoding_suffixes[coding]);
+		struct stat variant_stat;
+		if (stat(variant, &variant_stat) == 0
+		    && S_ISREG(variant_stat.st_mode)
+		    && variant_stat.st_mtime >= file_stat.st_mtime)
+			variants->sizes[coding] = variant_stat.st_size;
+	}
+}
+
+// Copies a slot, returns its sequence number, or 1 when it is being written
+static uint64_t encoding_read(const encoding_variants_t *slot,
+			      encoding_variants_t *variants)
+{
+	uint64_t sequence = __atomic_load_n(&slot->sequence, __ATOMIC_ACQUIRE);
+	if (sequence & 1)
+		return 1;
+
+	memcpy(variants, slot, sizeof(*variants));
+	__atomic_thread_fence(__ATOMIC_ACQUIRE);
+	if (__atomic_load_n(&slot->sequence, __ATOMIC_RELAXED) != sequence)
+		return 1;
+	return sequence;
+}
+
+// Stores variants in their slot, unless it changed since it was read
+static void encoding_write(encoding_variants_t *slot,
+			   const encoding_variants_t *variants,
+			   uint64_t sequence)
+{
+	if (sequence & 1
+	    || !__atomic_compare_exchange_n(&slot->sequence, &sequence,
+					    sequence + 1, false,
+					    __ATOMIC_ACQUIRE, __ATOMIC_RELAXED))
+		return;
+
+	__atomic_thread_fence(__ATOMIC_RELEASE);
+	memcpy((char *)slot + sizeof(slot->sequence),
+	       (const char *)variants + sizeof(variants->sequence),
+	       sizeof(*slot) - sizeof(slot->sequence));
+	__atomic_store_n(&slot->sequence, sequence + 2, __ATOMIC_RELEASE);
+}
+
+/**
+ * Copies the up to date variants of a file, and the slot they come from.
+ * Returns false when the file is not tracked.
+ */
+static bool encoding_find(const char *path, encoding_variants_t *variants,
+			  encoding_variants_t **slot, uint64_t *sequence)
+{
+	if (NULL == encoding_table || strlen(path) >= ENCODING_PATH_SIZE)
+		return false;
+
+	uint64_t hash = encoding_hash(path);
+	*slot = &encoding_table[hash % ENCODING_SLOTS];
+	*sequence = encoding_read(*slot, variants);
+
+	time_t now = time(NULL);
+	if (*sequence & 1 || variants->hash != hash
+	    || strcmp(variants->path, path) != 0) {
+		strcpy(variants->path, path);
+		variants->hash = hash;
+		variants->incompressible = false;
+		variants->sizes[ENCODING_IDENTITY] = -1;
+		variants->mtime = 0;
+	} else if (now - variants->validated_at < ENCODING_VALIDATE_INTERVAL)
+		return true;
+
+	encoding_scan(variants, path);
+	variants->validated_at = now;
+	encoding_write(*slot, variants, *sequence);
+	*sequence += 2;
+	return true;
+}
+
+/**
+ * Picks the smallest variant of a file among the accepted codings, or
+ * ENCODING_IDENTITY. Sets negotiated when the file has variants at all, so
+ * that every response for it carries Vary: Accept-Encoding.
+ */
+encoding_coding encoding_select(const char *path, unsigned int accepted,
+				bool *negotiated)
+{
+	*negotiated = false;
+	encoding_variants_t found, *variants = &found, *slot;
+	uint64_t sequence;
+	if (!encoding_find(path, variants, &slot, &sequence))
+		return ENCODING_IDENTITY;
+
+	off_t smallest = variants->sizes[ENCODING_IDENTITY];
+	if (smallest < 0)
+		return ENCODING_IDENTITY;
+
+	encoding_coding selected = ENCODING_IDENTITY;
+	for (int coding = ENCODING_GZIP; coding < ENCODING_CODINGS; coding++) {
+		if (variants->sizes[coding] < 0)
+			continue;
+		*negotiated = true;
+		if ((accepted & (1u << coding))
+		    && variants->sizes[coding] < smallest) {
+			smallest = variants->sizes[coding];
+			selected = coding;
+		}
+	}
+	return selected;
+}
+
+bool encoding_compressible_type(const char *content_type)
+{
+	static const char *types[] = {
+		"application/javascript", "application/json",
+		"application/xml", "application/wasm",
+		"application/xhtml+xml", "image/svg+xml", "image/x-icon",
+	};
+
+	if (strncmp(content_type, "text/", 5) == 0)
+		return true;
+	for (size_t i = 0; i < sizeof(types) / sizeof(types[0]); i++) {
+		size_t length = strlen(types[i]);
+		if (strncmp(content_type, types[i], length) == 0
+		    && ('\0' == content_type[length]
+			|| ';' == content_type[length]))
+			return true;
+	}
+	return false;
+}
+
+// Large enough, and not known to compress badly
+bool encoding_compressible(const char *path, size_t min_size)
+{
+	encoding_variants_t variants, *slot;
+	uint64_t sequence;
+	return encoding_find(path, &variants, &slot, &sequence)
+	    && !variants.incompressible
+	    && variants.sizes[ENCODING_IDENTITY] >= (off_t)min_size;
+}
+
+void encoding_incompressible(const char *path)
+{
+	encoding_variants_t variants, *slot;
+	uint64_t sequence;
+	if (!encoding_find(path, &variants, &slot, &sequence))
+		return;
+
+	variants.incompressible = true;
+	encoding_write(slot, &variants, sequence);
+}
+
+/**
+ * The compression level to use now: the configured one, lowered when the
+ * run queue is about as long as there are CPUs (the workers are saturated).
+ */
+int encoding_level(int level)
+{
+	static time_t sampled_at = 0;
+	static int busy = 0;	// percent of the CPUs
+
+	time_t now = time(NULL);
+	if (now - sampled_at >= ENCODING_LOAD_INTERVAL) {
+		double load;
+		long cpus = sysconf(_SC_NPROCESSORS_ONLN);
+		if (getloadavg(&load, 1) == 1 && cpus > 0)
+			busy = load * 100 / cpus;
+		sampled_at = now;
+	}
+
+	if (busy >= 90)
+		return 1;
+	if (busy >= 60 && level > 1)
+		return (level + 1) / 2;
+	return level;
+}
+
+size_t encoding_gzip_bound(size_t file_size)
+{
+	// zlib bound plus the larger gzip header and trailer
+	return compressBound(file_size) + 18;
+}
+
+/**
+ * Compresses a file with gzip into output, which holds at least
+ * encoding_gzip_bound() bytes, reading it a chunk at a time.
+ */
+int encoding_gzip(int file, size_t file_size, int level, char *output,
+		  size_t *length)
+{
+	z_stream stream;
+	memset(&stream, 0, sizeof(stream));
+	if (deflateInit2(&stream, level, Z_DEFLATED, 15 + 16, 8,
+			 Z_DEFAULT_STRATEGY) != Z_OK)
+		return -1;
+
+	stream.next_out = (Bytef *) output;
+	stream.avail_out = encoding_gzip_bound(file_size);
+
+	char chunk[ENCODING_CHUNK_SIZE];
+	off_t offset = 0;
+	int err = Z_OK;
+	while (Z_OK == err) {
+		ssize_t read_size = pread(file, chunk, sizeof(chunk), offset);
+		if (read_size < 0 && EINTR == errno)
+			continue;
+		if (read_size < 0) {
+			deflateEnd(&stream);
+			return -1;
+		}
+		offset += read_size;
+
+		stream.next_in = (Bytef *) chunk;
+		stream.avail_in = read_size;
+		int flush = 0 == read_size
+		    || (size_t)offset >= file_size ? Z_FINISH : Z_NO_FLUSH;
+		err = deflate(&stream, flush);
+		if (Z_OK == err && 0 != stream.avail_in)
+			err = Z_BUF_ERROR;	// Grew past the bound
+	}
+
+	*length = stream.total_out;
+	deflateEnd(&stream);
+	return Z_STREAM_END == err ? 0 : -1;
+}
+
+void encoding_free(void)
+{
+	if (NULL != encoding_table)
+		munmap(encoding_table,
+		       ENCODING_SLOTS * sizeof(encoding_variants_t));
+	encoding_table = NULL;
+}
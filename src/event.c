@@ -0,0 +1,534 @@
+#define _GNU_SOURCE
+
+#include <errno.h>
+#include <fcntl.h>
+#include <signal.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/epoll.h>
+#include <sys/sendfile.h>
+#include <sys/socket.h>
+#include <unistd.h>
+
+#include "accesslog.h"
+#include "admission.h"
+#include "event.h"
+#include "http.h"
+#include "metrics.h"
+#include "rfc1945.h"
+#include "server.h"
+
+/**
+ * Replaces the deadline of a connection, in milliseconds from now, 0 for
+ * none.
+ */
+static void event_deadline(wheel_t *wheel, connection_t *connection,
+			   int timeout)
+{
+	wheel_remove(wheel, &connection->timer);
+	if (timeout > 0)
+		wheel_add(wheel, &connection->timer, wheel_now() + timeout);
+}
+
+static void event_close(wheel_t *wheel, connection_t *connection)
+{
+	wheel_remove(wheel, &connection->timer);
+
+	close(connection->client.socket);
+	if (connection->file >= 0)
+		close(connection->file);
+
+	http_request_destroy(&connection->request);
+	http_response_destroy(&connection->response);
+	arena_free(&connection->arena);
+	free(connection);
+	metrics_connection_close();
+	admission_leave();
+}
+
+static int event_watch(int epoll, connection_t *connection, int op,
+		       unsigned int events)
+{
+	if (EPOLL_CTL_MOD == op && connection->watching == events)
+		return 0;
+
+	struct epoll_event event = {.events = events,.data.ptr = connection };
+	int err = epoll_ctl(epoll, op, connection->client.socket, &event);
+	if (err == 0)
+		connection->watching = events;
+	return err;
+}
+
+static void event_accept(const server_t server, int epoll, wheel_t *wheel)
+{
+	// Drain the listen queue, bounded so a burst cannot starve the others
+	for (int i = 0; i < EVENT_ACCEPT_BATCH; i++) {
+		struct sockaddr_in client_addr;
+		socklen_t client_addr_len = sizeof(client_addr);
+
+		int socket = accept4(server.socket,
+				     (struct sockaddr *)&client_addr,
+				     &client_addr_len,
+				     SOCK_NONBLOCK | SOCK_CLOEXEC);
+		if (socket < 0) {
+			if (EAGAIN == errno || EWOULDBLOCK == errno
+			    || ECONNABORTED == errno || EINTR == errno)
+				return;
+			metrics_accept_error();
+			// Out of descriptors, the listener would be ready again
+			if ((EMFILE == errno || ENFILE == errno)
+			    && server_refuse_connection(server) == 0)
+				continue;
+			return;
+		}
+
+		// Over the limit, the connection is refused before it costs memory
+		if (!admission_enter(socket)) {
+			admission_shed(socket);
+			continue;
+		}
+
+		connection_t *connection = malloc(sizeof(connection_t));
+		if (NULL == connection) {
+			close(socket);
+			admission_leave();
+			return;
+		}
+		connection->client.client_addr = client_addr;
+		connection->client.socket = socket;
+		connection->state = CONNECTION_READING_HEAD;
+		connection->watching = 0;
+		http_buffer_init(&connection->input);
+		connection->body_received = 0;
+		connection->file = -1;
+		connection->requests = 0;
+		connection->keep_alive = false;
+		connection->idle = false;
+		wheel_timer_init(&connection->timer, connection);
+		connection->progress = 0;
+
+		arena_init(&connection->arena, ARENA_BLOCK_SIZE);
+
+		http_request_init(&connection->request, &connection->arena);
+		if (http_response_create(&connection->response,
+					 &connection->arena) < 0) {
+			close(socket);
+			arena_free(&connection->arena);
+			free(connection);
+			admission_leave();
+			return;
+		}
+
+		metrics_connection_open();
+		trace_begin(&connection->trace);
+		if (event_watch(epoll, connection, EPOLL_CTL_ADD, EPOLLIN) < 0) {
+			event_close(wheel, connection);
+			continue;
+		}
+
+		event_deadline(wheel, connection,
+			       server.config.request_timeout);
+	}
+}
+
+static int event_prepare(const server_t server, connection_t *connection)
+{
+	http_request_t *request = &connection->request;
+	http_response_t *response = &connection->response;
+
+	connection->started = metrics_now();
+	trace_request(&connection->trace, request->method, request->uri);
+
+	char file_name[SERVER_BUFFER_SIZE];
+	server_route route = server_route_request(server, request, response,
+						  file_name,
+						  SERVER_BUFFER_SIZE);
+	if (SERVER_ROUTE_NONE == route)
+		return -1;
+	trace_mark(&connection->trace, TRACE_ROUTED);
+
+	if (SERVER_ROUTE_FILE == route) {
+		http_response_file(request, response, file_name,
+				   &connection->file, &connection->file_size);
+		if (connection->file >= 0)
+			trace_mark(&connection->trace, TRACE_OPENED);
+	}
+
+	if (request->method == HTTP_METHOD_HEAD && connection->file >= 0) {
+		close(connection->file);
+		connection->file = -1;
+	}
+
+	connection->keep_alive =
+	    server_keep_alive(server, request, ++connection->requests);
+	response->keep_alive = connection->keep_alive;
+	response->more = connection->keep_alive
+	    && http_buffer_pending(&connection->input);
+
+	if (http_output_prepare(&connection->output, request, response,
+				connection->file >= 0) < 0)
+		return -1;
+
+	connection->file_sent = 0;
+	connection->chunk_length = 0;
+	connection->chunk_sent = 0;
+	connection->zero_copy = true;
+	connection->state = CONNECTION_WRITING_HEAD;
+
+	return 0;
+}
+
+/**
+ * Sends the slice of the file that follows the buffers of the output.
+ * Returns 1 once it is out, 0 when the socket is full and a negative value
+ * when the connection broke.
+ */
+static int event_write_file(connection_t *connection)
+{
+	const http_output_t *output = &connection->output;
+
+	if (CONNECTION_WRITING_FILE != connection->state)
+		trace_mark(&connection->trace, TRACE_HEAD_SENT);
+	connection->state = CONNECTION_WRITING_FILE;
+	while (connection->file_sent < output->file_length) {
+		size_t remaining = output->file_length - connection->file_sent;
+
+		if (connection->zero_copy) {
+			off_t offset = output->file_offset +
+			    connection->file_sent;
+			ssize_t sent = sendfile(connection->client.socket,
+						connection->file, &offset,
+						remaining);
+			if (sent > 0) {
+				connection->file_sent += sent;
+				continue;
+			}
+			if (sent == 0)
+				return -1;	// File truncated
+			if (EAGAIN == errno || EWOULDBLOCK == errno)
+				return 0;
+			if (EINVAL != errno && ENOSYS != errno)
+				return -1;
+
+			// Not supported for this file, copy through the buffer
+			connection->zero_copy = false;
+		}
+
+		if (connection->chunk_sent == connection->chunk_length) {
+			ssize_t read_size = pread(connection->file,
+						  connection->chunk,
+						  remaining >
+						  SERVER_BUFFER_SIZE ?
+						  SERVER_BUFFER_SIZE :
+						  remaining,
+						  output->file_offset +
+						  connection->file_sent);
+			if (read_size <= 0)
+				return -1;
+			connection->chunk_length = read_size;
+			connection->chunk_sent = 0;
+		}
+
+		ssize_t sent = send(connection->client.socket,
+				    connection->chunk +
+				    connection->chunk_sent,
+				    connection->chunk_length -
+				    connection->chunk_sent, MSG_NOSIGNAL);
+		if (sent < 0)
+			return EAGAIN == errno || EWOULDBLOCK == errno ? 0 : -1;
+		connection->chunk_sent += sent;
+		connection->file_sent += sent;
+	}
+
+	return 1;
+}
+
+/**
+ * Returns 1 when the response is complete, 0 when the socket is full and
+ * a negative value when the connection broke.
+ */
+static int event_write(connection_t *connection)
+{
+	http_output_t *output = &connection->output;
+
+	// A multipart response is sent one part after the other
+	while (1) {
+		// Hold the segment back when a file or another response follows
+		int flags = 0;
+		if ((connection->file >= 0 && output->file_length > 0)
+		    || connection->response.more)
+			flags |= MSG_MORE;
+		while (!http_output_done(output)) {
+			ssize_t sent = http_output_send(output,
+							connection->client.
+							socket, flags);
+			if (sent < 0)
+				return EAGAIN == errno
+				    || EWOULDBLOCK == errno ? 0 : -1;
+		}
+
+		if (connection->file >= 0) {
+			int err = event_write_file(connection);
+			if (err <= 0)
+				return err;
+		}
+
+		if (!http_output_next(output, &connection->response))
+			return 1;
+		connection->file_sent = 0;
+	}
+}
+
+/**
+ * Returns 1 once the whole request (head and body) has been received, 0
+ * when more data is needed and a negative value on error. A request that
+ * was pipelined behind the previous one may already be in the buffer.
+ */
+static int event_read(connection_t *connection)
+{
+	http_request_t *request = &connection->request;
+	http_buffer_t *input = &connection->input;
+
+	while (CONNECTION_READING_HEAD == connection->state) {
+		int err = http_buffer_request(input, request,
+					      &connection->body_received);
+		if (err < 0)
+			return err;
+		if (err > 0) {
+			connection->state = CONNECTION_READING_BODY;
+			break;
+		}
+
+		ssize_t read_size = recv(connection->client.socket,
+					 input->data + input->length,
+					 SERVER_BUFFER_SIZE - input->length, 0);
+		if (read_size == 0)
+			return -1;
+		if (read_size < 0)
+			return EAGAIN == errno || EWOULDBLOCK == errno ? 0 : -1;
+		input->length += read_size;
+		input->data[input->length] = '\0';
+	}
+
+	while (connection->body_received < request->body_length) {
+		ssize_t read_size = recv(connection->client.socket,
+					 request->body +
+					 connection->body_received,
+					 request->body_length -
+					 connection->body_received, 0);
+		if (read_size == 0)
+			return -1;
+		if (read_size < 0)
+			return EAGAIN == errno || EWOULDBLOCK == errno ? 0 : -1;
+		connection->body_received += read_size;
+	}
+	if (NULL != request->body)
+		request->body[request->body_length] = '\0';
+
+	return 1;
+}
+
+/**
+ * Gets a persistent connection ready for its next request, which is given
+ * the keep-alive timeout to show up.
+ */
+static int event_reset(const server_t server, int epoll, wheel_t *wheel,
+		       connection_t *connection)
+{
+	if (connection->file >= 0)
+		close(connection->file);
+	connection->file = -1;
+
+	http_request_destroy(&connection->request);
+	http_response_destroy(&connection->response);
+	arena_reset(&connection->arena);
+	http_request_init(&connection->request, &connection->arena);
+	if (http_response_create(&connection->response,
+				 &connection->arena) < 0)
+		return -1;
+
+	connection->state = CONNECTION_READING_HEAD;
+	http_buffer_shift(&connection->input);
+	connection->body_received = 0;
+
+	trace_begin(&connection->trace);
+	connection->idle = true;
+	event_deadline(wheel, connection, server.config.keep_alive_timeout);
+
+	return event_watch(epoll, connection, EPOLL_CTL_MOD, EPOLLIN);
+}
+
+static void event_handle(const server_t server, int epoll, wheel_t *wheel,
+			 connection_t *connection, unsigned int events)
+{
+	int err;
+
+	if (events & EPOLLERR) {
+		event_close(wheel, connection);
+		return;
+	}
+
+	// The socket is writable again, the client took some of the response
+	if (connection->state >= CONNECTION_WRITING_HEAD
+	    && server.config.send_timeout > 0)
+		connection->progress = wheel_now();
+
+	// Pipelined requests are answered one after the other, in order
+	while (1) {
+		if (CONNECTION_READING_HEAD == connection->state
+		    || CONNECTION_READING_BODY == connection->state) {
+			// The next request started, it gets the request timeout
+			if (connection->idle) {
+				connection->idle = false;
+				event_deadline(wheel, connection,
+					       server.config.request_timeout);
+			}
+
+			if (0 == connection->trace.at[TRACE_RECEIVING])
+				trace_mark(&connection->trace,
+					   TRACE_RECEIVING);
+
+			connection_state reading = connection->state;
+			err = event_read(connection);
+			if (err == 0) {
+				// The head is in, the body gets its own deadline
+				if (CONNECTION_READING_HEAD == reading
+				    && CONNECTION_READING_BODY ==
+				    connection->state)
+					event_deadline(wheel, connection,
+						       server.config.
+						       body_timeout);
+				return;
+			}
+			if (err < 0) {
+				event_close(wheel, connection);
+				return;
+			}
+
+			// The request is complete, the response gets the send timeout
+			event_deadline(wheel, connection,
+				       server.config.send_timeout);
+			connection->progress = wheel_now();
+
+			err = event_prepare(server, connection);
+			if (err < 0) {
+				event_close(wheel, connection);
+				return;
+			}
+		}
+
+		err = event_write(connection);
+		if (err == 0) {
+			event_watch(epoll, connection, EPOLL_CTL_MOD, EPOLLOUT);
+			return;
+		}
+		if (err < 0)
+			break;
+
+		connection->response.sent = connection->output.length +
+		    connection->file_sent;
+		connection->response.body_sent = connection->response.sent -
+		    connection->output.head_length;
+		metrics_request(connection->request.method,
+				connection->response.status_code,
+				connection->response.sent, connection->started);
+		trace_end(&connection->trace, connection->response.status_code,
+			  connection->response.sent);
+		accesslog_request(&connection->client, &connection->request,
+				  &connection->response, connection->started);
+		if (!connection->keep_alive) {
+			if (http_request_chunked(&connection->request))
+				server_linger(connection->client, 0);
+			break;
+		}
+		if (event_reset(server, epoll, wheel, connection) < 0)
+			break;
+		if (0 == connection->input.length)
+			return;
+	}
+
+	event_close(wheel, connection);
+}
+
+static void event_expire(const server_t server, wheel_t *wheel)
+{
+	uint64_t now = wheel_now();
+	wheel_timer_t *timer = wheel_advance(wheel, now);
+	while (NULL != timer) {
+		wheel_timer_t *next = timer->next;
+		connection_t *connection = timer->data;
+
+		// Sending, the deadline moves with every bit of progress
+		uint64_t deadline =
+		    connection->progress + server.config.send_timeout;
+		if (connection->state >= CONNECTION_WRITING_HEAD
+		    && deadline > now)
+			wheel_add(wheel, timer, deadline);
+		else
+			event_close(wheel, connection);
+		timer = next;
+	}
+}
+
+int event_loop_run(const server_t server)
+{
+	int err;
+
+	signal(SIGPIPE, SIG_IGN);
+	server_spare_init();
+
+	int flags = fcntl(server.socket, F_GETFL, 0);
+	if (flags < 0)
+		return flags;
+	err = fcntl(server.socket, F_SETFL, flags | O_NONBLOCK);
+	if (err < 0)
+		return err;
+
+	int epoll = epoll_create1(EPOLL_CLOEXEC);
+	if (epoll < 0)
+		return epoll;
+
+	// Workers of a pool share the listening socket
+	struct epoll_event listen_event = {
+		.events = EPOLLIN | (server.config.workers >
+				     0 ? EPOLLEXCLUSIVE : 0),
+		.data.ptr = NULL,
+	};
+	err = epoll_ctl(epoll, EPOLL_CTL_ADD, server.socket, &listen_event);
+	if (err < 0) {
+		close(epoll);
+		return err;
+	}
+
+	wheel_t wheel;
+	wheel_init(&wheel, wheel_now());
+	struct epoll_event events[EVENT_MAX_EVENTS];
+
+	while (1) {
+		int ready = epoll_wait(epoll, events, EVENT_MAX_EVENTS,
+				       wheel_timeout(&wheel, wheel_now()));
+		if (ready < 0) {
+			if (EINTR == errno) {
+				trace_poll();
+				continue;
+			}
+			close(epoll);
+			return ready;
+		}
+
+		for (int i = 0; i < ready; i++) {
+			if (NULL == events[i].data.ptr)
+				event_accept(server, epoll, &wheel);
+			else
+				event_handle(server, epoll, &wheel,
+					     events[i].data.ptr,
+					     events[i].events);
+		}
+
+		event_expire(server, &wheel);
+	}
+
+	close(epoll);
+	return 0;
+}
@@ -0,0 +1,371 @@
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+
+#ifdef __SSE2__
+#include <emmintrin.h>
+#endif
+
+#include "arena.h"
+#include "cimap.h"
+#include "headers.h"
+
+#define HEADER_NAME(name) {name, sizeof(name) - 1}
+
+static const struct {
+	const char *name;
+	size_t length;
+} header_names[HEADER_COUNT] = {
+	[HEADER_UNKNOWN] = {NULL, 0},
+	[HEADER_ACCEPT] = HEADER_NAME("Accept"),
+	[HEADER_ACCEPT_ENCODING] = HEADER_NAME("Accept-Encoding"),
+	[HEADER_ACCEPT_RANGES] = HEADER_NAME("Accept-Ranges"),
+	[HEADER_AUTHORIZATION] = HEADER_NAME("Authorization"),
+	[HEADER_CACHE_CONTROL] = HEADER_NAME("Cache-Control"),
+	[HEADER_CONNECTION] = HEADER_NAME("Connection"),
+	[HEADER_CONTENT_ENCODING] = HEADER_NAME("Content-Encoding"),
+	[HEADER_CONTENT_LENGTH] = HEADER_NAME("Content-Length"),
+	[HEADER_CONTENT_RANGE] = HEADER_NAME("Content-Range"),
+	[HEADER_CONTENT_TYPE] = HEADER_NAME("Content-Type"),
+	[HEADER_COOKIE] = HEADER_NAME("Cookie"),
+	[HEADER_DATE] = HEADER_NAME("Date"),
+	[HEADER_ETAG] = HEADER_NAME("ETag"),
+	[HEADER_EXPECT] = HEADER_NAME("Expect"),
+	[HEADER_HOST] = HEADER_NAME("Host"),
+	[HEADER_IF_MODIFIED_SINCE] = HEADER_NAME("If-Modified-Since"),
+	[HEADER_IF_NONE_MATCH] = HEADER_NAME("If-None-Match"),
+	[HEADER_IF_RANGE] = HEADER_NAME("If-Range"),
+	[HEADER_KEEP_ALIVE] = HEADER_NAME("Keep-Alive"),
+	[HEADER_LAST_MODIFIED] = HEADER_NAME("Last-Modified"),
+	[HEADER_LOCATION] = HEADER_NAME("Location"),
+	[HEADER_ORIGIN] = HEADER_NAME("Origin"),
+	[HEADER_RANGE] = HEADER_NAME("Range"),
+	[HEADER_REFERER] = HEADER_NAME("Referer"),
+	[HEADER_RETRY_AFTER] = HEADER_NAME("Retry-After"),
+	[HEADER_SERVER] = HEADER_NAME("Server"),
+	[HEADER_TRANSFER_ENCODING] = HEADER_NAME("Transfer-Encoding"),
+	[HEADER_UPGRADE] = HEADER_NAME("Upgrade"),
+	[HEADER_USER_AGENT] = HEADER_NAME("User-Agent"),
+	[HEADER_VARY] = HEADER_NAME("Vary"),
+};
+
+/**
+ * Slot of every known name under header_hash(), which is collision free for
+ * them. The table was generated offline; a new name needs a new search for
+ * the three multipliers.
+ */
+static const uint8_t header_slots[HEADER_SLOTS] = {
+	[1] = HEADER_IF_RANGE,
+	[2] = HEADER_EXPECT,
+	[4] = HEADER_CONTENT_RANGE,
+	[5] = HEADER_AUTHORIZATION,
+	[6] = HEADER_TRANSFER_ENCODING,
+	[7] = HEADER_KEEP_ALIVE,
+	[8] = HEADER_RANGE,
+	[10] = HEADER_ACCEPT_RANGES,
+	[11] = HEADER_CACHE_CONTROL,
+	[13] = HEADER_VARY,
+	[15] = HEADER_RETRY_AFTER,
+	[16] = HEADER_HOST,
+	[18] = HEADER_UPGRADE,
+	[19] = HEADER_REFERER,
+	[22] = HEADER_LOCATION,
+	[24] = HEADER_IF_MODIFIED_SINCE,
+	[31] = HEADER_IF_NONE_MATCH,
+	[35] = HEADER_CONTENT_ENCODING,
+	[36] = HEADER_ORIGIN,
+	[37] = HEADER_CONTENT_TYPE,
+	[38] = HEADER_CONTENT_LENGTH,
+	[39] = HEADER_LAST_MODIFIED,
+	[43] = HEADER_COOKIE,
+	[48] = HEADER_CONNECTION,
+	[49] = HEADER_DATE,
+	[50] = HEADER_ACCEPT,
+	[55] = HEADER_ETAG,
+	[56] = HEADER_SERVER,
+	[60] = HEADER_ACCEPT_ENCODING,
+	[62] = HEADER_USER_AGENT,
+};
+
+static size_t header_hash(const char *name, size_t length)
+{
+	unsigned int first = (unsigned char)name[0] | 0x20;
+	unsigned int last = (unsigned char)name[length - 1] | 0x20;
+	return (4 * first + last + 31 * length) & (HEADER_SLOTS - 1);
+}
+
+header_id header_lookup(const char *name, size_t length)
+{
+	if (length < 4)
+		return HEADER_UNKNOWN;	// Shorter than any known name
+
+	header_id id = header_slots[header_hash(name, length)];
+	if (HEADER_UNKNOWN != id && header_names[id].length == length
+	    && cimap_equal(header_names[id].name, name, length, false))
+		return id;
+	return HEADER_UNKNOWN;
+}
+
+const char *header_name(header_id id)
+{
+	return id > HEADER_UNKNOWN && id < HEADER_COUNT ?
+	    header_names[id].name : NULL;
+}
+
+static uint8_t headers_tag(header_id id, const char *name, size_t length)
+{
+	if (HEADER_UNKNOWN != id)
+		return id;
+	return HEADER_TAG_OTHER | (cimap_hash(name, length, false) & 0x7f);
+}
+
+// Bit i is set when tags[i] == tag, for 16 tags
+static unsigned int headers_match(const uint8_t *tags, uint8_t tag)
+{
+#ifdef __SSE2__
+	__m128i bytes = _mm_loadu_si128((const __m128i *)tags);
+	return _mm_movemask_epi8(_mm_cmpeq_epi8(bytes, _mm_set1_epi8(tag)));
+#else
+	unsigned int mask = 0;
+	for (int i = 0; i < 16; i++)
+		mask |= (unsigned int)(tags[i] == tag) << i;
+	return mask;
+#endif
+}
+
+static size_t headers_find(const headers_t *headers, uint8_t tag,
+			   const char *name, size_t length)
+{
+	for (size_t i = 0; i < headers->count; i += 16) {
+		unsigned int mask = headers_match(headers->tags + i, tag);
+		while (0 != mask) {
+			size_t index = i + __builtin_ctz(mask);
+			mask &= mask - 1;
+
+			// Ids identify names, only other names need a compare
+			if (tag < HEADER_TAG_OTHER)
+				return index;
+			const headers_entry_t *entry = &headers->entries[index];
+			if (entry->name_length == length
+			    && cimap_equal(entry->name, name, length, false))
+				return index;
+		}
+	}
+	return (size_t)-1;
+}
+
+// Tables in an arena leave their memory to arena_reset()
+static void *headers_alloc(const headers_t *headers, size_t size)
+{
+	return headers->arena ? arena_alloc(headers->arena, size) :
+	    malloc(size);
+}
+
+static void headers_release(const headers_t *headers, void *pointer)
+{
+	if (NULL == headers->arena)
+		free(pointer);
+}
+
+static char *headers_copy(const headers_t *headers, const char *str,
+			  size_t length)
+{
+	char *copy = headers_alloc(headers, length + 1);
+	if (NULL != copy) {
+		memcpy(copy, str, length);
+		copy[length] = '\0';
+	}
+	return copy;
+}
+
+void headers_init(headers_t *headers, arena_t *arena)
+{
+	headers->arena = arena;
+	headers->tags = headers->inline_tags;
+	headers->entries = headers->inline_entries;
+	headers->count = 0;
+	headers->capacity = HEADERS_INLINE;
+	memset(headers->inline_tags, 0, sizeof(headers->inline_tags));
+}
+
+static int headers_grow(headers_t *headers)
+{
+	size_t capacity = headers->capacity * 2;
+	uint8_t *tags = headers_alloc(headers, capacity);
+	headers_entry_t *entries =
+	    headers_alloc(headers, capacity * sizeof(headers_entry_t));
+	if (NULL == tags || NULL == entries) {
+		headers_release(headers, tags);
+		headers_release(headers, entries);
+		return -1;
+	}
+
+	memcpy(tags, headers->tags, headers->count);
+	memset(tags + headers->count, 0, capacity - headers->count);
+	memcpy(entries, headers->entries,
+	       headers->count * sizeof(headers_entry_t));
+
+	if (headers->tags != headers->inline_tags) {
+		headers_release(headers, headers->tags);
+		headers_release(headers, headers->entries);
+	}
+	headers->tags = tags;
+	headers->entries = entries;
+	headers->capacity = capacity;
+	return 0;
+}
+
+static int headers_put(headers_t *headers, header_id id, const char *name,
+		       size_t length, const char *value)
+{
+	uint8_t tag = headers_tag(id, name, length);
+	size_t value_length = strlen(value);
+	char *copy = headers_copy(headers, value, value_length);
+	if (NULL == copy)
+		return -1;
+
+	size_t index = headers_find(headers, tag, name, length);
+	if ((size_t)-1 != index) {
+		headers_entry_t *entry = &headers->entries[index];
+		headers_release(headers, entry->value);
+		entry->value = copy;
+		entry->value_length = value_length;
+		return 0;
+	}
+
+	if (headers->count == headers->capacity && headers_grow(headers) < 0) {
+		headers_release(headers, copy);
+		return -1;
+	}
+
+	headers_entry_t *entry = &headers->entries[headers->count];
+	if (HEADER_UNKNOWN != id) {
+		entry->name = header_names[id].name;	// Static, never copied
+	} else {
+		char *name_copy = headers_copy(headers, name, length);
+		if (NULL == name_copy) {
+			headers_release(headers, copy);
+			return -1;
+		}
+		entry->name = name_copy;
+	}
+	entry->name_length = length;
+	entry->value = copy;
+	entry->value_length = value_length;
+	headers->tags[headers->count++] = tag;
+	return 0;
+}
+
+int headers_set(headers_t *headers, const char *name, const char *value)
+{
+	if (NULL == headers || NULL == name || NULL == value)
+		return -1;
+
+	size_t length = strlen(name);
+	return headers_put(headers, header_lookup(name, length), name, length,
+			   value);
+}
+
+int headers_set_id(headers_t *headers, header_id id, const char *value)
+{
+	if (NULL == headers || NULL == value || NULL == header_name(id))
+		return -1;
+
+	return headers_put(headers, id, header_names[id].name,
+			   header_names[id].length, value);
+}
+
+const char *headers_get(const headers_t *headers, const char *name)
+{
+	if (NULL == headers || NULL == name)
+		return NULL;
+
+	size_t length = strlen(name);
+	uint8_t tag = headers_tag(header_lookup(name, length), name, length);
+	size_t index = headers_find(headers, tag, name, length);
+	return (size_t)-1 == index ? NULL : headers->entries[index].value;
+}
+
+const char *headers_get_id(const headers_t *headers, header_id id)
+{
+	if (NULL == headers || NULL == header_name(id))
+		return NULL;
+
+	size_t index = headers_find(headers, id, NULL, 0);
+	return (size_t)-1 == index ? NULL : headers->entries[index].value;
+}
+
+static int headers_delete(headers_t *headers, size_t index)
+{
+	if ((size_t)-1 == index)
+		return 1;	// Not found
+
+	headers_entry_t *entry = &headers->entries[index];
+	headers_release(headers, entry->value);
+	if (headers->tags[index] >= HEADER_TAG_OTHER)
+		headers_release(headers, (char *)entry->name);
+
+	// Keep the insertion order
+	size_t after = headers->count - index - 1;
+	memmove(entry, entry + 1, after * sizeof(headers_entry_t));
+	memmove(headers->tags + index, headers->tags + index + 1, after);
+	headers->tags[--headers->count] = 0;
+	return 0;
+}
+
+int headers_remove(headers_t *headers, const char *name)
+{
+	if (NULL == headers || NULL == name)
+		return -1;
+
+	size_t length = strlen(name);
+	uint8_t tag = headers_tag(header_lookup(name, length), name, length);
+	return headers_delete(headers,
+			      headers_find(headers, tag, name, length));
+}
+
+int headers_remove_id(headers_t *headers, header_id id)
+{
+	if (NULL == headers || NULL == header_name(id))
+		return -1;
+
+	return headers_delete(headers, headers_find(headers, id, NULL, 0));
+}
+
+size_t headers_size(const headers_t *headers)
+{
+	return NULL != headers ? headers->count : 0;
+}
+
+/**
+ * Walks the headers in insertion order, position starts at 0. Returns 1
+ * after the last one.
+ */
+int headers_next(const headers_t *headers, size_t *position,
+		 const char **name, const char **value)
+{
+	if (NULL == headers || *position >= headers->count)
+		return 1;
+
+	const headers_entry_t *entry = &headers->entries[(*position)++];
+	*name = entry->name;
+	*value = entry->value;
+	return 0;
+}
+
+void headers_free(headers_t *headers)
+{
+	if (NULL == headers->arena) {
+		for (size_t i = 0; i < headers->count; i++) {
+			free(headers->entries[i].value);
+			if (headers->tags[i] >= HEADER_TAG_OTHER)
+				free((char *)headers->entries[i].name);
+		}
+		if (headers->tags != headers->inline_tags) {
+			free(headers->tags);
+			free(headers->entries);
+		}
+	}
+	headers_init(headers, headers->arena);
+}
@@ -1,148 +1,284 @@
+#define _GNU_SOURCE
+
 #include <arpa/inet.h>
 #include <errno.h>
-#include <magic.h>
+#include <fcntl.h>
+#include <linux/errqueue.h>
+#include <poll.h>
 #include <stdlib.h>
 #include <string.h>
+#include <sys/sendfile.h>
 #include <sys/socket.h>
+#include <sys/stat.h>
+#include <sys/uio.h>
+#include <unistd.h>
 
 #include <ctype.h>
 
-#include "cimap.h"
+#include "arena.h"
+#include "cache.h"
+#include "date.h"
+#include "encoding.h"
+#include "headers.h"
 #include "http.h"
+#include "mime.h"
 #include "rfc1945.h"
 #include "server.h"
+#include "trace.h"
 
-int http_request_create(const client_t client, http_request_t *request)
+const char *http_method_name(http_method_t method)
 {
-	*request = (http_request_t) {
-	.major = 0,.minor = 0,.body = (char *)NULL,.body_length = 0,};
-	request->headers = cimap_create(16, false);
+	switch (method) {
+	case HTTP_METHOD_GET:
+		return METHOD_GET;
+	case HTTP_METHOD_HEAD:
+		return METHOD_HEAD;
+	case HTTP_METHOD_POST:
+		return METHOD_POST;
+	default:
+		return NULL;
+	}
+}
 
-	char buffer[SERVER_BUFFER_SIZE];
-	int total_read = 0;
-	int read_size = 0;
-	// If the request is sent in multiple packets, read until the end of the headers
-	while (total_read < SERVER_BUFFER_SIZE) {
-		read_size =
-		    recv(client.socket, buffer + total_read,
-			 SERVER_BUFFER_SIZE - total_read, 0);
-		if (read_size <= 0)
-			return read_size;
-		total_read += read_size;
-		buffer[total_read] = '\0';
+void http_buffer_init(http_buffer_t *buffer)
+{
+	buffer->length = 0;
+	buffer->consumed = 0;
+	buffer->data[0] = '\0';
+}
 
-		char *end_of_headers = strstr(buffer, EOBLOCK);
-		if (end_of_headers)
-			break;
-	}
+/**
+ * Parses the request at the start of the buffer once its head is complete,
+ * and takes the part of its body that came along. Returns 1 when the
+ * request was parsed, 0 when more data is needed and a negative value on
+ * error. The caller receives the rest of the body, if any.
+ */
+int http_buffer_request(http_buffer_t *buffer, http_request_t *request,
+			size_t *body_received)
+{
+	// Picks up where the previous call stopped
+	int err = parser_execute(&request->parser, request, buffer->data,
+				 buffer->length);
+	if (err < 0)
+		return err;
+	if (err == 0)
+		return buffer->length >= SERVER_BUFFER_SIZE ?
+		    HTTP_REQUEST_MALFORMED : 0;
+	size_t head_length = request->parser.offset;
+
+	size_t content_length = http_request_content_length(request);
+	if (content_length > SERVER_BODY_SIZE)
+		return HTTP_ENTITY_TOO_LARGE;
+
+	size_t available = buffer->length - head_length;
+	if (available > content_length)
+		available = content_length;
+	buffer->consumed = head_length + available;
+	*body_received = available;
+	if (0 == content_length)
+		return 1;
+
+	request->body = request->arena ?
+	    arena_alloc(request->arena, content_length + 1) :
+	    malloc(content_length + 1);
+	if (NULL == request->body)
+		return -1;
+	request->body_length = content_length;
+	memcpy(request->body, buffer->data + head_length, available);
+	request->body[available] = '\0';
 
-	char *end_of_headers = strstr(buffer, EOBLOCK);
-	if (!end_of_headers)
-		return HTTP_REQUEST_MALFORMED;
-	char method[16];
+	return 1;
+}
 
-	char parser[32];
-	sprintf(parser, "%%s%s%%s%sHTTP/%%d.%%d", SP, SP);
-	if (sscanf
-	    (buffer, parser, method, request->uri, &request->major,
-	     &request->minor) != 4) {
-		return HTTP_REQUEST_MALFORMED;
-	}
+void http_buffer_shift(http_buffer_t *buffer)
+{
+	size_t left = buffer->length - buffer->consumed;
+	memmove(buffer->data, buffer->data + buffer->consumed, left);
+	buffer->length = left;
+	buffer->consumed = 0;
+	buffer->data[left] = '\0';
+}
 
-	if (strcmp(method, "GET") == 0) {
-		request->method = HTTP_METHOD_GET;
-	} else if (strcmp(method, "HEAD") == 0) {
-		request->method = HTTP_METHOD_HEAD;
-	} else if (strcmp(method, "POST") == 0) {
-		request->method = HTTP_METHOD_POST;
-	} else {
-		return HTTP_REQUEST_MALFORMED;
-	}
+/**
+ * Whether the head of another request follows the current one.
+ */
+bool http_buffer_pending(const http_buffer_t *buffer)
+{
+	return NULL != strstr(buffer->data + buffer->consumed, EOBLOCK);
+}
 
-	char *line_start = strchr(buffer, '\n') + 1;
-	while (line_start < end_of_headers) {
-		char *line_end = strchr(line_start, '\n');
-		if (!line_end)
-			break;
+int http_request_init(http_request_t *request, arena_t *arena)
+{
+	request->arena = arena;
+	request->method = 0;
+	request->uri = NULL;
+	request->uri_length = 0;
+	request->major = 0;
+	request->minor = 0;
+	request->header_count = 0;
+	request->body = NULL;
+	request->body_length = 0;
+	parser_init(&request->parser);
 
-		*line_end = '\0';
-		char *colon = strchr(line_start, ':');
-		if (colon) {
-			*colon = '\0';
-			char *key = line_start;
-			char *value = colon + 1;
-			while (*value == ' ')
-				value++;
-			cimap_set(request->headers, key, value);
-		}
-		line_start = line_end + 1;
+	return 0;
+}
+
+/**
+ * Parses a complete, NUL-terminated request head in one go.
+ */
+int http_request_parse(http_request_t *request, char *buffer)
+{
+	int err = parser_execute(&request->parser, request, buffer,
+				 strlen(buffer));
+	if (err < 0)
+		return err;
+	return err == 0 ? HTTP_REQUEST_MALFORMED : 0;
+}
+
+const char *http_request_header_id(const http_request_t *request,
+				   header_id id)
+{
+	for (size_t i = 0; i < request->header_count; i++) {
+		if (request->headers[i].id == id)
+			return request->headers[i].value;
+	}
+	return NULL;
+}
+
+const char *http_request_header(const http_request_t *request,
+				const char *name)
+{
+	size_t length = strlen(name);
+	header_id id = header_lookup(name, length);
+	if (HEADER_UNKNOWN != id)
+		return http_request_header_id(request, id);
+
+	for (size_t i = 0; i < request->header_count; i++) {
+		const http_header_t *header = &request->headers[i];
+		if (header->name_length == length
+		    && strncasecmp(header->name, name, length) == 0)
+			return header->value;
 	}
+	return NULL;
+}
 
-	// Handle body if present
+size_t http_request_content_length(const http_request_t *request)
+{
 	const char *content_length_str =
-	    cimap_get(request->headers, "Content-Length");
-	if (content_length_str) {
-		size_t content_length = atoi(content_length_str);
-		if (content_length > 0) {
-			request->body_length = content_length;
-			if (content_length > SERVER_BODY_SIZE)
-				return HTTP_ENTITY_TOO_LARGE;
-			request->body = malloc(content_length + 1);
-			if (!request->body)
-				return -1;
+	    http_request_header_id(request, HEADER_CONTENT_LENGTH);
+	if (NULL == content_length_str)
+		return 0;
 
-			size_t body_received =
-			    total_read - (end_of_headers - buffer + 4);
-			memcpy(request->body, end_of_headers + 4,
-			       body_received);
+	long long content_length = atoll(content_length_str);
+	if (content_length < 0)
+		return 0;
 
-			while (body_received < content_length) {
-				read_size =
-				    recv(client.socket,
-					 request->body + body_received,
-					 content_length - body_received, 0);
-				if (read_size <= 0) {
-					free(request->body);
-					request->body = NULL;
-					return -1;
-				}
-				body_received += read_size;
-			}
-			request->body[content_length] = '\0';
-		}
+	return (size_t)content_length;
+}
+
+/**
+ * Tells whether the request has a body whose end cannot be found (it is
+ * not read, chunked decoding is not supported): the connection must close
+ * after the response then, and linger while the client still sends it.
+ */
+bool http_request_chunked(const http_request_t *request)
+{
+	return NULL != http_request_header_id(request,
+					      HEADER_TRANSFER_ENCODING);
+}
+
+bool http_request_keep_alive(const http_request_t *request)
+{
+	// Nothing may follow a body whose end cannot be found
+	if (http_request_chunked(request))
+		return false;
+
+	const char *connection = http_request_header_id(request,
+							 HEADER_CONNECTION);
+	if (NULL != connection && NULL != strcasestr(connection, "close"))
+		return false;
+
+	// HTTP/1.1 is persistent by default, HTTP/1.0 has to ask for it
+	if (request->major > 1 || (request->major == 1 && request->minor >= 1))
+		return true;
+	return NULL != connection && NULL != strcasestr(connection,
+							"keep-alive");
+}
+
+/**
+ * Receives the head of a request, and whatever part of its body came with
+ * it, whose size goes to body_received. The rest of the body is left to
+ * http_request_receive_body().
+ */
+int http_request_create(const client_t client, http_buffer_t *buffer,
+			http_request_t *request, arena_t *arena,
+			size_t *body_received)
+{
+	int err = http_request_init(request, arena);
+	if (err < 0)
+		return err;
+
+	// Drop the previous request, keep what was pipelined after it
+	http_buffer_shift(buffer);
+
+	*body_received = 0;
+	// If the request is sent in multiple packets, read until the end of the headers
+	while ((err = http_buffer_request(buffer, request, body_received)) == 0) {
+		ssize_t read_size =
+		    recv(client.socket, buffer->data + buffer->length,
+			 SERVER_BUFFER_SIZE - buffer->length, 0);
+		if (read_size == 0)
+			return HTTP_CONNECTION_CLOSED;
+		if (read_size < 0)
+			return read_size;
+		buffer->length += read_size;
+		buffer->data[buffer->length] = '\0';
 	}
+	return err < 0 ? err : 0;
+}
 
-	char ip[INET_ADDRSTRLEN];
-	inet_ntop(AF_INET, &client.client_addr.sin_addr, ip, INET_ADDRSTRLEN);
-	fprintf(stderr, "[%s] %s %s HTTP/%d.%d\n", ip, method,
-		request->uri, request->major, request->minor);
+/**
+ * Receives the rest of the body, straight from the socket.
+ */
+int http_request_receive_body(const client_t client, http_request_t *request,
+			      size_t body_received)
+{
+	while (body_received < request->body_length) {
+		ssize_t read_size = recv(client.socket,
+					 request->body + body_received,
+					 request->body_length - body_received,
+					 0);
+		if (read_size <= 0)
+			return -1;
+		body_received += read_size;
+	}
+	if (NULL != request->body)
+		request->body[request->body_length] = '\0';
 
 	return 0;
 }
 
 void http_request_destroy(http_request_t *request)
 {
-	cimap_free(request->headers);
-
-	if (NULL != request->body) {
+	if (NULL != request->body && NULL == request->arena)
 		free(request->body);
-	}
+	request->body = NULL;
 }
 
-int http_response_create(http_response_t *response)
+int http_response_create(http_response_t *response, arena_t *arena)
 {
 	*response = (http_response_t) {
 	.status_code = 200,.major = 0,.minor = 0,.body =
-		    (char *)NULL,.body_length = 0};
-	response->headers = cimap_create(16, false);
+		    (char *)NULL,.body_length = 0,.cached = NULL,.prebuilt =
+		    NULL,.ranges = {.count = 0,.size = 0,.type = NULL},.keep_alive =
+		    false,.more = false,.sent = 0,.body_sent = 0,.trace = NULL,.arena = arena};
+	headers_init(&response->headers, arena);
 
 	http_response_status(response, 200);
-	cimap_set(response->headers, "Server", SERVER_NAME);
-
-	return 0;
+	return headers_set_id(&response->headers, HEADER_SERVER, SERVER_NAME);
 }
 
-char *http_response_message(int status_code)
+const char *http_response_message(int status_code)
 {
 	switch (status_code) {
 	case 200:
@@ -153,6 +289,8 @@ char *http_response_message(int status_code)
 		return STATUS_TEXT_202;
 	case 204:
 		return STATUS_TEXT_204;
+	case 206:
+		return STATUS_TEXT_206;
 
 	case 300:
 		return STATUS_TEXT_300;
@@ -171,6 +309,8 @@ char *http_response_message(int status_code)
 		return STATUS_TEXT_403;
 	case 404:
 		return STATUS_TEXT_404;
+	case 416:
+		return STATUS_TEXT_416;
 
 	case 500:
 		return STATUS_TEXT_500;
@@ -188,9 +328,14 @@ char *http_response_message(int status_code)
 
 int http_response_body(http_response_t *response, const char *body)
 {
+	if (NULL != response->body && NULL == response->arena)
+		free(response->body);
+
 	// Copy the body
 	response->body_length = strlen(body);
-	response->body = malloc(response->body_length + 1);
+	response->body = response->arena ?
+	    arena_alloc(response->arena, response->body_length + 1) :
+	    malloc(response->body_length + 1);
 	if (NULL == response->body)
 		return -1;
 
@@ -202,235 +347,999 @@ int http_response_body(http_response_t *response, const char *body)
 int http_response_status(http_response_t *response, int status_code)
 {
 	response->status_code = status_code;
+	response->prebuilt = NULL;
 	return 0;
 }
 
-int http_response_send(const client_t client, const http_request_t *request,
-		       http_response_t *response)
+// Head of a fixed response, without the Connection header
+#define HTTP_PREBUILT(code, text, body, length) \
+	{code, HTTP_VERSION_1_1 SP #code SP text EOL \
+	 "Server:" SP SERVER_NAME EOL "Content-Length:" SP #length EOL, \
+	 sizeof(HTTP_VERSION_1_1 SP #code SP text EOL \
+		"Server:" SP SERVER_NAME EOL "Content-Length:" SP #length EOL) - 1, \
+	 body, length}
+
+static const http_prebuilt_t http_prebuilt[] = {
+	HTTP_PREBUILT(400, STATUS_TEXT_400, "", 0),
+	HTTP_PREBUILT(404, STATUS_TEXT_404, STATUS_TEXT_404, 9),
+	HTTP_PREBUILT(501, STATUS_TEXT_501, "", 0),
+};
+
+/**
+ * Turns the response into one of the fixed error responses, which are
+ * sent from constant memory as they are. Other status codes only set the
+ * status.
+ */
+int http_response_prebuilt(http_response_t *response, int status_code)
 {
-	char buffer[SERVER_BUFFER_SIZE];
+	http_response_status(response, status_code);
 
-	// Send status line: "HTTP/1.0 200 OK\r\n"
-	int write_size = snprintf(buffer, SERVER_BUFFER_SIZE, "%s%s%d%s%s%s",
-				  HTTP_VERSION_1_0, SP, response->status_code,
-				  SP,
-				  http_response_message(response->status_code),
-				  EOL);
-	int err = send(client.socket, buffer, write_size, 0);
+	size_t count = sizeof(http_prebuilt) / sizeof(http_prebuilt[0]);
+	for (size_t i = 0; i < count; i++) {
+		if (http_prebuilt[i].status_code == status_code) {
+			response->prebuilt = &http_prebuilt[i];
+			return 0;
+		}
+	}
+	return -1;
+}
+
+int http_response_head(const http_response_t *response, char *buffer,
+		       size_t size)
+{
+	// Status line: "HTTP/1.1 200 OK\r\n", HTTP/1.0 clients read it as 1.0
+	// (an HTTP/1.0 status line would make HTTP/1.1 clients downgrade)
+	int length = snprintf(buffer, size, "%s%s%d%s%s%s",
+			      HTTP_VERSION_1_1, SP, response->status_code,
+			      SP,
+			      http_response_message(response->status_code),
+			      EOL);
+	if (length < 0 || (size_t)length >= size)
+		return -1;
 
-	// Send headers
-	cimap_iterator_t *iterator = cimap_iterator(response->headers);
+	size_t position = 0;
 	const char *key, *value;
-	while (cimap_next(iterator, &key, &value) == 0) {
-		write_size =
-		    snprintf(buffer, SERVER_BUFFER_SIZE, "%s:%s%s%s", key, SP,
-			     value, EOL);
-		err = send(client.socket, buffer, write_size, 0);
-		if (err < 0)
-			return err;
+	while (headers_next(&response->headers, &position, &key, &value)
+	       == 0) {
+		int write_size =
+		    snprintf(buffer + length, size - length, "%s:%s%s%s", key,
+			     SP, value, EOL);
+		if (write_size < 0 || (size_t)write_size >= size - length)
+			return -1;
+		length += write_size;
 	}
-	cimap_iterator_free(iterator);
 
-	err = send(client.socket, EOL, 2, 0);
-	if (err < 0)
-		return err;
+	// Persistent connections need every message to be delimited, a 304
+	// is by definition
+	if (304 != response->status_code
+	    && NULL == headers_get_id(&response->headers,
+				      HEADER_CONTENT_LENGTH)) {
+		int write_size =
+		    snprintf(buffer + length, size - length,
+			     "Content-Length:%s%zu%s", SP,
+			     NULL != response->body ? response->body_length : 0,
+			     EOL);
+		if (write_size < 0 || (size_t)write_size >= size - length)
+			return -1;
+		length += write_size;
+	}
 
-	if (request->method == HTTP_METHOD_HEAD) {
-		char ip[INET_ADDRSTRLEN];
-		inet_ntop(AF_INET, &client.client_addr.sin_addr, ip,
-			  INET_ADDRSTRLEN);
-		fprintf(stderr, "[%s] %d %s\n", ip, response->status_code,
-			http_response_message(response->status_code));
+	return length;
+}
 
-		return 0;
+/**
+ * Writes the part of the head that changes with each request: Date and
+ * Connection, then the blank line. The date is formatted once per second.
+ */
+int http_response_head_end(const http_response_t *response, char *buffer,
+			   size_t size)
+{
+	int length = snprintf(buffer, size, "Date:%s%s%sConnection:%s%s%s%s",
+			      SP, date_now(), EOL, SP,
+			      response->keep_alive ? "keep-alive" : "close",
+			      EOL, EOL);
+	if (length < 0 || (size_t)length >= size)
+		return -1;
+	return length;
+}
+
+/**
+ * Writes the delimiter and header of a multipart/byteranges part, or the
+ * closing delimiter after the last part.
+ */
+static int http_part_head(const http_ranges_t *ranges, size_t index,
+			  char *buffer, size_t size)
+{
+	int length;
+	if (index < ranges->count) {
+		const http_range_t *part = &ranges->parts[index];
+		length = snprintf(buffer, size,
+				  "%s--%s%sContent-Type:%s%s%sContent-Range:%sbytes %lld-%lld/%zu%s%s",
+				  EOL, HTTP_BOUNDARY, EOL, SP, ranges->type, EOL,
+				  SP, (long long)part->offset,
+				  (long long)(part->offset + part->length - 1),
+				  ranges->size, EOL, EOL);
+	} else {
+		length = snprintf(buffer, size, "%s--%s--%s", EOL,
+				  HTTP_BOUNDARY, EOL);
 	}
-	// Send body by blocks of SERVER_BUFFER_SIZE bytes
-	if (NULL != response->body) {
-		size_t body_length = response->body_length;
-		size_t sent = 0;
-		while (sent < body_length) {
-			size_t to_send =
-			    body_length - sent >
-			    SERVER_BUFFER_SIZE ? SERVER_BUFFER_SIZE :
-			    body_length - sent;
-			err =
-			    send(client.socket, response->body + sent, to_send,
-				 0);
-			if (err < 0)
-				return err;
-			sent += to_send;
-		}
-		if (err < 0)
-			return err;
+	if (length < 0 || (size_t)length >= size)
+		return -1;
+	return length;
+}
+
+// Lays out the next range: its part header, then its bytes from the body or the file
+static void http_output_part(http_output_t *output,
+			     const http_response_t *response)
+{
+	const http_ranges_t *ranges = &response->ranges;
+	size_t index = output->next_part++;
+
+	int part_length = ranges->count > 1 ?
+	    http_part_head(ranges, index, output->part, sizeof(output->part)) :
+	    0;
+	output->iov[2].iov_base = output->part;
+	output->iov[2].iov_len = part_length > 0 ? part_length : 0;
+
+	off_t offset = 0;
+	size_t length = 0;
+	if (index < ranges->count) {
+		offset = ranges->parts[index].offset;
+		length = ranges->parts[index].length;
 	}
+	if (NULL != output->body) {
+		output->iov[3].iov_base = (void *)(output->body + offset);
+		output->iov[3].iov_len = length;
+		output->file_length = 0;
+	} else {
+		output->iov[3].iov_base = NULL;
+		output->iov[3].iov_len = 0;
+		output->file_offset = offset;
+		output->file_length = length;
+	}
+}
 
-	err = send(client.socket, EOL, 2, 0);
-	if (err < 0)
-		return err;
+/**
+ * Lays out a response as (up to) four buffers: the head, its per-request
+ * end (Connection header and blank line), the header of the first part of a
+ * multipart response and the in-memory body, or the range of it to send.
+ * Heads of cached and prebuilt responses are used as they are, other heads
+ * are serialized into the output. Bodies are never copied.
+ */
+int http_output_prepare(http_output_t *output, const http_request_t *request,
+			const http_response_t *response, bool has_file)
+{
+	const char *body = response->body;
+	size_t body_length = NULL != body ? response->body_length : 0;
 
-	char ip[INET_ADDRSTRLEN];
-	inet_ntop(AF_INET, &client.client_addr.sin_addr, ip, INET_ADDRSTRLEN);
-	fprintf(stderr, "[%s] %d %s\n", ip, response->status_code,
-		http_response_message(response->status_code));
+	if (NULL != response->cached) {
+		body = cache_body(response->cached);
+		body_length = response->cached->body_length;
+	}
+
+	// Ranges of a cached body get a head of their own
+	if (NULL != response->cached && 0 == response->ranges.count) {
+		output->iov[0].iov_base = (void *)cache_head(response->cached);
+		output->iov[0].iov_len = response->cached->head_length;
+	} else if (NULL != response->prebuilt) {
+		output->iov[0].iov_base = (void *)response->prebuilt->head;
+		output->iov[0].iov_len = response->prebuilt->head_length;
+		body = response->prebuilt->body;
+		body_length = response->prebuilt->body_length;
+	} else {
+		int head_length = http_response_head(response, output->head,
+						     sizeof(output->head));
+		if (head_length < 0)
+			return -1;
+		output->iov[0].iov_base = output->head;
+		output->iov[0].iov_len = head_length;
+	}
+	int end_length = http_response_head_end(response, output->end,
+						sizeof(output->end));
+	if (end_length < 0)
+		return -1;
+	output->iov[1].iov_base = output->end;
+	output->iov[1].iov_len = end_length;
+
+	if (request->method == HTTP_METHOD_HEAD || has_file
+	    || 304 == response->status_code)
+		body_length = 0;
+	output->iov[2].iov_base = output->part;
+	output->iov[2].iov_len = 0;
+	output->iov[3].iov_base = (void *)body;
+	output->iov[3].iov_len = body_length;
+
+	output->body = has_file ? NULL : body;
+	output->next_part = 0;
+	output->file_offset = 0;
+	output->file_length = has_file ? response->ranges.size : 0;
+	if (response->ranges.count > 0)
+		http_output_part(output, response);
+
+	output->head_length = output->iov[0].iov_len + output->iov[1].iov_len;
+	output->current = output->iov;
+	output->count = 4;
+	output->length = output->iov[0].iov_len + output->iov[1].iov_len +
+	    output->iov[2].iov_len + output->iov[3].iov_len;
+	http_output_advance(output, 0);
 
 	return 0;
 }
 
-int http_response_send_file(const client_t client,
-			    const http_request_t *request,
-			    http_response_t *response, const char *file_name)
+/**
+ * Lays out the next part of a multipart/byteranges response once the
+ * current one is sent, and the closing delimiter after the last one.
+ * Returns false when the response is complete.
+ */
+bool http_output_next(http_output_t *output, const http_response_t *response)
 {
-	FILE *fd = fopen(file_name, "r");
-	if (NULL == fd) {
-		if (ENOENT == errno) {
-			http_response_status(response, 404);
-			http_response_body(response, STATUS_TEXT_404);
-		} else {
-			http_response_status(response, 500);
-		}
-		return http_response_send(client, request, response);
+	if (response->ranges.count < 2
+	    || output->next_part > response->ranges.count)
+		return false;
+
+	output->length += output->file_length;	// the slice that went out
+	http_output_part(output, response);
+
+	output->current = output->iov + 2;
+	output->count = 2;
+	output->length += output->iov[2].iov_len + output->iov[3].iov_len;
+	http_output_advance(output, 0);
+	return true;
+}
+
+void http_output_advance(http_output_t *output, size_t sent)
+{
+	while (output->count > 0 && sent >= output->current->iov_len) {
+		sent -= output->current->iov_len;
+		output->current++;
+		output->count--;
 	}
-	char buffer[SERVER_BUFFER_SIZE];
-
-	// Send status line: "HTTP/1.0 200 OK\r\n"
-	int write_size = snprintf(buffer, SERVER_BUFFER_SIZE, "%s%s%d%s%s%s",
-				  HTTP_VERSION_1_0, SP, response->status_code,
-				  SP,
-				  http_response_message(response->status_code),
-				  EOL);
-	int err = send(client.socket, buffer, write_size, 0);
-
-	// Determine the file size
-	fseek(fd, 0L, SEEK_END);
-	size_t file_size = ftell(fd);
-	fseek(fd, 0L, SEEK_SET);
-
-	int content_length_len = snprintf(NULL, 0, "%ld", file_size);
-	char *content_length = malloc(content_length_len + 1);
-	snprintf(content_length, content_length_len + 1, "%ld", file_size);
-	content_length[content_length_len] = '\0';
-	cimap_set(response->headers, "Content-Length", content_length);
-	free(content_length);
-
-	// Send headers
-	cimap_iterator_t *iterator = cimap_iterator(response->headers);
-	const char *key, *value;
-	while (cimap_next(iterator, &key, &value) == 0) {
-		write_size =
-		    snprintf(buffer, SERVER_BUFFER_SIZE, "%s:%s%s%s", key, SP,
-			     value, EOL);
-		err = send(client.socket, buffer, write_size, 0);
-		if (err < 0)
-			return err;
+	if (output->count > 0) {
+		output->current->iov_base =
+		    (char *)output->current->iov_base + sent;
+		output->current->iov_len -= sent;
 	}
-	cimap_iterator_free(iterator);
+}
 
-	err = send(client.socket, EOL, 2, 0);
-	if (err < 0)
-		return err;
+bool http_output_done(const http_output_t *output)
+{
+	return 0 == output->count;
+}
 
-	if (request->method == HTTP_METHOD_HEAD) {
-		fclose(fd);
+/**
+ * Points the message header of the output at what is left to send, for
+ * callers that hand it to the kernel themselves (io_uring).
+ */
+struct msghdr *http_output_message(http_output_t *output)
+{
+	memset(&output->message, 0, sizeof(output->message));
+	output->message.msg_iov = output->current;
+	output->message.msg_iovlen = output->count;
+	return &output->message;
+}
 
-		char ip[INET_ADDRSTRLEN];
-		inet_ntop(AF_INET, &client.client_addr.sin_addr, ip,
-			  INET_ADDRSTRLEN);
-		fprintf(stderr, "[%s] %d %s\n", ip, response->status_code,
-			http_response_message(response->status_code));
+/**
+ * Sends as much of the output as the socket takes in one call.
+ */
+ssize_t http_output_send(http_output_t *output, socket_t socket, int flags)
+{
+	ssize_t sent;
+	do {
+		sent = sendmsg(socket, http_output_message(output),
+			       flags | MSG_NOSIGNAL);
+	} while (sent < 0 && EINTR == errno);
+
+	if (sent > 0)
+		http_output_advance(output, sent);
+	return sent;
+}
 
-		return 0;
+/**
+ * Sends the whole output on a blocking socket, retrying short writes.
+ */
+int http_output_send_all(http_output_t *output, socket_t socket, int flags)
+{
+	while (!http_output_done(output)) {
+		if (http_output_send(output, socket, flags) < 0)
+			return -1;
 	}
-	// Send body (file)
-	size_t read_size;
-	while ((read_size = fread(buffer, 1, SERVER_BUFFER_SIZE, fd)) > 0) {
-		err = send(client.socket, buffer, read_size, 0);
-		if (err < 0)
-			return err;
+	return 0;
+}
 
-		if (read_size < SERVER_BUFFER_SIZE)
-			break;
+int http_response_file_error(http_response_t *response, int error)
+{
+	// The type came from the extension table and does not describe the error
+	headers_remove_id(&response->headers, HEADER_CONTENT_TYPE);
+
+	if (ENOENT == error) {
+		http_response_prebuilt(response, 404);
+	} else {
+		http_response_status(response, 500);
 	}
 
-	fclose(fd);
+	return HTTP_ENTITY_NOT_FOUND;
+}
 
-	char ip[INET_ADDRSTRLEN];
-	inet_ntop(AF_INET, &client.client_addr.sin_addr, ip, INET_ADDRSTRLEN);
-	fprintf(stderr, "[%s] %d %s\n", ip, response->status_code,
-		http_response_message(response->status_code));
+int http_response_file_size(http_response_t *response, size_t file_size)
+{
+	char content_length[32];
+	snprintf(content_length, sizeof(content_length), "%zu", file_size);
+	if (headers_set_id(&response->headers, HEADER_ACCEPT_RANGES,
+			   "bytes") < 0)
+		return -1;
+	return headers_set_id(&response->headers, HEADER_CONTENT_LENGTH,
+			      content_length);
+}
 
-	return 0;
+/**
+ * Sets the validators of a file: Last-Modified, and an ETag made of its
+ * inode, size and mtime (and content coding, a variant is another entity).
+ */
+int http_response_validators(http_response_t *response, ino_t inode,
+			     off_t size, const struct timespec *mtime)
+{
+	char last_modified[DATE_SIZE];
+	date_format(mtime->tv_sec, last_modified);
+	if (headers_set_id(&response->headers, HEADER_LAST_MODIFIED,
+			   last_modified) < 0)
+		return -1;
+
+	const char *coding = headers_get_id(&response->headers,
+					    HEADER_CONTENT_ENCODING);
+	char etag[HTTP_ETAG_SIZE];
+	snprintf(etag, sizeof(etag), "\"%llx-%llx-%llx%s%s\"",
+		 (unsigned long long)inode, (unsigned long long)size,
+		 (unsigned long long)mtime->tv_sec * 1000000000ULL +
+		 mtime->tv_nsec, NULL != coding ? "-" : "",
+		 NULL != coding ? coding : "");
+	return headers_set_id(&response->headers, HEADER_ETAG, etag);
 }
 
-void http_response_destroy(http_response_t *response)
+bool http_request_conditional(const http_request_t *request)
 {
-	cimap_free(response->headers);
+	return (HTTP_METHOD_GET == request->method
+		|| HTTP_METHOD_HEAD == request->method)
+	    && (NULL != http_request_header_id(request, HEADER_IF_NONE_MATCH)
+		|| NULL != http_request_header_id(request,
+						  HEADER_IF_MODIFIED_SINCE));
+}
 
-	if (NULL != response->body) {
-		free(response->body);
+// Weak comparison, as If-None-Match wants it
+static bool http_etag_match(const char *list, const char *etag)
+{
+	size_t length = strlen(etag);
+	while ('\0' != *list) {
+		while (' ' == *list || '\t' == *list || ',' == *list)
+			list++;
+		if ('*' == *list)
+			return true;
+		if (strncmp(list, "W/", 2) == 0)
+			list += 2;
+		if (strncmp(list, etag, length) == 0
+		    && ('\0' == list[length] || ',' == list[length]
+			|| ' ' == list[length] || '\t' == list[length]))
+			return true;
+		while ('\0' != *list && ',' != *list)
+			list++;
 	}
+	return false;
+}
+
+/**
+ * Whether the copy the client holds is still current. If-None-Match wins
+ * over If-Modified-Since, dates that cannot be parsed are ignored.
+ */
+static bool http_request_fresh(const http_request_t *request,
+			       const http_response_t *response, time_t mtime)
+{
+	const char *none_match = http_request_header_id(request,
+							HEADER_IF_NONE_MATCH);
+	if (NULL != none_match) {
+		const char *etag = headers_get_id(&response->headers,
+						  HEADER_ETAG);
+		return NULL != etag && http_etag_match(none_match, etag);
+	}
+
+	const char *modified_since =
+	    http_request_header_id(request, HEADER_IF_MODIFIED_SINCE);
+	time_t since;
+	return NULL != modified_since && date_parse(modified_since, &since)
+	    && mtime <= since;
 }
 
-static magic_t magic_cookie = NULL;
+/**
+ * Sets the validators of a file and answers a conditional request for it
+ * with 304 Not Modified, without the representation headers. Returns true
+ * in that case.
+ */
+bool http_response_conditional(const http_request_t *request,
+			       http_response_t *response, ino_t inode,
+			       off_t size, const struct timespec *mtime)
+{
+	http_response_validators(response, inode, size, mtime);
+	if (!http_request_conditional(request)
+	    || !http_request_fresh(request, response, mtime->tv_sec))
+		return false;
+
+	http_response_status(response, 304);
+	headers_remove_id(&response->headers, HEADER_CONTENT_TYPE);
+	headers_remove_id(&response->headers, HEADER_CONTENT_ENCODING);
+	headers_remove_id(&response->headers, HEADER_CONTENT_LENGTH);
+	return true;
+}
+
+bool http_request_ranged(const http_request_t *request)
+{
+	// Other methods ignore Range, HEAD describes the whole representation
+	return HTTP_METHOD_GET == request->method
+	    && NULL != http_request_header_id(request, HEADER_RANGE);
+}
 
-int http_content_init(void)
+static bool http_range_number(const char **cursor, size_t *value)
 {
-	magic_cookie = magic_open(MAGIC_MIME | MAGIC_ERROR);
-	if (NULL == magic_cookie)
+	const char *digit = *cursor;
+	if (!isdigit((unsigned char)*digit))
+		return false;
+
+	*value = 0;
+	for (; isdigit((unsigned char)*digit); digit++) {
+		if (*value > (SIZE_MAX - 9) / 10)
+			return false;
+		*value = *value * 10 + (*digit - '0');
+	}
+	*cursor = digit;
+	return true;
+}
+
+/**
+ * Adds the range first-last to the count parts, merged with the ones it
+ * overlaps or touches, so that no byte is sent twice. Returns the new
+ * count, or -1 when HTTP_RANGES_MAX ranges apart from it are there.
+ */
+static int http_range_add(http_range_t *parts, int count, size_t first,
+			  size_t last)
+{
+	for (int i = 0; i < count; i++) {
+		size_t start = parts[i].offset;
+		size_t end = start + parts[i].length - 1;
+		if (first > end + 1 || last + 1 < start)
+			continue;
+
+		// Taken out and added again merged, it may reach others now
+		first = first < start ? first : start;
+		last = last > end ? last : end;
+		memmove(&parts[i], &parts[i + 1],
+			(count - i - 1) * sizeof(*parts));
+		count--;
+		i = -1;
+	}
+	if (HTTP_RANGES_MAX == count)
 		return -1;
 
-	if (0 != magic_load(magic_cookie, NULL))
+	parts[count].offset = first;
+	parts[count].length = last - first + 1;
+	return count + 1;
+}
+
+/**
+ * Reads a "bytes=" range set against a representation of the given size
+ * into parts, clamping the ranges to it and merging the overlapping ones.
+ * Returns the number of ranges that can be satisfied, or -1 when the
+ * header is to be ignored (another unit, invalid syntax or more than
+ * HTTP_RANGES_MAX ranges once merged).
+ */
+static int http_range_parse(const char *value, size_t size,
+			    http_range_t *parts)
+{
+	if (strncasecmp(value, "bytes=", 6) != 0)
 		return -1;
 
-	fprintf(stderr, "Info: Magic database loaded\n");
-	return 0;
+	const char *cursor = value + 6;
+	int count = 0;
+	int listed = 0;
+	while ('\0' != *cursor) {
+		while (' ' == *cursor || '\t' == *cursor || ',' == *cursor)
+			cursor++;
+		if ('\0' == *cursor)
+			break;
+		listed++;
+
+		size_t first, last;
+		if ('-' == *cursor) {
+			// The last bytes of the representation
+			cursor++;
+			size_t suffix;
+			if (!http_range_number(&cursor, &suffix))
+				return -1;
+			if (0 == suffix || 0 == size)
+				goto next;
+			first = suffix < size ? size - suffix : 0;
+			last = size - 1;
+		} else {
+			if (!http_range_number(&cursor, &first)
+			    || '-' != *cursor++)
+				return -1;
+			last = SIZE_MAX;
+			if (isdigit((unsigned char)*cursor)
+			    && !http_range_number(&cursor, &last))
+				return -1;
+			if (last < first)
+				return -1;
+			if (first >= size)
+				goto next;
+			if (last >= size)
+				last = size - 1;
+		}
+		count = http_range_add(parts, count, first, last);
+		if (count < 0)
+			return -1;
+
+ next:
+		while (' ' == *cursor || '\t' == *cursor)
+			cursor++;
+		if ('\0' != *cursor && ',' != *cursor)
+			return -1;
+	}
+	return listed > 0 ? count : -1;
 }
 
-int http_content_free(void)
+/**
+ * If-Range: the ranges only apply to the representation the client already
+ * holds part of, otherwise the whole of it is sent. Entity tags are
+ * compared strongly, dates must be the Last-Modified date as it was sent.
+ */
+static bool http_range_current(const http_request_t *request,
+			       const http_response_t *response)
 {
-	magic_close(magic_cookie);
+	const char *if_range = http_request_header_id(request,
+						      HEADER_IF_RANGE);
+	if (NULL == if_range)
+		return true;
+
+	header_id validator = '"' == if_range[0] ? HEADER_ETAG :
+	    HEADER_LAST_MODIFIED;
+	if (strncmp(if_range, "W/", 2) == 0)
+		return false;
+	const char *current = headers_get_id(&response->headers, validator);
+	return NULL != current && strcmp(if_range, current) == 0;
+}
+
+/**
+ * Applies the Range header of a GET to a representation of the given size,
+ * once its validators and Content-Length are set: the response becomes 206
+ * Partial Content, multipart/byteranges for more than one range, or 416
+ * Range Not Satisfiable when none of them can be. Returns false in the
+ * latter case, the representation is not sent then.
+ */
+bool http_response_range(const http_request_t *request,
+			 http_response_t *response, size_t size)
+{
+	http_ranges_t *ranges = &response->ranges;
+	ranges->size = size;
+	ranges->count = 0;
+	if (!http_request_ranged(request)
+	    || !http_range_current(request, response))
+		return true;
+
+	int count = http_range_parse(http_request_header_id(request,
+							    HEADER_RANGE),
+				     size, ranges->parts);
+	if (count < 0)
+		return true;
+
+	char value[HTTP_PART_SIZE];
+	if (0 == count) {
+		http_response_status(response, 416);
+		headers_remove_id(&response->headers, HEADER_CONTENT_TYPE);
+		headers_remove_id(&response->headers, HEADER_CONTENT_ENCODING);
+		headers_remove_id(&response->headers, HEADER_CONTENT_LENGTH);
+		snprintf(value, sizeof(value), "bytes */%zu", size);
+		headers_set_id(&response->headers, HEADER_CONTENT_RANGE, value);
+		return false;
+	}
+
+	size_t length = 0;
+	if (1 == count) {
+		const http_range_t *part = &ranges->parts[0];
+		snprintf(value, sizeof(value), "bytes %lld-%lld/%zu",
+			 (long long)part->offset,
+			 (long long)(part->offset + part->length - 1), size);
+		headers_set_id(&response->headers, HEADER_CONTENT_RANGE, value);
+		length = part->length;
+	} else {
+		// Every part repeats the type, the head announces the parts
+		const char *type = headers_get_id(&response->headers,
+						  HEADER_CONTENT_TYPE);
+		if (NULL == type)
+			type = "application/octet-stream";
+		size_t type_length = strlen(type);
+		ranges->type = response->arena ?
+		    arena_alloc(response->arena, type_length + 1) :
+		    malloc(type_length + 1);
+		if (NULL == ranges->type)
+			return true;
+		memcpy(ranges->type, type, type_length + 1);
+
+		ranges->count = count;
+		for (size_t i = 0; i <= ranges->count; i++) {
+			int part_length = http_part_head(ranges, i, value,
+							 sizeof(value));
+			if (part_length < 0) {
+				ranges->count = 0;
+				return true;	// Type too long, send it all
+			}
+			length += part_length;
+			if (i < ranges->count)
+				length += ranges->parts[i].length;
+		}
+		headers_set_id(&response->headers, HEADER_CONTENT_TYPE,
+			       "multipart/byteranges; boundary=" HTTP_BOUNDARY);
+	}
+
+	ranges->count = count;
+	http_response_status(response, 206);
+	snprintf(value, sizeof(value), "%zu", length);
+	headers_set_id(&response->headers, HEADER_CONTENT_LENGTH, value);
+	return true;
+}
+
+/**
+ * Loads the headers of a cached head into the response, so that another
+ * head can be built around ranges of the cached body.
+ */
+int http_response_restore(http_response_t *response)
+{
+	char head[SERVER_BUFFER_SIZE];
+	size_t length = response->cached->head_length;
+	if (length >= sizeof(head))
+		return -1;
+	memcpy(head, cache_head(response->cached), length);
+	head[length] = '\0';
+
+	// The status line is the response's own
+	char *line = strstr(head, EOL);
+	while (NULL != line && '\0' != line[2]) {
+		line += 2;
+		char *end = strstr(line, EOL);
+		char *colon = strchr(line, ':');
+		if (NULL == end || NULL == colon || colon > end)
+			return -1;
+		*end = '\0';
+		*colon = '\0';
+		char *value = colon + 1;
+		while (' ' == *value)
+			value++;
+		if (headers_set(&response->headers, line, value) < 0)
+			return -1;
+		line = end;
+	}
 	return 0;
 }
 
-const char *http_content_get_override(const char *file_name)
+int http_response_file(const http_request_t *request,
+		       http_response_t *response, const char *file_name,
+		       int *file, size_t *file_size)
 {
-	const char *extension = strrchr(file_name, '.');
-	if (NULL == extension)
-		return NULL;
+	*file = open(file_name, O_RDONLY | O_NONBLOCK);
+	if (*file < 0)
+		return http_response_file_error(response, errno);
+
+	struct stat file_stat;
+	if (fstat(*file, &file_stat) < 0 || !S_ISREG(file_stat.st_mode)) {
+		close(*file);
+		*file = -1;
+		http_response_status(response, 500);
+		return -1;
+	}
+	*file_size = file_stat.st_size;
+
+	// The client's copy is current, the file is not needed
+	if (http_response_conditional(request, response, file_stat.st_ino,
+				      file_stat.st_size,
+				      &file_stat.st_mtim)) {
+		close(*file);
+		*file = -1;
+		return 0;
+	}
 
-	if (strcmp(extension, ".css") == 0)
-		return "text/css";
-	if (strcmp(extension, ".js") == 0)
-		return "application/javascript";
-	if (strcmp(extension, ".json") == 0)
-		return "application/json";
-	if (strcmp(extension, ".xml") == 0)
-		return "application/xml";
-	if (strcmp(extension, ".md") == 0)
-		return "text/markdown";
+	if (http_response_file_size(response, *file_size) < 0)
+		return -1;
 
-	return NULL;
+	// Nothing of the file can be sent
+	if (!http_response_range(request, response, *file_size)) {
+		close(*file);
+		*file = -1;
+	}
+	return 0;
 }
 
-int http_content_get(const char *file_name, char **content_type)
+/**
+ * Moves the file to the socket through a pipe. When the socket stops
+ * taking data, the bytes left in the pipe are given back to the file
+ * offset, so that the caller sends them again.
+ */
+static ssize_t http_splice(socket_t socket, int file, off_t *offset,
+			   size_t count)
 {
-	if (NULL == magic_cookie) {
-		fprintf(stderr, "Error: %s", magic_error(magic_cookie));
+	int pipes[2];
+	if (pipe(pipes) < 0)
 		return -1;
+
+	ssize_t total = 0;
+	while ((size_t)total < count) {
+		ssize_t filled = splice(file, offset, pipes[1], NULL,
+					count - total,
+					SPLICE_F_MOVE | SPLICE_F_MORE);
+		if (filled <= 0) {
+			if (filled < 0 && EINTR == errno)
+				continue;
+			break;
+		}
+
+		while (filled > 0) {
+			ssize_t drained = splice(pipes[0], NULL, socket, NULL,
+						 filled,
+						 SPLICE_F_MOVE | SPLICE_F_MORE);
+			if (drained < 0) {
+				if (EINTR == errno)
+					continue;
+				// What is left in the pipe is read again next time
+				int saved = errno;
+				*offset -= filled;
+				close(pipes[0]);
+				close(pipes[1]);
+				errno = saved;
+				return total > 0 ? total : -1;
+			}
+			filled -= drained;
+			total += drained;
+		}
 	}
 
-	const char *mime_type = magic_file(magic_cookie, file_name);
-	if (NULL == mime_type) {
-		return HTTP_ENTITY_NOT_FOUND;
+	close(pipes[0]);
+	close(pipes[1]);
+	return total;
+}
+
+ssize_t http_sendfile(socket_t socket, int file, off_t *offset, size_t count)
+{
+	ssize_t sent;
+	do {
+		sent = sendfile(socket, file, offset, count);
+	} while (sent < 0 && EINTR == errno);
+
+	// Some files (e.g. on FUSE or /proc) cannot be sendfile()d
+	if (sent < 0 && (EINVAL == errno || ENOSYS == errno))
+		return http_splice(socket, file, offset, count);
+
+	return sent;
+}
+
+/**
+ * Sends a large in-memory buffer with MSG_ZEROCOPY, then waits for the
+ * kernel to release the pages so that the caller may free the buffer.
+ * Falls back to regular sends when the socket does not support it.
+ */
+static int http_send_zerocopy(socket_t socket, const char *buffer,
+			      size_t length)
+{
+	int zerocopy =
+	    setsockopt(socket, SOL_SOCKET, SO_ZEROCOPY, &(int) { 1 },
+		       sizeof(int)) == 0;
+
+	unsigned int calls = 0;
+	size_t sent = 0;
+	while (sent < length) {
+		ssize_t write_size =
+		    send(socket, buffer + sent, length - sent,
+			 zerocopy ? MSG_ZEROCOPY : 0);
+		if (write_size < 0) {
+			if (EINTR == errno)
+				continue;
+			if (ENOBUFS == errno && zerocopy) {
+				zerocopy = 0;	// Out of optmem, copy instead
+				continue;
+			}
+			return -1;
+		}
+		if (zerocopy)
+			calls++;
+		sent += write_size;
+	}
+
+	// A client that stops reading holds the pages: wait no longer than a
+	// send would, that is the send timeout of the socket
+	int wait = -1;
+	struct timeval timeout;
+	socklen_t timeout_length = sizeof(timeout);
+	if (calls > 0
+	    && getsockopt(socket, SOL_SOCKET, SO_SNDTIMEO, &timeout,
+			  &timeout_length) == 0
+	    && (timeout.tv_sec > 0 || timeout.tv_usec > 0))
+		wait = timeout.tv_sec * 1000 + timeout.tv_usec / 1000;
+
+	// Each notification acknowledges a range of zerocopy send() calls
+	unsigned int completed = 0;
+	while (completed < calls) {
+		struct pollfd pollfd = {.fd = socket,.events = 0 };
+		int ready = poll(&pollfd, 1, wait);
+		if (ready == 0) {
+			errno = ETIMEDOUT;
+			return -1;
+		}
+		if (ready < 0 && EINTR != errno)
+			return -1;
+
+		char control[CMSG_SPACE(sizeof(struct sock_extended_err))];
+		struct msghdr message = {
+			.msg_control = control,
+			.msg_controllen = sizeof(control),
+		};
+		if (recvmsg(socket, &message, MSG_ERRQUEUE) < 0) {
+			if (EAGAIN == errno || EINTR == errno)
+				continue;
+			return -1;
+		}
+
+		struct cmsghdr *cmsg = CMSG_FIRSTHDR(&message);
+		if (NULL == cmsg)
+			continue;
+		struct sock_extended_err *error =
+		    (struct sock_extended_err *)CMSG_DATA(cmsg);
+		if (SO_EE_ORIGIN_ZEROCOPY == error->ee_origin)
+			completed += error->ee_data - error->ee_info + 1;
 	}
-	if (strcmp(mime_type, "text/plain") == 0) {
-		const char *mime_type_override =
-		    http_content_get_override(file_name);
-		if (NULL != mime_type_override)
-			mime_type = mime_type_override;
+
+	return 0;
+}
+
+int http_response_send(const client_t client, const http_request_t *request,
+		       http_response_t *response)
+{
+	http_output_t output;
+	int err = http_output_prepare(&output, request, response, false);
+	if (err < 0)
+		return err;
+
+	int more = response->more ? MSG_MORE : 0;
+
+	// Large bodies are sent without copying them into the socket buffer
+	if (output.iov[3].iov_len >= HTTP_ZEROCOPY_THRESHOLD) {
+		output.count = 3;
+		err = http_output_send_all(&output, client.socket, MSG_MORE);
+		if (err < 0)
+			return err;
+
+		err = http_send_zerocopy(client.socket, output.iov[3].iov_base,
+					 output.iov[3].iov_len);
+	} else {
+		// Head and body leave in a single system call
+		err = http_output_send_all(&output, client.socket, more);
 	}
+	if (err < 0)
+		return err;
 
-	strcpy(*content_type, mime_type);
-	(*content_type)[strlen(mime_type)] = '\0';
+	// The other parts of a multipart response, cut from the same body
+	while (http_output_next(&output, response)) {
+		err = http_output_send_all(&output, client.socket, more);
+		if (err < 0)
+			return err;
+	}
+
+	response->sent = output.length;
+	response->body_sent = output.length - output.head_length;
+
+	return 0;
+}
+
+int http_response_send_file(const client_t client,
+			    const http_request_t *request,
+			    http_response_t *response, const char *file_name)
+{
+	int fd;
+	size_t file_size;
+	if (http_response_file(request, response, file_name, &fd,
+			       &file_size) < 0 || fd < 0)
+		return http_response_send(client, request, response);
+	trace_mark(response->trace, TRACE_OPENED);
+
+	if (request->method == HTTP_METHOD_HEAD) {
+		close(fd);
+		return http_response_send(client, request, response);
+	}
+
+	http_output_t output;
+	int err = http_output_prepare(&output, request, response, true);
+	if (err < 0) {
+		close(fd);
+		return err;
+	}
+
+	// Each part of a multipart response is a header, then a slice of the file
+	bool head_sent = false;
+	size_t slice_sent;
+	do {
+		// Corked, so that the head goes out with the first file bytes
+		int more = output.file_length > 0 || response->more ?
+		    MSG_MORE : 0;
+		err = http_output_send_all(&output, client.socket, more);
+		if (err < 0) {
+			close(fd);
+			return err;
+		}
+		if (!head_sent)
+			trace_mark(response->trace, TRACE_HEAD_SENT);
+		head_sent = true;
+
+		// Send body (file) straight from the page cache
+		off_t offset = output.file_offset;
+		off_t end = output.file_offset + output.file_length;
+		while (offset < end) {
+			ssize_t sent = http_sendfile(client.socket, fd, &offset,
+						     end - offset);
+			// Truncated while sending, the announced length is a lie
+			if (sent <= 0) {
+				close(fd);
+				return sent < 0 ? sent : -1;
+			}
+		}
+		slice_sent = offset - output.file_offset;
+	} while (http_output_next(&output, response));
+
+	close(fd);
+
+	response->sent = output.length + slice_sent;
+	response->body_sent = response->sent - output.head_length;
+
+	return 0;
+}
+
+void http_response_destroy(http_response_t *response)
+{
+	headers_free(&response->headers);
+
+	if (NULL != response->cached) {
+		cache_release(response->cached);
+		response->cached = NULL;
+	}
+
+	if (NULL != response->body && NULL == response->arena)
+		free(response->body);
+	response->body = NULL;
+
+	if (NULL != response->ranges.type && NULL == response->arena)
+		free(response->ranges.type);
+	response->ranges.type = NULL;
+}
+
+int http_content_init(const char *mime_types)
+{
+	if (encoding_init() < 0)
+		return -1;
+	return mime_init(mime_types);
+}
+
+int http_content_free(void)
+{
+	mime_free();
+	encoding_free();
+	return 0;
+}
+
+int http_content_get(const char *file_name, char **content_type)
+{
+	const char *mime_type = mime_lookup(file_name);
+	if (NULL != mime_type) {
+		snprintf(*content_type, SERVER_BUFFER_SIZE, "%s", mime_type);
+		return 0;
+	}
+
+	// Unknown extension, let libmagic look at the content
+	int err = mime_sniff(file_name, *content_type, SERVER_BUFFER_SIZE);
+	if (MIME_NOT_FOUND == err)
+		return HTTP_ENTITY_NOT_FOUND;
+	if (err < 0)
+		return -1;
 
 	return 0;
 }
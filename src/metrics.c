@@ -0,0 +1,488 @@
+#define _GNU_SOURCE
+
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <stdarg.h>
+#include <stdbool.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <sys/socket.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "metrics.h"
+
+static metrics_t *metrics = NULL;
+static metrics_shard_t *metrics_current = NULL;
+
+// Upper bounds of the duration buckets, in microseconds
+static const uint64_t metrics_bounds[METRICS_BUCKETS] = {
+	100, 250, 500, 1000, 2500, 5000, 10000, 25000, 50000, 100000,
+	250000, 500000, 1000000, 2500000, 5000000, 10000000,
+};
+
+static const char *metrics_methods[METRICS_METHODS] = {
+	"other", "GET", "HEAD", "POST",
+};
+
+typedef struct metrics_output_t {
+	char *buffer;
+	size_t size;
+	size_t length;
+	int overflow;
+} metrics_output_t;
+
+static size_t metrics_align(size_t size)
+{
+	return (size + 63) & ~(size_t)63;
+}
+
+static metrics_shard_t *metrics_shard(int index)
+{
+	return (metrics_shard_t *) ((char *)metrics +
+				    metrics_align(sizeof(metrics_t)) +
+				    (size_t)index * metrics->shard_size);
+}
+
+static void metrics_add(uint64_t *counter, uint64_t value)
+{
+	__atomic_fetch_add(counter, value, __ATOMIC_RELAXED);
+}
+
+static uint64_t metrics_load(const uint64_t *counter)
+{
+	return __atomic_load_n(counter, __ATOMIC_RELAXED);
+}
+
+int metrics_init(int workers)
+{
+	int shard_count = workers > 0 ? workers : 1;
+	size_t shard_size = metrics_align(sizeof(metrics_shard_t));
+	size_t mapping_size = metrics_align(sizeof(metrics_t)) +
+	    (size_t)shard_count * shard_size;
+
+	// Zero-filled, so every counter starts at 0
+	void *mapping = mmap(NULL, mapping_size, PROT_READ | PROT_WRITE,
+			     MAP_SHARED | MAP_ANONYMOUS, -1, 0);
+	if (MAP_FAILED == mapping)
+		return -1;
+
+	metrics = mapping;
+	metrics->shard_count = shard_count;
+	metrics->shard_size = shard_size;
+	metrics->started_at = time(NULL);
+	metrics->mapping_size = mapping_size;
+
+	metrics_current = metrics_shard(0);
+	metrics_current->pid = getpid();
+	return 0;
+}
+
+/**
+ * Called by a worker right after it was forked: from then on it only
+ * writes to the shard of its index. A respawned worker takes over the
+ * counters of the worker it replaces, so they never go backwards.
+ */
+void metrics_worker(int index)
+{
+	if (NULL == metrics || index < 0 || index >= metrics->shard_count)
+		return;
+
+	metrics_current = metrics_shard(index);
+	__atomic_store_n(&metrics_current->pid, getpid(), __ATOMIC_RELAXED);
+}
+
+uint64_t metrics_now(void)
+{
+	struct timespec now;
+	clock_gettime(CLOCK_MONOTONIC, &now);
+	return (uint64_t)now.tv_sec * 1000000000 + now.tv_nsec;
+}
+
+void metrics_connection_open(void)
+{
+	if (NULL == metrics_current)
+		return;
+
+	__atomic_fetch_add(&metrics_current->connections_active, 1,
+			   __ATOMIC_RELAXED);
+	metrics_add(&metrics_current->connections_total, 1);
+}
+
+void metrics_connection_close(void)
+{
+	if (NULL == metrics_current)
+		return;
+
+	__atomic_fetch_sub(&metrics_current->connections_active, 1,
+			   __ATOMIC_RELAXED);
+}
+
+void metrics_connection_shed(void)
+{
+	if (NULL != metrics_current)
+		metrics_add(&metrics_current->connections_shed, 1);
+}
+
+void metrics_accept_error(void)
+{
+	if (NULL != metrics_current)
+		metrics_add(&metrics_current->accept_errors, 1);
+}
+
+void metrics_request(int method, int status_code, size_t bytes,
+		     uint64_t started)
+{
+	if (NULL == metrics_current)
+		return;
+
+	if (method < 0 || method >= METRICS_METHODS)
+		method = 0;
+	int status_class = status_code / 100 - 1;
+	if (status_class < 0 || status_class >= METRICS_STATUS_CLASSES)
+		status_class = METRICS_STATUS_CLASSES - 1;
+
+	uint64_t duration = (metrics_now() - started) / 1000;
+	int bucket = 0;
+	while (bucket < METRICS_BUCKETS && duration > metrics_bounds[bucket])
+		bucket++;
+
+	metrics_add(&metrics_current->requests[method][status_class], 1);
+	metrics_add(&metrics_current->bytes_sent, bytes);
+	metrics_add(&metrics_current->duration_buckets[bucket], 1);
+	metrics_add(&metrics_current->duration_sum, duration);
+}
+
+size_t metrics_render_size(void)
+{
+	int shard_count = NULL != metrics ? metrics->shard_count : 1;
+	return METRICS_RENDER_SIZE + (size_t)shard_count * METRICS_RENDER_WORKER;
+}
+
+__attribute__((format(printf, 2, 3)))
+static void metrics_printf(metrics_output_t *output, const char *format, ...)
+{
+	if (output->overflow)
+		return;
+
+	va_list arguments;
+	va_start(arguments, format);
+	int length = vsnprintf(output->buffer + output->length,
+			       output->size - output->length, format,
+			       arguments);
+	va_end(arguments);
+
+	if (length < 0 || (size_t)length >= output->size - output->length) {
+		output->overflow = 1;
+		return;
+	}
+	output->length += length;
+}
+
+/**
+ * Overflows of the accept queues (SYNs or handshakes dropped because the
+ * application did not accept fast enough) are only counted by the kernel,
+ * for the whole system.
+ */
+static int metrics_listen_overflows(uint64_t *overflows, uint64_t *drops)
+{
+	FILE *file = fopen("/proc/net/netstat", "r");
+	if (NULL == file)
+		return -1;
+
+	char names[4096];
+	char values[4096];
+	int err = -1;
+	while (fgets(names, sizeof(names), file)
+	       && fgets(values, sizeof(values), file)) {
+		if (strncmp(names, "TcpExt:", 7) != 0)
+			continue;
+
+		char *name_save = NULL;
+		char *value_save = NULL;
+		char *name = strtok_r(names, " \n", &name_save);
+		char *value = strtok_r(values, " \n", &value_save);
+		while (NULL != name && NULL != value) {
+			if (strcmp(name, "ListenOverflows") == 0)
+				*overflows = strtoull(value, NULL, 10);
+			else if (strcmp(name, "ListenDrops") == 0)
+				*drops = strtoull(value, NULL, 10);
+			name = strtok_r(NULL, " \n", &name_save);
+			value = strtok_r(NULL, " \n", &value_save);
+		}
+		err = 0;
+		break;
+	}
+
+	fclose(file);
+	return err;
+}
+
+typedef struct metrics_totals_t {
+	uint64_t requests[METRICS_METHODS][METRICS_STATUS_CLASSES];
+	uint64_t requests_total;
+	uint64_t bytes_sent;
+	int64_t connections_active;
+	uint64_t connections_total;
+	uint64_t connections_shed;
+	uint64_t accept_errors;
+	uint64_t duration_buckets[METRICS_BUCKETS + 1];
+	uint64_t duration_sum;
+} metrics_totals_t;
+
+static uint64_t metrics_shard_requests(const metrics_shard_t *shard)
+{
+	uint64_t requests = 0;
+	for (int m = 0; m < METRICS_METHODS; m++)
+		for (int s = 0; s < METRICS_STATUS_CLASSES; s++)
+			requests += metrics_load(&shard->requests[m][s]);
+	return requests;
+}
+
+static void metrics_sum(metrics_totals_t *totals)
+{
+	memset(totals, 0, sizeof(*totals));
+	for (int i = 0; i < metrics->shard_count; i++) {
+		const metrics_shard_t *shard = metrics_shard(i);
+		for (int m = 0; m < METRICS_METHODS; m++) {
+			for (int s = 0; s < METRICS_STATUS_CLASSES; s++) {
+				uint64_t count =
+				    metrics_load(&shard->requests[m][s]);
+				totals->requests[m][s] += count;
+				totals->requests_total += count;
+			}
+		}
+		totals->bytes_sent += metrics_load(&shard->bytes_sent);
+		totals->connections_active +=
+		    __atomic_load_n(&shard->connections_active,
+				    __ATOMIC_RELAXED);
+		totals->connections_total +=
+		    metrics_load(&shard->connections_total);
+		totals->connections_shed +=
+		    metrics_load(&shard->connections_shed);
+		totals->accept_errors += metrics_load(&shard->accept_errors);
+		for (int b = 0; b <= METRICS_BUCKETS; b++)
+			totals->duration_buckets[b] +=
+			    metrics_load(&shard->duration_buckets[b]);
+		totals->duration_sum += metrics_load(&shard->duration_sum);
+	}
+}
+
+static void metrics_render_text(metrics_output_t *output,
+				 const metrics_totals_t *totals,
+				 const struct tcp_info *listen, bool has_listen,
+				 uint64_t overflows, uint64_t drops)
+{
+	time_t uptime = time(NULL) - metrics->started_at;
+
+	metrics_printf(output, "Uptime: %lds\n", (long)uptime);
+	metrics_printf(output, "Requests: %llu\n",
+		       (unsigned long long)totals->requests_total);
+	metrics_printf(output, "Bytes sent: %llu\n",
+		       (unsigned long long)totals->bytes_sent);
+	metrics_printf(output, "Active connections: %lld\n",
+		       (long long)totals->connections_active);
+	metrics_printf(output, "Accepted connections: %llu\n",
+		       (unsigned long long)totals->connections_total);
+	metrics_printf(output, "Shed connections: %llu\n",
+		       (unsigned long long)totals->connections_shed);
+	metrics_printf(output, "Accept errors: %llu\n",
+		       (unsigned long long)totals->accept_errors);
+	if (has_listen)
+		metrics_printf(output, "Accept queue: %u/%u\n",
+			       listen->tcpi_unacked, listen->tcpi_sacked);
+	metrics_printf(output, "Listen overflows (system): %llu\n",
+		       (unsigned long long)overflows);
+	metrics_printf(output, "Listen drops (system): %llu\n",
+		       (unsigned long long)drops);
+
+	metrics_printf(output, "\n%-8s %12s %12s %12s %12s %12s\n", "Method",
+		       "1xx", "2xx", "3xx", "4xx", "5xx");
+	for (int m = 0; m < METRICS_METHODS; m++) {
+		metrics_printf(output, "%-8s", metrics_methods[m]);
+		for (int s = 0; s < METRICS_STATUS_CLASSES; s++)
+			metrics_printf(output, " %12llu",
+				       (unsigned long long)totals->
+				       requests[m][s]);
+		metrics_printf(output, "\n");
+	}
+
+	metrics_printf(output, "\nRequest duration\n");
+	for (int b = 0; b <= METRICS_BUCKETS; b++) {
+		if (b < METRICS_BUCKETS)
+			metrics_printf(output, "  <= %8.2fms %12llu\n",
+				       metrics_bounds[b] / 1000.0,
+				       (unsigned long long)totals->
+				       duration_buckets[b]);
+		else
+			metrics_printf(output, "   > %8.2fms %12llu\n",
+				       metrics_bounds[b - 1] / 1000.0,
+				       (unsigned long long)totals->
+				       duration_buckets[b]);
+	}
+	if (totals->requests_total > 0)
+		metrics_printf(output, "  mean %.3fms\n",
+			       (double)totals->duration_sum /
+			       totals->requests_total / 1000.0);
+
+	metrics_printf(output, "\n%-8s %8s %12s %12s %8s\n", "Worker", "PID",
+		       "Requests", "Bytes", "Active");
+	for (int i = 0; i < metrics->shard_count; i++) {
+		const metrics_shard_t *shard = metrics_shard(i);
+		metrics_printf(output, "%-8d %8d %12llu %12llu %8lld\n", i,
+			       (int)__atomic_load_n(&shard->pid,
+						    __ATOMIC_RELAXED),
+			       (unsigned long long)
+			       metrics_shard_requests(shard),
+			       (unsigned long long)
+			       metrics_load(&shard->bytes_sent),
+			       (long long)
+			       __atomic_load_n(&shard->connections_active,
+					       __ATOMIC_RELAXED));
+	}
+}
+
+static void metrics_render_prometheus(metrics_output_t *output,
+				      const metrics_totals_t *totals,
+				      const struct tcp_info *listen,
+				      bool has_listen, uint64_t overflows,
+				      uint64_t drops)
+{
+	metrics_printf(output,
+		       "# HELP simplehttp_uptime_seconds Time since the server started.\n"
+		       "# TYPE simplehttp_uptime_seconds gauge\n"
+		       "simplehttp_uptime_seconds %ld\n",
+		       (long)(time(NULL) - metrics->started_at));
+
+	metrics_printf(output,
+		       "# HELP simplehttp_requests_total Requests answered, by method and status class.\n"
+		       "# TYPE simplehttp_requests_total counter\n");
+	for (int m = 0; m < METRICS_METHODS; m++)
+		for (int s = 0; s < METRICS_STATUS_CLASSES; s++)
+			metrics_printf(output,
+				       "simplehttp_requests_total{method=\"%s\",code=\"%dxx\"} %llu\n",
+				       metrics_methods[m], s + 1,
+				       (unsigned long long)totals->
+				       requests[m][s]);
+
+	metrics_printf(output,
+		       "# HELP simplehttp_sent_bytes_total Response bytes handed to the kernel.\n"
+		       "# TYPE simplehttp_sent_bytes_total counter\n"
+		       "simplehttp_sent_bytes_total %llu\n",
+		       (unsigned long long)totals->bytes_sent);
+	metrics_printf(output,
+		       "# HELP simplehttp_connections_active Open client connections.\n"
+		       "# TYPE simplehttp_connections_active gauge\n"
+		       "simplehttp_connections_active %lld\n",
+		       (long long)totals->connections_active);
+	metrics_printf(output,
+		       "# HELP simplehttp_connections_total Accepted client connections.\n"
+		       "# TYPE simplehttp_connections_total counter\n"
+		       "simplehttp_connections_total %llu\n",
+		       (unsigned long long)totals->connections_total);
+	metrics_printf(output,
+		       "# HELP simplehttp_connections_shed_total Connections answered 503 and closed by admission control.\n"
+		       "# TYPE simplehttp_connections_shed_total counter\n"
+		       "simplehttp_connections_shed_total %llu\n",
+		       (unsigned long long)totals->connections_shed);
+	metrics_printf(output,
+		       "# HELP simplehttp_accept_errors_total Failed accept() calls, other than a missing connection.\n"
+		       "# TYPE simplehttp_accept_errors_total counter\n"
+		       "simplehttp_accept_errors_total %llu\n",
+		       (unsigned long long)totals->accept_errors);
+	if (has_listen)
+		metrics_printf(output,
+			       "# HELP simplehttp_accept_queue_length Connections waiting to be accepted on the listener that served this page.\n"
+			       "# TYPE simplehttp_accept_queue_length gauge\n"
+			       "simplehttp_accept_queue_length %u\n"
+			       "# HELP simplehttp_accept_queue_limit Backlog of that listener.\n"
+			       "# TYPE simplehttp_accept_queue_limit gauge\n"
+			       "simplehttp_accept_queue_limit %u\n",
+			       listen->tcpi_unacked, listen->tcpi_sacked);
+	metrics_printf(output,
+		       "# HELP simplehttp_listen_overflows_total Accept queue overflows of the whole system.\n"
+		       "# TYPE simplehttp_listen_overflows_total counter\n"
+		       "simplehttp_listen_overflows_total %llu\n"
+		       "# HELP simplehttp_listen_drops_total Connections dropped by listeners of the whole system.\n"
+		       "# TYPE simplehttp_listen_drops_total counter\n"
+		       "simplehttp_listen_drops_total %llu\n",
+		       (unsigned long long)overflows,
+		       (unsigned long long)drops);
+
+	metrics_printf(output,
+		       "# HELP simplehttp_request_duration_seconds Time from the complete request head to the last response byte.\n"
+		       "# TYPE simplehttp_request_duration_seconds histogram\n");
+	uint64_t cumulative = 0;
+	for (int b = 0; b < METRICS_BUCKETS; b++) {
+		cumulative += totals->duration_buckets[b];
+		metrics_printf(output,
+			       "simplehttp_request_duration_seconds_bucket{le=\"%g\"} %llu\n",
+			       metrics_bounds[b] / 1e6,
+			       (unsigned long long)cumulative);
+	}
+	cumulative += totals->duration_buckets[METRICS_BUCKETS];
+	metrics_printf(output,
+		       "simplehttp_request_duration_seconds_bucket{le=\"+Inf\"} %llu\n"
+		       "simplehttp_request_duration_seconds_sum %.6f\n"
+		       "simplehttp_request_duration_seconds_count %llu\n",
+		       (unsigned long long)cumulative,
+		       totals->duration_sum / 1e6,
+		       (unsigned long long)cumulative);
+
+	metrics_printf(output,
+		       "# HELP simplehttp_worker_requests_total Requests answered by each worker.\n"
+		       "# TYPE simplehttp_worker_requests_total counter\n");
+	for (int i = 0; i < metrics->shard_count; i++)
+		metrics_printf(output,
+			       "simplehttp_worker_requests_total{worker=\"%d\"} %llu\n",
+			       i, (unsigned long long)
+			       metrics_shard_requests(metrics_shard(i)));
+}
+
+/**
+ * Renders the status page into the buffer. Returns its length, or a
+ * negative value when the registry is missing or the buffer is too small.
+ */
+int metrics_render(char *buffer, size_t size, metrics_format format,
+		   socket_t listener)
+{
+	if (NULL == metrics)
+		return -1;
+
+	metrics_totals_t totals;
+	metrics_sum(&totals);
+
+	struct tcp_info listen;
+	socklen_t length = sizeof(listen);
+	bool has_listen = getsockopt(listener, IPPROTO_TCP, TCP_INFO, &listen,
+				     &length) == 0;
+
+	uint64_t overflows = 0;
+	uint64_t drops = 0;
+	metrics_listen_overflows(&overflows, &drops);
+
+	metrics_output_t output = {.buffer = buffer,.size = size,.length =
+		    0,.overflow = 0
+	};
+	if (METRICS_FORMAT_PROMETHEUS == format)
+		metrics_render_prometheus(&output, &totals, &listen,
+					  has_listen, overflows, drops);
+	else
+		metrics_render_text(&output, &totals, &listen, has_listen,
+				    overflows, drops);
+
+	return output.overflow ? -1 : (int)output.length;
+}
+
+int metrics_free(void)
+{
+	if (NULL == metrics)
+		return 0;
+
+	int err = munmap(metrics, metrics->mapping_size);
+	metrics = NULL;
+	metrics_current = NULL;
+	return err;
+}
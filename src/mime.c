@@ -0,0 +1,295 @@
+#define _GNU_SOURCE
+
+#include <ctype.h>
+#include <errno.h>
+#include <magic.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/stat.h>
+
+#include "mime.h"
+#include "utils.h"
+
+// Used when the mime.types file is missing or does not list an extension
+static const char *mime_defaults[][2] = {
+	{"html", "text/html"},
+	{"htm", "text/html"},
+	{"css", "text/css"},
+	{"js", "application/javascript"},
+	{"mjs", "application/javascript"},
+	{"json", "application/json"},
+	{"xml", "application/xml"},
+	{"txt", "text/plain"},
+	{"md", "text/markdown"},
+	{"csv", "text/csv"},
+	{"svg", "image/svg+xml"},
+	{"png", "image/png"},
+	{"jpg", "image/jpeg"},
+	{"jpeg", "image/jpeg"},
+	{"gif", "image/gif"},
+	{"webp", "image/webp"},
+	{"ico", "image/x-icon"},
+	{"woff", "font/woff"},
+	{"woff2", "font/woff2"},
+	{"pdf", "application/pdf"},
+	{"wasm", "application/wasm"},
+};
+
+static mime_entry_t *mime_entries = NULL;
+static size_t mime_entry_count = 0;
+static size_t mime_entry_capacity = 0;
+
+static char **mime_types = NULL;
+static size_t mime_type_count = 0;
+static size_t mime_type_capacity = 0;
+
+static magic_t mime_magic = NULL;
+static bool mime_magic_failed = false;
+static mime_sniff_t *mime_sniffed = NULL;
+
+static const char *mime_type_add(const char *type)
+{
+	if (mime_type_count == mime_type_capacity) {
+		size_t capacity =
+		    mime_type_capacity ? mime_type_capacity * 2 : 64;
+		char **types = realloc(mime_types, capacity * sizeof(char *));
+		if (NULL == types)
+			return NULL;
+		mime_types = types;
+		mime_type_capacity = capacity;
+	}
+
+	char *copy = strdup(type);
+	if (NULL == copy)
+		return NULL;
+	mime_types[mime_type_count++] = copy;
+	return copy;
+}
+
+static int mime_entry_add(const char *extension, const char *type)
+{
+	size_t length = strlen(extension);
+	if (0 == length || length >= MIME_EXTENSION_SIZE)
+		return MIME_OK;	// Cannot match a lookup anyway
+
+	if (mime_entry_count == mime_entry_capacity) {
+		size_t capacity =
+		    mime_entry_capacity ? mime_entry_capacity * 2 : 256;
+		mime_entry_t *entries =
+		    realloc(mime_entries, capacity * sizeof(mime_entry_t));
+		if (NULL == entries)
+			return MIME_MEMORY_ERROR;
+		mime_entries = entries;
+		mime_entry_capacity = capacity;
+	}
+
+	mime_entry_t *entry = &mime_entries[mime_entry_count];
+	for (size_t i = 0; i <= length; i++)
+		entry->extension[i] = tolower((unsigned char)extension[i]);
+	entry->type = type;
+	entry->order = mime_entry_count++;
+	return MIME_OK;
+}
+
+static int mime_load(const char *path)
+{
+	FILE *file = fopen(path, "r");
+	if (NULL == file)
+		return -1;
+
+	char *line = NULL;
+	size_t memsize = 0;
+	size_t length;
+	while ((length = fgetline(&line, &memsize, file)) > 0) {
+		if ((size_t)-1 == length)
+			break;
+
+		char *save = NULL;
+		char *type = strtok_r(line, " \t\r\n", &save);
+		if (NULL == type || '#' == type[0])
+			continue;
+
+		char *extension = strtok_r(NULL, " \t\r\n", &save);
+		if (NULL == extension)
+			continue;
+
+		const char *shared = mime_type_add(type);
+		if (NULL == shared)
+			break;
+
+		for (; NULL != extension;
+		     extension = strtok_r(NULL, " \t\r\n", &save)) {
+			if (mime_entry_add(extension, shared) != MIME_OK)
+				break;
+		}
+	}
+	free(line);
+	fclose(file);
+	return 0;
+}
+
+static int mime_entry_compare(const void *a, const void *b)
+{
+	const mime_entry_t *x = a;
+	const mime_entry_t *y = b;
+	int cmp = strcmp(x->extension, y->extension);
+	if (0 != cmp)
+		return cmp;
+	return (x->order > y->order) - (x->order < y->order);
+}
+
+static int mime_extension_compare(const void *key, const void *member)
+{
+	const mime_entry_t *entry = member;
+	return strcmp(key, entry->extension);
+}
+
+int mime_init(const char *path)
+{
+	size_t count = sizeof(mime_defaults) / sizeof(mime_defaults[0]);
+	for (size_t i = 0; i < count; i++) {
+		const char *type = mime_type_add(mime_defaults[i][1]);
+		if (NULL == type
+		    || mime_entry_add(mime_defaults[i][0], type) != MIME_OK)
+			return MIME_MEMORY_ERROR;
+	}
+
+	if (NULL == path)
+		path = MIME_TYPES_DEFAULT;
+	if (mime_load(path) < 0)
+		fprintf(stderr,
+			"Warning: Cannot read '%s', using built-in MIME types\n",
+			path);
+
+	// Sort by extension, later definitions win over earlier ones
+	qsort(mime_entries, mime_entry_count, sizeof(mime_entry_t),
+	      mime_entry_compare);
+	size_t unique = 0;
+	for (size_t i = 0; i < mime_entry_count; i++) {
+		if (unique > 0
+		    && strcmp(mime_entries[unique - 1].extension,
+			      mime_entries[i].extension) == 0)
+			unique--;
+		mime_entries[unique++] = mime_entries[i];
+	}
+	mime_entry_count = unique;
+
+	mime_sniffed = calloc(MIME_SNIFF_SLOTS, sizeof(mime_sniff_t));
+	if (NULL == mime_sniffed)
+		return MIME_MEMORY_ERROR;
+
+	fprintf(stderr, "Info: %zu MIME types loaded\n", mime_entry_count);
+	return MIME_OK;
+}
+
+const char *mime_lookup(const char *file_name)
+{
+	const char *base = strrchr(file_name, '/');
+	base = (NULL == base) ? file_name : base + 1;
+
+	const char *dot = strrchr(base, '.');
+	if (NULL == dot || '\0' == dot[1])
+		return NULL;
+
+	char extension[MIME_EXTENSION_SIZE];
+	size_t i = 0;
+	for (dot++; '\0' != *dot; dot++) {
+		if (i == MIME_EXTENSION_SIZE - 1)
+			return NULL;
+		extension[i++] = tolower((unsigned char)*dot);
+	}
+	extension[i] = '\0';
+
+	const mime_entry_t *entry = bsearch(extension, mime_entries,
+					    mime_entry_count,
+					    sizeof(mime_entry_t),
+					    mime_extension_compare);
+	return (NULL == entry) ? NULL : entry->type;
+}
+
+static uint64_t mime_hash(const char *str)
+{
+	uint64_t hash = 5381;
+	int c;
+	while ((c = *str++))
+		hash = ((hash << 5) + hash) + c;
+	return hash;
+}
+
+static int mime_magic_load(void)
+{
+	if (NULL != mime_magic)
+		return MIME_OK;
+	if (mime_magic_failed)
+		return MIME_MAGIC_ERROR;
+
+	mime_magic = magic_open(MAGIC_MIME | MAGIC_ERROR);
+	if (NULL == mime_magic || 0 != magic_load(mime_magic, NULL)) {
+		fprintf(stderr, "Error: Cannot load magic database\n");
+		if (NULL != mime_magic)
+			magic_close(mime_magic);
+		mime_magic = NULL;
+		mime_magic_failed = true;
+		return MIME_MAGIC_ERROR;
+	}
+	return MIME_OK;
+}
+
+int mime_sniff(const char *file_name, char *type, size_t size)
+{
+	struct stat st;
+	if (stat(file_name, &st) < 0)
+		return MIME_NOT_FOUND;
+
+	mime_sniff_t *slot = NULL;
+	if (NULL != mime_sniffed && strlen(file_name) < MIME_SNIFF_PATH_SIZE) {
+		slot = &mime_sniffed[mime_hash(file_name) % MIME_SNIFF_SLOTS];
+		if (slot->device == st.st_dev && slot->inode == st.st_ino
+		    && slot->mtime.tv_sec == st.st_mtim.tv_sec
+		    && slot->mtime.tv_nsec == st.st_mtim.tv_nsec
+		    && strcmp(slot->path, file_name) == 0) {
+			snprintf(type, size, "%s", slot->type);
+			return MIME_OK;
+		}
+	}
+
+	if (mime_magic_load() < 0)
+		return MIME_MAGIC_ERROR;
+
+	const char *sniffed = magic_file(mime_magic, file_name);
+	if (NULL == sniffed)
+		return MIME_NOT_FOUND;
+
+	snprintf(type, size, "%s", sniffed);
+	if (NULL != slot && strlen(sniffed) < MIME_TYPE_SIZE) {
+		strcpy(slot->path, file_name);
+		strcpy(slot->type, sniffed);
+		slot->device = st.st_dev;
+		slot->inode = st.st_ino;
+		slot->mtime = st.st_mtim;
+	}
+	return MIME_OK;
+}
+
+void mime_free(void)
+{
+	if (NULL != mime_magic)
+		magic_close(mime_magic);
+	mime_magic = NULL;
+
+	for (size_t i = 0; i < mime_type_count; i++)
+		free(mime_types[i]);
+	free(mime_types);
+	mime_types = NULL;
+	mime_type_count = mime_type_capacity = 0;
+
+	free(mime_entries);
+	mime_entries = NULL;
+	mime_entry_count = mime_entry_capacity = 0;
+
+	free(mime_sniffed);
+	mime_sniffed = NULL;
+}
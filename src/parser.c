@@ -0,0 +1,220 @@
+#include <stdbool.h>
+#include <string.h>
+
+#include "http.h"
+#include "parser.h"
+#include "rfc1945.h"
+
+// Method names packed into integers, so that dispatch is a single switch
+#define PARSER_PACK3(a, b, c) \
+	((uint64_t)(a) << 16 | (uint64_t)(b) << 8 | (uint64_t)(c))
+#define PARSER_PACK4(a, b, c, d) \
+	((uint64_t)(a) << 24 | PARSER_PACK3(b, c, d))
+
+#define PARSER_GET PARSER_PACK3('G', 'E', 'T')
+#define PARSER_HEAD PARSER_PACK4('H', 'E', 'A', 'D')
+#define PARSER_POST PARSER_PACK4('P', 'O', 'S', 'T')
+
+static size_t parser_max_headers = PARSER_DEFAULT_HEADERS;
+static size_t parser_max_head_size = SERVER_BUFFER_SIZE;
+
+void parser_limits(size_t max_headers, size_t max_head_size)
+{
+	parser_max_headers = max_headers < PARSER_HEADERS_MAX ?
+	    max_headers : PARSER_HEADERS_MAX;
+	parser_max_head_size = max_head_size < SERVER_BUFFER_SIZE ?
+	    max_head_size : SERVER_BUFFER_SIZE;
+}
+
+void parser_init(parser_t *parser)
+{
+	parser->state = PARSER_METHOD;
+	parser->offset = 0;
+	parser->mark = 0;
+	parser->method = 0;
+	parser->method_length = 0;
+}
+
+static int parser_method(parser_t *parser, http_request_t *request)
+{
+	switch (parser->method) {
+	case PARSER_GET:
+		request->method = HTTP_METHOD_GET;
+		return PARSER_OK;
+	case PARSER_HEAD:
+		request->method = HTTP_METHOD_HEAD;
+		return PARSER_OK;
+	case PARSER_POST:
+		request->method = HTTP_METHOD_POST;
+		return PARSER_OK;
+	default:
+		return PARSER_MALFORMED;
+	}
+}
+
+// "HTTP/x.y"
+static int parser_version(const char *version, size_t length,
+			  http_request_t *request)
+{
+	if (length != 8 || memcmp(version, "HTTP/", 5) != 0)
+		return PARSER_MALFORMED;
+	if (version[5] < '0' || version[5] > '9' || version[6] != '.'
+	    || version[7] < '0' || version[7] > '9')
+		return PARSER_MALFORMED;
+
+	request->major = version[5] - '0';
+	request->minor = version[7] - '0';
+	return PARSER_OK;
+}
+
+static bool parser_is_ctl(unsigned char c)
+{
+	return c < 0x20 || c == 0x7f;
+}
+
+/**
+ * Resumes parsing at the byte where the previous call stopped. Returns 1
+ * once the head is complete (parser->offset is then its length), 0 when
+ * more data is needed and a negative value when the head is malformed or
+ * over the limits.
+ */
+int parser_execute(parser_t *parser, http_request_t *request, char *data,
+		   size_t length)
+{
+	int err;
+
+	for (; parser->offset < length; parser->offset++) {
+		if (parser->offset >= parser_max_head_size)
+			return PARSER_TOO_LARGE;
+
+		size_t offset = parser->offset;
+		unsigned char c = data[offset];
+
+		switch (parser->state) {
+		case PARSER_METHOD:
+			if (' ' == c) {
+				err = parser_method(parser, request);
+				if (err < 0)
+					return err;
+				parser->state = PARSER_URI_START;
+				break;
+			}
+			if (c < 'A' || c > 'Z'
+			    || ++parser->method_length > PARSER_METHOD_SIZE)
+				return PARSER_MALFORMED;
+			parser->method = parser->method << 8 | c;
+			break;
+
+		case PARSER_URI_START:
+			if (' ' == c || parser_is_ctl(c))
+				return PARSER_MALFORMED;
+			parser->mark = offset;
+			parser->state = PARSER_URI;
+			break;
+
+		case PARSER_URI:
+			if (' ' == c) {
+				data[offset] = '\0';
+				request->uri = data + parser->mark;
+				request->uri_length = offset - parser->mark;
+				parser->mark = offset + 1;
+				parser->state = PARSER_VERSION;
+				break;
+			}
+			if (parser_is_ctl(c))
+				return PARSER_MALFORMED;	// HTTP/0.9 is not served
+			break;
+
+		case PARSER_VERSION:
+			if ('\r' != c && '\n' != c)
+				break;
+			err = parser_version(data + parser->mark,
+					     offset - parser->mark, request);
+			if (err < 0)
+				return err;
+			parser->state = '\r' == c ? PARSER_LINE_LF :
+			    PARSER_HEADER_START;
+			break;
+
+		case PARSER_LINE_LF:
+			if ('\n' != c)
+				return PARSER_MALFORMED;
+			parser->state = PARSER_HEADER_START;
+			break;
+
+		case PARSER_HEADER_START:
+			if ('\r' == c) {
+				parser->state = PARSER_HEAD_END_LF;
+				break;
+			}
+			if ('\n' == c) {
+				parser->offset++;
+				parser->state = PARSER_DONE;
+				return 1;
+			}
+			// Folded lines were deprecated by RFC 7230
+			if (':' == c || ' ' == c || '\t' == c || parser_is_ctl(c))
+				return PARSER_MALFORMED;
+			if (request->header_count >= parser_max_headers)
+				return PARSER_TOO_LARGE;
+			parser->mark = offset;
+			parser->state = PARSER_HEADER_NAME;
+			break;
+
+		case PARSER_HEADER_NAME:
+			if (':' == c) {
+				http_header_t *header =
+				    &request->headers[request->header_count];
+				data[offset] = '\0';
+				header->name = data + parser->mark;
+				header->name_length = offset - parser->mark;
+				header->id = header_lookup(header->name,
+							   header->name_length);
+				parser->state = PARSER_VALUE_START;
+				break;
+			}
+			if (' ' == c || parser_is_ctl(c))
+				return PARSER_MALFORMED;
+			break;
+
+		case PARSER_VALUE_START:
+			if (' ' == c || '\t' == c)
+				break;
+			parser->mark = offset;
+			parser->state = PARSER_VALUE;
+			/* fall through */
+
+		case PARSER_VALUE:
+			if ('\r' == c || '\n' == c) {
+				http_header_t *header =
+				    &request->headers[request->header_count++];
+				size_t end = offset;
+				while (end > parser->mark
+				       && (' ' == data[end - 1]
+					   || '\t' == data[end - 1]))
+					end--;
+				data[end] = '\0';
+				header->value = data + parser->mark;
+				header->value_length = end - parser->mark;
+				parser->state = '\r' == c ? PARSER_LINE_LF :
+				    PARSER_HEADER_START;
+				break;
+			}
+			if (parser_is_ctl(c) && '\t' != c)
+				return PARSER_MALFORMED;
+			break;
+
+		case PARSER_HEAD_END_LF:
+			if ('\n' != c)
+				return PARSER_MALFORMED;
+			parser->offset++;
+			parser->state = PARSER_DONE;
+			return 1;
+
+		case PARSER_DONE:
+			return 1;
+		}
+	}
+
+	return 0;
+}
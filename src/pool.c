@@ -0,0 +1,332 @@
+#define _GNU_SOURCE
+
+#include <errno.h>
+#include <fcntl.h>
+#include <linux/filter.h>
+#include <sched.h>
+#include <signal.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/epoll.h>
+#include <sys/socket.h>
+#include <sys/types.h>
+#include <sys/wait.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "accesslog.h"
+#include "admission.h"
+#include "cache.h"
+#include "event.h"
+#include "metrics.h"
+#include "pool.h"
+#include "server.h"
+#include "trace.h"
+#include "uring.h"
+
+#define POOL_RESPAWN_DELAY 1	// seconds
+
+static volatile sig_atomic_t pool_stopping = 0;
+
+static void pool_stop_handler(int signum)
+{
+	(void)signum;
+	pool_stopping = 1;
+}
+
+static int pool_worker(const server_t server)
+{
+	signal(SIGCHLD, SIG_DFL);
+	signal(SIGINT, SIG_DFL);
+	signal(SIGTERM, SIG_DFL);
+	signal(SIGPIPE, SIG_IGN);
+	signal(SIGUSR1, SIG_IGN);	// the master dumps the flight recorder
+	signal(SIGHUP, SIG_IGN);	// and forwards log rotations
+
+	if (IO_MODEL_EPOLL == server.config.io_model)
+		return event_loop_run(server);
+
+	if (IO_MODEL_URING == server.config.io_model)
+		return uring_loop_run(server);
+
+	int epoll = epoll_create1(EPOLL_CLOEXEC);
+	if (epoll < 0)
+		return epoll;
+
+	struct epoll_event event = {
+		.events = EPOLLIN | EPOLLEXCLUSIVE,
+		.data.fd = server.socket,
+	};
+	int err = epoll_ctl(epoll, EPOLL_CTL_ADD, server.socket, &event);
+	if (err < 0) {
+		close(epoll);
+		return err;
+	}
+
+	while (1) {
+		int ready = epoll_wait(epoll, &event, 1, -1);
+		if (ready < 0) {
+			if (EINTR == errno)
+				continue;
+			close(epoll);
+			return ready;
+		}
+
+		client_t client;
+		err = server_accept_connection(server, &client);
+		if (err < 0) {
+			// Another worker took the connection, or it was reset
+			if (EAGAIN == errno || EWOULDBLOCK == errno
+			    || ECONNABORTED == errno || EINTR == errno)
+				continue;
+			metrics_accept_error();
+			close(epoll);
+			return err;
+		}
+
+		if (!admission_enter(client.socket)) {
+			admission_shed(client.socket);
+			continue;
+		}
+
+		// A faulty request must not take the worker down
+		server_handle_connection(server, client);
+		server_close_connection(client);
+		admission_leave();
+	}
+
+	return 0;
+}
+
+static int pool_set_nonblocking(socket_t socket)
+{
+	int flags = fcntl(socket, F_GETFL, 0);
+	if (flags < 0)
+		return flags;
+
+	return fcntl(socket, F_SETFL, flags | O_NONBLOCK);
+}
+
+static void pool_pin(const pool_t *pool, int index)
+{
+	if (NULL == pool->cpus || pool->cpu_count == 0)
+		return;
+
+	cpu_set_t set;
+	CPU_ZERO(&set);
+	CPU_SET(pool->cpus[index % pool->cpu_count], &set);
+	if (sched_setaffinity(0, sizeof(set), &set) < 0)
+		fprintf(stderr, "Warning: Failed to pin worker %d to CPU %d\n",
+			index, pool->cpus[index % pool->cpu_count]);
+}
+
+static int pool_listeners_create(pool_t *pool, const server_t server)
+{
+	pool->listeners = calloc(pool->size, sizeof(socket_t));
+	if (NULL == pool->listeners)
+		return -1;
+
+	cpu_set_t set;
+	CPU_ZERO(&set);
+	if (sched_getaffinity(0, sizeof(set), &set) == 0) {
+		pool->cpus = calloc(CPU_COUNT(&set), sizeof(int));
+		if (NULL == pool->cpus)
+			return -1;
+		for (int cpu = 0; cpu < CPU_SETSIZE; cpu++) {
+			if (CPU_ISSET(cpu, &set))
+				pool->cpus[pool->cpu_count++] = cpu;
+		}
+	}
+
+	for (int i = 0; i < pool->size; i++)
+		pool->listeners[i] = -1;
+
+	// Listeners join the reuseport group in order: index i is socket i
+	pool->listeners[0] = server.socket;
+	for (int i = 1; i < pool->size; i++) {
+		int err = server_listen(server, &(pool->listeners[i]));
+		if (err < 0)
+			return err;
+	}
+
+	for (int i = 0; i < pool->size; i++) {
+		int err = pool_set_nonblocking(pool->listeners[i]);
+		if (err < 0)
+			return err;
+	}
+
+	if (REUSEPORT_CPU != server.config.reuseport)
+		return 0;
+
+	// A = current CPU % number of listeners; return A as the socket index
+	struct sock_filter code[] = {
+		{BPF_LD | BPF_W | BPF_ABS, 0, 0, SKF_AD_OFF + SKF_AD_CPU},
+		{BPF_ALU | BPF_MOD | BPF_K, 0, 0, pool->size},
+		{BPF_RET | BPF_A, 0, 0, 0},
+	};
+	struct sock_fprog program = {
+		.len = sizeof(code) / sizeof(code[0]),
+		.filter = code,
+	};
+	return setsockopt(server.socket, SOL_SOCKET, SO_ATTACH_REUSEPORT_CBPF,
+			  &program, sizeof(program));
+}
+
+static void pool_listeners_free(pool_t *pool, int keep)
+{
+	if (NULL != pool->listeners) {
+		for (int i = 0; i < pool->size; i++) {
+			if (i != keep && pool->listeners[i] >= 0)
+				close(pool->listeners[i]);
+		}
+	}
+
+	free(pool->listeners);
+	pool->listeners = NULL;
+	free(pool->cpus);
+	pool->cpus = NULL;
+}
+
+static pid_t pool_spawn(pool_t *pool, int index, server_t server)
+{
+	pid_t pid = fork();
+	if (pid != 0) {
+		if (pid > 0) {
+			pool->workers[index].pid = pid;
+			pool->workers[index].started_at = time(NULL);
+		}
+		return pid;
+	}
+
+	// Keep only this worker's listener when running with SO_REUSEPORT
+	if (NULL != pool->listeners) {
+		pool_pin(pool, index);
+		server.socket = pool->listeners[index];
+		pool_listeners_free(pool, index);
+	}
+
+	free(pool->workers);
+	pool->workers = NULL;
+
+	metrics_worker(index);
+	accesslog_worker(index);
+	admission_worker(index);
+
+	int err = pool_worker(server);
+	server_stop(server);
+	exit(err < 0 ? EXIT_FAILURE : EXIT_SUCCESS);
+}
+
+static int pool_find(const pool_t *pool, pid_t pid)
+{
+	for (int i = 0; i < pool->size; i++) {
+		if (pool->workers[i].pid == pid)
+			return i;
+	}
+
+	return -1;
+}
+
+static void pool_shutdown(pool_t *pool)
+{
+	for (int i = 0; i < pool->size; i++) {
+		if (pool->workers[i].pid > 0)
+			kill(pool->workers[i].pid, SIGTERM);
+	}
+
+	// Not waitpid(-1), the access logger outlives the workers
+	for (int i = 0; i < pool->size; i++) {
+		if (pool->workers[i].pid > 0)
+			while (waitpid(pool->workers[i].pid, NULL, 0) < 0
+			       && EINTR == errno) ;
+	}
+}
+
+int pool_run(server_t *server)
+{
+	int err;
+
+	pool_t pool = {.size = server->config.workers,.listeners =
+		    NULL,.cpus = NULL,.cpu_count = 0
+	};
+
+	if (REUSEPORT_OFF != server->config.reuseport) {
+		err = pool_listeners_create(&pool, *server);
+		if (err < 0) {
+			fprintf(stderr,
+				"Error: Failed to create reuseport listeners\n");
+			pool_listeners_free(&pool, 0);
+			return err;
+		}
+	} else {
+		// Workers must not block in accept() when another worker won the race
+		err = pool_set_nonblocking(server->socket);
+		if (err < 0)
+			return err;
+	}
+
+	struct sigaction action;
+	memset(&action, 0, sizeof(action));
+	action.sa_handler = pool_stop_handler;
+	sigemptyset(&action.sa_mask);
+	sigaction(SIGINT, &action, NULL);
+	sigaction(SIGTERM, &action, NULL);
+	signal(SIGCHLD, SIG_DFL);
+
+	pool.workers = calloc(pool.size, sizeof(pool_worker_t));
+	if (NULL == pool.workers) {
+		pool_listeners_free(&pool, 0);
+		return -1;
+	}
+
+	for (int i = 0; i < pool.size; i++) {
+		if (pool_spawn(&pool, i, *server) < 0) {
+			pool_shutdown(&pool);
+			pool_listeners_free(&pool, 0);
+			free(pool.workers);
+			return -1;
+		}
+	}
+
+	fprintf(stderr, "Info: Started %d workers%s\n", pool.size,
+		NULL != pool.listeners ? " with SO_REUSEPORT listeners" : "");
+
+	while (!pool_stopping) {
+		int status;
+		pid_t pid = waitpid(-1, &status, 0);
+		if (pid < 0) {
+			if (EINTR == errno) {
+				trace_poll();
+				continue;
+			}
+			break;
+		}
+
+		int index = pool_find(&pool, pid);
+		if (index < 0)
+			continue;
+
+		fprintf(stderr, "Warning: Worker %d (pid %d) exited, respawning\n",
+			index, (int)pid);
+
+		// Avoid a respawn storm when workers die right after startup
+		if (time(NULL) - pool.workers[index].started_at <
+		    POOL_RESPAWN_DELAY)
+			sleep(POOL_RESPAWN_DELAY);
+
+		pool.workers[index].pid = 0;
+		admission_reclaim(index);
+		cache_reclaim(pid);
+		if (!pool_stopping && pool_spawn(&pool, index, *server) < 0)
+			fprintf(stderr, "Error: Failed to respawn worker %d\n",
+				index);
+	}
+
+	pool_shutdown(&pool);
+	pool_listeners_free(&pool, 0);
+	free(pool.workers);
+
+	fprintf(stderr, "Info: Worker pool stopped\n");
+	return 0;
+}
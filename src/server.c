@@ -1,51 +1,93 @@
+#define _GNU_SOURCE
+
 #include <arpa/inet.h>
 #include <errno.h>
+#include <fcntl.h>
 #include <magic.h>
 #include <netinet/in.h>
+#include <poll.h>
 #include <unistd.h>
 #include <signal.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
-#include <sys/select.h>
 #include <sys/socket.h>
-
+#include <sys/stat.h>
+#include <sys/time.h>
+#include <sys/wait.h>
+
+#include "accesslog.h"
+#include "admission.h"
+#include "arena.h"
+#include "cache.h"
+#include "cimap.h"
 #include "cli.h"
 #include "conf.h"
+#include "encoding.h"
+#include "event.h"
 #include "http.h"
+#include "metrics.h"
 #include "network.h"
+#include "parser.h"
+#include "pool.h"
 #include "rfc1945.h"
 #include "server.h"
+#include "trace.h"
+#include "uring.h"
+#include "wheel.h"
 
-int server_init(server_t *server)
+int server_listen(const server_t server, socket_t *listener)
 {
 	int err;
 
-	err = socket_create(&(server->socket));
+	err = socket_create(listener);
 	if (err < 0)
 		return err;
 
-	server->server_addr.sin_family = AF_INET;
-	server->server_addr.sin_addr.s_addr = server->config.host;
-	server->server_addr.sin_port = htons(server->config.port);
-
-	err = setsockopt(server->socket, SOL_SOCKET, SO_REUSEADDR, &(int) { 1 },
+	err = setsockopt(*listener, SOL_SOCKET, SO_REUSEADDR, &(int) { 1 },
 			 sizeof(int));
 	if (err < 0)
 		return err;
 
+	if (REUSEPORT_OFF != server.config.reuseport) {
+		err = setsockopt(*listener, SOL_SOCKET, SO_REUSEPORT,
+				 &(int) { 1 }, sizeof(int));
+		if (err < 0)
+			return err;
+	}
+
 	err =
-	    bind(server->socket, (struct sockaddr *)&(server->server_addr),
-		 sizeof(server->server_addr));
+	    bind(*listener, (struct sockaddr *)&(server.server_addr),
+		 sizeof(server.server_addr));
 	if (err < 0) {
 		if (EACCES == errno) {
 			fprintf(stderr,
 				"Error: Port %d is a restricted port. Make sure to run as root.\n",
-				server->config.port);
+				server.config.port);
 		}
 		return err;
 	}
 
+	err = listen(*listener, server.config.max_connections);
+	if (err < 0)
+		return err;
+
+	return 0;
+}
+
+int server_init(server_t *server)
+{
+	int err;
+
+	server->server_addr.sin_family = AF_INET;
+	server->server_addr.sin_addr.s_addr = server->config.host;
+	server->server_addr.sin_port = htons(server->config.port);
+
+	err = server_listen(*server, &(server->socket));
+	if (err < 0)
+		return err;
+
+	// Resolve the actual port, so that other listeners bind to the same one
 	err = getsockname
 	    (server->socket, (struct sockaddr *)&server->server_addr,
 	     &(unsigned int) { sizeof(server->server_addr) }
@@ -56,10 +98,6 @@ int server_init(server_t *server)
 		fprintf(stderr, "Info: Server running on port %d\n",
 			ntohs(server->server_addr.sin_port));
 
-	err = listen(server->socket, server->config.max_connections);
-	if (err < 0)
-		return err;
-
 	return 0;
 }
 
@@ -80,92 +118,568 @@ int server_accept_connection(const server_t server, client_t *client)
 	return 0;
 }
 
-int server_handle_connection(const server_t server, const client_t client)
+static int server_spare = -1;
+
+/**
+ * Keeps a file descriptor in reserve, for server_refuse_connection().
+ */
+int server_spare_init(void)
 {
-	fd_set input;
-	FD_ZERO(&input);
-	FD_SET(client.socket, &input);
+	if (server_spare < 0)
+		server_spare = open("/dev/null", O_RDONLY | O_CLOEXEC);
+	return server_spare;
+}
 
-	struct timeval timeout;
-	timeout.tv_sec = server.config.request_timeout / 1000;
-	timeout.tv_usec = (server.config.request_timeout % 1000) * 1000;
+/**
+ * Out of file descriptors, accept() fails and leaves the connection in the
+ * listen queue, where a level-triggered listener reports it again at once.
+ * The spare descriptor is given up to accept the connection and close it
+ * right away, then taken again, so the loop goes on with the queue drained
+ * and the client is not left waiting. Returns -1 without a spare or a
+ * pending connection, the listener may be blocking (io_uring).
+ */
+int server_refuse_connection(const server_t server)
+{
+	struct pollfd listener = {.fd = server.socket,.events = POLLIN };
+	if (server_spare_init() < 0 || poll(&listener, 1, 0) <= 0)
+		return -1;
 
-	int ready;
-	if (server.config.request_timeout > 0)
-		ready = select(client.socket + 1, &input, NULL, NULL, &timeout);
-	else
-		ready = select(client.socket + 1, &input, NULL, NULL, NULL);
-	if (ready < 0)
-		return ready;
+	close(server_spare);
+	int socket = accept4(server.socket, NULL, NULL, SOCK_CLOEXEC);
+	if (socket >= 0)
+		close(socket);
+	server_spare = open("/dev/null", O_RDONLY | O_CLOEXEC);
+	return socket < 0 ? -1 : 0;
+}
 
-	if (ready == 0)
-		// http_send(client, 408, "Request Timeout");   // not in RFC1945
-		return 0;
+/**
+ * The status page is matched on its path alone, a "format=prometheus"
+ * query asks for the Prometheus text format.
+ */
+static bool server_status_match(const server_t server,
+				const http_request_t *request,
+				metrics_format *format)
+{
+	const char *status_uri = server.config.status_uri;
+	if (NULL == status_uri)
+		return false;
+
+	size_t length = strlen(status_uri);
+	if (strncmp(request->uri, status_uri, length) != 0)
+		return false;
+	if ('\0' != request->uri[length] && '?' != request->uri[length])
+		return false;
+
+	*format = strstr(request->uri + length, "format=prometheus") != NULL ?
+	    METRICS_FORMAT_PROMETHEUS : METRICS_FORMAT_TEXT;
+	return true;
+}
 
-	int err;
+static void server_status(const server_t server, http_response_t *response,
+			  metrics_format format)
+{
+	size_t size = metrics_render_size();
+	char *body = NULL != response->arena ?
+	    arena_alloc(response->arena, size) : malloc(size);
+	int length = NULL != body ?
+	    metrics_render(body, size, format, server.socket) : -1;
+	if (length < 0) {
+		if (NULL == response->arena)
+			free(body);
+		http_response_status(response, 500);
+		return;
+	}
 
-	http_request_t request;
-	err = http_request_create(client, &request);
-	if (err < 0)
-		return err;
+	response->body = body;
+	response->body_length = length;
+	headers_set_id(&response->headers, HEADER_CONTENT_TYPE,
+		       METRICS_FORMAT_PROMETHEUS == format ?
+		       "text/plain; version=0.0.4; charset=utf-8" :
+		       "text/plain; charset=utf-8");
+	headers_set_id(&response->headers, HEADER_CACHE_CONTROL, "no-store");
+}
+
+/**
+ * A cached file answers conditional and range requests from its entry,
+ * without touching the file system.
+ */
+static server_route server_cached(const http_request_t *request,
+				  http_response_t *response)
+{
+	bool ranged = http_request_ranged(request);
+	if (!http_request_conditional(request) && !ranged)
+		return SERVER_ROUTE_CACHE;
+
+	cache_entry_t *entry = response->cached;
+	if (ranged) {
+		// The head is built again around the ranges, from the cached one
+		if (http_response_restore(response) < 0)
+			return SERVER_ROUTE_CACHE;
+	} else {
+		if (ENCODING_IDENTITY != entry->coding)
+			headers_set_id(&response->headers,
+				       HEADER_CONTENT_ENCODING,
+				       encoding_name(entry->coding));
+		if (entry->vary)
+			headers_set_id(&response->headers, HEADER_VARY,
+				       "Accept-Encoding");
+	}
+	if (!http_response_conditional(request, response, entry->inode,
+				       entry->size, &entry->mtime)
+	    && http_response_range(request, response, entry->body_length))
+		return SERVER_ROUTE_CACHE;
+
+	cache_release(entry);
+	response->cached = NULL;
+	return SERVER_ROUTE_TEXT;
+}
+
+/**
+ * Compresses a file with gzip into the content cache. Files larger than a
+ * cache entry, or that do not get at least an eighth smaller, are marked
+ * so that they are not tried again.
+ */
+static int server_compress(const server_t server, const char *file_name,
+			   http_response_t *response)
+{
+	int file = open(file_name, O_RDONLY | O_CLOEXEC);
+	if (file < 0)
+		return -1;
+
+	struct stat file_stat;
+	if (fstat(file, &file_stat) < 0 || !S_ISREG(file_stat.st_mode)) {
+		close(file);
+		return -1;
+	}
+	size_t file_size = file_stat.st_size;
+	if (file_size > server.config.cache_max_file) {
+		close(file);
+		encoding_incompressible(file_name);
+		return -1;
+	}
 
-	http_response_t response;
-	http_response_create(&response);
+	size_t length = 0;
+	char *output = malloc(encoding_gzip_bound(file_size));
+	int err = NULL == output ? -1 :
+	    encoding_gzip(file, file_size,
+			  encoding_level(server.config.compress_level), output,
+			  &length);
+	close(file);
+
+	if (0 == err && length > file_size - file_size / 8) {
+		encoding_incompressible(file_name);
+		err = -1;
+	}
+	if (0 == err)
+		err = cache_store(file_name, ENCODING_GZIP, &file_stat,
+				  response, output, length, &response->cached);
+	free(output);
+	return err;
+}
 
-	if (request.major > 1 || (request.major == 1 && request.minor > 1))
+server_route server_route_request(const server_t server,
+				  const http_request_t *request,
+				  http_response_t *response, char *file_name,
+				  size_t size)
+{
+	if (request->major > 1 || (request->major == 1 && request->minor > 1))
 		// http_send(client, 505, "HTTP Version Not Supported");   // not in RFC1945
-		return 0;
+		return SERVER_ROUTE_NONE;
 
-	if (strcmp(request.uri, "/") == 0) {
-		http_response_status(&response, 301);
-		cimap_set(response.headers, "Location", "/index.html");
-		goto send_text;
+	metrics_format format;
+	if (server_status_match(server, request, &format)) {
+		server_status(server, response, format);
+		return SERVER_ROUTE_TEXT;
 	}
 
-	if (strstr(request.uri, "..") != NULL) {
-		http_response_status(&response, 400);
-		goto send_text;
+	if (strcmp(request->uri, "/") == 0) {
+		http_response_status(response, 301);
+		headers_set_id(&response->headers, HEADER_LOCATION,
+			       "/index.html");
+		return SERVER_ROUTE_TEXT;
 	}
 
-	char vroot_uri[SERVER_BUFFER_SIZE];
-	snprintf(vroot_uri, SERVER_BUFFER_SIZE, "%s%s", server.config.vroot,
-		 request.uri);
+	if (strstr(request->uri, "..") != NULL) {
+		http_response_prebuilt(response, 400);
+		return SERVER_ROUTE_TEXT;
+	}
 
-	char *content_type = malloc(SERVER_BUFFER_SIZE);
-	if (!content_type)
-		return -1;
-	err = http_content_get(vroot_uri, &content_type);
+	snprintf(file_name, size, "%s%s", server.config.vroot, request->uri);
+	size_t length = strlen(file_name);
+
+	// A precompressed sibling is served in place of the file
+	bool negotiated = false;
+	unsigned int accepted = 0;
+	encoding_coding coding = ENCODING_IDENTITY;
+	if (request->method != HTTP_METHOD_POST && length + 8 < size) {
+		accepted =
+		    encoding_accepted(http_request_header_id(request,
+							     HEADER_ACCEPT_ENCODING));
+		coding = encoding_select(file_name, accepted, &negotiated);
+		strcpy(file_name + length, encoding_suffix(coding));
+	}
+
+	// Otherwise the file may be compressed on the fly, once, into the cache
+	bool compress = ENCODING_IDENTITY == coding
+	    && server.config.compress_level > 0
+	    && (accepted & (1u << ENCODING_GZIP)) && cache_enabled()
+	    && encoding_compressible(file_name,
+				     server.config.compress_min_size);
+	if (compress
+	    && cache_acquire(file_name, ENCODING_GZIP, &response->cached) == 0)
+		return server_cached(request, response);
+
+	// Hot files are served from the shared cache, without sniffing them
+	if (request->method != HTTP_METHOD_POST && !compress
+	    && cache_acquire(file_name, coding, &response->cached) == 0)
+		return server_cached(request, response);
+
+	// The type is the one of the file, not of its compressed variant
+	char content_type[SERVER_BUFFER_SIZE];
+	char *content_type_ptr = content_type;
+	file_name[length] = '\0';
+	int err = http_content_get(file_name, &content_type_ptr);
+	strcpy(file_name + length, encoding_suffix(coding));
 
 	if (HTTP_ENTITY_NOT_FOUND == err) {
-		http_response_status(&response, 404);
-		http_response_body(&response, STATUS_TEXT_404);
+		http_response_prebuilt(response, 404);
 	} else if (err < 0) {
-		http_response_status(&response, 500);
+		http_response_status(response, 500);
 	} else {
-		cimap_set(response.headers, "Content-Type", content_type);
+		headers_set_id(&response->headers, HEADER_CONTENT_TYPE,
+			       content_type);
+		if (server.config.compress_level > 0
+		    && encoding_compressible_type(content_type))
+			negotiated = true;
+		else if (compress) {
+			encoding_incompressible(file_name);
+			compress = false;
+		}
+		if (ENCODING_IDENTITY != coding)
+			headers_set_id(&response->headers,
+				       HEADER_CONTENT_ENCODING,
+				       encoding_name(coding));
+		if (negotiated)
+			headers_set_id(&response->headers, HEADER_VARY,
+				       "Accept-Encoding");
+	}
+
+	if (request->method == HTTP_METHOD_POST) {
+		http_response_prebuilt(response, 501);
+		return SERVER_ROUTE_TEXT;
 	}
-	free(content_type);
 
-	if (request.method == HTTP_METHOD_POST) {
-		http_response_status(&response, 501);
-		goto send_text;
+	if (HTTP_OK == err && compress) {
+		headers_set_id(&response->headers, HEADER_CONTENT_ENCODING,
+			       CONTENT_CODING_GZIP);
+		if (server_compress(server, file_name, response) == 0)
+			return server_cached(request, response);
+		headers_remove_id(&response->headers, HEADER_CONTENT_ENCODING);
 	}
 
-	goto send_file;
+	if (HTTP_OK == err
+	    && cache_fill(file_name, coding, response, &response->cached) == 0)
+		return server_cached(request, response);
 
- send_text:
-	http_response_send(client, &request, &response);
-	goto cleanup;
+	return SERVER_ROUTE_FILE;
+}
 
- send_file:
-	http_response_send_file(client, &request, &response, vroot_uri);
-	goto cleanup;
+bool server_keep_alive(const server_t server, const http_request_t *request,
+		       unsigned int requests)
+{
+	if (server.config.keep_alive_timeout <= 0)
+		return false;
 
- cleanup:
-	http_request_destroy(&request);
-	http_response_destroy(&response);
+	if (server.config.keep_alive_requests > 0
+	    && requests >= (unsigned int)server.config.keep_alive_requests)
+		return false;
 
-	return 0;
+	return http_request_keep_alive(request);
+}
+
+/**
+ * A blocking connection has no loop to look at its deadline: the process
+ * keeps its own wheel, driven by SIGALRM, and an expired deadline shuts
+ * the socket down so that the recv() blocked on it returns. The handler
+ * stays off the wheel while the process is changing it, and leaves the
+ * expiry to the process then.
+ */
+static wheel_t server_wheel;
+static wheel_timer_t server_timer;
+static socket_t server_timed_socket = -1;
+static uint64_t server_armed = 0;	// when SIGALRM is due, 0 for never
+static volatile sig_atomic_t server_wheel_busy = 0;
+static volatile sig_atomic_t server_wheel_missed = 0;
+
+static void server_arm(uint64_t now)
+{
+	int delay = wheel_timeout(&server_wheel, now);
+	if (delay < 0 || (server_armed > 0 && server_armed <= now + delay))
+		return;
+
+	// setitimer() takes a zero delay to disarm the timer
+	if (delay == 0)
+		delay = 1;
+	struct itimerval timer = {
+		.it_interval = {0, 0},
+		.it_value = {delay / 1000, (delay % 1000) * 1000},
+	};
+	if (setitimer(ITIMER_REAL, &timer, NULL) == 0)
+		server_armed = now + delay;
+}
+
+static void server_expire(void)
+{
+	uint64_t now = wheel_now();
+	server_armed = 0;
+	if (NULL != wheel_advance(&server_wheel, now))
+		shutdown(server_timed_socket, SHUT_RDWR);
+	server_arm(now);
+}
+
+static void server_alarm_handler(int signum)
+{
+	(void)signum;
+	if (server_wheel_busy) {
+		server_wheel_missed = 1;
+		return;
+	}
+
+	int saved = errno;
+	server_expire();
+	errno = saved;
+}
+
+/**
+ * Replaces the deadline of the connection served by this process, in
+ * milliseconds from now, 0 for none.
+ */
+static void server_deadline(const client_t client, int timeout)
+{
+	static bool ready = false;
+	if (!ready) {
+		wheel_init(&server_wheel, wheel_now());
+		wheel_timer_init(&server_timer, NULL);
+
+		struct sigaction action;
+		memset(&action, 0, sizeof(action));
+		action.sa_handler = server_alarm_handler;
+		action.sa_flags = SA_RESTART;
+		sigemptyset(&action.sa_mask);
+		sigaction(SIGALRM, &action, NULL);
+		ready = true;
+	}
+	if (timeout <= 0 && !wheel_pending(&server_timer))
+		return;
+
+	server_wheel_busy = 1;
+	__atomic_signal_fence(__ATOMIC_SEQ_CST);
+
+	uint64_t now = wheel_now();
+	server_timed_socket = client.socket;
+	wheel_remove(&server_wheel, &server_timer);
+	if (timeout > 0) {
+		wheel_add(&server_wheel, &server_timer, now + timeout);
+		server_arm(now);
+	}
+
+	__atomic_signal_fence(__ATOMIC_SEQ_CST);
+	server_wheel_busy = 0;
+	if (server_wheel_missed) {
+		server_wheel_missed = 0;
+		server_expire();
+	}
+}
+
+/**
+ * Waits for the first bytes of the next request on a connection. Returns 0
+ * when the client closed the connection or its deadline expired.
+ *
+ * A pool worker waiting on an idle connection accepts no other one, so
+ * with a listener, the connection is let go once connections wait to be
+ * accepted and it stayed idle for SERVER_YIELD_IDLE more: a client that
+ * is about to send its next request keeps its connection.
+ */
+static ssize_t server_wait_request(const client_t client,
+				   http_buffer_t *buffer, socket_t listener)
+{
+	http_buffer_shift(buffer);
+	if (listener >= 0) {
+		struct pollfd sockets[2] = {
+			{.fd = client.socket,.events = POLLIN},
+			{.fd = listener,.events = POLLIN},
+		};
+		int ready;
+		do {
+			ready = poll(sockets, 2, -1);
+		} while (ready < 0 && EINTR == errno);
+		if (ready > 0 && 0 == sockets[0].revents
+		    && (sockets[1].revents & POLLIN)) {
+			do {
+				ready = poll(sockets, 1, SERVER_YIELD_IDLE);
+			} while (ready < 0 && EINTR == errno);
+			if (0 == ready)
+				return 0;
+		}
+	}
+
+	ssize_t read_size = recv(client.socket, buffer->data + buffer->length,
+				 SERVER_BUFFER_SIZE - buffer->length, 0);
+	if (read_size > 0) {
+		buffer->length += read_size;
+		buffer->data[buffer->length] = '\0';
+	}
+	return read_size;
+}
+
+int server_handle_connection(const server_t server, const client_t client)
+{
+	unsigned int requests = 0;
+	bool keep_alive = true;
+	bool linger = false;
+
+	http_buffer_t buffer;
+	http_buffer_init(&buffer);
+
+	arena_t arena;
+	arena_init(&arena, ARENA_BLOCK_SIZE);
+
+	metrics_connection_open();
+
+	trace_t trace;
+	trace_begin(&trace);
+
+	// A send that makes no progress for that long fails
+	if (server.config.send_timeout > 0) {
+		struct timeval timeout = {
+			.tv_sec = server.config.send_timeout / 1000,
+			.tv_usec = (server.config.send_timeout % 1000) * 1000,
+		};
+		setsockopt(client.socket, SOL_SOCKET, SO_SNDTIMEO, &timeout,
+			   sizeof(timeout));
+	}
+
+	server_deadline(client, server.config.request_timeout);
+
+	int err = 0;
+	while (keep_alive) {
+		// A pipelined request is already there, no need to wait
+		if (buffer.length == buffer.consumed) {
+			if (requests > 0)
+				server_deadline(client,
+						server.config.keep_alive_timeout);
+			socket_t listener = requests > 0
+			    && server.config.workers > 0 ? server.socket : -1;
+			if (server_wait_request(client, &buffer, listener) <= 0)
+				// http_send(client, 408, "Request Timeout");   // not in RFC1945
+				break;
+		}
+		if (requests > 0)
+			server_deadline(client, server.config.request_timeout);
+		trace_mark(&trace, TRACE_RECEIVING);
+
+		http_request_t request;
+		size_t body_received;
+		err = http_request_create(client, &buffer, &request, &arena,
+					  &body_received);
+		if (err == 0) {
+			if (body_received < request.body_length)
+				server_deadline(client,
+						server.config.body_timeout);
+			err = http_request_receive_body(client, &request,
+							body_received);
+		}
+		server_deadline(client, 0);
+		if (err < 0) {
+			http_request_destroy(&request);
+			// The client is done with the connection
+			if (HTTP_CONNECTION_CLOSED == err)
+				err = 0;
+			break;
+		}
+
+		uint64_t started = metrics_now();
+		trace_request(&trace, request.method, request.uri);
+
+		http_response_t response;
+		err = http_response_create(&response, &arena);
+		if (err < 0) {
+			http_request_destroy(&request);
+			break;
+		}
+		response.trace = &trace;
+
+		char vroot_uri[SERVER_BUFFER_SIZE];
+		server_route route =
+		    server_route_request(server, &request, &response,
+					 vroot_uri, SERVER_BUFFER_SIZE);
+		trace_mark(&trace, TRACE_ROUTED);
+
+		keep_alive = SERVER_ROUTE_NONE != route
+		    && server_keep_alive(server, &request, ++requests);
+		linger = http_request_chunked(&request);
+		response.keep_alive = keep_alive;
+		response.more = keep_alive && http_buffer_pending(&buffer);
+
+		if (SERVER_ROUTE_FILE == route)
+			err = http_response_send_file(client, &request,
+						      &response, vroot_uri);
+		else if (SERVER_ROUTE_TEXT == route
+			 || SERVER_ROUTE_CACHE == route)
+			err = http_response_send(client, &request, &response);
+		if (err < 0)
+			keep_alive = false;
+		else if (SERVER_ROUTE_NONE != route) {
+			metrics_request(request.method, response.status_code,
+					response.sent, started);
+			trace_end(&trace, response.status_code, response.sent);
+			accesslog_request(&client, &request, &response,
+					  started);
+		}
+
+		http_request_destroy(&request);
+		http_response_destroy(&response);
+		arena_reset(&arena);
+		trace_begin(&trace);
+		err = 0;
+	}
+
+	server_deadline(client, 0);
+	if (linger)
+		server_linger(client, SERVER_LINGER_TIME);
+	arena_free(&arena);
+	metrics_connection_close();
+	return err;
+}
+
+/**
+ * Shuts the sending side and discards what the client still sends, before
+ * a connection whose request body was not read is closed: closing it with
+ * unread data would reset it, and the client could lose the response.
+ * Waits for the client to close its side for timeout milliseconds in the
+ * blocking model, only takes what already came in with 0.
+ */
+void server_linger(const client_t client, int timeout)
+{
+	shutdown(client.socket, SHUT_WR);
+	if (timeout > 0)
+		server_deadline(client, timeout);
+
+	char discard[SERVER_BUFFER_SIZE];
+	size_t discarded = 0;
+	while (discarded < SERVER_LINGER_SIZE) {
+		ssize_t read_size = recv(client.socket, discard,
+					 sizeof(discard),
+					 timeout > 0 ? 0 : MSG_DONTWAIT);
+		if (read_size < 0 && EINTR == errno)
+			continue;
+		if (read_size <= 0)
+			break;
+		discarded += read_size;
+	}
+
+	if (timeout > 0)
+		server_deadline(client, 0);
 }
 
 int server_close_connection(const client_t client)
@@ -177,28 +691,141 @@ int server_close_connection(const client_t client)
 	return 0;
 }
 
+static volatile sig_atomic_t server_reclaim = 0;
+
+/**
+ * Reaps the children forked per connection. Each one held an admission
+ * slot, given back here whether it exited or was killed. The cache pins
+ * of a child that did not exit cleanly are given back by the accept loop,
+ * as the cache lock cannot be taken here.
+ */
+static void server_reap_handler(int signum)
+{
+	(void)signum;
+	int saved = errno;
+	int status;
+	pid_t pid;
+	while ((pid = waitpid(-1, &status, WNOHANG)) > 0) {
+		if (pid == accesslog_logger())
+			continue;
+		admission_leave();
+		if (!WIFEXITED(status) || WEXITSTATUS(status) != 0)
+			server_reclaim = 1;
+	}
+	errno = saved;
+}
+
 int server_start(server_t *server)
 {
 	int err;
 
-	err = http_content_init();
+	cimap_init();
+	err = http_content_init(server->config.mime_types);
 	if (err < 0)
 		return err;
 
+	parser_limits(server->config.max_headers,
+		      server->config.max_header_size);
+
+	// Mapped before forking, so that every worker shares the same cache
+	err = cache_init(server->config.cache_size,
+			 server->config.cache_max_file);
+	if (err < 0)
+		return err;
+
+	if (server->config.compress_level > 0 && !cache_enabled())
+		fprintf(stderr,
+			"Warning: Compression on the fly needs the content cache, it is disabled\n");
+
+	if (REUSEPORT_OFF != server->config.reuseport
+	    && server->config.workers == 0)
+		server->config.workers = sysconf(_SC_NPROCESSORS_ONLN);
+
+	// One shard per worker, mapped before forking like the cache
+	err = metrics_init(server->config.workers);
+	if (err < 0)
+		return err;
+
+	// Shared by every process, like the metrics
+	err = admission_init(server->config.max_active,
+			     server->config.queue_delay,
+			     server->config.workers);
+	if (err < 0)
+		return err;
+
+	err = trace_init(server->config.flight_recorder,
+			 server->config.slow_request);
+	if (err < 0)
+		return err;
+
+	// The logger is forked before the socket exists, so it does not hold it
+	if (strcmp(server->config.access_log, "off") != 0) {
+		const char *path = strcmp(server->config.access_log, "-") == 0 ?
+		    NULL : server->config.access_log;
+		err = accesslog_init(path, server->config.access_log_format,
+				     server->config.access_log_sample,
+				     server->config.workers);
+		if (err < 0)
+			return err;
+	}
+
+	// io_uring may be missing or disabled, keep the blocking path then
+	if (IO_MODEL_URING == server->config.io_model && uring_probe() < 0) {
+		fprintf(stderr,
+			"Warning: io_uring is not supported, falling back to blocking I/O\n");
+		server->config.io_model = IO_MODEL_BLOCKING;
+	}
+
 	err = server_init(server);
 	if (err < 0)
 		return err;
 
-	signal(SIGCHLD, SIG_IGN);
+	if (server->config.workers > 0)
+		return pool_run(server);
+
+	if (IO_MODEL_EPOLL == server->config.io_model)
+		return event_loop_run(*server);
+
+	if (IO_MODEL_URING == server->config.io_model)
+		return uring_loop_run(*server);
+
+	// Children are reaped here, which gives their admission slot back
+	struct sigaction action;
+	memset(&action, 0, sizeof(action));
+	action.sa_handler = server_reap_handler;
+	action.sa_flags = SA_RESTART | SA_NOCLDSTOP;
+	sigemptyset(&action.sa_mask);
+	if (sigaction(SIGCHLD, &action, NULL) < 0)
+		return -1;
+
 	while (1) {
 		client_t client;
 
 		err = server_accept_connection(*server, &client);
+		if (err < 0 && EINTR == errno) {
+			trace_poll();
+			continue;
+		}
 		if (err < 0)
 			return err;
 
+		if (server_reclaim) {
+			server_reclaim = 0;
+			cache_reclaim(0);
+		}
+
+		// Shed before forking, a refused connection costs no process
+		if (!admission_enter(client.socket)) {
+			admission_shed(client.socket);
+			continue;
+		}
+
 		int pid = fork();
 		if (pid == 0) {
+			signal(SIGUSR1, SIG_IGN);	// the master dumps the recorder
+			signal(SIGHUP, SIG_IGN);	// and forwards log rotations
+			signal(SIGCHLD, SIG_DFL);
+			// The slot is the master's to give back, even if killed
 			err = server_handle_connection(*server, client);
 			if (err < 0)
 				return err;
@@ -208,6 +835,8 @@ int server_start(server_t *server)
 				return err;
 			break;	// Child process should exit
 		} else {
+			if (pid < 0)
+				admission_leave();
 			err = server_close_connection(client);
 			if (err < 0)
 				return err;
@@ -225,5 +854,25 @@ int server_stop(const server_t server)
 	if (err < 0)
 		return err;
 
+	err = cache_free();
+	if (err < 0)
+		return err;
+
+	err = metrics_free();
+	if (err < 0)
+		return err;
+
+	err = trace_free();
+	if (err < 0)
+		return err;
+
+	err = admission_free();
+	if (err < 0)
+		return err;
+
+	err = accesslog_free();
+	if (err < 0)
+		return err;
+
 	return close(server.socket);
 }
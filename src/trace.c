@@ -0,0 +1,221 @@
+#define _GNU_SOURCE
+
+#include <signal.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "trace.h"
+
+static trace_ring_t *trace_ring = NULL;
+static uint64_t trace_slow_threshold = 0;	// nanoseconds, 0 is off
+static volatile sig_atomic_t trace_dump_requested = 0;
+
+static const char *trace_methods[] = { "-", "GET", "HEAD", "POST" };
+
+static void trace_dump_handler(int signum)
+{
+	(void)signum;
+	trace_dump_requested = 1;
+}
+
+/**
+ * Maps the flight recorder before forking, so that every process writes to
+ * the same ring. SIGUSR1 is installed without SA_RESTART: it interrupts the
+ * wait of the loops, which then dump the ring from trace_poll().
+ */
+int trace_init(size_t entries, int slow_threshold)
+{
+	trace_slow_threshold = slow_threshold > 0 ?
+	    (uint64_t)slow_threshold * 1000000 : 0;
+
+	if (entries > 0) {
+		size_t mapping_size = sizeof(trace_ring_t) +
+		    entries * sizeof(trace_slot_t);
+		void *mapping = mmap(NULL, mapping_size, PROT_READ | PROT_WRITE,
+				     MAP_SHARED | MAP_ANONYMOUS, -1, 0);
+		if (MAP_FAILED == mapping)
+			return -1;
+
+		trace_ring = mapping;
+		trace_ring->next = 0;
+		trace_ring->size = entries;
+		trace_ring->mapping_size = mapping_size;
+	}
+
+	struct sigaction action;
+	memset(&action, 0, sizeof(action));
+	action.sa_handler = trace_dump_handler;
+	sigemptyset(&action.sa_mask);
+	return sigaction(SIGUSR1, &action, NULL);
+}
+
+uint64_t trace_now(void)
+{
+	struct timespec now;
+	clock_gettime(CLOCK_MONOTONIC_COARSE, &now);
+	return (uint64_t)now.tv_sec * 1000000000 + now.tv_nsec;
+}
+
+void trace_begin(trace_t *trace)
+{
+	memset(trace->at, 0, sizeof(trace->at));
+	trace->method = 0;
+	trace->status_code = 0;
+	trace->sent = 0;
+	trace->uri[0] = '\0';
+	trace->at[TRACE_WAITING] = trace_now();
+}
+
+void trace_mark(trace_t *trace, trace_phase phase)
+{
+	if (NULL == trace)
+		return;
+
+	trace->at[phase] = trace_now();
+	TRACE_PROBE2(request__phase, (int)phase, trace->uri);
+}
+
+void trace_request(trace_t *trace, int method, const char *uri)
+{
+	trace->method = method;
+	snprintf(trace->uri, sizeof(trace->uri), "%s", uri);
+	trace_mark(trace, TRACE_PARSED);
+}
+
+// Time spent in the phase that ends at the given boundary
+static uint64_t trace_phase_time(const trace_t *trace, int phase)
+{
+	if (0 == trace->at[phase])
+		return 0;
+
+	for (int previous = phase - 1; previous >= 0; previous--) {
+		if (0 != trace->at[previous])
+			return trace->at[phase] - trace->at[previous];
+	}
+	return 0;
+}
+
+// From the first request bytes to the last response byte
+static uint64_t trace_duration(const trace_t *trace)
+{
+	uint64_t start = 0 != trace->at[TRACE_RECEIVING] ?
+	    trace->at[TRACE_RECEIVING] : trace->at[TRACE_PARSED];
+	return trace->at[TRACE_DONE] - start;
+}
+
+static void trace_print(FILE *output, const trace_t *trace)
+{
+	const char *method = trace->method > 0 && trace->method < 4 ?
+	    trace_methods[trace->method] : trace_methods[0];
+	fprintf(output, "%6d %-6s %3d %9zu", (int)trace->pid, method,
+		trace->status_code, trace->sent);
+	for (int phase = TRACE_RECEIVING; phase < TRACE_PHASES; phase++) {
+		if (0 == trace->at[phase])
+			fprintf(output, " %7s", "-");
+		else
+			fprintf(output, " %7.1f",
+				trace_phase_time(trace, phase) / 1e6);
+	}
+	fprintf(output, " %7.1f %s\n", trace_duration(trace) / 1e6,
+		trace->uri);
+}
+
+static void trace_print_header(FILE *output)
+{
+	fprintf(output, "%6s %-6s %3s %9s %7s %7s %7s %7s %7s %7s %7s %s\n",
+		"pid", "method", "st", "bytes", "wait", "read", "route", "open",
+		"head", "body", "total", "uri");
+}
+
+static void trace_record(const trace_t *trace)
+{
+	if (NULL == trace_ring)
+		return;
+
+	uint64_t ticket = __atomic_fetch_add(&trace_ring->next, 1,
+					     __ATOMIC_RELAXED);
+	trace_slot_t *slot = &trace_ring->slots[ticket % trace_ring->size];
+
+	__atomic_store_n(&slot->sequence, 2 * ticket + 1, __ATOMIC_RELAXED);
+	__atomic_thread_fence(__ATOMIC_RELEASE);
+	slot->trace = *trace;
+	__atomic_store_n(&slot->sequence, 2 * ticket + 2, __ATOMIC_RELEASE);
+}
+
+void trace_end(trace_t *trace, int status_code, size_t sent)
+{
+	trace->status_code = status_code;
+	trace->sent = sent;
+	trace->pid = getpid();
+	trace_mark(trace, TRACE_DONE);
+
+	uint64_t duration = trace_duration(trace);
+	TRACE_PROBE4(request__done, trace->uri, status_code, duration, sent);
+
+	if (0 != trace_slow_threshold && duration >= trace_slow_threshold) {
+		fprintf(stderr, "Warning: Slow request (ms)\n");
+		trace_print_header(stderr);
+		trace_print(stderr, trace);
+	}
+
+	trace_record(trace);
+}
+
+/**
+ * Called by the loops when their wait returns, dumps the flight recorder
+ * if SIGUSR1 came in since the last call.
+ */
+void trace_poll(void)
+{
+	if (!trace_dump_requested)
+		return;
+
+	trace_dump_requested = 0;
+	trace_dump(stderr);
+}
+
+void trace_dump(FILE *output)
+{
+	if (NULL == trace_ring) {
+		fprintf(output, "Info: Flight recorder is disabled\n");
+		return;
+	}
+
+	uint64_t next = __atomic_load_n(&trace_ring->next, __ATOMIC_ACQUIRE);
+	uint64_t first = next > trace_ring->size ? next - trace_ring->size : 0;
+
+	fprintf(output, "Info: Flight recorder, last %llu requests (ms)\n",
+		(unsigned long long)(next - first));
+	trace_print_header(output);
+	for (uint64_t ticket = first; ticket < next; ticket++) {
+		const trace_slot_t *slot =
+		    &trace_ring->slots[ticket % trace_ring->size];
+
+		uint64_t sequence = __atomic_load_n(&slot->sequence,
+						    __ATOMIC_ACQUIRE);
+		trace_t trace = slot->trace;
+		__atomic_thread_fence(__ATOMIC_ACQUIRE);
+
+		// Skip slots being written, or overwritten while copying them
+		if (sequence != 2 * ticket + 2
+		    || __atomic_load_n(&slot->sequence,
+				       __ATOMIC_RELAXED) != sequence)
+			continue;
+		trace_print(output, &trace);
+	}
+	fflush(output);
+}
+
+int trace_free(void)
+{
+	if (NULL == trace_ring)
+		return 0;
+
+	int err = munmap(trace_ring, trace_ring->mapping_size);
+	trace_ring = NULL;
+	return err;
+}
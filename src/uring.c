@@ -0,0 +1,933 @@
+#define _GNU_SOURCE
+
+#include <errno.h>
+#include <fcntl.h>
+#include <poll.h>
+#include <signal.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <sys/socket.h>
+#include <sys/stat.h>
+#include <sys/syscall.h>
+#include <unistd.h>
+
+#include "accesslog.h"
+#include "admission.h"
+#include "http.h"
+#include "metrics.h"
+#include "rfc1945.h"
+#include "server.h"
+#include "uring.h"
+
+// user_data values that are not connections
+#define URING_DATA_ACCEPT 0
+#define URING_DATA_TICK 1
+#define URING_DATA_POLL 2
+
+static int uring_setup(unsigned int entries, struct io_uring_params *params)
+{
+	return (int)syscall(__NR_io_uring_setup, entries, params);
+}
+
+static int uring_enter(int fd, unsigned int to_submit,
+		       unsigned int min_complete, unsigned int flags)
+{
+	return (int)syscall(__NR_io_uring_enter, fd, to_submit, min_complete,
+			    flags, NULL, 0);
+}
+
+int uring_init(uring_t *ring, unsigned int entries)
+{
+	struct io_uring_params params;
+	memset(&params, 0, sizeof(params));
+	memset(ring, 0, sizeof(uring_t));
+
+	ring->fd = uring_setup(entries, &params);
+	if (ring->fd < 0)
+		return ring->fd;
+	ring->entries = params.sq_entries;
+
+	ring->sq_ring_size =
+	    params.sq_off.array + params.sq_entries * sizeof(unsigned int);
+	ring->cq_ring_size =
+	    params.cq_off.cqes +
+	    params.cq_entries * sizeof(struct io_uring_cqe);
+	if (params.features & IORING_FEAT_SINGLE_MMAP) {
+		if (ring->cq_ring_size > ring->sq_ring_size)
+			ring->sq_ring_size = ring->cq_ring_size;
+		ring->cq_ring_size = ring->sq_ring_size;
+	}
+
+	ring->sq_ring = mmap(NULL, ring->sq_ring_size, PROT_READ | PROT_WRITE,
+			     MAP_SHARED | MAP_POPULATE, ring->fd,
+			     IORING_OFF_SQ_RING);
+	if (MAP_FAILED == ring->sq_ring)
+		goto error;
+
+	if (params.features & IORING_FEAT_SINGLE_MMAP) {
+		ring->cq_ring = ring->sq_ring;
+	} else {
+		ring->cq_ring =
+		    mmap(NULL, ring->cq_ring_size, PROT_READ | PROT_WRITE,
+			 MAP_SHARED | MAP_POPULATE, ring->fd,
+			 IORING_OFF_CQ_RING);
+		if (MAP_FAILED == ring->cq_ring)
+			goto error;
+	}
+
+	ring->sqes_size = params.sq_entries * sizeof(struct io_uring_sqe);
+	ring->sqes = mmap(NULL, ring->sqes_size, PROT_READ | PROT_WRITE,
+			  MAP_SHARED | MAP_POPULATE, ring->fd,
+			  IORING_OFF_SQES);
+	if (MAP_FAILED == ring->sqes)
+		goto error;
+
+	char *sq = ring->sq_ring;
+	ring->sq_head = (unsigned int *)(sq + params.sq_off.head);
+	ring->sq_tail = (unsigned int *)(sq + params.sq_off.tail);
+	ring->sq_mask = (unsigned int *)(sq + params.sq_off.ring_mask);
+	ring->sq_array = (unsigned int *)(sq + params.sq_off.array);
+	ring->sq_local_tail = *ring->sq_tail;
+	ring->sq_submitted = *ring->sq_tail;
+
+	char *cq = ring->cq_ring;
+	ring->cq_head = (unsigned int *)(cq + params.cq_off.head);
+	ring->cq_tail = (unsigned int *)(cq + params.cq_off.tail);
+	ring->cq_mask = (unsigned int *)(cq + params.cq_off.ring_mask);
+	ring->cqes = (struct io_uring_cqe *)(cq + params.cq_off.cqes);
+
+	return 0;
+
+ error:
+	uring_free(ring);
+	return -1;
+}
+
+void uring_free(uring_t *ring)
+{
+	if (NULL != ring->sqes && MAP_FAILED != ring->sqes)
+		munmap(ring->sqes, ring->sqes_size);
+	if (NULL != ring->cq_ring && MAP_FAILED != ring->cq_ring
+	    && ring->cq_ring != ring->sq_ring)
+		munmap(ring->cq_ring, ring->cq_ring_size);
+	if (NULL != ring->sq_ring && MAP_FAILED != ring->sq_ring)
+		munmap(ring->sq_ring, ring->sq_ring_size);
+	if (ring->fd >= 0)
+		close(ring->fd);
+	memset(ring, 0, sizeof(uring_t));
+	ring->fd = -1;
+}
+
+static unsigned int uring_space(const uring_t *ring)
+{
+	unsigned int head = __atomic_load_n(ring->sq_head, __ATOMIC_ACQUIRE);
+	return ring->entries - (ring->sq_local_tail - head);
+}
+
+struct io_uring_sqe *uring_sqe(uring_t *ring)
+{
+	if (uring_space(ring) == 0)
+		return NULL;
+
+	unsigned int index = ring->sq_local_tail & *ring->sq_mask;
+	struct io_uring_sqe *sqe = &ring->sqes[index];
+	ring->sq_array[index] = index;
+	ring->sq_local_tail++;
+
+	memset(sqe, 0, sizeof(struct io_uring_sqe));
+	return sqe;
+}
+
+int uring_submit(uring_t *ring, unsigned int wait)
+{
+	unsigned int to_submit = ring->sq_local_tail - ring->sq_submitted;
+	__atomic_store_n(ring->sq_tail, ring->sq_local_tail, __ATOMIC_RELEASE);
+
+	// A signal interrupting the wait goes back to the loop, to be acted on
+	int submitted;
+	do {
+		submitted = uring_enter(ring->fd, to_submit, wait,
+					wait > 0 ? IORING_ENTER_GETEVENTS : 0);
+	} while (submitted < 0 && EINTR == errno && 0 == wait);
+	if (submitted < 0)
+		return submitted;
+
+	ring->sq_submitted += submitted;
+	return submitted;
+}
+
+/**
+ * Makes room for a group of linked entries, so that a link is never split
+ * across two submissions.
+ */
+static int uring_reserve(uring_t *ring, unsigned int count)
+{
+	if (uring_space(ring) >= count)
+		return 0;
+
+	return uring_submit(ring, 0) < 0 ? -1 : 0;
+}
+
+int uring_probe(void)
+{
+	uring_t ring;
+	if (uring_init(&ring, 4) < 0)
+		return -1;
+
+	size_t size = sizeof(struct io_uring_probe) +
+	    256 * sizeof(struct io_uring_probe_op);
+	struct io_uring_probe *probe = calloc(1, size);
+	if (NULL == probe) {
+		uring_free(&ring);
+		return -1;
+	}
+
+	int err = (int)syscall(__NR_io_uring_register, ring.fd,
+			       IORING_REGISTER_PROBE, probe, 256);
+	uring_free(&ring);
+	if (err < 0) {
+		free(probe);
+		return -1;
+	}
+
+	const int required[] = {
+		IORING_OP_ACCEPT, IORING_OP_RECV, IORING_OP_SEND,
+		IORING_OP_SENDMSG,
+		IORING_OP_OPENAT, IORING_OP_STATX, IORING_OP_READ,
+		IORING_OP_TIMEOUT, IORING_OP_POLL_ADD,
+	};
+	for (size_t i = 0; i < sizeof(required) / sizeof(required[0]); i++) {
+		int op = required[i];
+		if (op > probe->last_op
+		    || !(probe->ops[op].flags & IO_URING_OP_SUPPORTED)) {
+			free(probe);
+			return -1;
+		}
+	}
+
+	free(probe);
+	return 0;
+}
+
+static bool uring_multishot = true;
+
+static wheel_t uring_wheel;
+static uint64_t uring_armed = 0;	// when the tick is due, 0 for never
+static struct __kernel_timespec uring_tick;
+
+static int uring_accept(uring_t *ring, const server_t server)
+{
+	if (uring_reserve(ring, 1) < 0)
+		return -1;
+
+	struct io_uring_sqe *sqe = uring_sqe(ring);
+	sqe->opcode = IORING_OP_ACCEPT;
+	sqe->fd = server.socket;
+	sqe->accept_flags = SOCK_CLOEXEC;
+	sqe->ioprio = uring_multishot ? IORING_ACCEPT_MULTISHOT : 0;
+	sqe->user_data = URING_DATA_ACCEPT;
+	return 0;
+}
+
+static int uring_poll_listener(uring_t *ring, const server_t server)
+{
+	if (uring_reserve(ring, 1) < 0)
+		return -1;
+
+	struct io_uring_sqe *sqe = uring_sqe(ring);
+	sqe->opcode = IORING_OP_POLL_ADD;
+	sqe->fd = server.socket;
+	sqe->poll32_events = POLLIN;
+	sqe->user_data = URING_DATA_POLL;
+	return 0;
+}
+
+static int uring_recv(uring_t *ring, uring_connection_t *connection)
+{
+	if (uring_reserve(ring, 1) < 0)
+		return -1;
+
+	struct io_uring_sqe *sqe = uring_sqe(ring);
+	sqe->opcode = IORING_OP_RECV;
+	sqe->fd = connection->client.socket;
+	if (URING_READING_HEAD == connection->state) {
+		sqe->addr = (unsigned long)(connection->input.data +
+					    connection->input.length);
+		sqe->len = SERVER_BUFFER_SIZE - connection->input.length;
+	} else {
+		sqe->addr = (unsigned long)(connection->request.body +
+					    connection->body_received);
+		sqe->len = connection->request.body_length -
+		    connection->body_received;
+	}
+	sqe->user_data = (unsigned long)connection;
+	return 0;
+}
+
+/**
+ * Makes sure the loop wakes up for the next tick of the wheel that may
+ * expire a deadline.
+ */
+static int uring_arm(uring_t *ring, uint64_t now)
+{
+	int delay = wheel_timeout(&uring_wheel, now);
+	if (delay < 0 || (uring_armed > 0 && uring_armed <= now + delay))
+		return 0;
+
+	if (uring_reserve(ring, 1) < 0)
+		return -1;
+
+	// Read by the kernel when the entry is submitted
+	uring_tick.tv_sec = delay / 1000;
+	uring_tick.tv_nsec = (delay % 1000) * 1000000;
+
+	struct io_uring_sqe *sqe = uring_sqe(ring);
+	sqe->opcode = IORING_OP_TIMEOUT;
+	sqe->fd = -1;
+	sqe->addr = (unsigned long)&uring_tick;
+	sqe->len = 1;
+	sqe->user_data = URING_DATA_TICK;
+	uring_armed = now + delay;
+	return 0;
+}
+
+/**
+ * Replaces the deadline of a connection, in milliseconds from now, 0 for
+ * none.
+ */
+static void uring_deadline(uring_connection_t *connection, int timeout)
+{
+	wheel_remove(&uring_wheel, &connection->timer);
+	if (timeout > 0)
+		wheel_add(&uring_wheel, &connection->timer,
+			  wheel_now() + timeout);
+}
+
+static void uring_expire(const server_t server, uint64_t now)
+{
+	wheel_timer_t *timer = wheel_advance(&uring_wheel, now);
+	while (NULL != timer) {
+		wheel_timer_t *next = timer->next;
+		uring_connection_t *connection = timer->data;
+
+		// Responding, the deadline moves with every bit of progress
+		uint64_t deadline =
+		    connection->progress + server.config.send_timeout;
+		if (connection->state >= URING_OPENING_FILE && deadline > now)
+			wheel_add(&uring_wheel, timer, deadline);
+		else
+			// The operation in flight fails and closes the connection
+			shutdown(connection->client.socket, SHUT_RDWR);
+		timer = next;
+	}
+}
+
+static int uring_send(uring_t *ring, uring_connection_t *connection)
+{
+	if (uring_reserve(ring, 1) < 0)
+		return -1;
+
+	struct io_uring_sqe *sqe = uring_sqe(ring);
+	sqe->opcode = IORING_OP_SEND;
+	sqe->fd = connection->client.socket;
+	if (URING_WRITING_HEAD == connection->state) {
+		// Head and in-memory body in one operation
+		sqe->opcode = IORING_OP_SENDMSG;
+		sqe->addr = (unsigned long)
+		    http_output_message(&connection->output);
+		sqe->len = 1;
+		// Hold the segment back when a file or another response follows
+		if ((connection->file >= 0
+		     && connection->output.file_length > 0)
+		    || connection->response.more)
+			sqe->msg_flags = MSG_MORE;
+	} else {
+		sqe->addr = (unsigned long)(connection->chunk +
+					    connection->chunk_sent);
+		sqe->len = connection->chunk_length - connection->chunk_sent;
+	}
+	sqe->msg_flags |= MSG_NOSIGNAL;
+	sqe->user_data = (unsigned long)connection;
+	return 0;
+}
+
+static int uring_read_file(uring_t *ring, uring_connection_t *connection)
+{
+	if (uring_reserve(ring, 1) < 0)
+		return -1;
+
+	const http_output_t *output = &connection->output;
+	size_t remaining = output->file_length - connection->file_sent;
+	struct io_uring_sqe *sqe = uring_sqe(ring);
+	sqe->opcode = IORING_OP_READ;
+	sqe->fd = connection->file;
+	sqe->addr = (unsigned long)connection->chunk;
+	sqe->len =
+	    remaining > SERVER_BUFFER_SIZE ? SERVER_BUFFER_SIZE : remaining;
+	sqe->off = output->file_offset + connection->file_sent;
+	sqe->user_data = (unsigned long)connection;
+	return 0;
+}
+
+static int uring_fill_pipe(uring_t *ring, uring_connection_t *connection)
+{
+	if (uring_reserve(ring, 1) < 0)
+		return -1;
+
+	const http_output_t *output = &connection->output;
+	size_t remaining = output->file_length - connection->file_sent;
+	struct io_uring_sqe *sqe = uring_sqe(ring);
+	sqe->opcode = IORING_OP_SPLICE;
+	sqe->fd = connection->pipe[1];
+	sqe->off = (uint64_t)-1;
+	sqe->splice_fd_in = connection->file;
+	sqe->splice_off_in = output->file_offset + connection->file_sent;
+	sqe->len = remaining > URING_PIPE_SIZE ? URING_PIPE_SIZE : remaining;
+	sqe->splice_flags = SPLICE_F_MOVE;
+	sqe->user_data = (unsigned long)connection;
+	return 0;
+}
+
+static int uring_drain_pipe(uring_t *ring, uring_connection_t *connection)
+{
+	if (uring_reserve(ring, 1) < 0)
+		return -1;
+
+	struct io_uring_sqe *sqe = uring_sqe(ring);
+	sqe->opcode = IORING_OP_SPLICE;
+	sqe->fd = connection->client.socket;
+	sqe->off = (uint64_t)-1;
+	sqe->splice_fd_in = connection->pipe[0];
+	sqe->splice_off_in = (uint64_t)-1;
+	sqe->len = connection->piped;
+	sqe->splice_flags = SPLICE_F_MOVE;
+	// Hold the segment back when more body or another response follows
+	if (connection->file_sent + connection->piped <
+	    connection->output.file_length || connection->response.more)
+		sqe->splice_flags |= SPLICE_F_MORE;
+	sqe->user_data = (unsigned long)connection;
+	return 0;
+}
+
+/**
+ * Starts sending the rest of the file slice: through the pipe, or copied
+ * through the chunk buffer when there is no pipe or the file cannot be
+ * spliced.
+ */
+static int uring_send_file(uring_t *ring, uring_connection_t *connection)
+{
+	if (connection->zero_copy && connection->pipe[0] < 0
+	    && pipe2(connection->pipe, O_CLOEXEC) < 0)
+		connection->zero_copy = false;
+
+	if (!connection->zero_copy) {
+		connection->state = URING_READING_FILE;
+		return uring_read_file(ring, connection);
+	}
+	connection->state = URING_FILLING_PIPE;
+	return uring_fill_pipe(ring, connection);
+}
+
+static int uring_open_file(uring_t *ring, uring_connection_t *connection)
+{
+	if (uring_reserve(ring, 1) < 0)
+		return -1;
+
+	struct io_uring_sqe *sqe = uring_sqe(ring);
+	sqe->opcode = IORING_OP_OPENAT;
+	sqe->fd = AT_FDCWD;
+	sqe->addr = (unsigned long)connection->file_name;
+	sqe->open_flags = O_RDONLY | O_CLOEXEC;
+	sqe->user_data = (unsigned long)connection;
+	return 0;
+}
+
+static int uring_stat_file(uring_t *ring, uring_connection_t *connection)
+{
+	if (uring_reserve(ring, 1) < 0)
+		return -1;
+
+	struct io_uring_sqe *sqe = uring_sqe(ring);
+	sqe->opcode = IORING_OP_STATX;
+	sqe->fd = connection->file;
+	sqe->addr = (unsigned long)"";
+	sqe->len = STATX_TYPE | STATX_SIZE | STATX_INO | STATX_MTIME;
+	sqe->off = (unsigned long)&connection->file_stat;
+	sqe->statx_flags = AT_EMPTY_PATH;
+	sqe->user_data = (unsigned long)connection;
+	return 0;
+}
+
+static void uring_close(uring_connection_t *connection)
+{
+	wheel_remove(&uring_wheel, &connection->timer);
+	close(connection->client.socket);
+	if (connection->file >= 0)
+		close(connection->file);
+	if (connection->pipe[0] >= 0) {
+		close(connection->pipe[0]);
+		close(connection->pipe[1]);
+	}
+
+	http_request_destroy(&connection->request);
+	http_response_destroy(&connection->response);
+	arena_free(&connection->arena);
+	free(connection);
+	metrics_connection_close();
+	admission_leave();
+}
+
+static void uring_accepted(uring_t *ring, const server_t server, int socket)
+{
+	// Over the limit, the connection is refused before it costs memory
+	if (!admission_enter(socket)) {
+		admission_shed(socket);
+		return;
+	}
+
+	uring_connection_t *connection = malloc(sizeof(uring_connection_t));
+	if (NULL == connection) {
+		close(socket);
+		admission_leave();
+		return;
+	}
+
+	socklen_t client_addr_len = sizeof(connection->client.client_addr);
+	getpeername(socket, (struct sockaddr *)&connection->client.client_addr,
+		    &client_addr_len);
+	connection->client.socket = socket;
+	connection->state = URING_READING_HEAD;
+	http_buffer_init(&connection->input);
+	connection->body_received = 0;
+	connection->file = -1;
+	connection->pipe[0] = -1;
+	connection->pipe[1] = -1;
+	connection->requests = 0;
+	connection->keep_alive = false;
+	connection->idle = false;
+	wheel_timer_init(&connection->timer, connection);
+	connection->progress = 0;
+
+	arena_init(&connection->arena, ARENA_BLOCK_SIZE);
+
+	http_request_init(&connection->request, &connection->arena);
+	if (http_response_create(&connection->response,
+				 &connection->arena) < 0) {
+		close(socket);
+		arena_free(&connection->arena);
+		free(connection);
+		admission_leave();
+		return;
+	}
+
+	metrics_connection_open();
+	trace_begin(&connection->trace);
+	uring_deadline(connection, server.config.request_timeout);
+	if (uring_recv(ring, connection) < 0)
+		uring_close(connection);
+}
+
+/**
+ * Serializes the response head (and in-memory body, if any) and starts
+ * sending it.
+ */
+static int uring_respond(uring_t *ring, uring_connection_t *connection)
+{
+	http_request_t *request = &connection->request;
+	http_response_t *response = &connection->response;
+
+	if (request->method == HTTP_METHOD_HEAD && connection->file >= 0) {
+		close(connection->file);
+		connection->file = -1;
+	}
+
+	if (http_output_prepare(&connection->output, request, response,
+				connection->file >= 0) < 0)
+		return -1;
+
+	connection->file_sent = 0;
+	connection->zero_copy = true;
+	connection->state = URING_WRITING_HEAD;
+
+	return uring_send(ring, connection);
+}
+
+static int uring_prepare(uring_t *ring, const server_t server,
+			 uring_connection_t *connection)
+{
+	http_request_t *request = &connection->request;
+	http_response_t *response = &connection->response;
+
+	connection->started = metrics_now();
+	trace_request(&connection->trace, request->method, request->uri);
+
+	// The request is complete, the response gets the send timeout
+	uring_deadline(connection, server.config.send_timeout);
+	connection->progress = wheel_now();
+
+	server_route route = server_route_request(server, request, response,
+						  connection->file_name,
+						  SERVER_BUFFER_SIZE);
+	if (SERVER_ROUTE_NONE == route)
+		return -1;
+	trace_mark(&connection->trace, TRACE_ROUTED);
+
+	connection->keep_alive =
+	    server_keep_alive(server, request, ++connection->requests);
+	response->keep_alive = connection->keep_alive;
+	response->more = connection->keep_alive
+	    && http_buffer_pending(&connection->input);
+
+	if (SERVER_ROUTE_TEXT == route || SERVER_ROUTE_CACHE == route)
+		return uring_respond(ring, connection);
+
+	connection->state = URING_OPENING_FILE;
+	return uring_open_file(ring, connection);
+}
+
+/**
+ * Handles a received chunk. Returns 1 once the whole request has been
+ * received, 0 when more data is needed and a negative value on error.
+ */
+static int uring_received(uring_connection_t *connection, size_t size)
+{
+	http_request_t *request = &connection->request;
+	http_buffer_t *input = &connection->input;
+
+	if (URING_READING_BODY == connection->state)
+		connection->body_received += size;
+	else {
+		input->length += size;
+		input->data[input->length] = '\0';
+
+		int err = http_buffer_request(input, request,
+					      &connection->body_received);
+		if (err <= 0)
+			return err;
+		connection->state = URING_READING_BODY;
+	}
+
+	if (connection->body_received < request->body_length)
+		return 0;
+	if (NULL != request->body)
+		request->body[request->body_length] = '\0';
+	return 1;
+}
+
+/**
+ * Gets a persistent connection ready for its next request.
+ */
+static int uring_reset(uring_t *ring, const server_t server,
+		       uring_connection_t *connection)
+{
+	if (connection->file >= 0)
+		close(connection->file);
+	connection->file = -1;
+
+	http_request_destroy(&connection->request);
+	http_response_destroy(&connection->response);
+	arena_reset(&connection->arena);
+	http_request_init(&connection->request, &connection->arena);
+	if (http_response_create(&connection->response,
+				 &connection->arena) < 0)
+		return -1;
+
+	connection->state = URING_READING_HEAD;
+	http_buffer_shift(&connection->input);
+	connection->body_received = 0;
+	trace_begin(&connection->trace);
+
+	// The next request may have been pipelined behind the previous one
+	connection->idle = 0 == connection->input.length;
+	uring_deadline(connection, connection->idle ?
+		       server.config.keep_alive_timeout :
+		       server.config.request_timeout);
+	int err = uring_received(connection, 0);
+	if (err < 0)
+		return err;
+	if (err == 0)
+		return uring_recv(ring, connection);
+	return uring_prepare(ring, server, connection);
+}
+
+/**
+ * Advances a connection after one of its operations completed. Returns a
+ * negative value when the connection must be closed.
+ */
+static int uring_complete(uring_t *ring, const server_t server,
+			  uring_connection_t *connection, int result)
+{
+	int err;
+	uring_state reading;
+
+	switch (connection->state) {
+	case URING_READING_HEAD:
+	case URING_READING_BODY:
+		if (result <= 0)
+			return -1;
+		// The next request started, it gets the request timeout
+		if (connection->idle) {
+			connection->idle = false;
+			uring_deadline(connection,
+				       server.config.request_timeout);
+		}
+		if (0 == connection->trace.at[TRACE_RECEIVING])
+			trace_mark(&connection->trace, TRACE_RECEIVING);
+		reading = connection->state;
+		err = uring_received(connection, result);
+		if (err < 0)
+			return err;
+		if (err == 0) {
+			// The head is in, the body gets its own deadline
+			if (URING_READING_HEAD == reading
+			    && URING_READING_BODY == connection->state)
+				uring_deadline(connection,
+					       server.config.body_timeout);
+			return uring_recv(ring, connection);
+		}
+		return uring_prepare(ring, server, connection);
+
+	case URING_OPENING_FILE:
+		if (result < 0) {
+			http_response_file_error(&connection->response,
+						 -result);
+			return uring_respond(ring, connection);
+		}
+		connection->file = result;
+		connection->state = URING_STATING_FILE;
+		return uring_stat_file(ring, connection);
+
+	case URING_STATING_FILE:
+		if (result < 0 || !S_ISREG(connection->file_stat.stx_mode)) {
+			close(connection->file);
+			connection->file = -1;
+			http_response_status(&connection->response, 500);
+			return uring_respond(ring, connection);
+		}
+		connection->file_size = connection->file_stat.stx_size;
+		trace_mark(&connection->trace, TRACE_OPENED);
+
+		struct timespec mtime = {
+			.tv_sec = connection->file_stat.stx_mtime.tv_sec,
+			.tv_nsec = connection->file_stat.stx_mtime.tv_nsec
+		};
+		bool send_file =
+		    !http_response_conditional(&connection->request,
+					       &connection->response,
+					       connection->file_stat.stx_ino,
+					       connection->file_size, &mtime);
+		if (send_file) {
+			http_response_file_size(&connection->response,
+						connection->file_size);
+			send_file = http_response_range(&connection->request,
+							&connection->response,
+							connection->file_size);
+		}
+		// The client's copy is current or no range fits, only the head goes
+		if (!send_file) {
+			close(connection->file);
+			connection->file = -1;
+		}
+		return uring_respond(ring, connection);
+
+	case URING_WRITING_HEAD:
+		if (result < 0)
+			return -1;
+		if (server.config.send_timeout > 0)
+			connection->progress = wheel_now();
+		http_output_advance(&connection->output, result);
+		if (!http_output_done(&connection->output))
+			return uring_send(ring, connection);
+		if (connection->file < 0
+		    || connection->file_sent >= connection->output.file_length)
+			break;
+		if (0 == connection->trace.at[TRACE_HEAD_SENT])
+			trace_mark(&connection->trace, TRACE_HEAD_SENT);
+		return uring_send_file(ring, connection);
+
+	case URING_FILLING_PIPE:
+		// Not supported for this file (or kernel), copy it instead
+		if (-EINVAL == result) {
+			connection->zero_copy = false;
+			return uring_send_file(ring, connection);
+		}
+		if (result <= 0)
+			return -1;	// Failed or truncated
+		connection->piped = result;
+		connection->state = URING_DRAINING_PIPE;
+		return uring_drain_pipe(ring, connection);
+
+	case URING_DRAINING_PIPE:
+		if (result <= 0)
+			return -1;
+		if (server.config.send_timeout > 0)
+			connection->progress = wheel_now();
+		connection->piped -= result;
+		connection->file_sent += result;
+		if (connection->piped > 0)
+			return uring_drain_pipe(ring, connection);
+		if (connection->file_sent >= connection->output.file_length)
+			break;
+		connection->state = URING_FILLING_PIPE;
+		return uring_fill_pipe(ring, connection);
+
+	case URING_READING_FILE:
+		if (result <= 0)
+			return -1;
+		connection->chunk_length = result;
+		connection->chunk_sent = 0;
+		connection->state = URING_WRITING_FILE;
+		return uring_send(ring, connection);
+
+	case URING_WRITING_FILE:
+		if (result < 0)
+			return -1;
+		if (server.config.send_timeout > 0)
+			connection->progress = wheel_now();
+		connection->chunk_sent += result;
+		connection->file_sent += result;
+		if (connection->chunk_sent < connection->chunk_length)
+			return uring_send(ring, connection);
+		if (connection->file_sent >= connection->output.file_length)
+			break;
+		connection->state = URING_READING_FILE;
+		return uring_read_file(ring, connection);
+	}
+
+	// A multipart response goes on with its next part
+	if (http_output_next(&connection->output, &connection->response)) {
+		connection->file_sent = 0;
+		connection->state = URING_WRITING_HEAD;
+		return uring_send(ring, connection);
+	}
+
+	// The response is complete
+	connection->response.sent = connection->output.length +
+	    connection->file_sent;
+	connection->response.body_sent = connection->response.sent -
+	    connection->output.head_length;
+	metrics_request(connection->request.method,
+			connection->response.status_code,
+			connection->response.sent, connection->started);
+	trace_end(&connection->trace, connection->response.status_code,
+		  connection->response.sent);
+	accesslog_request(&connection->client, &connection->request,
+			  &connection->response, connection->started);
+	if (!connection->keep_alive) {
+		if (http_request_chunked(&connection->request))
+			server_linger(connection->client, 0);
+		return -1;
+	}
+	return uring_reset(ring, server, connection);
+}
+
+static int uring_listener(uring_t *ring, const server_t server,
+			  unsigned long data, int result, unsigned int flags)
+{
+	if (URING_DATA_POLL == data)
+		return uring_accept(ring, server);
+
+	if (result >= 0) {
+		uring_accepted(ring, server, result);
+		if (flags & IORING_CQE_F_MORE)
+			return 0;
+		return uring_accept(ring, server);
+	}
+
+	// Multishot accept needs Linux 5.19, retry with one-shot accepts
+	if (-EINVAL == result && uring_multishot) {
+		uring_multishot = false;
+		return uring_accept(ring, server);
+	}
+
+	// Non-blocking listener shared with other workers: wait until ready
+	if (-EAGAIN == result || -EWOULDBLOCK == result)
+		return uring_poll_listener(ring, server);
+
+	if (-ECONNABORTED != result && -EINTR != result)
+		metrics_accept_error();
+
+	// Out of descriptors, an accept fails before it even waits for a
+	// connection: refuse the pending one and wait for the next
+	if (-EMFILE == result || -ENFILE == result) {
+		server_refuse_connection(server);
+		if (flags & IORING_CQE_F_MORE)
+			return 0;
+		return uring_poll_listener(ring, server);
+	}
+
+	if (flags & IORING_CQE_F_MORE)
+		return 0;
+	return uring_accept(ring, server);
+}
+
+int uring_loop_run(const server_t server)
+{
+	signal(SIGPIPE, SIG_IGN);
+	server_spare_init();
+
+	uring_t ring;
+	int err = uring_init(&ring, URING_ENTRIES);
+	if (err < 0)
+		return err;
+
+	err = uring_accept(&ring, server);
+	if (err < 0) {
+		uring_free(&ring);
+		return err;
+	}
+	wheel_init(&uring_wheel, wheel_now());
+
+	while (1) {
+		trace_poll();
+
+		err = uring_submit(&ring, 1);
+		if (err < 0 && EBUSY != errno && EINTR != errno)
+			break;
+
+		unsigned int head = *ring.cq_head;
+		unsigned int tail = __atomic_load_n(ring.cq_tail,
+						    __ATOMIC_ACQUIRE);
+		while (head != tail) {
+			struct io_uring_cqe *cqe =
+			    &ring.cqes[head & *ring.cq_mask];
+			unsigned long data = cqe->user_data;
+			int result = cqe->res;
+			unsigned int flags = cqe->flags;
+
+			head++;
+			__atomic_store_n(ring.cq_head, head, __ATOMIC_RELEASE);
+
+			if (URING_DATA_TICK == data) {
+				uring_armed = 0;
+				continue;
+			}
+
+			if (URING_DATA_ACCEPT == data || URING_DATA_POLL == data) {
+				err = uring_listener(&ring, server, data,
+						     result, flags);
+				if (err < 0)
+					goto stop;
+				continue;
+			}
+
+			uring_connection_t *connection =
+			    (uring_connection_t *) data;
+			if (uring_complete(&ring, server, connection, result)
+			    < 0)
+				uring_close(connection);
+		}
+
+		uint64_t now = wheel_now();
+		uring_expire(server, now);
+		err = uring_arm(&ring, now);
+		if (err < 0)
+			break;
+	}
+
+ stop:
+	uring_free(&ring);
+	return err;
+}
@@ -0,0 +1,160 @@
+#define _GNU_SOURCE
+
+#include <time.h>
+
+#include "wheel.h"
+
+#define WHEEL_MASK (WHEEL_SLOTS - 1)
+#define WHEEL_SPAN (((uint64_t)1 << (WHEEL_BITS * WHEEL_LEVELS)) - 1)
+
+/**
+ * Milliseconds of the coarse monotonic clock, precise enough for ticks and
+ * read without a system call.
+ */
+uint64_t wheel_now(void)
+{
+	struct timespec now;
+	clock_gettime(CLOCK_MONOTONIC_COARSE, &now);
+	return (uint64_t)now.tv_sec * 1000 + now.tv_nsec / 1000000;
+}
+
+void wheel_init(wheel_t *wheel, uint64_t now)
+{
+	wheel->now = now / WHEEL_TICK;
+	wheel->count = 0;
+	for (int level = 0; level < WHEEL_LEVELS; level++)
+		for (int slot = 0; slot < WHEEL_SLOTS; slot++)
+			wheel->slots[level][slot] = NULL;
+}
+
+void wheel_timer_init(wheel_timer_t *timer, void *data)
+{
+	timer->expires = 0;
+	timer->data = data;
+	timer->next = NULL;
+	timer->pprev = NULL;
+}
+
+bool wheel_pending(const wheel_timer_t *timer)
+{
+	return NULL != timer->pprev;
+}
+
+// Links the timer in the slot its distance to the current tick falls in
+static void wheel_place(wheel_t *wheel, wheel_timer_t *timer)
+{
+	uint64_t delta = timer->expires - wheel->now;
+	int level = 0;
+	while (level < WHEEL_LEVELS - 1
+	       && delta >= (uint64_t)1 << (WHEEL_BITS * (level + 1)))
+		level++;
+
+	wheel_timer_t **head =
+	    &wheel->slots[level][(timer->expires >> (WHEEL_BITS * level)) &
+				 WHEEL_MASK];
+	timer->next = *head;
+	if (NULL != *head)
+		(*head)->pprev = &timer->next;
+	*head = timer;
+	timer->pprev = head;
+}
+
+/**
+ * Schedules a timer for a deadline in milliseconds, rounded up to the next
+ * tick. A timer already scheduled must be removed first.
+ */
+void wheel_add(wheel_t *wheel, wheel_timer_t *timer, uint64_t deadline)
+{
+	uint64_t expires = (deadline + WHEEL_TICK - 1) / WHEEL_TICK;
+	if (expires <= wheel->now)
+		expires = wheel->now + 1;
+	if (expires - wheel->now > WHEEL_SPAN)
+		expires = wheel->now + WHEEL_SPAN;
+
+	timer->expires = expires;
+	wheel_place(wheel, timer);
+	wheel->count++;
+}
+
+void wheel_remove(wheel_t *wheel, wheel_timer_t *timer)
+{
+	if (!wheel_pending(timer))
+		return;
+
+	*timer->pprev = timer->next;
+	if (NULL != timer->next)
+		timer->next->pprev = timer->pprev;
+	timer->next = NULL;
+	timer->pprev = NULL;
+	wheel->count--;
+}
+
+// Spreads the timers of a slot over the levels below
+static void wheel_cascade(wheel_t *wheel, int level)
+{
+	int slot = (wheel->now >> (WHEEL_BITS * level)) & WHEEL_MASK;
+	wheel_timer_t *timer = wheel->slots[level][slot];
+	wheel->slots[level][slot] = NULL;
+
+	while (NULL != timer) {
+		wheel_timer_t *next = timer->next;
+		wheel_place(wheel, timer);
+		timer = next;
+	}
+}
+
+/**
+ * Moves the wheel to the current time in milliseconds. Returns the timers
+ * that expired, no longer scheduled and chained through next, so they can
+ * be scheduled again while walking the chain.
+ */
+wheel_timer_t *wheel_advance(wheel_t *wheel, uint64_t now)
+{
+	uint64_t target = now / WHEEL_TICK;
+	wheel_timer_t *expired = NULL;
+
+	// Nothing to expire, the ticks in between can be skipped
+	if (0 == wheel->count && target > wheel->now)
+		wheel->now = target;
+
+	while (wheel->now < target) {
+		wheel->now++;
+
+		// A lap of a level, the next slot of the one above comes down
+		for (int level = 1; level < WHEEL_LEVELS; level++) {
+			if (wheel->now & (((uint64_t)1 << (WHEEL_BITS *
+							   level)) - 1))
+				break;
+			wheel_cascade(wheel, level);
+		}
+
+		wheel_timer_t **head = &wheel->slots[0][wheel->now & WHEEL_MASK];
+		while (NULL != *head) {
+			wheel_timer_t *timer = *head;
+			wheel_remove(wheel, timer);
+			timer->next = expired;
+			expired = timer;
+		}
+	}
+
+	return expired;
+}
+
+/**
+ * Returns how many milliseconds the caller may sleep before advancing the
+ * wheel again, or -1 when no timer is scheduled. Without a timer in the
+ * first level, that is until its lap ends and the level above cascades.
+ */
+int wheel_timeout(const wheel_t *wheel, uint64_t now)
+{
+	if (0 == wheel->count)
+		return -1;
+
+	uint64_t tick = wheel->now + 1;
+	while ((tick & WHEEL_MASK) != 0
+	       && NULL == wheel->slots[0][tick & WHEEL_MASK])
+		tick++;
+
+	uint64_t deadline = tick * WHEEL_TICK;
+	return deadline > now ? (int)(deadline - now) : 0;
+}
@@ -0,0 +1,22 @@
+#ifndef TESTS_H
+#define TESTS_H
+
+#include <stdbool.h>
+
+/**
+ * Unit tests
+ *
+ * Each suite is a function checking its module with test_check(). The
+ * runner calls every suite and exits with a failure status when a check
+ * failed, after reporting each failed check.
+ */
+
+void test_check(const char *name, bool passed);
+
+void test_cache(void);
+void test_cimap(void);
+void test_http(void);
+void test_parser(void);
+void test_wheel(void);
+
+#endif
@@ -0,0 +1,84 @@
+#define _GNU_SOURCE
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <sys/wait.h>
+#include <unistd.h>
+
+#include "arena.h"
+#include "cache.h"
+#include "http.h"
+#include "tests.h"
+
+#define TEST_CACHE_SIZE 65536
+
+static int test_cache_fill(const char *path, cache_entry_t **entry)
+{
+	arena_t arena;
+	arena_init(&arena, ARENA_BLOCK_SIZE);
+	http_response_t response;
+	int err = http_response_create(&response, &arena);
+	if (err == 0)
+		err = cache_fill(path, 0, &response, entry);
+	http_response_destroy(&response);
+	arena_free(&arena);
+	return err;
+}
+
+// A process that dies with an entry pinned gives the pin back when reaped
+static void test_cache_reclaim(const char *path)
+{
+	pid_t pid = fork();
+	if (pid == 0) {
+		cache_entry_t *entry;
+		_exit(test_cache_fill(path, &entry) == 0 ? 0 : 1);
+	}
+	int status = -1;
+	waitpid(pid, &status, 0);
+	test_check("cache_fill_child", WIFEXITED(status)
+		   && WEXITSTATUS(status) == 0);
+
+	cache_entry_t *entry;
+	test_check("cache_acquire_filled", cache_acquire(path, 0, &entry) == 0);
+	if (NULL == entry)
+		return;
+	test_check("cache_pinned_by_both", entry->refcount == 2);
+
+	cache_reclaim(pid);
+	test_check("cache_reclaim_pid", entry->refcount == 1);
+	cache_release(entry);
+	test_check("cache_release", entry->refcount == 0);
+}
+
+// Pins come from a bounded pool, lookups miss once it is used up
+static void test_cache_pins(const char *path)
+{
+	cache_entry_t *entry;
+	int pinned = 0;
+	while (cache_acquire(path, 0, &entry) == 0)
+		pinned++;
+	test_check("cache_pins_bounded", pinned > 0
+		   && pinned <= CACHE_MIN_ENTRIES * CACHE_PINS_PER_ENTRY);
+
+	cache_reclaim(getpid());
+	test_check("cache_reclaim_all", cache_acquire(path, 0, &entry) == 0
+		   && entry->refcount == 1);
+	cache_release(entry);
+}
+
+void test_cache(void)
+{
+	char path[] = "/tmp/simple-http-test-XXXXXX";
+	int file = mkstemp(path);
+	if (file < 0 || write(file, "cached", 6) != 6) {
+		test_check("cache_file", false);
+		return;
+	}
+	close(file);
+
+	test_check("cache_init", cache_init(TEST_CACHE_SIZE, 4096) == 0);
+	test_cache_reclaim(path);
+	test_cache_pins(path);
+	cache_free();
+	unlink(path);
+}
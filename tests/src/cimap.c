@@ -0,0 +1,100 @@
+#define _GNU_SOURCE
+
+#include <stdint.h>
+#include <stdlib.h>
+
+#include "cimap.h"
+#include "tests.h"
+
+#define TEST_CIMAP_ROUNDS 50000
+#define TEST_CIMAP_KEY_SIZE 160
+
+/**
+ * Fills a with random bytes, none of them null and some past ASCII, and b
+ * with the same bytes in another case, one of them flipped now and then.
+ */
+static size_t test_cimap_keys(char *a, char *b, unsigned int *seed)
+{
+	size_t length = rand_r(seed) % TEST_CIMAP_KEY_SIZE;
+	for (size_t i = 0; i < length; i++) {
+		a[i] = (char)(rand_r(seed) % 255 + 1);
+		b[i] = a[i];
+		if (b[i] >= 'a' && b[i] <= 'z' && rand_r(seed) % 2)
+			b[i] -= 'a' - 'A';
+	}
+	if (length > 0 && rand_r(seed) % 4 == 0)
+		b[rand_r(seed) % length] ^= 1 << (rand_r(seed) % 8);
+	return length;
+}
+
+// Every vector kernel gives the scalar results, on random keys
+static void test_cimap_kernels(void)
+{
+	static const char *names[] = { "cimap_kernel_scalar", "cimap_kernel_sse2",
+		"cimap_kernel_avx2"
+	};
+	bool agree[CIMAP_KERNEL_AVX2 + 1] = { true, true, true };
+	cimap_kernel selected = cimap_kernel_get();
+	char a[TEST_CIMAP_KEY_SIZE], b[TEST_CIMAP_KEY_SIZE];
+	unsigned int seed = 42;
+
+	for (int i = 0; i < TEST_CIMAP_ROUNDS; i++) {
+		size_t length = test_cimap_keys(a, b, &seed);
+
+		cimap_kernel_set(CIMAP_KERNEL_SCALAR);
+		uint64_t folded = cimap_hash(a, length, false);
+		uint64_t exact = cimap_hash(a, length, true);
+		uint64_t other = cimap_hash(b, length, false);
+		bool equal = cimap_equal(a, b, length, false);
+
+		for (int kernel = CIMAP_KERNEL_SSE2;
+		     kernel <= CIMAP_KERNEL_AVX2; kernel++) {
+			if (cimap_kernel_set(kernel) < 0)
+				continue;
+			if (cimap_hash(a, length, false) != folded
+			    || cimap_hash(a, length, true) != exact
+			    || cimap_hash(b, length, false) != other
+			    || cimap_equal(a, b, length, false) != equal)
+				agree[kernel] = false;
+		}
+	}
+	cimap_kernel_set(selected);
+
+	for (int kernel = CIMAP_KERNEL_SSE2; kernel <= CIMAP_KERNEL_AVX2;
+	     kernel++)
+		test_check(names[kernel], agree[kernel]);
+}
+
+// Keys that only differ in case are the same key
+static void test_cimap_case(void)
+{
+	cimap_t *map = cimap_create(8, false);
+	cimap_set(map, "Content-Type", "text/html");
+	cimap_set(map, "X-A-Rather-Long-Header-Name-Past-32-Bytes", "1");
+
+	test_check("cimap_case_get",
+		   NULL != cimap_get(map, "content-TYPE")
+		   && NULL != cimap_get(map,
+					"x-a-rather-long-header-name-past-32-bytes"));
+	test_check("cimap_case_missing", NULL == cimap_get(map, "Content-Typf"));
+	cimap_free(map);
+}
+
+// cimap_init() picks the widest kernel the CPU has
+static void test_cimap_init(void)
+{
+	cimap_kernel selected = cimap_kernel_get();
+	bool widest = true;
+	for (int kernel = selected + 1; kernel <= CIMAP_KERNEL_AVX2; kernel++)
+		if (cimap_kernel_set(kernel) == 0)
+			widest = false;
+	cimap_kernel_set(selected);
+	test_check("cimap_init_widest", widest);
+}
+
+void test_cimap(void)
+{
+	test_cimap_init();
+	test_cimap_case();
+	test_cimap_kernels();
+}
@@ -0,0 +1,133 @@
+#define _GNU_SOURCE
+
+#include <stdio.h>
+#include <string.h>
+
+#include "headers.h"
+#include "http.h"
+#include "tests.h"
+
+#define TEST_HTTP_SIZE 1000	// of the representation ranges are cut from
+#define TEST_HTTP_RANGE_SIZE 64
+
+/**
+ * Applies a Range header to a GET of TEST_HTTP_SIZE bytes. Returns the
+ * status of the response, with its Content-Range ("" without one) and
+ * ranges.
+ */
+static int test_http_range(const char *value, char *content_range,
+			   http_ranges_t *ranges)
+{
+	http_request_t request;
+	http_request_init(&request, NULL);
+	request.method = HTTP_METHOD_GET;
+	request.headers[0] = (http_header_t) {
+	.id = HEADER_RANGE,.name = "Range",.name_length = 5,.value =
+		    value,.value_length = strlen(value)};
+	request.header_count = 1;
+
+	http_response_t response;
+	http_response_create(&response, NULL);
+	headers_set_id(&response.headers, HEADER_CONTENT_TYPE, "text/plain");
+	bool send = http_response_range(&request, &response, TEST_HTTP_SIZE);
+	int status = send == (416 != response.status_code) ?
+	    response.status_code : -1;
+
+	const char *range = headers_get_id(&response.headers,
+					   HEADER_CONTENT_RANGE);
+	snprintf(content_range, TEST_HTTP_RANGE_SIZE, "%s",
+		 NULL != range ? range : "");
+	*ranges = response.ranges;
+	ranges->type = NULL;
+	http_response_destroy(&response);
+	return status;
+}
+
+// A single range, answered with its Content-Range
+static bool test_http_single(const char *value, const char *expected)
+{
+	char content_range[TEST_HTTP_RANGE_SIZE];
+	http_ranges_t ranges;
+	return test_http_range(value, content_range, &ranges) == 206
+	    && ranges.count == 1 && strcmp(content_range, expected) == 0;
+}
+
+// The whole representation, as if there were no Range header
+static bool test_http_ignored(const char *value)
+{
+	char content_range[TEST_HTTP_RANGE_SIZE];
+	http_ranges_t ranges;
+	return test_http_range(value, content_range, &ranges) == 200
+	    && ranges.count == 0 && '\0' == content_range[0];
+}
+
+static bool test_http_unsatisfiable(const char *value)
+{
+	char content_range[TEST_HTTP_RANGE_SIZE];
+	http_ranges_t ranges;
+	return test_http_range(value, content_range, &ranges) == 416
+	    && strcmp(content_range, "bytes */1000") == 0;
+}
+
+static void test_http_ranges(void)
+{
+	test_check("http_range_suffix",
+		   test_http_single("bytes=-100", "bytes 900-999/1000")
+		   && test_http_single("bytes=-2000", "bytes 0-999/1000"));
+	test_check("http_range_open_ended",
+		   test_http_single("bytes=500-", "bytes 500-999/1000")
+		   && test_http_single("bytes=999-", "bytes 999-999/1000"));
+	test_check("http_range_clamped",
+		   test_http_single("bytes=900-5000", "bytes 900-999/1000"));
+	test_check("http_range_unsatisfiable",
+		   test_http_unsatisfiable("bytes=1000-")
+		   && test_http_unsatisfiable("bytes=-0")
+		   && test_http_unsatisfiable("bytes=2000-3000, 5000-"));
+	test_check("http_range_partly_satisfiable",
+		   test_http_single("bytes=2000-, 0-9", "bytes 0-9/1000"));
+
+	test_check("http_range_overlapping",
+		   test_http_single("bytes=0-499,400-599", "bytes 0-599/1000")
+		   && test_http_single("bytes=0-,0-,0-", "bytes 0-999/1000")
+		   && test_http_single("bytes=0-1,4-5,2-3", "bytes 0-5/1000")
+		   && test_http_single("bytes=10-19,-990", "bytes 10-999/1000"));
+
+	char content_range[TEST_HTTP_RANGE_SIZE];
+	http_ranges_t ranges;
+	test_check("http_range_multipart",
+		   test_http_range("bytes=10-19,0-4,15-29", content_range,
+				   &ranges) == 206 && ranges.count == 2
+		   && ranges.parts[0].offset == 0 && ranges.parts[0].length == 5
+		   && ranges.parts[1].offset == 10
+		   && ranges.parts[1].length == 20
+		   && '\0' == content_range[0]);
+
+	// Distinct ranges past HTTP_RANGES_MAX get the whole file
+	char value[TEST_HTTP_RANGE_SIZE * 2] = "bytes=";
+	for (int i = 0; i < HTTP_RANGES_MAX; i++)
+		sprintf(value + strlen(value), "%d-%d,", i * 2, i * 2);
+	test_check("http_range_max", test_http_range(value, content_range,
+						     &ranges) == 206
+		   && ranges.count == HTTP_RANGES_MAX);
+	strcat(value, "100-100");
+	test_check("http_range_over_max", test_http_ignored(value));
+	test_check("http_range_repeated",
+		   test_http_single("bytes=0-0,0-0,0-0,0-0,0-0,0-0,0-0,0-0,0-0",
+				    "bytes 0-0/1000"));
+
+	static const char *malformed[] = {
+		"bytes=abc", "bytes=5-2", "items=0-1", "bytes=", "bytes=,",
+		"bytes=0-1;x", "bytes=--1", "bytes=1-2-3", "bytes=-",
+		"bytes=99999999999999999999999-",
+	};
+	bool ignored = true;
+	for (size_t i = 0; i < sizeof(malformed) / sizeof(*malformed); i++)
+		if (!test_http_ignored(malformed[i]))
+			ignored = false;
+	test_check("http_range_malformed", ignored);
+}
+
+void test_http(void)
+{
+	test_http_ranges();
+}
@@ -0,0 +1,30 @@
+#include <stdio.h>
+#include <stdlib.h>
+
+#include "cimap.h"
+#include "tests.h"
+
+static unsigned int test_count = 0;
+static unsigned int test_failures = 0;
+
+void test_check(const char *name, bool passed)
+{
+	test_count++;
+	if (passed)
+		return;
+	test_failures++;
+	fprintf(stderr, "Error: Check '%s' failed\n", name);
+}
+
+int main(void)
+{
+	cimap_init();
+	test_cache();
+	test_cimap();
+	test_http();
+	test_parser();
+	test_wheel();
+
+	printf("%u checks, %u failed\n", test_count, test_failures);
+	return test_failures > 0 ? EXIT_FAILURE : EXIT_SUCCESS;
+}
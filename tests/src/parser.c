@@ -0,0 +1,218 @@
+#define _GNU_SOURCE
+
+#include <stdio.h>
+#include <string.h>
+
+#include "http.h"
+#include "parser.h"
+#include "tests.h"
+
+#define TEST_PARSER_HEAD \
+	"GET /index.html?q=1 HTTP/1.1\r\n" \
+	"Host: example.com\r\n" \
+	"Accept:  */* \r\n" \
+	"X-Empty:\r\n" \
+	"\r\n"
+#define TEST_PARSER_NEXT "GET /b HTTP/1.1\r\nHost: x\r\n\r\n"
+
+static int test_parser_run(http_request_t *request, char *data)
+{
+	http_request_init(request, NULL);
+	return parser_execute(&request->parser, request, data, strlen(data));
+}
+
+// The request line and headers of TEST_PARSER_HEAD, parsed completely
+static bool test_parser_parsed(const http_request_t *request)
+{
+	return HTTP_METHOD_GET == request->method
+	    && strcmp(request->uri, "/index.html?q=1") == 0
+	    && request->major == 1 && request->minor == 1
+	    && request->header_count == 3
+	    && strcmp(http_request_header_id(request, HEADER_HOST),
+		      "example.com") == 0
+	    && strcmp(request->headers[1].value, "*/*") == 0
+	    && request->headers[2].value_length == 0
+	    && request->parser.offset == strlen(TEST_PARSER_HEAD);
+}
+
+// Wherever a read cuts the head, the parser resumes and gets the same result
+static void test_parser_split(void)
+{
+	size_t length = strlen(TEST_PARSER_HEAD);
+	bool split = true;
+	for (size_t cut = 1; cut < length; cut++) {
+		char data[sizeof(TEST_PARSER_HEAD)];
+		memcpy(data, TEST_PARSER_HEAD, sizeof(data));
+
+		http_request_t request;
+		http_request_init(&request, NULL);
+		if (parser_execute(&request.parser, &request, data, cut) != 0
+		    || parser_execute(&request.parser, &request, data,
+				      length) != 1
+		    || !test_parser_parsed(&request))
+			split = false;
+	}
+	test_check("parser_split", split);
+
+	// One byte per read
+	char data[sizeof(TEST_PARSER_HEAD)];
+	memcpy(data, TEST_PARSER_HEAD, sizeof(data));
+	http_request_t request;
+	http_request_init(&request, NULL);
+	int err = 0;
+	for (size_t received = 1; received <= length && err == 0; received++)
+		err = parser_execute(&request.parser, &request, data, received);
+	test_check("parser_bytewise", err == 1 && test_parser_parsed(&request));
+}
+
+// A head with the given number of headers, padded to size bytes by the last
+static void test_parser_head(char *data, size_t headers, size_t size)
+{
+	size_t length = sprintf(data, "GET / HTTP/1.1\r\n");
+	for (size_t i = 0; i < headers; i++)
+		length += sprintf(data + length, "X-Header-%zu: %zu\r\n", i, i);
+	if (length + 2 < size) {
+		size_t padding = size - 2 - length;
+		memset(data + length - 2, 'x', padding);
+		length += padding;
+		memcpy(data + length - 2, "\r\n", 2);
+	}
+	strcpy(data + length, "\r\n");
+}
+
+static void test_parser_limits(void)
+{
+	static char data[2 * SERVER_BUFFER_SIZE];
+	http_request_t request;
+
+	parser_limits(PARSER_HEADERS_MAX, SERVER_BUFFER_SIZE);
+	test_parser_head(data, PARSER_HEADERS_MAX, 0);
+	test_check("parser_headers_max", test_parser_run(&request, data) == 1
+		   && request.header_count == PARSER_HEADERS_MAX);
+	test_parser_head(data, PARSER_HEADERS_MAX + 1, 0);
+	test_check("parser_headers_over",
+		   test_parser_run(&request, data) == PARSER_TOO_LARGE);
+
+	// The setting is capped by the room in the request
+	parser_limits(PARSER_HEADERS_MAX * 2, SERVER_BUFFER_SIZE);
+	test_parser_head(data, PARSER_HEADERS_MAX + 1, 0);
+	test_check("parser_headers_capped",
+		   test_parser_run(&request, data) == PARSER_TOO_LARGE);
+
+	parser_limits(PARSER_DEFAULT_HEADERS, SERVER_BUFFER_SIZE);
+	test_parser_head(data, PARSER_DEFAULT_HEADERS + 1, 0);
+	test_check("parser_headers_setting",
+		   test_parser_run(&request, data) == PARSER_TOO_LARGE);
+
+	test_parser_head(data, 1, SERVER_BUFFER_SIZE);
+	test_check("parser_size_max", strlen(data) == SERVER_BUFFER_SIZE
+		   && test_parser_run(&request, data) == 1);
+	test_parser_head(data, 1, SERVER_BUFFER_SIZE + 1);
+	test_check("parser_size_over",
+		   test_parser_run(&request, data) == PARSER_TOO_LARGE);
+
+	parser_limits(PARSER_DEFAULT_HEADERS, 1024);
+	test_parser_head(data, 1, 1025);
+	test_check("parser_size_setting",
+		   test_parser_run(&request, data) == PARSER_TOO_LARGE);
+
+	// A full receive buffer without the end of the head is refused
+	parser_limits(PARSER_DEFAULT_HEADERS, SERVER_BUFFER_SIZE);
+	http_buffer_t buffer;
+	http_buffer_init(&buffer);
+	test_parser_head(data, 1, SERVER_BUFFER_SIZE + 2);
+	memcpy(buffer.data, data, SERVER_BUFFER_SIZE);
+	buffer.length = SERVER_BUFFER_SIZE;
+	buffer.data[buffer.length] = '\0';
+	size_t body_received;
+	http_request_init(&request, NULL);
+	test_check("parser_buffer_full",
+		   http_buffer_request(&buffer, &request, &body_received)
+		   == HTTP_REQUEST_MALFORMED);
+}
+
+static void test_parser_syntax(void)
+{
+	http_request_t request;
+	char bare_lf[] = "GET /a HTTP/1.0\nHost: a\nAccept: b\n\n";
+	test_check("parser_bare_lf", test_parser_run(&request, bare_lf) == 1
+		   && request.minor == 0 && request.header_count == 2
+		   && strcmp(request.headers[1].value, "b") == 0);
+	char mixed[] = "GET /a HTTP/1.1\r\nHost: a\n\r\n";
+	test_check("parser_mixed_lf", test_parser_run(&request, mixed) == 1
+		   && strcmp(request.headers[0].value, "a") == 0);
+
+	static const char *malformed[] = {
+		"get / HTTP/1.1\r\n\r\n",
+		"PUT / HTTP/1.1\r\n\r\n",
+		"GETGETGET / HTTP/1.1\r\n\r\n",
+		"GET  / HTTP/1.1\r\n\r\n",
+		"GET /\r\n\r\n",
+		"GET / HTTP/1.x\r\n\r\n",
+		"GET / HTTP/11\r\n\r\n",
+		"GET / HTTPS/1.1\r\n\r\n",
+		"GET / HTTP/1.1\rX\r\n\r\n",
+	};
+	bool refused = true;
+	for (size_t i = 0; i < sizeof(malformed) / sizeof(*malformed); i++) {
+		char data[64];
+		strcpy(data, malformed[i]);
+		if (test_parser_run(&request, data) != PARSER_MALFORMED)
+			refused = false;
+	}
+	test_check("parser_bad_request_line", refused);
+
+	char no_colon[] = "GET / HTTP/1.1\r\nHost example.com\r\n\r\n";
+	char name_only[] = "GET / HTTP/1.1\r\nHost\r\n\r\n";
+	char empty_name[] = "GET / HTTP/1.1\r\n: value\r\n\r\n";
+	char folded[] = "GET / HTTP/1.1\r\nHost: a\r\n b\r\n\r\n";
+	test_check("parser_no_colon",
+		   test_parser_run(&request, no_colon) == PARSER_MALFORMED
+		   && test_parser_run(&request, name_only) == PARSER_MALFORMED
+		   && test_parser_run(&request, empty_name) == PARSER_MALFORMED
+		   && test_parser_run(&request, folded) == PARSER_MALFORMED);
+}
+
+// The bytes of the next request stay in the buffer for the next parse
+static void test_parser_pipelined(void)
+{
+	static const char pipelined[] =
+	    "POST /a HTTP/1.1\r\nContent-Length: 3\r\n\r\nabc"
+	    TEST_PARSER_NEXT;
+	http_buffer_t buffer;
+	http_buffer_init(&buffer);
+	strcpy(buffer.data, pipelined);
+	buffer.length = strlen(pipelined);
+
+	http_request_t request;
+	size_t body_received;
+	http_request_init(&request, NULL);
+	int err = http_buffer_request(&buffer, &request, &body_received);
+	test_check("parser_pipelined_first", err == 1
+		   && HTTP_METHOD_POST == request.method
+		   && strcmp(request.uri, "/a") == 0 && body_received == 3
+		   && strcmp(request.body, "abc") == 0
+		   && buffer.consumed
+		   == sizeof(pipelined) - sizeof(TEST_PARSER_NEXT)
+		   && http_buffer_pending(&buffer));
+	http_request_destroy(&request);
+
+	http_buffer_shift(&buffer);
+	http_request_init(&request, NULL);
+	err = http_buffer_request(&buffer, &request, &body_received);
+	test_check("parser_pipelined_second", err == 1
+		   && HTTP_METHOD_GET == request.method
+		   && strcmp(request.uri, "/b") == 0
+		   && buffer.consumed == buffer.length
+		   && !http_buffer_pending(&buffer));
+	http_request_destroy(&request);
+}
+
+void test_parser(void)
+{
+	test_parser_split();
+	test_parser_limits();
+	test_parser_syntax();
+	test_parser_pipelined();
+	parser_limits(PARSER_DEFAULT_HEADERS, SERVER_BUFFER_SIZE);
+}
@@ -0,0 +1,169 @@
+#include <stddef.h>
+
+#include "tests.h"
+#include "wheel.h"
+
+#define TEST_WHEEL_TIMERS 9
+
+// Deadlines in milliseconds, across every level and its boundaries
+static const uint64_t test_wheel_deadlines[TEST_WHEEL_TIMERS] = {
+	55,			// level 0, rounded up to the next tick
+	630,			// last slot of level 0
+	640,			// first tick of level 1
+	1000,
+	40950,			// last tick of level 1
+	40960,			// first tick of level 2
+	50005,
+	3000000,		// level 3
+	(uint64_t)WHEEL_TICK << 30,	// past the span, cut to it
+};
+
+static size_t test_wheel_chain(wheel_timer_t *chain)
+{
+	size_t count = 0;
+	for (; NULL != chain; chain = chain->next)
+		count++;
+	return count;
+}
+
+/**
+ * Each timer comes down the levels as the wheel turns and expires on its
+ * own tick, neither a tick early nor late.
+ */
+static void test_wheel_cascade(uint64_t start)
+{
+	wheel_t wheel;
+	wheel_timer_t timers[TEST_WHEEL_TIMERS];
+	wheel_init(&wheel, start);
+	for (int i = 0; i < TEST_WHEEL_TIMERS; i++) {
+		wheel_timer_init(&timers[i], &timers[i]);
+		wheel_add(&wheel, &timers[i], start + test_wheel_deadlines[i]);
+	}
+
+	bool cascaded = true;
+	for (int i = 0; i < TEST_WHEEL_TIMERS; i++) {
+		uint64_t tick = timers[i].expires;
+		wheel_timer_t *early = wheel_advance(&wheel,
+						     (tick - 1) * WHEEL_TICK);
+		wheel_timer_t *due = wheel_advance(&wheel, tick * WHEEL_TICK);
+		if (NULL != early || due != &timers[i] || NULL != due->next
+		    || wheel_pending(due) || wheel.count + i + 1 !=
+		    TEST_WHEEL_TIMERS)
+			cascaded = false;
+	}
+	uint64_t span = (((uint64_t)1 << (WHEEL_BITS * WHEEL_LEVELS)) - 1);
+	test_check(0 == start ? "wheel_cascade" : "wheel_cascade_unaligned",
+		   cascaded && timers[0].expires ==
+		   (start + 55 + WHEEL_TICK - 1) / WHEEL_TICK
+		   && timers[TEST_WHEEL_TIMERS - 1].expires ==
+		   start / WHEEL_TICK + span);
+}
+
+/**
+ * Timers scheduled again while the expired chain is walked, the way the
+ * loops move a deadline, land in the wheel again rather than being lost
+ * or expiring in the same pass.
+ */
+static void test_wheel_readd(void)
+{
+	wheel_t wheel;
+	wheel_timer_t timers[3];
+	wheel_init(&wheel, 0);
+	for (int i = 0; i < 3; i++) {
+		wheel_timer_init(&timers[i], NULL);
+		wheel_add(&wheel, &timers[i], 100);
+	}
+
+	wheel_timer_t *expired = wheel_advance(&wheel, 100);
+	bool walked = test_wheel_chain(expired) == 3 && 0 == wheel.count;
+	int index = 0;
+	while (NULL != expired) {
+		wheel_timer_t *next = expired->next;
+		// Already due, into the same slot a lap later, and on level 1
+		uint64_t deadlines[] = { 100, 100 + 640, 100 + 1000 };
+		wheel_remove(&wheel, expired);
+		wheel_add(&wheel, expired, deadlines[index++]);
+		expired = next;
+	}
+	walked = walked && 3 == wheel.count;
+
+	expired = wheel_advance(&wheel, 110);
+	walked = walked && test_wheel_chain(expired) == 1
+	    && NULL == wheel_advance(&wheel, 730);
+	expired = wheel_advance(&wheel, 740);
+	walked = walked && test_wheel_chain(expired) == 1
+	    && NULL == wheel_advance(&wheel, 1090);
+	expired = wheel_advance(&wheel, 1100);
+	test_check("wheel_readd", walked && test_wheel_chain(expired) == 1
+		   && 0 == wheel.count);
+
+	// A deadline already past when added again is due on the next tick
+	wheel_timer_init(&timers[0], NULL);
+	wheel_timer_init(&timers[1], NULL);
+	wheel_add(&wheel, &timers[0], 1200);
+	wheel_add(&wheel, &timers[1], 1300);
+	expired = wheel_advance(&wheel, 1300);
+	size_t count = test_wheel_chain(expired);
+	wheel_add(&wheel, &timers[1], 1300);
+	test_check("wheel_readd_late", 2 == count && timers[1].expires == 131
+		   && wheel_advance(&wheel, 1310) == &timers[1]);
+}
+
+/**
+ * With the first level empty, the loops wake up when its lap ends so the
+ * level above can cascade. Sleeping as told never misses a deadline.
+ */
+static void test_wheel_timeout(void)
+{
+	wheel_t wheel;
+	wheel_timer_t timer;
+	wheel_init(&wheel, 0);
+	wheel_timer_init(&timer, NULL);
+	test_check("wheel_timeout_empty", -1 == wheel_timeout(&wheel, 0));
+
+	wheel_add(&wheel, &timer, 50);
+	test_check("wheel_timeout_level0", 50 == wheel_timeout(&wheel, 0)
+		   && 30 == wheel_timeout(&wheel, 20)
+		   && 0 == wheel_timeout(&wheel, 70));
+	wheel_remove(&wheel, &timer);
+
+	wheel_add(&wheel, &timer, 1000);
+	bool lap = 640 == wheel_timeout(&wheel, 0)
+	    && NULL == wheel_advance(&wheel, 640)
+	    && 360 == wheel_timeout(&wheel, 640);
+	wheel_remove(&wheel, &timer);
+
+	// From a tick in the middle of a lap
+	wheel_init(&wheel, 1235);
+	wheel_add(&wheel, &timer, 1235 + 5000);
+	test_check("wheel_timeout_lap", lap && 45 == wheel_timeout(&wheel,
+								   1235));
+	wheel_remove(&wheel, &timer);
+
+	bool punctual = true;
+	for (int i = 0; i < TEST_WHEEL_TIMERS - 1; i++) {
+		uint64_t now = 7;
+		wheel_init(&wheel, now);
+		wheel_add(&wheel, &timer, now + test_wheel_deadlines[i]);
+		uint64_t due = timer.expires * WHEEL_TICK;
+		wheel_timer_t *expired = NULL;
+		while (NULL == expired && now <= due) {
+			int timeout = wheel_timeout(&wheel, now);
+			if (timeout < 0)
+				break;
+			now += timeout;
+			expired = wheel_advance(&wheel, now);
+		}
+		if (expired != &timer || now != due)
+			punctual = false;
+	}
+	test_check("wheel_timeout_punctual", punctual);
+}
+
+void test_wheel(void)
+{
+	test_wheel_cascade(0);
+	test_wheel_cascade(123457);
+	test_wheel_readd();
+	test_wheel_timeout();
+}